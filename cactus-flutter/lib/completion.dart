@@ -167,9 +167,8 @@ class CactusCompletionResult {
   /// Otherwise, this will be an empty string.
   final String stoppingWord;
 
-  // TODO: Consider adding timing information if available from native layer (e.g., prompt eval time, token gen time)
-  // final double promptEvalTimeSeconds;
-  // final double tokenGenerationTimeSeconds;
+  /// Per-phase timings and inter-token latency of this completion.
+  final CactusCompletionTimings? timings;
 
   /// Creates a new [CactusCompletionResult].
   CactusCompletionResult({
@@ -181,10 +180,75 @@ class CactusCompletionResult {
     required this.stoppedWord,
     required this.stoppedLimit,
     required this.stoppingWord,
+    this.timings,
   });
 
   @override
   String toString() {
     return 'CactusCompletionResult(text: ${text.length > 50 ? "${text.substring(0, 50)}..." : text}, tokensPredicted: $tokensPredicted, tokensEvaluated: $tokensEvaluated, stoppedEos: $stoppedEos, stoppedWord: $stoppedWord, stoppedLimit: $stoppedLimit, stoppingWord: $stoppingWord, truncated: $truncated)';
   }
-} 
\ No newline at end of file
+} 
+
+/// Timings reported by the native layer for a completion. All durations are in milliseconds.
+class CactusCompletionTimings {
+  /// Prompt tokens evaluated, excluding a prefix reused from the KV cache.
+  final int promptTokens;
+
+  /// Prefill time: tokenizing and evaluating the prompt.
+  final double promptMs;
+
+  /// Time to the first generated token.
+  final double timeToFirstTokenMs;
+
+  /// Number of generated tokens.
+  final int predictedTokens;
+
+  /// Time spent decoding generated tokens.
+  final double decodeMs;
+
+  /// Time spent sampling generated tokens.
+  final double samplingMs;
+
+  /// Time spent converting generated tokens to text.
+  final double detokenizeMs;
+
+  /// Time spent in the token callback.
+  final double callbackMs;
+
+  /// Time from the start of generation to the last token.
+  final double totalMs;
+
+  /// Prefill throughput in tokens per second.
+  final double promptPerSecond;
+
+  /// Generation throughput in tokens per second, after the first token.
+  final double predictedPerSecond;
+
+  /// Inter-token latency percentiles.
+  final double interTokenP50Ms;
+  final double interTokenP90Ms;
+  final double interTokenP99Ms;
+
+  /// Creates a new [CactusCompletionTimings].
+  CactusCompletionTimings({
+    required this.promptTokens,
+    required this.promptMs,
+    required this.timeToFirstTokenMs,
+    required this.predictedTokens,
+    required this.decodeMs,
+    required this.samplingMs,
+    required this.detokenizeMs,
+    required this.callbackMs,
+    required this.totalMs,
+    required this.promptPerSecond,
+    required this.predictedPerSecond,
+    required this.interTokenP50Ms,
+    required this.interTokenP90Ms,
+    required this.interTokenP99Ms,
+  });
+
+  @override
+  String toString() {
+    return 'CactusCompletionTimings(promptTokens: $promptTokens, promptMs: $promptMs, timeToFirstTokenMs: $timeToFirstTokenMs, predictedTokens: $predictedTokens, predictedPerSecond: $predictedPerSecond, interTokenP50Ms: $interTokenP50Ms, interTokenP99Ms: $interTokenP99Ms)';
+  }
+}
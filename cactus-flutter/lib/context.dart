@@ -448,6 +448,22 @@ class CactusContext {
         stoppedWord: cResult.ref.stopped_word,
         stoppedLimit: cResult.ref.stopped_limit,
         stoppingWord: cResult.ref.stopping_word.toDartString(),
+        timings: CactusCompletionTimings(
+          promptTokens: cResult.ref.timings.prompt_n,
+          promptMs: cResult.ref.timings.prompt_ms,
+          timeToFirstTokenMs: cResult.ref.timings.ttft_ms,
+          predictedTokens: cResult.ref.timings.predicted_n,
+          decodeMs: cResult.ref.timings.decode_ms,
+          samplingMs: cResult.ref.timings.sampling_ms,
+          detokenizeMs: cResult.ref.timings.detokenize_ms,
+          callbackMs: cResult.ref.timings.callback_ms,
+          totalMs: cResult.ref.timings.total_ms,
+          promptPerSecond: cResult.ref.timings.prompt_per_second,
+          predictedPerSecond: cResult.ref.timings.predicted_per_second,
+          interTokenP50Ms: cResult.ref.timings.itl_p50_ms,
+          interTokenP90Ms: cResult.ref.timings.itl_p90_ms,
+          interTokenP99Ms: cResult.ref.timings.itl_p99_ms,
+        ),
       );
 
       return result;
@@ -94,6 +94,37 @@ final class CactusFloatArrayC extends Struct {
   external int count;
 }
 
+final class CactusCompletionTimingsC extends Struct {
+  @Int32()
+  external int prompt_n;
+  @Double()
+  external double prompt_ms;
+  @Double()
+  external double ttft_ms;
+  @Int32()
+  external int predicted_n;
+  @Double()
+  external double decode_ms;
+  @Double()
+  external double sampling_ms;
+  @Double()
+  external double detokenize_ms;
+  @Double()
+  external double callback_ms;
+  @Double()
+  external double total_ms;
+  @Double()
+  external double prompt_per_second;
+  @Double()
+  external double predicted_per_second;
+  @Double()
+  external double itl_p50_ms;
+  @Double()
+  external double itl_p90_ms;
+  @Double()
+  external double itl_p99_ms;
+}
+
 final class CactusCompletionResultC extends Struct {
   external Pointer<Utf8> text;
   @Int32()
@@ -109,6 +140,7 @@ final class CactusCompletionResultC extends Struct {
   @Bool()
   external bool stopped_limit;
   external Pointer<Utf8> stopping_word;
+  external CactusCompletionTimingsC timings;
 }
 
 typedef InitContextCNative = Pointer<CactusContextOpaque> Function(
@@ -576,6 +576,10 @@ Java_com_cactus_LlamaContext_loadSession(
     if (!llama_state_load_file(llama->ctx, path_chars, llama->embd.data(), llama->embd.capacity(), &n_token_count_out)) {
       env->ReleaseStringUTFChars(path, path_chars);
 
+      // embd mirrors sequence 0, which a failed load leaves in an unknown state
+      llama->embd.clear();
+      llama_kv_self_seq_rm(llama->ctx, 0, -1, -1);
+
       putString(env, result, "error", "Failed to load session");
       return reinterpret_cast<jobject>(result);
     }
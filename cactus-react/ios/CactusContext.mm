@@ -766,6 +766,9 @@
     size_t n_token_count_out = 0;
     llama->embd.resize(llama->params.n_ctx);
     if (!llama_state_load_file(llama->ctx, [path UTF8String], llama->embd.data(), llama->embd.capacity(), &n_token_count_out)) {
+        // embd mirrors sequence 0, which a failed load leaves in an unknown state
+        llama->embd.clear();
+        llama_kv_self_seq_rm(llama->ctx, 0, -1, -1);
         @throw [NSException exceptionWithName:@"LlamaException" reason:@"Failed to load session" userInfo:nil];
     }
     llama->embd.resize(n_token_count_out);
@@ -21,16 +21,45 @@ int main() {
         test_chat_formatting();
         test_prompt_truncation();
         test_stopping_criteria();
+        test_stop_string_matching();
         test_embedding_generation();
+        test_embedding_batch_many();
         test_benchmarking();
+        test_bench_suite();
         test_jinja_chat_formatting();
         test_kv_cache_type();
+        test_prompt_cache_reuse();
+        test_session_save_restore();
+        test_grammar_cache();
+        test_penalties_sampler();
+        test_dry_sampler();
+        test_grammar_trigger_dfa();
+        test_grammar_jump_forward();
+        test_grammar_trie_mask();
+        test_batch_engine();
+        test_batch_engine_single_stream();
+        test_sampler_preselect();
+        test_sampler_batch();
+        test_logits_top_k();
+        test_paged_kv_cache();
+        test_prefix_cache();
+        test_kv_cache_seq_ops();
+        test_swa_kv_cache();
+        test_kv_evict_policies();
+        test_speculative_decoding();
+        test_speculative_small_draft_ctx();
+        test_tts_irfft();
+        test_tts_overlap_add();
         
         // Call FFI API tests
         test_ffi_init_free_context();
         test_ffi_tokenize_detokenize();
         test_ffi_completion_basic();
+        test_ffi_completion_timings();
+        test_ffi_completion_stream();
         test_ffi_embedding_basic();
+        test_ffi_embedding_batch();
+        test_ffi_embedding_batch_shares_decode();
         
         std::cout << "\nAll tests passed successfully!" << std::endl;
         return 0;
@@ -1,10 +1,20 @@
 #include "test_core_api.h"
 #include "../cactus/cactus.h"
+#include "../cactus/cactus_tts.h"
+#include "../cactus/json.hpp"
+#include "../cactus/llama-grammar.h"
+#include "../cactus/llama-sampling.h"
 #include <iostream>
 #include <string>
 #include <vector>
+#include <map>
+#include <algorithm>
+#include <cmath>
 #include <cassert>
 #include <cstring> 
+#include <cstdlib>
+#include <cstdio>
+#include <random>
 
 // Test basic model loading and initialization
 void test_model_loading() {
@@ -60,6 +70,10 @@ void test_basic_completion() {
     }
 
     assert(!response.empty() && "Response should not be empty");
+
+    // beginCompletion after loadPrompt must keep the prompt timings
+    const cactus::cactus_completion_timings timings = ctx.getTimings();
+    assert(timings.prompt_n > 0 && timings.prompt_ms > 0 && "Prompt timings should survive beginCompletion");
     std::cout << "Basic completion test passed" << std::endl;
 }
 
@@ -171,6 +185,42 @@ void test_stopping_criteria() {
     std::cout << "Stopping criteria test passed" << std::endl;
 }
 
+// Test incremental stop string matching against generated text
+void test_stop_string_matching() {
+    std::cout << "Testing stop string matching..." << std::endl;
+
+    cactus::cactus_context ctx;
+    ctx.params.antiprompt = {"</tool_call>", "<|im_end|>", "\n\nUser:", "ool"};
+    ctx.stop_matcher.init(ctx.params.antiprompt);
+    ctx.has_next_token = true;
+
+    const std::vector<std::string> pieces = {"Calling", " the", " t", "ool", "<", "/tool", "_c"};
+    for (const std::string& piece : pieces) {
+        ctx.generated_text += piece;
+    }
+    // "ool" completes inside " tool": the earliest full match wins
+    size_t pos = ctx.findStoppingStrings(ctx.generated_text, pieces.back().size(), cactus::STOP_FULL);
+    assert(pos == std::string("Calling the t").size() && ctx.stopping_word == "ool" && "Earliest full match expected");
+    assert(!ctx.has_next_token && ctx.stopped_word);
+
+    // Partial matches are relative to the text passed in
+    ctx.generated_text = "Calling the";
+    ctx.stop_matcher.init(ctx.params.antiprompt);
+    ctx.stopped_word = false;
+    ctx.generated_text += " end<|im_";
+    const size_t sent = std::string("Calling the end").size();
+    pos = ctx.findStoppingStrings(ctx.generated_text.substr(sent), 4, cactus::STOP_FULL);
+    assert(pos == std::string::npos && !ctx.stopped_word && "No full match yet");
+    pos = ctx.findStoppingStrings(ctx.generated_text.substr(sent), 4, cactus::STOP_PARTIAL);
+    assert(pos == 0 && "Partial '<|im_' should be held back");
+
+    ctx.generated_text += "end|>";
+    pos = ctx.findStoppingStrings(ctx.generated_text.substr(sent), 5, cactus::STOP_FULL);
+    assert(pos == 0 && ctx.stopping_word == "<|im_end|>" && "Full match expected");
+
+    std::cout << "Stop string matching test passed" << std::endl;
+}
+
 // Test embedding generation
 void test_embedding_generation() {
     std::cout << "Testing embedding generation..." << std::endl;
@@ -192,6 +242,40 @@ void test_embedding_generation() {
     std::cout << "Embedding generation test passed" << std::endl;
 }
 
+// Test batch embedding of more texts than there are sequence ids
+void test_embedding_batch_many() {
+    std::cout << "Testing batch embedding of many texts..." << std::endl;
+
+    common_params params;
+    params.model.path = "../llm.gguf";
+    params.embedding = true;
+    params.n_ctx = 2048;
+    params.n_batch = 2048;
+    params.n_ubatch = 2048;
+    params.n_parallel = LLAMA_MAX_SEQ;
+    params.cpuparams.n_threads = 4;
+    params.use_mmap = true;
+    params.warmup = false;
+
+    cactus::cactus_context ctx;
+    assert(ctx.loadModel(params) && "Model loading failed");
+
+    // Short texts fit many to a micro-batch, so the sequence id cap forces the flushes
+    std::vector<std::string> texts;
+    for (int i = 0; i < LLAMA_MAX_SEQ + 16; ++i) {
+        texts.push_back("Text " + std::to_string(i));
+    }
+
+    std::vector<std::vector<float>> embds = ctx.getEmbeddings(texts);
+    assert(embds.size() == texts.size() && "One embedding per text expected");
+    for (size_t i = 0; i < embds.size(); ++i) {
+        const bool non_zero = std::any_of(embds[i].begin(), embds[i].end(), [](float v) { return v != 0.0f; });
+        assert(non_zero && "Every text should get a non-zero embedding");
+    }
+
+    std::cout << "Batch embedding of many texts test passed" << std::endl;
+}
+
 // Test benchmarking function
 void test_benchmarking() {
     std::cout << "Testing benchmarking..." << std::endl;
@@ -219,6 +303,55 @@ void test_benchmarking() {
     std::cout << "Benchmarking test passed" << std::endl;
 }
 
+void test_bench_suite() {
+    std::cout << "Testing benchmark suite..." << std::endl;
+
+    common_params params;
+    params.model.path = "../llm.gguf";
+    params.n_ctx = 256;
+    params.n_batch = 64;
+    params.n_parallel = 2;
+    params.cpuparams.n_threads = 4;
+    params.use_mmap = true;
+    params.warmup = false;
+    params.prompt = "The quick brown fox jumps over the lazy dog";
+
+    cactus::cactus_context ctx;
+    assert(ctx.loadModel(params) && "Model loading failed for benchmark suite");
+    assert(ctx.initSampling() && "Sampling initialization failed");
+    ctx.loadPrompt();
+    assert(!ctx.embd.empty());
+
+    // The prompt is longer than n_batch, so prefill spans several batches
+    cactus::cactus_bench_params bp;
+    bp.n_prompt = {96};
+    bp.n_gen = {4};
+    bp.n_depth = {0, 32};
+    bp.n_threads = {1, 2};
+    bp.n_parallel = {1, 2};
+    bp.repetitions = 2;
+
+    std::string suite = ctx.benchSuite(bp);
+    auto doc = nlohmann::ordered_json::parse(suite);
+    assert(doc["schema"] == "cactus-bench" && doc["schema_version"] == 1);
+    assert(doc["results"].size() == 8 && "One result per sweep point expected");
+    for (const auto &res : doc["results"]) {
+        assert(!res.contains("error"));
+        assert(res["prompt"]["tokens_per_second"]["p50"].get<double>() > 0);
+        assert(res["generation"]["step_ms"]["n"].get<int>() == 2 * 4);
+        assert(res["memory"]["kv_buffer_bytes"].get<size_t>() > 0);
+        assert(res["memory"]["compute_buffer_bytes"].get<size_t>() > 0);
+        assert(res["n_batch"].get<int>() == 64);
+    }
+
+    // The loaded context fits the sweep, so it was reused and its cached prompt dropped
+    assert(ctx.embd.empty());
+    ctx.loadPrompt();
+    assert(ctx.timings.prompt_n == (int32_t) ctx.embd.size() && "No prompt token should be reused after the sweep");
+
+    std::cout << "Benchmark suite test passed" << std::endl;
+}
+
 // Test Jinja chat formatting
 void test_jinja_chat_formatting() {
     std::cout << "Testing Jinja chat formatting..." << std::endl;
@@ -291,4 +424,1247 @@ void test_kv_cache_type() {
     assert(caught_exception && "Expected std::runtime_error was not thrown for invalid KV cache type");
 
     std::cout << "KV cache type conversion test passed" << std::endl;
-} 
\ No newline at end of file
+} 
+
+// Test KV cache prefix reuse across completions
+void test_prompt_cache_reuse() {
+    std::cout << "Testing prompt cache reuse..." << std::endl;
+
+    common_params params;
+    params.model.path = "../llm.gguf";
+    params.prompt = "The quick brown fox jumps over the lazy dog.";
+    params.n_predict = 8;
+    params.n_ctx = 1024;
+    params.n_batch = 512;
+    params.cpuparams.n_threads = 4;
+    params.use_mmap = true;
+    params.warmup = false;
+
+    cactus::cactus_context ctx;
+    assert(ctx.loadModel(params) && "Model loading failed");
+    assert(ctx.initSampling() && "Sampling initialization failed");
+
+    ctx.loadPrompt();
+    assert(ctx.n_past == 0 && "First prompt should be evaluated from scratch");
+    ctx.beginCompletion();
+    while (ctx.has_next_token) {
+        if (ctx.doCompletion().tok < 0) break;
+    }
+    const std::string first_turn = params.prompt + ctx.generated_text;
+
+    // Extend the previous turn: everything already in the KV cache should be reused
+    ctx.rewind();
+    ctx.params.prompt = first_turn + " The dog did not react.";
+    assert(ctx.initSampling() && "Sampling initialization failed");
+    ctx.loadPrompt();
+
+    std::cout << "Reused " << ctx.n_past << " of " << ctx.num_prompt_tokens << " prompt tokens" << std::endl;
+    assert(ctx.n_past > 0 && "Shared prefix should be reused from the KV cache");
+    assert(ctx.n_past < ctx.num_prompt_tokens && "New tokens should still be evaluated");
+
+    ctx.beginCompletion();
+    auto tok = ctx.nextToken();
+    assert(tok.tok >= 0 && "Completion after cache reuse should produce a token");
+
+    std::cout << "Prompt cache reuse test passed" << std::endl;
+}
+
+// Test saving sessions as append-only deltas and prefix-matched restore
+void test_session_save_restore() {
+    std::cout << "Testing session save/restore..." << std::endl;
+
+    common_params params;
+    params.model.path = "../llm.gguf";
+    params.prompt = "The quick brown fox jumps over the lazy dog.";
+    params.n_predict = 8;
+    params.n_ctx = 1024;
+    params.n_batch = 512;
+    params.cpuparams.n_threads = 4;
+    params.use_mmap = true;
+    params.warmup = false;
+    const std::string session_file = "session_test.bin";
+
+    auto run_turn = [](cactus::cactus_context& ctx, const std::string& prompt) {
+        ctx.rewind();
+        ctx.params.prompt = prompt;
+        assert(ctx.initSampling() && "Sampling initialization failed");
+        ctx.loadPrompt();
+        ctx.beginCompletion();
+        while (ctx.has_next_token) {
+            if (ctx.doCompletion().tok < 0) break;
+        }
+        return prompt + ctx.generated_text;
+    };
+
+    cactus::cactus_context ctx;
+    assert(ctx.loadModel(params) && "Model loading failed");
+
+    const std::string first_turn = run_turn(ctx, params.prompt);
+    assert(ctx.saveSession(session_file) && "Saving the first turn failed");
+    const long first_bytes = ctx.session_file_bytes;
+
+    const std::string second_turn = run_turn(ctx, first_turn + " The dog did not react.");
+    assert(ctx.saveSession(session_file) && "Saving the second turn failed");
+    const long delta_bytes = ctx.session_file_bytes - first_bytes;
+    std::cout << "Session: first save " << first_bytes << " bytes, delta " << delta_bytes << " bytes" << std::endl;
+    assert(delta_bytes > 0 && delta_bytes < ctx.session_file_bytes && "Second save should only append new tokens");
+    const size_t n_cached = ctx.embd.size();
+
+    // A new context restores the whole session, and the next prompt reuses it
+    cactus::cactus_context restored;
+    assert(restored.loadModel(params) && "Model loading failed");
+    const std::vector<llama_token> next_prompt = common_tokenize(restored.ctx, second_turn + " Then", true, true);
+    const int n_restored = restored.loadSession(session_file, next_prompt);
+    std::cout << "Restored " << n_restored << " of " << n_cached << " session tokens" << std::endl;
+    assert(n_restored > 0 && (size_t) n_restored <= n_cached && "Session restore failed");
+
+    restored.params.prompt = second_turn + " Then";
+    assert(restored.initSampling() && "Sampling initialization failed");
+    restored.loadPrompt();
+    assert(restored.n_past > 0 && "Restored session should be reused by loadPrompt");
+
+    // A prompt sharing only the first sentence restores just that prefix
+    cactus::cactus_context partial;
+    assert(partial.loadModel(params) && "Model loading failed");
+    const std::vector<llama_token> other_prompt = common_tokenize(partial.ctx, params.prompt + " A different story.", true, true);
+    const int n_partial = partial.loadSession(session_file, other_prompt);
+    assert(n_partial > 0 && n_partial < n_restored && "Only the shared prefix should be restored");
+
+    std::remove(session_file.c_str());
+    std::cout << "Session save/restore test passed" << std::endl;
+}
+
+// Test that compiled grammars survive a save/load round trip
+void test_grammar_cache() {
+    std::cout << "Testing grammar cache..." << std::endl;
+
+    common_params params;
+    params.model.path = "../llm.gguf";
+    params.prompt = "Answer yes or no: is the sky blue?";
+    params.n_predict = 4;
+    params.n_ctx = 512;
+    params.cpuparams.n_threads = 4;
+    params.use_mmap = true;
+    params.warmup = false;
+    params.sampling.seed = 42;
+    params.sampling.grammar = "root ::= (\"yes\" | \"no\") \".\"";
+    const std::string cache_file = "grammar_cache_test.bin";
+
+    auto run = [](cactus::cactus_context& ctx) {
+        ctx.rewind();
+        assert(ctx.initSampling() && "Sampling initialization failed");
+        ctx.loadPrompt();
+        ctx.beginCompletion();
+        while (ctx.has_next_token) {
+            if (ctx.doCompletion().tok < 0) break;
+        }
+        return ctx.generated_text;
+    };
+
+    cactus::cactus_context ctx;
+    assert(ctx.loadModel(params) && "Model loading failed");
+    const std::string first = run(ctx);
+    assert((first == "yes." || first == "no.") && "Output should follow the grammar");
+    assert(ctx.saveGrammarCache(cache_file) && "Saving the grammar cache failed");
+
+    cactus::cactus_context restored;
+    assert(restored.loadModel(params) && "Model loading failed");
+    assert(restored.loadGrammarCache(cache_file) && "Loading the grammar cache failed");
+    const std::string second = run(restored);
+    assert(second == first && "Loaded grammar should constrain generation the same way");
+
+    assert(!restored.loadGrammarCache("missing_grammar_cache.bin") && "Loading a missing file should fail");
+
+    std::remove(cache_file.c_str());
+    std::cout << "Grammar cache test passed" << std::endl;
+}
+
+// Test repetition penalties over a sliding window, on full and truncated candidate arrays
+void test_penalties_sampler() {
+    std::cout << "Testing penalties sampler..." << std::endl;
+
+    const int32_t n_vocab = 1000;
+    const int32_t last_n = 8;
+    const float repeat = 1.5f, freq = 0.25f, present = 0.5f;
+    llama_sampler * smpl = llama_sampler_init_penalties(last_n, repeat, freq, present);
+
+    std::vector<llama_token> history;
+    for (int i = 0; i < 40; ++i) {
+        const llama_token token = (i * 37 + (i % 3) * 500) % n_vocab % 11 * 90;
+        llama_sampler_accept(smpl, token);
+        history.push_back(token);
+    }
+    std::map<llama_token, int> window;
+    for (size_t i = history.size() - last_n; i < history.size(); ++i) {
+        window[history[i]]++;
+    }
+    const auto expected = [&](llama_token id, float logit) {
+        const auto it = window.find(id);
+        if (it == window.end()) return logit;
+        logit = logit <= 0 ? logit * repeat : logit / repeat;
+        return logit - it->second * freq - present;
+    };
+
+    // candidates in token order, then reversed and truncated
+    for (const bool reorder : {false, true}) {
+        std::vector<llama_token_data> data;
+        for (llama_token id = 0; id < n_vocab; ++id) {
+            data.push_back({id, (id % 7) - 3.0f, 0.0f});
+        }
+        if (reorder) {
+            std::reverse(data.begin(), data.end());
+            data.resize(n_vocab / 2 + 100);
+        }
+        llama_token_data_array cur_p = { data.data(), data.size(), -1, false };
+        llama_sampler * clone = llama_sampler_clone(smpl);
+        llama_sampler_apply(clone, &cur_p);
+        for (const auto & cur : data) {
+            assert(std::fabs(cur.logit - expected(cur.id, (cur.id % 7) - 3.0f)) < 1e-5f && "Penalized logit mismatch");
+        }
+        llama_sampler_free(clone);
+    }
+
+    llama_sampler_free(smpl);
+    std::cout << "Penalties sampler test passed" << std::endl;
+}
+
+// Test the incremental DRY sampler against a direct computation over the window
+void test_dry_sampler() {
+    std::cout << "Testing DRY sampler..." << std::endl;
+
+    const int32_t n_vocab = 8;
+    const int32_t last_n = 12;
+    const float multiplier = 0.8f, base = 1.75f;
+    const std::vector<std::vector<llama_token>> breakers = {{3}, {4, 5}};
+
+    for (const int32_t allowed : {1, 2, 3}) {
+        llama_sampler * smpl = llama_sampler_init_dry_testing(1024, multiplier, base, allowed, last_n, breakers);
+
+        std::vector<llama_token> history;
+        uint32_t seed = 12345;
+        for (int step = 0; step < 300; ++step) {
+            seed = seed * 1664525u + 1013904223u;
+            // mostly repeat a short phrase so that long repeats occur
+            const llama_token token = (seed >> 24) % 4 == 0 ? (llama_token) ((seed >> 16) % n_vocab) : (llama_token) (step % 5);
+            llama_sampler_accept(smpl, token);
+            history.push_back(token);
+
+            // expected penalties
+            const std::vector<llama_token> w(history.end() - std::min<size_t>(history.size(), last_n), history.end());
+            const int L = (int) w.size();
+            std::map<llama_token, int> max_repeat;
+            int rep_limit = L;
+            for (int i = 0; i < L; ++i) {
+                int longest = -1;
+                for (const auto & breaker : breakers) {
+                    const int tail = (int) breaker.size() - 1;
+                    if (breaker[0] != w[L - 1 - i] || tail > i || tail <= longest) continue;
+                    bool match = true;
+                    for (int o = 0; o < tail; ++o) match = match && breaker[1 + o] == w[L - i + o];
+                    if (match) longest = tail;
+                }
+                if (longest >= 0) {
+                    rep_limit = i - longest;
+                    break;
+                }
+            }
+            if (L > allowed && rep_limit >= allowed) {
+                for (int j = 0; j + 1 < L; ++j) {
+                    int n = 0;
+                    while (n <= j && w[j - n] == w[L - 1 - n]) ++n;
+                    n = std::min(n, rep_limit);
+                    if (n >= allowed) max_repeat[w[j + 1]] = std::max(max_repeat[w[j + 1]], n);
+                }
+            }
+            max_repeat.erase(3);
+
+            for (const bool reorder : {false, true}) {
+                std::vector<llama_token_data> data;
+                for (llama_token id = 0; id < n_vocab; ++id) {
+                    data.push_back({id, 0.0f, 0.0f});
+                }
+                if (reorder) {
+                    std::reverse(data.begin(), data.end());
+                }
+                llama_token_data_array cur_p = { data.data(), data.size(), -1, false };
+                llama_sampler_apply(smpl, &cur_p);
+                for (const auto & cur : data) {
+                    const auto it = max_repeat.find(cur.id);
+                    const float expected = it == max_repeat.end() ? 0.0f : -multiplier * std::pow(base, (float) (it->second - allowed));
+                    assert(std::fabs(cur.logit - expected) < 1e-4f && "DRY penalty mismatch");
+                }
+            }
+        }
+        llama_sampler_free(smpl);
+    }
+
+    std::cout << "DRY sampler test passed" << std::endl;
+}
+
+// Test that lazy grammar trigger patterns stepped as a DFA agree with std::regex
+void test_grammar_trigger_dfa() {
+    std::cout << "Testing grammar trigger DFA..." << std::endl;
+
+    const std::vector<std::string> patterns = {
+        "^[\\s\\S]*?(<tool_call>|\\[TOOL_CALLS\\]|<function\\s+name\\s*=\\s*\"get_weather\")[\\s\\S]*",
+        "^((?:```(?:json|xml)?\n\\s*)?(?:<tools>|<response>)?\\s*\\{\\s*\")[\\s\\S]*",
+        "^(a{2,3}?b+|[^x-z\\d]c)$",
+    };
+    const std::vector<std::vector<std::string>> outputs = {
+        {"Let me check. ", "<tool", "_call>", "{\"name\""},
+        {"<function  name", "=\"get_weather\"", ">"},
+        {"```json\n", "  {\"", "name"},
+        {" {", " \"a\""},
+        {"Sure, ", "{\""},
+        {"aa", "ab", "b"},
+        {"q", "c"},
+        {"1c"},
+    };
+
+    for (const std::string & pattern : patterns) {
+        const auto dfa = llama_grammar_trigger_dfa_init(pattern);
+        assert(dfa && "Pattern should compile to a DFA");
+        const std::regex regex(pattern);
+
+        for (const auto & pieces : outputs) {
+            std::string buffer;
+            uint32_t state = llama_grammar_trigger_dfa::start_state;
+            for (const std::string & piece : pieces) {
+                buffer += piece;
+                state = dfa->step(state, piece);
+
+                std::smatch match;
+                const bool matched = std::regex_match(buffer, match, regex);
+                assert(matched == (bool) dfa->accept[state] && "DFA and std::regex should agree on a full match");
+                if (matched) {
+                    assert(dfa->group_start(buffer) == (size_t) match.position(1) && "First group should start at the same offset");
+                }
+            }
+        }
+    }
+
+    assert(!llama_grammar_trigger_dfa_init("(a)\\1") && "Backreferences fall back to std::regex");
+    assert(!llama_grammar_trigger_dfa_init("a(?=b)") && "Lookaheads fall back to std::regex");
+
+    std::cout << "Grammar trigger DFA test passed" << std::endl;
+}
+
+// Test that grammar-forced text is decoded without sampling and still follows the grammar
+void test_grammar_jump_forward() {
+    std::cout << "Testing grammar jump-forward decoding..." << std::endl;
+
+    common_params params;
+    params.model.path = "../llm.gguf";
+    params.prompt = "Is the sky blue? Reply in JSON.";
+    params.n_predict = 32;
+    params.n_ctx = 512;
+    params.cpuparams.n_threads = 4;
+    params.use_mmap = true;
+    params.warmup = false;
+    params.sampling.grammar = "root ::= \"{\\\"answer\\\": \\\"\" (\"yes\" | \"no\") \"\\\", \\\"confidence\\\": \\\"high\\\"}\"";
+    params.sampling.n_probs = 3;
+
+    cactus::cactus_context ctx;
+    assert(ctx.loadModel(params) && "Model loading failed");
+    assert(ctx.initSampling() && "Sampling initialization failed");
+    ctx.loadPrompt();
+    ctx.beginCompletion();
+    while (ctx.has_next_token) {
+        if (ctx.doCompletion().tok < 0) break;
+    }
+
+    std::cout << "Generated: " << ctx.generated_text << " (" << ctx.num_tokens_predicted << " tokens, "
+              << ctx.n_jump_forward << " forced)" << std::endl;
+    assert((ctx.generated_text == "{\"answer\": \"yes\", \"confidence\": \"high\"}" ||
+            ctx.generated_text == "{\"answer\": \"no\", \"confidence\": \"high\"}") && "Output should follow the grammar");
+    assert(ctx.n_jump_forward < ctx.num_tokens_predicted && "Forced tokens are a subset of the predicted tokens");
+    assert(ctx.embd.size() == ctx.n_past && "Every returned token should be resident in the KV cache");
+
+    // Forced tokens report themselves as the only candidate
+    size_t n_certain = 0;
+    for (const auto &token : ctx.generated_token_probs) {
+        assert(!token.probs.empty() && "Every returned token should carry probabilities");
+        if (token.probs.size() == 1 && token.probs[0].tok == token.tok && token.probs[0].prob == 1.0f) {
+            n_certain++;
+        }
+    }
+    assert(n_certain >= ctx.n_jump_forward && "Forced tokens should have probability 1");
+
+    std::cout << "Grammar jump-forward test passed" << std::endl;
+}
+
+// Test that the vocabulary trie allow-mask rejects the same tokens as matching each token on its own
+void test_grammar_trie_mask() {
+    std::cout << "Testing grammar trie allow-mask..." << std::endl;
+
+    common_params params;
+    params.model.path = "../llm.gguf";
+    params.n_ctx = 512;
+    params.cpuparams.n_threads = 4;
+    params.use_mmap = true;
+    params.warmup = false;
+
+    cactus::cactus_context ctx;
+    assert(ctx.loadModel(params) && "Model loading failed");
+
+    const llama_vocab * vocab = llama_model_get_vocab(ctx.model);
+    const int n_vocab = llama_vocab_n_tokens(vocab);
+    // finite, so that the walk below reaches the end where only end-of-generation tokens are allowed
+    const char * grammar_str =
+        "root ::= \"{\\\"\" [a-z] [a-z]? \"\\\":\" ws value ws \"}\"\n"
+        "value ::= [0-9] | \"true\" | \"caf\\u00e9\"\n"
+        "ws ::= [ \\t]?\n";
+    llama_grammar * grammar = llama_grammar_init_impl(vocab, grammar_str, "root", false, nullptr, 0, nullptr, 0);
+    assert(grammar != nullptr && grammar->automaton != nullptr && "Grammar initialization failed");
+
+    auto apply = [&](const llama_grammar & g) {
+        std::vector<llama_token_data> data;
+        for (llama_token id = 0; id < n_vocab; ++id) {
+            data.push_back({id, 0.0f, 0.0f});
+        }
+        llama_token_data_array cur_p = { data.data(), data.size(), -1, false };
+        llama_grammar_apply_impl(g, &cur_p);
+        std::vector<bool> allowed(n_vocab);
+        for (const auto & cur : data) {
+            allowed[cur.id] = cur.logit != -INFINITY;
+        }
+        return allowed;
+    };
+
+    bool reached_end = false;
+    for (int step = 0; step < 32 && !reached_end; ++step) {
+        // the full vocabulary goes through the trie mask, a grammar without automaton matches every token with
+        // llama_grammar_reject_candidates
+        const std::vector<bool> masked = apply(*grammar);
+        llama_grammar * ref = llama_grammar_clone_impl(*grammar);
+        ref->automaton = nullptr;
+        const std::vector<bool> expected = apply(*ref);
+        llama_grammar_free_impl(ref);
+        assert(masked == expected && "Trie mask and per-token rejection should agree");
+
+        std::vector<llama_token> next;
+        for (llama_token id = 0; id < n_vocab; ++id) {
+            if (masked[id] && !llama_vocab_is_eog(vocab, id)) {
+                next.push_back(id);
+            }
+        }
+        reached_end = next.empty();
+        if (!reached_end) {
+            llama_grammar_accept_impl(*grammar, next[(step * 7) % next.size()]);
+        }
+    }
+    assert(reached_end && "The walk should reach the end of the grammar");
+
+    llama_grammar_free_impl(grammar);
+    std::cout << "Grammar trie allow-mask test passed" << std::endl;
+}
+
+// Test continuous batching of several requests on one context
+void test_batch_engine() {
+    std::cout << "Testing batch engine..." << std::endl;
+
+    common_params params;
+    params.model.path = "../llm.gguf";
+    params.n_ctx = 1024;
+    params.n_batch = 512;
+    params.n_parallel = 4;
+    params.cpuparams.n_threads = 4;
+    params.use_mmap = true;
+    params.warmup = false;
+
+    cactus::cactus_context ctx;
+    assert(ctx.loadModel(params) && "Model loading failed");
+
+    cactus::cactus_batch_engine engine(ctx, 4);
+    const std::vector<std::string> prompts = {
+        "Hello, how are you?",
+        "Write a short story about a cat.",
+        "The capital of France is",
+        "List three colors:",
+        "Count from one to five:",
+    };
+
+    int n_streamed = 0;
+    std::map<int32_t, std::string> streamed;
+    for (const auto &prompt : prompts) {
+        cactus::cactus_batch_request request;
+        request.prompt = prompt;
+        request.n_predict = 16;
+        request.on_token = [&n_streamed, &streamed](int32_t id, const cactus::completion_token_output &, const std::string &piece) {
+            n_streamed++;
+            streamed[id] += piece;
+            return true;
+        };
+        engine.submit(request);
+    }
+
+    std::vector<cactus::cactus_batch_result> results = engine.run();
+    assert(results.size() == prompts.size() && "Every request should produce a result");
+
+    int n_predicted = 0;
+    for (const auto &result : results) {
+        assert(!result.failed && "Batched request should not fail");
+        assert(result.num_tokens_predicted > 0 && "Batched request should predict tokens");
+        assert(streamed[result.id] == result.text && "Streamed pieces should add up to the result text");
+        n_predicted += result.num_tokens_predicted;
+    }
+    assert(n_streamed == n_predicted && "Every predicted token should be streamed");
+
+    // Stop strings: greedy decode once, then stop on a string from the middle of that text
+    cactus::cactus_batch_request greedy;
+    greedy.prompt = prompts[1];
+    greedy.n_predict = 32;
+    greedy.sampling.temp = 0.0f;
+    engine.submit(greedy);
+    const std::string full_text = engine.run().at(0).text;
+    assert(full_text.size() >= 8 && "Greedy request should generate some text");
+    const std::string stop = full_text.substr(full_text.size() / 2, 3);
+    const size_t stop_pos = full_text.find(stop);
+
+    // Prefill from scratch so the second run computes the same logits
+    llama_kv_self_clear(ctx.ctx);
+    std::string stop_streamed;
+    greedy.antiprompt = {stop};
+    greedy.on_token = [&stop_streamed](int32_t, const cactus::completion_token_output &, const std::string &piece) {
+        stop_streamed += piece;
+        return true;
+    };
+    engine.submit(greedy);
+    const cactus::cactus_batch_result stopped = engine.run().at(0);
+    assert(stopped.stopped_word && stopped.stopping_word == stop && "Request should stop on the stop string");
+    assert(stopped.text == full_text.substr(0, stop_pos) && "Result text should end before the stop string");
+    assert(stop_streamed == stopped.text && "No byte of the stop string should be streamed");
+    std::cout << "  Stopped on \"" << stop << "\" after " << stopped.text.size() << " bytes" << std::endl;
+
+    std::cout << "Batch engine test passed" << std::endl;
+}
+
+// Test that single-stream decoding on sequence 0 is unaffected by longer batch slots
+void test_batch_engine_single_stream() {
+    std::cout << "Testing single-stream completion after the batch engine..." << std::endl;
+
+    common_params params;
+    params.model.path = "../llm.gguf";
+    params.prompt = "The capital of France is";
+    params.n_predict = 16;
+    params.n_ctx = 1024;
+    params.n_batch = 512;
+    params.n_parallel = 2;
+    params.cpuparams.n_threads = 4;
+    params.use_mmap = true;
+    params.warmup = false;
+    params.sampling.temp = 0.0f;
+
+    auto complete = [](cactus::cactus_context &ctx) {
+        ctx.loadPrompt();
+        ctx.beginCompletion();
+        while (ctx.has_next_token) {
+            if (ctx.doCompletion().tok < 0) break;
+        }
+        return ctx.generated_text;
+    };
+
+    cactus::cactus_context fresh;
+    assert(fresh.loadModel(params) && "Model loading failed");
+    assert(fresh.initSampling() && "Sampling initialization failed");
+    const std::string expected = complete(fresh);
+    assert(!expected.empty() && "Response should not be empty");
+
+    cactus::cactus_context ctx;
+    assert(ctx.loadModel(params) && "Model loading failed");
+    assert(ctx.initSampling() && "Sampling initialization failed");
+
+    // The slot sequence stays resident while the engine lives and is longer than the prompt of sequence 0
+    cactus::cactus_batch_engine engine(ctx, 1);
+    cactus::cactus_batch_request request;
+    request.prompt = "Write a short story about a cat who lives in a lighthouse and watches the ships go by.";
+    request.n_predict = 32;
+    engine.submit(request);
+    const std::vector<cactus::cactus_batch_result> results = engine.run();
+    assert(results.size() == 1 && !results[0].failed && "Batched request should not fail");
+
+    assert(complete(ctx) == expected && "Sequence 0 should decode at its own positions next to the engine's slots");
+
+    std::cout << "Single-stream after batch engine test passed" << std::endl;
+}
+
+// Test that preselecting the top candidates samples the same tokens as the full vocabulary
+void test_sampler_preselect() {
+    std::cout << "Testing sampler preselection..." << std::endl;
+
+    common_params params;
+    params.model.path = "../llm.gguf";
+    params.n_ctx = 512;
+    params.cpuparams.n_threads = 4;
+    params.use_mmap = true;
+    params.warmup = false;
+
+    cactus::cactus_context ctx;
+    assert(ctx.loadModel(params) && "Model loading failed");
+
+    const int n_vocab = llama_vocab_n_tokens(llama_model_get_vocab(ctx.model));
+    const std::vector<llama_token> prompt = common_tokenize(ctx.ctx, "Once upon a time, in a small village", true, true);
+
+    // greedy, top-k/top-p and min-p chains, with penalties and a logit bias adjusting tokens
+    std::vector<common_params_sampling> configs(3);
+    configs[0].temp = 0.0f;
+    configs[0].penalty_repeat = 1.1f;
+    configs[1].temp = 0.8f;
+    configs[1].top_k = 40;
+    configs[1].top_p = 0.9f;
+    configs[1].penalty_repeat = 1.1f;
+    configs[1].logit_bias.push_back({prompt.back(), 2.0f});
+    configs[2].temp = 0.8f;
+    configs[2].top_k = 0;
+    configs[2].min_p = 0.05f;
+    for (auto & config : configs) {
+        config.seed = 42;
+    }
+
+    llama_batch batch = llama_batch_init(64, 0, 1);
+    for (const auto & config : configs) {
+        // a zero bias on every token leaves the logits alone but makes preselection fall back to the full vocabulary
+        common_params_sampling full_config = config;
+        for (llama_token id = 0; id < n_vocab; ++id) {
+            if (id != prompt.back()) {
+                full_config.logit_bias.push_back({id, 0.0f});
+            }
+        }
+        common_sampler * preselected = common_sampler_init(ctx.model, config);
+        common_sampler * full = common_sampler_init(ctx.model, full_config);
+
+        llama_kv_self_clear(ctx.ctx);
+        common_batch_clear(batch);
+        for (size_t i = 0; i < prompt.size(); ++i) {
+            common_batch_add(batch, prompt[i], (llama_pos) i, {0}, i + 1 == prompt.size());
+        }
+        assert(llama_decode(ctx.ctx, batch) == 0 && "Prompt decode failed");
+
+        for (int i = 0; i < 16; ++i) {
+            const llama_token token = common_sampler_sample(preselected, ctx.ctx, -1);
+            assert(token == common_sampler_sample(full, ctx.ctx, -1) && "Preselected and full sampling should agree");
+            common_sampler_accept(preselected, token, true);
+            common_sampler_accept(full, token, true);
+
+            common_batch_clear(batch);
+            common_batch_add(batch, token, (llama_pos) (prompt.size() + i), {0}, true);
+            assert(llama_decode(ctx.ctx, batch) == 0 && "Decode failed");
+        }
+
+        common_sampler_free(preselected);
+        common_sampler_free(full);
+    }
+    llama_batch_free(batch);
+
+    std::cout << "Sampler preselection test passed" << std::endl;
+}
+
+// Test that sampling several sequences of one batch in parallel matches sampling them one by one
+void test_sampler_batch() {
+    std::cout << "Testing batched sampling..." << std::endl;
+
+    common_params params;
+    params.model.path = "../llm.gguf";
+    params.n_ctx = 512;
+    params.n_parallel = 3;
+    params.cpuparams.n_threads = 4;
+    params.use_mmap = true;
+    params.warmup = false;
+    params.sampling.temp = 0.8f;
+    params.sampling.seed = 42;
+
+    cactus::cactus_context ctx;
+    assert(ctx.loadModel(params) && "Model loading failed");
+
+    const std::vector<std::string> prompts = {"The capital of France is", "List three colors:", "Once upon a time"};
+    llama_batch batch = llama_batch_init(256, 0, 1);
+    std::vector<common_sampler_seq> seqs;
+    for (size_t s = 0; s < prompts.size(); ++s) {
+        const std::vector<llama_token> tokens = common_tokenize(ctx.ctx, prompts[s], true, true);
+        for (size_t i = 0; i < tokens.size(); ++i) {
+            common_batch_add(batch, tokens[i], (llama_pos) i, {(llama_seq_id) s}, i + 1 == tokens.size());
+        }
+        seqs.push_back({common_sampler_init(ctx.model, params.sampling), batch.n_tokens - 1});
+    }
+    assert(llama_decode(ctx.ctx, batch) == 0 && "Batch decode failed");
+
+    std::vector<common_sampler *> serial;
+    for (const auto &seq : seqs) {
+        serial.push_back(common_sampler_clone(seq.gsmpl));
+    }
+    common_sampler_pool * pool = common_sampler_pool_init(3);
+    common_sampler_sample_batch(seqs, ctx.ctx, pool);
+    common_sampler_pool_free(pool);
+    for (size_t s = 0; s < seqs.size(); ++s) {
+        assert(seqs[s].token == common_sampler_sample(serial[s], ctx.ctx, seqs[s].idx) && "Batched and serial sampling should agree");
+        common_sampler_free(serial[s]);
+        common_sampler_free(seqs[s].gsmpl);
+    }
+    llama_batch_free(batch);
+
+    std::cout << "Batched sampling test passed" << std::endl;
+}
+
+// Test that a context with logits_top_k outputs the top of the full logits
+void test_logits_top_k() {
+    std::cout << "Testing top-k logits output..." << std::endl;
+
+    common_params params;
+    params.model.path = "../llm.gguf";
+    params.n_ctx = 512;
+    params.use_mmap = true;
+    params.warmup = false;
+    params.logits_top_k = 40;
+
+    cactus::cactus_context ctx;
+    assert(ctx.loadModel(params) && "Model loading failed");
+
+    params.logits_top_k = 0;
+    llama_context * full = llama_init_from_model(ctx.model, common_context_params_to_llama(params));
+    assert(full != nullptr && "Full logits context creation failed");
+
+    std::vector<llama_token> tokens = common_tokenize(ctx.ctx, "The capital of France is", true, true);
+    assert(llama_decode(ctx.ctx, llama_batch_get_one(tokens.data(), tokens.size())) == 0 && "Top-k decode failed");
+    assert(llama_decode(full, llama_batch_get_one(tokens.data(), tokens.size())) == 0 && "Full decode failed");
+
+    const float * logits = nullptr;
+    const llama_token * ids = nullptr;
+    assert(llama_get_logits_top_k_ith(ctx.ctx, -1, &logits, &ids) == 40 && "Expected 40 top-k logits");
+    assert(llama_get_logits_ith(ctx.ctx, -1) == nullptr && "Full logits should not be available");
+    assert(llama_get_logits_top_k_ith(full, -1, &logits, &ids) == 0 && "Full context should not output top-k logits");
+
+    const float * ref = llama_get_logits_ith(full, -1);
+    llama_get_logits_top_k_ith(ctx.ctx, -1, &logits, &ids);
+    for (int i = 0; i < 40; ++i) {
+        assert(std::fabs(logits[i] - ref[ids[i]]) < 1e-3f && "Top-k logit mismatch");
+        assert((i == 0 || logits[i] <= logits[i - 1]) && "Top-k logits should be in descending order");
+    }
+    const int n_vocab = llama_vocab_n_tokens(llama_model_get_vocab(ctx.model));
+    const int n_above = std::count_if(ref, ref + n_vocab, [&](float l) { return l > logits[39] + 1e-3f; });
+    assert(n_above < 40 && "Top-k should hold the largest logits");
+
+    llama_free(full);
+    std::cout << "Top-k logits output test passed" << std::endl;
+}
+
+// Test that a paged KV cache gives the same logits as the unified one across sequences
+void test_paged_kv_cache() {
+    std::cout << "Testing paged KV cache..." << std::endl;
+
+    common_params params;
+    params.model.path = "../llm.gguf";
+    params.n_ctx = 512;
+    params.n_parallel = 2;
+    params.use_mmap = true;
+    params.warmup = false;
+
+    cactus::cactus_context ctx;
+    assert(ctx.loadModel(params) && "Model loading failed");
+
+    params.kv_block_size = 16;
+    llama_context * paged = llama_init_from_model(ctx.model, common_context_params_to_llama(params));
+    assert(paged != nullptr && "Paged context creation failed");
+
+    const int n_vocab = llama_vocab_n_tokens(llama_model_get_vocab(ctx.model));
+    auto check = [&](const std::vector<std::pair<llama_token, llama_seq_id>> & toks, std::vector<llama_pos> & n_past) {
+        llama_batch batch = llama_batch_init(toks.size(), 0, 1);
+        for (const auto & [tok, seq] : toks) {
+            common_batch_add(batch, tok, n_past[seq]++, { seq }, true);
+        }
+        assert(llama_decode(ctx.ctx, batch) == 0 && "Unified decode failed");
+        assert(llama_decode(paged, batch) == 0 && "Paged decode failed");
+        for (int i = 0; i < batch.n_tokens; ++i) {
+            const float * ref = llama_get_logits_ith(ctx.ctx, i);
+            const float * out = llama_get_logits_ith(paged, i);
+            for (int v = 0; v < n_vocab; ++v) {
+                assert(std::fabs(out[v] - ref[v]) < 5e-2f && "Paged logits should match the unified cache");
+            }
+        }
+        llama_batch_free(batch);
+    };
+
+    std::vector<llama_pos> n_past(2, 0);
+    std::vector<std::pair<llama_token, llama_seq_id>> toks;
+    for (llama_token tok : common_tokenize(ctx.ctx, "The capital of France is Paris, and the capital of Spain is", true, true)) {
+        toks.push_back({ tok, 0 });
+    }
+    for (llama_token tok : common_tokenize(ctx.ctx, "Once upon a time", true, true)) {
+        toks.push_back({ tok, 1 });
+    }
+    check(toks, n_past);
+
+    // Drop the tail of sequence 0 and keep decoding both sequences
+    for (llama_context * c : { ctx.ctx, paged }) {
+        llama_kv_self_seq_rm(c, 0, n_past[0] - 4, -1);
+    }
+    n_past[0] -= 4;
+    for (llama_token tok : common_tokenize(ctx.ctx, " there was", false, true)) {
+        check({ { tok, 0 }, { tok, 1 } }, n_past);
+    }
+    assert(llama_kv_self_used_cells(paged) == llama_kv_self_used_cells(ctx.ctx) && "Paged cache should hold the same cells");
+    assert(llama_kv_self_seq_pos_max(paged, 0) == n_past[0] - 1 && "Paged cache should track sequence positions");
+
+    llama_kv_self_clear(paged);
+    assert(llama_kv_self_used_cells(paged) == 0 && "Cleared paged cache should be empty");
+
+    llama_free(paged);
+    std::cout << "Paged KV cache test passed" << std::endl;
+}
+
+// Test that a paged KV cache shares the blocks of a common prompt prefix between sequences
+void test_prefix_cache() {
+    std::cout << "Testing KV cache prefix sharing..." << std::endl;
+
+    common_params params;
+    params.model.path = "../llm.gguf";
+    params.n_ctx = 512;
+    params.n_parallel = 2;
+    params.use_mmap = true;
+    params.warmup = false;
+    params.kv_block_size = 16;
+
+    cactus::cactus_context ctx;
+    assert(ctx.loadModel(params) && "Model loading failed");
+
+    params.kv_block_size = 0;
+    llama_context * unified = llama_init_from_model(ctx.model, common_context_params_to_llama(params));
+    assert(unified != nullptr && "Unified context creation failed");
+
+    const std::string system = "You are a helpful assistant. Answer every question briefly and accurately, "
+                               "and say so when you do not know the answer.";
+    std::vector<llama_token> first  = common_tokenize(ctx.ctx, system + " What is the capital of France?", true, true);
+    std::vector<llama_token> second = common_tokenize(ctx.ctx, system + " Name a large animal.", true, true);
+    const size_t n_common = cactus::common_part(first, second);
+    assert(n_common >= 16 && "The prompts should share at least one block");
+
+    assert(llama_decode(ctx.ctx, llama_batch_get_one(first.data(), first.size())) == 0 && "First decode failed");
+
+    const int32_t n_past = llama_kv_self_seq_attach_prefix(ctx.ctx, 1, second.data(), second.size() - 1, 0);
+    assert(n_past == (int32_t) (n_common / 16 * 16) && "The full blocks of the common prefix should be attached");
+    assert(llama_kv_self_seq_pos_max(ctx.ctx, 1) == n_past - 1 && "The attached prefix should belong to the sequence");
+
+    llama_batch batch = llama_batch_init(second.size(), 0, 1);
+    for (size_t i = n_past; i < second.size(); ++i) {
+        common_batch_add(batch, second[i], i, { 1 }, i + 1 == second.size());
+    }
+    assert(llama_decode(ctx.ctx, batch) == 0 && "Decode after the prefix failed");
+    assert(llama_decode(unified, llama_batch_get_one(second.data(), second.size())) == 0 && "Unified decode failed");
+    llama_batch_free(batch);
+
+    const int n_vocab = llama_vocab_n_tokens(llama_model_get_vocab(ctx.model));
+    const float * ref = llama_get_logits_ith(unified, -1);
+    const float * out = llama_get_logits_ith(ctx.ctx, -1);
+    for (int v = 0; v < n_vocab; ++v) {
+        assert(std::fabs(out[v] - ref[v]) < 5e-2f && "Logits after a shared prefix should match a full prefill");
+    }
+
+    // The prefix stays cached after both sequences are gone
+    llama_kv_self_seq_rm(ctx.ctx, 0, -1, -1);
+    llama_kv_self_seq_rm(ctx.ctx, 1, -1, -1);
+    assert(llama_kv_self_used_cells(ctx.ctx) == 0 && "No sequence should hold cells");
+    assert(llama_kv_self_seq_attach_prefix(ctx.ctx, 0, first.data(), first.size() - 1, 0) >= n_past && "The released prefix should still be cached");
+
+    llama_free(unified);
+    std::cout << "KV cache prefix sharing test passed" << std::endl;
+}
+
+// Test the sequence operations of the KV cache index on several sequences
+void test_kv_cache_seq_ops() {
+    std::cout << "Testing KV cache sequence operations..." << std::endl;
+
+    common_params params;
+    params.model.path = "../llm.gguf";
+    params.n_ctx = 256;
+    params.n_parallel = 4;
+    params.use_mmap = true;
+    params.warmup = false;
+
+    cactus::cactus_context ctx;
+    assert(ctx.loadModel(params) && "Model loading failed");
+
+    std::vector<llama_token> tokens = common_tokenize(ctx.ctx, "The quick brown fox jumps over the lazy dog", true, true);
+    const llama_pos n = tokens.size();
+
+    llama_batch batch = llama_batch_init(n, 0, 1);
+    for (llama_pos i = 0; i < n; ++i) {
+        common_batch_add(batch, tokens[i], i, { 0 }, false);
+    }
+    assert(llama_decode(ctx.ctx, batch) == 0 && "Decode failed");
+
+    llama_kv_self_seq_cp(ctx.ctx, 0, 1, -1, -1);
+    llama_kv_self_seq_cp(ctx.ctx, 0, 2, 0, n/2);
+    assert(llama_kv_self_used_cells(ctx.ctx) == n && "Copies should share the cells");
+    assert(llama_kv_self_n_tokens(ctx.ctx) == 2*n + n/2 && "Every sequence should count its tokens");
+    assert(llama_kv_self_seq_pos_max(ctx.ctx, 2) == n/2 - 1 && "The partial copy should end at n/2");
+
+    llama_kv_self_seq_rm(ctx.ctx, 0, n/2, -1);
+    assert(llama_kv_self_seq_pos_max(ctx.ctx, 0) == n/2 - 1 && "The removed tail should be gone");
+    assert(llama_kv_self_used_cells(ctx.ctx) == n && "Sequence 1 still holds all cells");
+
+    llama_kv_self_seq_keep(ctx.ctx, 1);
+    assert(llama_kv_self_used_cells(ctx.ctx) == n && "The cells of sequence 1 should be kept");
+    assert(llama_kv_self_seq_pos_max(ctx.ctx, 2) == 0 && "Dropped sequences should be empty");
+
+    llama_kv_self_seq_add(ctx.ctx, 1, 0, -1, 10);
+    assert(llama_kv_self_seq_pos_max(ctx.ctx, 1) == n + 9 && "The shift should move the sequence");
+
+    llama_kv_self_seq_rm(ctx.ctx, 1, 0, 10 + n/2);
+    assert(llama_kv_self_used_cells(ctx.ctx) == n - n/2 && "Removed cells should be released");
+
+    // a sequence id past the cache limit is rejected
+    common_batch_clear(batch);
+    common_batch_add(batch, tokens[0], 0, { LLAMA_MAX_SEQ }, true);
+    assert(llama_decode(ctx.ctx, batch) != 0 && "Out of range sequence ids should be rejected");
+
+    llama_kv_self_seq_rm(ctx.ctx, -1, -1, -1);
+    assert(llama_kv_self_used_cells(ctx.ctx) == 0 && "The cache should be empty");
+
+    llama_batch_free(batch);
+    std::cout << "KV cache sequence operations test passed" << std::endl;
+}
+
+// Test that sliding-window layers keep only their window without changing the logits
+void test_swa_kv_cache() {
+    std::cout << "Testing sliding-window KV cache..." << std::endl;
+
+    common_params params;
+    params.model.path = "../llm.gguf";
+    params.n_ctx = 512;
+    params.n_ubatch = 32;
+    params.n_parallel = 2;
+    params.use_mmap = true;
+    params.warmup = false;
+
+    cactus::cactus_context ctx;
+    assert(ctx.loadModel(params) && "Model loading failed");
+
+    char arch[64] = {};
+    char val[32] = {};
+    llama_model_meta_val_str(ctx.model, "general.architecture", arch, sizeof(arch));
+    if (llama_model_meta_val_str(ctx.model, (std::string(arch) + ".attention.sliding_window").c_str(), val, sizeof(val)) < 0) {
+        std::cout << "Model has no sliding-window layers, skipping sliding-window KV cache test" << std::endl;
+        return;
+    }
+    const int n_swa = std::atoi(val);
+
+    // The windowed cache holds n_parallel + 2 windows of n_swa + n_ubatch cells and is only
+    // used when that is smaller than the context
+    params.n_ctx = std::max(512, 6*(n_swa + params.n_ubatch));
+    llama_context * win = llama_init_from_model(ctx.model, common_context_params_to_llama(params));
+    assert(win != nullptr && "Windowed SWA context creation failed");
+
+    params.swa_full = true;
+    llama_context * full = llama_init_from_model(ctx.model, common_context_params_to_llama(params));
+    assert(full != nullptr && "Full-size SWA context creation failed");
+
+    const int n_vocab = llama_vocab_n_tokens(llama_model_get_vocab(ctx.model));
+    auto check = [&](const std::vector<llama_token> & toks, llama_pos & n_past, llama_seq_id seq) {
+        llama_batch batch = llama_batch_init(toks.size(), 0, 1);
+        for (size_t i = 0; i < toks.size(); ++i) {
+            common_batch_add(batch, toks[i], n_past++, { seq }, i + 1 == toks.size());
+        }
+        assert(llama_decode(win, batch) == 0 && "Windowed decode failed");
+        assert(llama_decode(full, batch) == 0 && "Full decode failed");
+        const float * ref = llama_get_logits_ith(full, -1);
+        const float * out = llama_get_logits_ith(win, -1);
+        for (int v = 0; v < n_vocab; ++v) {
+            assert(std::fabs(out[v] - ref[v]) < 5e-2f && "Windowed logits should match the full cache");
+        }
+        llama_batch_free(batch);
+    };
+
+    std::vector<llama_token> text = common_tokenize(ctx.ctx,
+        "The history of the city goes back to a small fishing village on the river, which grew into a market town "
+        "and later into the capital of a large province, with a cathedral, a university and a busy harbour.", true, true);
+
+    // Decode two sequences past the window in small steps, so the windowed cache has to reuse its cells
+    std::vector<llama_pos> n_past(2, 0);
+    while (n_past[1] <= 2*(n_swa + params.n_ubatch)) {
+        for (llama_seq_id seq = 0; seq < 2; ++seq) {
+            check(text, n_past[seq], seq);
+        }
+    }
+    assert(llama_state_get_size(win) < llama_state_get_size(full) && "Sliding-window layers should only keep their window");
+
+    // A short rollback keeps the window and decodes the same on both caches
+    for (llama_context * c : { win, full }) {
+        assert(llama_kv_self_seq_rm(c, 0, n_past[0] - 4, -1) && "A short rollback should be allowed");
+    }
+    n_past[0] -= 4;
+    check({ text[1], text[2] }, n_past[0], 0);
+
+    llama_kv_self_clear(win);
+    assert(llama_kv_self_used_cells(win) == 0 && "Cleared cache should be empty");
+
+    llama_free(win);
+    llama_free(full);
+    std::cout << "Sliding-window KV cache test passed" << std::endl;
+}
+
+// Test that each eviction policy keeps generating past the context size with the sinks in place
+void test_kv_evict_policies() {
+    std::cout << "Testing KV eviction policies..." << std::endl;
+
+    for (common_kv_evict policy : { COMMON_KV_EVICT_HALF, COMMON_KV_EVICT_SINK, COMMON_KV_EVICT_HEAVY_HITTER }) {
+        common_params params;
+        params.model.path = "../llm.gguf";
+        params.prompt = "Write a long story about a lighthouse keeper:";
+        params.n_predict = 300;
+        params.n_ctx = 128;
+        params.n_batch = 128;
+        params.n_keep = 4;
+        params.n_evict = 8;
+        params.kv_evict = policy;
+        params.cpuparams.n_threads = 4;
+        params.use_mmap = true;
+        params.warmup = false;
+        params.sampling.ignore_eos = true;
+
+        cactus::cactus_context ctx;
+        assert(ctx.loadModel(params) && "Model loading failed");
+        assert(ctx.initSampling() && "Sampling initialization failed");
+
+        ctx.loadPrompt();
+        ctx.beginCompletion();
+        const std::vector<llama_token> prompt = ctx.embd;
+
+        int n_generated = 0;
+        while (ctx.has_next_token) {
+            auto tok = ctx.nextToken();
+            if (tok.tok < 0) break;
+            n_generated++;
+
+            assert(ctx.embd.size() < (size_t) params.n_ctx && "Eviction should keep the tokens within the context");
+            assert(llama_kv_self_seq_pos_max(ctx.ctx, 0) == (llama_pos) ctx.n_past - 1 && "Cache positions should stay contiguous");
+        }
+
+        assert(n_generated == params.n_predict && "Generation should continue past the context size");
+        for (int i = 0; i <= params.n_keep; ++i) {
+            assert(ctx.embd[i] == prompt[i] && "The kept tokens should never be evicted");
+        }
+        if (policy != COMMON_KV_EVICT_HALF) {
+            assert(ctx.embd.size() + params.n_evict >= (size_t) params.n_ctx - 1 && "Small eviction steps should keep the cache full");
+        }
+        if (policy == COMMON_KV_EVICT_HEAVY_HITTER) {
+            assert(!ctx.kv_scores.empty() && "The attention mass should be accumulated");
+        }
+    }
+
+    std::cout << "KV eviction policies test passed" << std::endl;
+}
+
+// Test speculative decoding, using the test model as its own draft model
+void test_speculative_decoding() {
+    std::cout << "Testing speculative decoding..." << std::endl;
+
+    common_params params;
+    params.model.path = "../llm.gguf";
+    params.speculative.model.path = "../llm.gguf";
+    params.speculative.n_max = 4;
+    params.speculative.p_min = 0.0f; // draft regardless of confidence so every round speculates
+    params.prompt = "Count from one to ten: one, two, three,";
+    params.n_predict = 24;
+    params.n_ctx = 1024;
+    params.n_batch = 512;
+    params.cpuparams.n_threads = 4;
+    params.use_mmap = true;
+    params.warmup = false;
+    params.sampling.temp = 0.0f;
+
+    cactus::cactus_context ctx;
+    assert(ctx.loadModel(params) && "Model loading failed");
+    assert(ctx.draft_ctx != nullptr && "Draft model should be loaded");
+    assert(ctx.initSampling() && "Sampling initialization failed");
+
+    ctx.loadPrompt();
+    ctx.beginCompletion();
+    while (ctx.has_next_token) {
+        if (ctx.doCompletion().tok < 0) break;
+    }
+
+    std::cout << "Drafted " << ctx.n_drafted << " tokens, accepted " << ctx.n_draft_accepted << std::endl;
+    assert(!ctx.generated_text.empty() && "Response should not be empty");
+    assert(ctx.num_tokens_predicted <= (size_t) params.n_predict && "Speculation should respect n_predict");
+    assert(ctx.n_draft_accepted > 0 && "A model drafting for itself should get drafts accepted");
+
+    // Greedy speculation must not change the output
+    common_params plain_params = params;
+    plain_params.speculative.model.path.clear();
+    cactus::cactus_context plain;
+    assert(plain.loadModel(plain_params) && "Model loading failed");
+    assert(plain.draft_ctx == nullptr);
+    assert(plain.initSampling() && "Sampling initialization failed");
+
+    plain.loadPrompt();
+    plain.beginCompletion();
+    while (plain.has_next_token) {
+        if (plain.doCompletion().tok < 0) break;
+    }
+    assert(plain.generated_text == ctx.generated_text && "Speculative and plain greedy decoding should agree");
+
+    std::cout << "Speculative decoding test passed" << std::endl;
+}
+
+// Test that a draft context smaller than the generation keeps reusing its cache
+void test_speculative_small_draft_ctx() {
+    std::cout << "Testing speculative decoding with a small draft context..." << std::endl;
+
+    common_params params;
+    params.model.path = "../llm.gguf";
+    params.speculative.model.path = "../llm.gguf";
+    params.speculative.n_ctx = 64;
+    params.speculative.n_max = 4;
+    params.speculative.p_min = 0.0f;
+    params.prompt = "Count from one to one hundred: one, two, three,";
+    params.n_predict = 192;
+    params.n_ctx = 1024;
+    params.n_batch = 512;
+    params.cpuparams.n_threads = 4;
+    params.use_mmap = true;
+    params.warmup = false;
+    params.sampling.temp = 0.0f;
+    params.sampling.ignore_eos = true;
+
+    cactus::cactus_context ctx;
+    assert(ctx.loadModel(params) && "Model loading failed");
+    assert(ctx.draft_ctx != nullptr && "Draft model should be loaded");
+    assert((int) llama_n_ctx(ctx.draft_ctx) < params.n_predict && "Generation should outgrow the draft context");
+    assert(ctx.initSampling() && "Sampling initialization failed");
+
+    ctx.loadPrompt();
+    ctx.beginCompletion();
+    while (ctx.has_next_token) {
+        if (ctx.doCompletion().tok < 0) break;
+    }
+
+    std::cout << "Draft model decoded " << ctx.n_draft_prefill << " context tokens for "
+              << ctx.num_prompt_tokens + ctx.num_tokens_predicted << " tokens" << std::endl;
+    assert(ctx.draft_n_cut > 0 && "Generation should have moved the draft window");
+    assert(ctx.n_draft_accepted > 0 && "A model drafting for itself should get drafts accepted");
+    // Each round evaluates at most the tokens accepted since the last one, not the whole window again
+    assert(ctx.n_draft_prefill <= ctx.num_prompt_tokens + 2*ctx.num_tokens_predicted && "The draft cache should be shifted, not recomputed");
+
+    common_params plain_params = params;
+    plain_params.speculative.model.path.clear();
+    cactus::cactus_context plain;
+    assert(plain.loadModel(plain_params) && "Model loading failed");
+    assert(plain.initSampling() && "Sampling initialization failed");
+
+    plain.loadPrompt();
+    plain.beginCompletion();
+    while (plain.has_next_token) {
+        if (plain.doCompletion().tok < 0) break;
+    }
+    assert(plain.generated_text == ctx.generated_text && "Speculative and plain greedy decoding should agree");
+
+    std::cout << "Speculative decoding with a small draft context test passed" << std::endl;
+}
+
+// Test the vocoder's mixed-radix inverse real FFT against the direct transform it replaced
+void test_tts_irfft() {
+    std::cout << "Testing vocoder inverse FFT..." << std::endl;
+
+    std::mt19937 rng(42);
+    std::uniform_real_distribution<float> dist(-1.0f, 1.0f);
+
+    // 1280 is the vocoder's size; the others reach radix 3, 5 and the generic odd radix
+    for (int n : {1280, 1200, 1008, 22}) {
+        const cactus::tts_internal::irfft_plan &plan = cactus::tts_internal::get_irfft_plan(n);
+        const int n_bins = n / 2 + 1;
+
+        std::vector<float> spectrum(2 * n_bins);
+        for (float &v : spectrum) {
+            v = dist(rng);
+        }
+
+        std::vector<float> out(n);
+        std::vector<float> scratch(4 * plan.m);
+        plan.execute(spectrum.data(), out.data(), scratch.data());
+
+        // out[t] = Re(sum_{k <= n/2} X[k] * e^(2*pi*i*k*t/n)) / (n/2 + 1), evaluated directly in double
+        double max_ref = 0.0;
+        double max_err = 0.0;
+        for (int t = 0; t < n; ++t) {
+            double sum = 0.0;
+            for (int k = 0; k < n_bins; ++k) {
+                const double a = 2.0 * M_PI * (double) ((int64_t) k * t % n) / n;
+                sum += spectrum[2 * k] * cos(a) - spectrum[2 * k + 1] * sin(a);
+            }
+            sum /= n_bins;
+            max_ref = std::max(max_ref, std::fabs(sum));
+            max_err = std::max(max_err, std::fabs(sum - out[t]));
+        }
+        std::cout << "  n=" << n << ": max error " << max_err << " (max magnitude " << max_ref << ")" << std::endl;
+        assert(max_err <= 1e-5 * max_ref && "FFT should match the direct transform");
+    }
+
+    std::cout << "Vocoder inverse FFT test passed" << std::endl;
+}
+
+// Test that streaming overlap-add emits the same samples as folding every frame at once
+void test_tts_overlap_add() {
+    std::cout << "Testing streaming vocoder overlap-add..." << std::endl;
+
+    const int n_fft = 1280;
+    const int n_hop = 320;
+    const int n_pad = (n_fft - n_hop) / 2;
+    const int n_embd = 2 * (n_fft / 2 + 1);
+    const int n_frames = 50;
+    const cactus::tts_internal::irfft_plan &plan = cactus::tts_internal::get_irfft_plan(n_fft);
+
+    // Synthetic vocoder output: log-magnitudes and phases per frame
+    std::mt19937 rng(7);
+    std::uniform_real_distribution<float> log_mag(-4.0f, 1.0f);
+    std::uniform_real_distribution<float> phase(-3.14159f, 3.14159f);
+    std::vector<float> embd((size_t) n_frames * n_embd);
+    for (int f = 0; f < n_frames; ++f) {
+        for (int k = 0; k < n_embd / 2; ++k) {
+            embd[(size_t) f * n_embd + k] = log_mag(rng);
+            embd[(size_t) f * n_embd + n_embd / 2 + k] = phase(rng);
+        }
+    }
+
+    // Single pass: fold all windowed frames and the squared window, trim the padding, normalize
+    std::vector<float> frames((size_t) n_frames * n_fft);
+    cactus::tts_internal::frames_to_windowed_signal(plan, embd.data(), n_frames, n_embd, 2, frames.data());
+    const int64_t n_out_padded = (int64_t) (n_frames - 1) * n_hop + n_fft;
+    std::vector<float> folded(n_out_padded, 0.0f);
+    std::vector<float> energy(n_out_padded, 0.0f);
+    for (int f = 0; f < n_frames; ++f) {
+        for (int j = 0; j < n_fft; ++j) {
+            folded[(size_t) f * n_hop + j] += frames[(size_t) f * n_fft + j];
+            energy[(size_t) f * n_hop + j] += plan.window_sq[j];
+        }
+    }
+    std::vector<float> expected;
+    for (int64_t i = n_pad; i < n_out_padded - n_pad; ++i) {
+        expected.push_back(energy[i] > 1e-8f ? folded[i] / energy[i] : 0.0f);
+    }
+
+    // Streaming: frames arrive in uneven chunks and finished samples are taken after each one
+    cactus::tts_internal::overlap_add ola(plan, n_hop);
+    std::vector<float> streamed;
+    size_t n_taken_early = 0;
+    int n_done = 0;
+    for (int n_chunk : {7, 24, 1, 18}) {
+        std::vector<float> chunk((size_t) n_chunk * n_fft);
+        cactus::tts_internal::frames_to_windowed_signal(plan, embd.data() + (size_t) n_done * n_embd, n_chunk, n_embd, 1, chunk.data());
+        ola.add(chunk.data(), n_chunk);
+        n_done += n_chunk;
+        ola.take(false, streamed);
+        n_taken_early = streamed.size();
+    }
+    assert(n_done == n_frames);
+    ola.take(true, streamed);
+
+    assert(n_taken_early > 0 && n_taken_early < streamed.size() && "Samples should be emitted before the end");
+    assert(streamed.size() == expected.size() && "Streaming should emit as many samples as the single pass");
+    float max_err = 0.0f;
+    for (size_t i = 0; i < expected.size(); ++i) {
+        max_err = std::max(max_err, std::fabs(streamed[i] - expected[i]));
+    }
+    std::cout << "  " << streamed.size() << " samples, max difference " << max_err << std::endl;
+    assert(max_err <= 1e-6f && "Streaming overlap-add should match the single pass");
+
+    std::cout << "Streaming vocoder overlap-add test passed" << std::endl;
+}
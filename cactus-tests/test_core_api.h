@@ -7,9 +7,34 @@ void test_basic_completion();
 void test_chat_formatting();
 void test_prompt_truncation();
 void test_stopping_criteria();
+void test_stop_string_matching();
 void test_embedding_generation();
+void test_embedding_batch_many();
 void test_benchmarking();
+void test_bench_suite();
 void test_jinja_chat_formatting();
 void test_kv_cache_type();
+void test_prompt_cache_reuse();
+void test_session_save_restore();
+void test_grammar_cache();
+void test_penalties_sampler();
+void test_dry_sampler();
+void test_grammar_trigger_dfa();
+void test_grammar_jump_forward();
+void test_grammar_trie_mask();
+void test_batch_engine();
+void test_batch_engine_single_stream();
+void test_sampler_preselect();
+void test_sampler_batch();
+void test_logits_top_k();
+void test_paged_kv_cache();
+void test_prefix_cache();
+void test_kv_cache_seq_ops();
+void test_swa_kv_cache();
+void test_kv_evict_policies();
+void test_speculative_decoding();
+void test_speculative_small_draft_ctx();
+void test_tts_irfft();
+void test_tts_overlap_add();
 
 #endif // TEST_CORE_API_H 
\ No newline at end of file
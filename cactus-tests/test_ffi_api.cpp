@@ -1,5 +1,6 @@
 #include "test_ffi_api.h"
 #include "../cactus/cactus_ffi.h"
+#include "../cactus/cactus.h"
 #include <iostream>
 #include <string>
 #include <vector>
@@ -105,6 +106,103 @@ void test_ffi_completion_basic() {
     std::cout << "FFI basic completion test passed" << std::endl;
 }
 
+static bool count_tokens_callback(const char* token) {
+    (void) token;
+    return true;
+}
+
+void test_ffi_completion_timings() {
+    std::cout << "Testing FFI completion timings..." << std::endl;
+    cactus_init_params_c_t init_params_c = {};
+    init_params_c.model_path = "../llm.gguf";
+    init_params_c.n_ctx = 512;
+    init_params_c.n_batch = 512; 
+    init_params_c.n_threads = 1;
+    init_params_c.use_mmap = true;
+    cactus_context_handle_t handle = cactus_init_context_c(&init_params_c);
+    assert(handle != nullptr && "FFI: Context init failed for timings test");
+
+    cactus_completion_params_c_t comp_params_c = {};
+    comp_params_c.prompt = "Write a short sentence about the sea.";
+    comp_params_c.n_predict = 16;
+    comp_params_c.temperature = 0.1;
+    comp_params_c.seed = 1234;
+    comp_params_c.ignore_eos = true;
+    comp_params_c.token_callback = count_tokens_callback;
+
+    cactus_completion_result_c_t result = {};
+    int status = cactus_completion_c(handle, &comp_params_c, &result);
+    assert(status == 0 && "FFI: cactus_completion_c failed");
+
+    const cactus_completion_timings_c_t& t = result.timings;
+    assert(t.prompt_n > 0 && t.prompt_ms > 0 && "FFI: Prefill timings not populated");
+    assert(t.predicted_n == result.tokens_predicted && "FFI: Timed token count mismatch");
+    assert(t.ttft_ms > 0 && t.ttft_ms <= t.total_ms && "FFI: Invalid time to first token");
+    assert(t.decode_ms > 0 && t.sampling_ms > 0 && "FFI: Decode/sampling timings not populated");
+    assert(t.itl_p50_ms > 0 && t.itl_p50_ms <= t.itl_p90_ms && t.itl_p90_ms <= t.itl_p99_ms && "FFI: Invalid latency percentiles");
+    std::cout << "  FFI: prefill " << t.prompt_n << " tokens in " << t.prompt_ms << " ms, TTFT " << t.ttft_ms
+              << " ms, " << t.predicted_per_second << " tokens/s, ITL p50/p99 " << t.itl_p50_ms << "/" << t.itl_p99_ms << " ms" << std::endl;
+
+    cactus_free_completion_result_members_c(&result);
+    cactus_free_context_c(handle);
+
+    std::cout << "FFI completion timings test passed" << std::endl;
+}
+
+void test_ffi_completion_stream() {
+    std::cout << "Testing FFI pull-based completion stream..." << std::endl;
+    cactus_init_params_c_t init_params_c = {};
+    init_params_c.model_path = "../llm.gguf";
+    init_params_c.n_ctx = 512;
+    init_params_c.n_batch = 512; 
+    init_params_c.n_threads = 1;
+    init_params_c.use_mmap = true;
+    cactus_context_handle_t handle = cactus_init_context_c(&init_params_c);
+    assert(handle != nullptr && "FFI: Context init failed for stream test");
+
+    cactus_completion_params_c_t comp_params_c = {};
+    comp_params_c.prompt = "Count from one to ten:";
+    comp_params_c.n_predict = 24;
+    comp_params_c.temperature = 0.1;
+    comp_params_c.seed = 1234;
+    comp_params_c.ignore_eos = true;
+    comp_params_c.n_probs = 3;
+
+    // A tiny ring forces the generator to wait for the reader
+    cactus_token_stream_handle_t stream = cactus_completion_stream_start_c(handle, &comp_params_c, 4);
+    assert(stream != nullptr && "FFI: cactus_completion_stream_start_c failed");
+
+    std::string streamed_text;
+    int32_t n_events_total = 0;
+    int32_t n_batches = 0;
+    while (true) {
+        const cactus_token_event_c_t* events = nullptr;
+        int32_t n = cactus_completion_stream_acquire_c(stream, &events, 8, -1);
+        if (n < 0) break;
+        for (int32_t i = 0; i < n; ++i) {
+            assert(events[i].index == n_events_total && "FFI: Stream events out of order");
+            assert(events[i].text_offset == (int32_t) streamed_text.size() && "FFI: Stream text offset mismatch");
+            assert(events[i].n_probs > 0 && events[i].n_probs <= 3 && "FFI: Stream probabilities missing");
+            streamed_text.append(events[i].text, events[i].text_len);
+            n_events_total++;
+        }
+        cactus_completion_stream_release_c(stream, n);
+        n_batches++;
+    }
+
+    cactus_completion_result_c_t result = {};
+    int status = cactus_completion_stream_finish_c(stream, &result);
+    assert(status == 0 && "FFI: cactus_completion_stream_finish_c failed");
+    assert(n_events_total == result.tokens_predicted && "FFI: Streamed token count mismatch");
+    assert(streamed_text == result.text && "FFI: Streamed text differs from final text");
+    std::cout << "  FFI: Streamed " << n_events_total << " tokens in " << n_batches << " batches" << std::endl;
+
+    cactus_free_completion_result_members_c(&result);
+    cactus_free_context_c(handle);
+
+    std::cout << "FFI completion stream test passed" << std::endl;
+}
+
 void test_ffi_embedding_basic() {
     std::cout << "Testing FFI basic embedding..." << std::endl;
     // 1. Init context for embedding
@@ -134,4 +232,79 @@ void test_ffi_embedding_basic() {
     cactus_free_context_c(handle);
 
     std::cout << "FFI basic embedding test passed" << std::endl;
-} 
\ No newline at end of file
+} 
+
+void test_ffi_embedding_batch() {
+    std::cout << "Testing FFI batch embedding..." << std::endl;
+    // 1. Init context for embedding with mean pooling
+    cactus_init_params_c_t init_params_c = {};
+    init_params_c.model_path = "../llm.gguf";
+    init_params_c.n_ctx = 512;
+    init_params_c.n_batch = 512;
+    init_params_c.n_ubatch = 512;
+    init_params_c.n_threads = 1;
+    init_params_c.use_mmap = true;
+    init_params_c.embedding = true;
+    init_params_c.pooling_type = 1;
+
+    cactus_context_handle_t handle = cactus_init_context_c(&init_params_c);
+    assert(handle != nullptr && "FFI: Context init failed for batch embedding test");
+
+    // 2. Embed several texts in one call
+    const char* texts[] = {"Embed this.", "A second, longer sentence to embed.", "Third."};
+    cactus_embedding_batch_c_t batch = cactus_embedding_batch_c(handle, texts, 3);
+    assert(batch.values != nullptr && "FFI: Batch embedding failed (null values)");
+    assert(batch.n_texts == 3 && "FFI: Batch embedding should return one row per text");
+    assert(batch.n_embd > 0 && "FFI: Batch embedding failed (zero dimension)");
+
+    // 3. Rows must match embedding the same text on its own
+    cactus_float_array_c_t single = cactus_embedding_c(handle, texts[1]);
+    assert(single.count == batch.n_embd && "FFI: Single and batch embedding sizes differ");
+    for (int32_t i = 0; i < single.count; ++i) {
+        const float diff = single.values[i] - batch.values[batch.n_embd + i];
+        assert(diff < 1e-3f && diff > -1e-3f && "FFI: Batched row differs from single embedding");
+    }
+    std::cout << "  FFI: Embedded " << batch.n_texts << " texts of dimension " << batch.n_embd << std::endl;
+
+    // 4. Clean up
+    cactus_free_float_array_c(single);
+    cactus_free_embedding_batch_c(batch);
+    cactus_free_context_c(handle);
+
+    std::cout << "FFI batch embedding test passed" << std::endl;
+}
+
+void test_ffi_embedding_batch_shares_decode() {
+    std::cout << "Testing FFI batch embedding packs texts into one decode..." << std::endl;
+    // FFI contexts are created with a single sequence (n_parallel = 1)
+    cactus_init_params_c_t init_params_c = {};
+    init_params_c.model_path = "../llm.gguf";
+    init_params_c.n_ctx = 512;
+    init_params_c.n_batch = 512;
+    init_params_c.n_ubatch = 512;
+    init_params_c.n_threads = 1;
+    init_params_c.use_mmap = true;
+    init_params_c.embedding = true;
+    init_params_c.pooling_type = 1;
+
+    cactus_context_handle_t handle = cactus_init_context_c(&init_params_c);
+    assert(handle != nullptr && "FFI: Context init failed for shared decode test");
+    cactus::cactus_context* context = reinterpret_cast<cactus::cactus_context*>(handle);
+    assert(llama_n_seq_max(context->ctx) == 1);
+
+    const char* texts[] = {"One.", "Two words.", "Three short words.", "And a fourth one."};
+    const int32_t n_texts = 4;
+    cactus_embedding_batch_c_t batch = cactus_embedding_batch_c(handle, texts, n_texts);
+    assert(batch.values != nullptr && batch.n_texts == n_texts);
+
+    // The texts fit one micro-batch, so the last decode must have pooled every sequence id
+    for (int32_t s = 0; s < n_texts; ++s) {
+        assert(llama_get_embeddings_seq(context->ctx, s) != nullptr && "FFI: Texts were not decoded together");
+    }
+    std::cout << "  FFI: " << n_texts << " texts pooled from a single decode" << std::endl;
+
+    cactus_free_embedding_batch_c(batch);
+    cactus_free_context_c(handle);
+
+    std::cout << "FFI batch embedding shared decode test passed" << std::endl;
+}
@@ -5,6 +5,10 @@
 void test_ffi_init_free_context();
 void test_ffi_tokenize_detokenize();
 void test_ffi_completion_basic();
+void test_ffi_completion_timings();
+void test_ffi_completion_stream();
 void test_ffi_embedding_basic();
+void test_ffi_embedding_batch();
+void test_ffi_embedding_batch_shares_decode();
 
 #endif // TEST_FFI_API_H 
\ No newline at end of file
@@ -9,6 +9,10 @@
 // Standard Library Headers
 #include <sstream>
 #include <iostream>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <set>
 
 // llama.cpp Headers (used by mtmd_init_from_file for llama_model and llama_context)
 #include "llama.h" 
@@ -78,6 +82,15 @@ std::string tokens_to_str(llama_context *ctx, const std::vector<llama_token>::co
 lm_ggml_type kv_cache_type_from_str(const std::string & s);
 
 
+/**
+ * @brief Sequence id that saveSession/loadSession stage KV cells in
+ *
+ * Reserved above every batch engine slot (slot i uses seq_id i + 1), so staging never
+ * touches sequence 0 or a live slot.
+ */
+constexpr llama_seq_id session_staging_seq_id = LLAMA_MAX_SEQ - 1;
+
+
 /**
  * @enum stop_type
  * @brief Types of stopping criteria for text generation
@@ -89,6 +102,50 @@ enum stop_type
 };
 
 
+/**
+ * @struct stop_string_matcher
+ * @brief Incremental multi-pattern matcher for stop strings (Aho-Corasick automaton)
+ *
+ * Built once per request and fed the generated text as it grows, so each generated byte
+ * costs one table lookup regardless of the number and length of the stop strings.
+ */
+struct stop_string_matcher {
+    std::vector<std::string> stops;   /**< Stop strings, in the order given */
+
+    size_t n_fed = 0;                      /**< Bytes fed since the last reset */
+    size_t full_pos = std::string::npos;   /**< Start of the earliest complete stop string, npos if none */
+    int full_index = -1;                   /**< Index in stops of the string at full_pos */
+
+    /**
+     * @brief Builds the automaton for the given stop strings (empty strings are ignored) and resets it
+     */
+    void init(const std::vector<std::string> &stop_strings);
+
+    /**
+     * @brief Forgets the fed text, keeping the automaton
+     */
+    void reset();
+
+    /**
+     * @brief Appends bytes to the matched text
+     */
+    void feed(const char *data, size_t size);
+
+    /**
+     * @brief Start of the longest suffix of the fed text that is a prefix of a stop string
+     * @return Byte offset in the fed text, npos if no stop string has started
+     */
+    size_t partial_pos() const;
+
+    uint8_t byte_class[256] = {};   /**< Bytes not used by any stop string share class 0 */
+    int32_t n_classes = 1;
+    std::vector<int32_t> next;      /**< Transitions, node * n_classes + class */
+    std::vector<int32_t> depth;     /**< Length of the prefix a node stands for */
+    std::vector<int32_t> match;     /**< Longest stop string ending at a node, -1 if none */
+    int32_t state = 0;
+};
+
+
 /**
  * @struct completion_token_output
  * @brief Structure to hold a completion token and its probabilities
@@ -110,6 +167,47 @@ struct completion_token_output
 };
 
 
+/**
+ * @struct cactus_completion_timings
+ * @brief Per-phase timings of the current completion, in milliseconds
+ */
+struct cactus_completion_timings {
+    int32_t prompt_n = 0;            /**< Prompt tokens evaluated (cached prefix excluded) */
+    double prompt_ms = 0;            /**< Prefill: tokenizing and evaluating the prompt */
+    double ttft_ms = 0;              /**< Time from beginCompletion to the first generated token */
+    int32_t predicted_n = 0;         /**< Generated tokens */
+    double decode_ms = 0;            /**< llama_decode of generated tokens, including speculative rounds */
+    double sampling_ms = 0;          /**< Sampling and accepting generated tokens */
+    double detokenize_ms = 0;        /**< Converting generated tokens to text */
+    double callback_ms = 0;          /**< Time spent in host token callbacks (added by the caller) */
+    double total_ms = 0;             /**< Time from beginCompletion to the last generated token */
+    double prompt_per_second = 0;    /**< Prefill throughput */
+    double predicted_per_second = 0; /**< Generation throughput after the first token */
+    double itl_p50_ms = 0;           /**< Median inter-token latency */
+    double itl_p90_ms = 0;           /**< 90th percentile inter-token latency */
+    double itl_p99_ms = 0;           /**< 99th percentile inter-token latency */
+};
+
+
+/**
+ * @struct cactus_bench_params
+ * @brief Sweep definition for cactus_context::benchSuite
+ *
+ * Every combination of the listed values is measured. Empty thread and KV type lists
+ * use the values the context was loaded with.
+ */
+struct cactus_bench_params {
+    std::vector<int> n_prompt = {512};        /**< Prompt lengths; may exceed n_batch (prefill runs in n_batch chunks) */
+    std::vector<int> n_gen = {128};           /**< Generated tokens per sequence */
+    std::vector<int> n_depth = {0};           /**< Tokens already in the KV cache before the prompt */
+    std::vector<int> n_threads;               /**< Thread counts */
+    std::vector<int> n_parallel = {1};        /**< Parallel sequences decoded per generation step */
+    std::vector<lm_ggml_type> type_k;         /**< KV cache key types */
+    std::vector<lm_ggml_type> type_v;         /**< KV cache value types */
+    int repetitions = 3;                      /**< Timed runs per sweep point (after one warmup) */
+};
+
+
 /**
  * @struct cactus_context
  * @brief Main context class for LLM operations
@@ -129,7 +227,7 @@ struct cactus_context {
     size_t n_past = 0;               /**< Number of tokens already evaluated */
     size_t n_remain = 0;             /**< Number of tokens remaining to predict */
 
-    std::vector<llama_token> embd;   /**< Current token embeddings */
+    std::vector<llama_token> embd;   /**< Tokens resident in the KV cache for sequence 0 */
     common_params params;            /**< Model and generation parameters */
     common_init_result llama_init;   /**< llama.cpp initialization result */
 
@@ -146,6 +244,29 @@ struct cactus_context {
     llama_model *vocoder_model = nullptr;   /**< Pointer to the vocoder model */
     llama_context *vocoder_ctx = nullptr; /**< llama context for the vocoder */
 
+    // --- Speculative Decoding Members ---
+    llama_model *draft_model = nullptr;     /**< Draft model for speculative decoding */
+    llama_context *draft_ctx = nullptr;     /**< llama context for the draft model */
+    common_sampler *draft_sampling = nullptr; /**< Greedy sampler used to draft tokens */
+    std::vector<llama_token> draft_embd;    /**< Tokens resident in the draft KV cache */
+    size_t draft_n_cut = 0;                 /**< Leading embd tokens left out of a full draft context */
+    llama_token spec_id_last = LLAMA_TOKEN_NULL; /**< Last accepted token, decoded with the next draft */
+    std::deque<llama_token> spec_pending;   /**< Verified tokens not yet returned by nextToken */
+    size_t n_drafted = 0;                   /**< Total number of drafted tokens */
+    size_t n_draft_accepted = 0;            /**< Total number of drafted tokens accepted by the target */
+    size_t n_draft_prefill = 0;             /**< Total number of context tokens decoded by the draft model */
+    size_t n_jump_forward = 0;              /**< Total number of grammar-forced tokens decoded without sampling */
+
+    // --- Session Members ---
+    std::string session_path;               /**< Session file last saved or loaded */
+    std::vector<llama_token> session_tokens; /**< Tokens stored in session_path */
+    long session_file_bytes = 0;            /**< Size of the valid records in session_path */
+
+    // --- Context Eviction Members ---
+    std::vector<float> kv_scores;           /**< Attention mass received by each position of sequence 0 (heavy-hitter eviction) */
+    llama_kv_cache_view kv_view = {};       /**< Cell positions of the decode being scored */
+    int kv_score_layer = -1;                /**< Last layer scored, a lower one starts a new decode */
+
     int n_ctx;                       /**< Context size */
 
     bool truncated = false;          /**< Whether prompt was truncated */
@@ -154,6 +275,12 @@ struct cactus_context {
     bool stopped_limit = false;      /**< Stopped on token limit */
     std::string stopping_word;       /**< Word that triggered stopping */
     bool incomplete = false;         /**< Incomplete UTF-8 character */
+    stop_string_matcher stop_matcher; /**< params.antiprompt matched against generated_text */
+
+    cactus_completion_timings timings;   /**< Accumulated timings of the current completion */
+    int64_t t_completion_start_us = 0;   /**< Start of the current completion (beginCompletion) */
+    int64_t t_last_token_us = 0;         /**< Time the last generated token was produced, 0 before the first */
+    std::vector<float> inter_token_ms;   /**< Latency between consecutive generated tokens */
 
     std::vector<common_adapter_lora_info> lora; /**< LoRA adapters */
 
@@ -211,8 +338,136 @@ struct cactus_context {
      * @return true if synthesis succeeded, false otherwise.
      */
     bool synthesizeSpeech(const std::string& text, const std::string& output_wav_path, const std::string& speaker_id = "");
+
+    /**
+     * @brief Synthesizes speech from text, delivering PCM audio while codes are still being generated.
+     * 
+     * Audio codes are vocoded in small overlapping windows and overlap-added incrementally, so the
+     * first samples are available after a few dozen codes instead of after the whole utterance.
+     * 
+     * @param text The text to synthesize.
+     * @param on_audio Receives mono float PCM chunks in [-1, 1] and the sample rate; return false to stop.
+     * @param speaker_id Optional identifier for a speaker (if using speaker embeddings).
+     * @return true if synthesis succeeded (including a stop requested by on_audio), false otherwise.
+     */
+    bool synthesizeSpeechStream(
+        const std::string& text,
+        const std::function<bool(const float* samples, size_t n_samples, int sample_rate)>& on_audio,
+        const std::string& speaker_id = "");
+
+    /**
+     * @brief Runs the primary TTS model and reports each generated audio code (already offset to the vocoder's range).
+     * 
+     * @param text The text to synthesize.
+     * @param speaker_id Optional identifier for a speaker (if using speaker embeddings).
+     * @param on_code Called for every audio code; return false to stop generation.
+     * @return true if generation succeeded, false otherwise.
+     */
+    bool generateAudioCodes(const std::string& text, const std::string& speaker_id, const std::function<bool(llama_token code)>& on_code);
     
 
+    /**
+     * @brief Loads a draft model and enables speculative decoding in nextToken
+     * 
+     * Called by loadModel when params.speculative.model.path is set. The draft model
+     * must share the target model's vocabulary.
+     * 
+     * @param spec_params Draft model path and drafting limits (n_max, n_min, p_min, n_ctx)
+     * @return true if loading succeeded, false otherwise
+     */
+    bool loadDraftModel(const common_params_speculative &spec_params);
+
+
+    /**
+     * @brief Frees the draft model and disables speculative decoding
+     */
+    void freeDraftModel();
+
+
+    /**
+     * @brief Whether the current generation can use speculative decoding
+     */
+    bool canSpeculate() const;
+
+
+    /**
+     * @brief Tokenizes the text the grammar forces after the last accepted token
+     * 
+     * The last token of the forced text is left to the sampler so that the model can merge it
+     * with the unconstrained text that follows.
+     * 
+     * @param n_max Maximum number of tokens to return
+     * @return Tokens whose pieces spell a prefix of the forced text, possibly empty
+     */
+    std::vector<llama_token> jumpForwardTokens(size_t n_max);
+
+
+    /**
+     * @brief Drafts up to n_draft_max tokens following embd and id_last with the draft model
+     * 
+     * @param id_last Last accepted token, not yet in embd
+     * @param n_draft_max Maximum number of tokens to draft
+     * @return Drafted tokens (may be empty)
+     */
+    std::vector<llama_token> draftTokens(llama_token id_last, int n_draft_max);
+
+
+    /**
+     * @brief Verifies a draft with one batched decode of the target model
+     * 
+     * @return Accepted tokens (at least one), empty on decode failure
+     */
+    std::vector<llama_token> speculativeStep();
+
+
+    /**
+     * @brief Saves the KV cache of sequence 0 and its tokens to a session file
+     * 
+     * When the file was last saved or loaded by this context and still holds a prefix of the
+     * cached tokens, only the tokens added since are appended; otherwise the file is rewritten.
+     * 
+     * @param path Session file path
+     * @return true if saving succeeded, false otherwise
+     */
+    bool saveSession(const std::string &path);
+
+
+    /**
+     * @brief Restores a session file into sequence 0
+     * 
+     * Only the longest prefix shared with prompt_tokens is restored, and records whose tokens are
+     * already resident in the KV cache are skipped. The following loadPrompt reuses the restored
+     * prefix.
+     * 
+     * @param path Session file path
+     * @param prompt_tokens Tokens of the upcoming prompt; empty restores the whole session
+     * @return Number of tokens resident in the KV cache after restoring, -1 on failure
+     */
+    int loadSession(const std::string &path, const std::vector<llama_token> &prompt_tokens = {});
+
+
+    /**
+     * @brief Saves the grammars compiled for this model's vocabulary
+     * 
+     * Grammar masks are computed the first time generation reaches each grammar state; saving
+     * them lets a later process start constrained generation without that warm-up.
+     * 
+     * @param path Grammar cache file path
+     * @return true if saving succeeded, false otherwise
+     */
+    bool saveGrammarCache(const std::string &path);
+
+
+    /**
+     * @brief Loads grammars compiled by saveGrammarCache
+     * 
+     * @param path Grammar cache file path
+     * @return true if loading succeeded, false if the file is missing, corrupted or was saved
+     *         for a different vocabulary
+     */
+    bool loadGrammarCache(const std::string &path);
+
+
     /**
      * @brief Validates if a chat template exists and is valid
      * 
@@ -268,7 +523,10 @@ struct cactus_context {
     /**
      * @brief Loads a prompt into the context
      * 
-     * Tokenizes and prepares a prompt for inference
+     * Tokenizes and prepares a prompt for inference. The longest prefix shared with
+     * the tokens already in the KV cache is reused and only the remainder is evaluated.
+     * Resets the completion timings, so prompt_n and prompt_ms survive a following
+     * beginCompletion.
      */
     void loadPrompt();
     
@@ -284,9 +542,45 @@ struct cactus_context {
     /**
      * @brief Generates the next token
      * 
+     * With a draft model loaded, tokens are produced in speculative rounds and the
+     * verified tokens of a round are returned by consecutive calls.
+     * 
      * @return The generated token and its probabilities
      */
     completion_token_output nextToken();
+
+
+    /**
+     * @brief Makes room in sequence 0 once embd fills the context, following params.kv_evict
+     * 
+     * The evicted ranges are removed from the KV cache and the tokens after them are shifted
+     * down, so a single K-shift is applied on the next decode.
+     * 
+     * @return false if the context is too small for the kept tokens
+     */
+    bool evictContext();
+
+
+    /**
+     * @brief Decodes tokens into sequence 0 at positions n_past, n_past + 1, ...
+     * 
+     * Positions are set explicitly because llama_batch_get_one continues after the highest
+     * position of any sequence, which is wrong once the batch engine's slots are longer than
+     * sequence 0. Only the last token gets logits.
+     * 
+     * @return The llama_decode result
+     */
+    int decodeSeq0(const llama_token *tokens, int32_t n_tokens);
+
+
+    /**
+     * @brief Evaluation callback accumulating the attention mass each position of sequence 0 receives
+     * 
+     * Installed by loadModel for heavy-hitter eviction; user_data is the cactus_context. Only
+     * single-token decodes are scored, so prompt tokens start at zero and collect mass from the
+     * generated tokens that attend to them.
+     */
+    static bool scoreAttention(struct lm_ggml_tensor * t, bool ask, void * user_data);
     
 
     /**
@@ -307,6 +601,17 @@ struct cactus_context {
      * @return The generated token and its probabilities
      */
     completion_token_output doCompletion();
+
+
+    /**
+     * @brief Returns the timings of the current completion
+     * 
+     * Fills the derived fields (total time, throughput, inter-token latency percentiles)
+     * from the accumulated phase timings.
+     * 
+     * @return Timings since the last beginCompletion
+     */
+    cactus_completion_timings getTimings() const;
     
 
     /**
@@ -316,6 +621,17 @@ struct cactus_context {
      * @return Vector of embedding values
      */
     std::vector<float> getEmbedding(common_params &embd_params);
+
+
+    /**
+     * @brief Generates embeddings for many texts, packing them into shared batches
+     * 
+     * A batch holds at most LLAMA_MAX_SEQ texts (one sequence id each), or n_parallel for recurrent models.
+     * 
+     * @param texts Texts to embed
+     * @return One embedding per text, in input order
+     */
+    std::vector<std::vector<float>> getEmbeddings(const std::vector<std::string> &texts);
     
 
     /**
@@ -328,6 +644,23 @@ struct cactus_context {
      * @return JSON string with benchmark results
      */
     std::string bench(int pp, int tg, int pl, int nr);
+
+
+    /**
+     * @brief Runs a benchmark sweep for regression tracking
+     *
+     * Each KV cache type combination runs on a context sized for the largest sweep point. The
+     * loaded context is reused (and its KV cache cleared) when its cache types, size and
+     * n_parallel already fit; otherwise a dedicated context is created and the loaded one is left
+     * untouched. Points with n_parallel above n_batch or LLAMA_MAX_SEQ are reported as errors. The result is a JSON document
+     * with "schema": "cactus-bench" and a "schema_version"; each entry of "results" holds the
+     * sweep point, prompt and generation throughput (mean, std, min, p50, p90, p99, max),
+     * per-step generation latency, compute and KV buffer sizes, and current and peak RSS.
+     *
+     * @param bp Sweep definition
+     * @return JSON string with benchmark results
+     */
+    std::string benchSuite(const cactus_bench_params &bp);
     
 
     /**
@@ -353,6 +686,162 @@ struct cactus_context {
 };
 
 
+/**
+ * @struct cactus_batch_request
+ * @brief A completion request submitted to a cactus_batch_engine
+ */
+struct cactus_batch_request {
+    std::string prompt;                   /**< Prompt text (tokenized with special tokens) */
+    int32_t n_predict = -1;               /**< Tokens to predict, -1 for unlimited (bounded by the slot context) */
+    common_params_sampling sampling;      /**< Sampling parameters for this request */
+    std::vector<std::string> antiprompt;  /**< Stop strings for this request */
+
+    /**
+     * Called from step() for every generated token with the token and the text it releases.
+     * Text that may start a stop string is held back until the match fails or the request ends,
+     * and a matched stop string is never passed on. Returning false stops the request.
+     */
+    std::function<bool(int32_t request_id, const completion_token_output &token, const std::string &piece)> on_token;
+};
+
+
+/**
+ * @struct cactus_batch_result
+ * @brief Final state of a request processed by a cactus_batch_engine
+ */
+struct cactus_batch_result {
+    int32_t id = -1;                      /**< Request id returned by submit() */
+    std::string text;                     /**< Generated text (stop string removed) */
+    std::vector<completion_token_output> token_probs; /**< Token probabilities (when sampling.n_probs > 0) */
+    size_t num_prompt_tokens = 0;         /**< Number of tokens in the prompt */
+    size_t num_prompt_tokens_cached = 0;  /**< Prompt tokens reused from the slot's KV cache */
+    size_t num_tokens_predicted = 0;      /**< Number of tokens predicted */
+    bool truncated = false;               /**< Whether the prompt was truncated */
+    bool stopped_eos = false;             /**< Stopped on EOS token */
+    bool stopped_word = false;            /**< Stopped on stop word */
+    bool stopped_limit = false;           /**< Stopped on token or context limit */
+    bool failed = false;                  /**< Decoding failed for this request */
+    std::string stopping_word;            /**< Word that triggered stopping */
+};
+
+
+/**
+ * @struct cactus_batch_slot
+ * @brief A decoding slot of a cactus_batch_engine, owning one KV cache sequence
+ */
+struct cactus_batch_slot {
+    enum slot_state {
+        SLOT_IDLE,       /**< No request assigned */
+        SLOT_PROMPT,     /**< Prompt is being prefilled */
+        SLOT_GENERATING, /**< Decoding one token per step */
+    };
+
+    int id = 0;                           /**< Slot index */
+    llama_seq_id seq_id = 0;              /**< KV cache sequence owned by this slot */
+    slot_state state = SLOT_IDLE;         /**< Current state */
+
+    int32_t request_id = -1;              /**< Id of the assigned request */
+    cactus_batch_request request;         /**< Assigned request */
+    cactus_batch_result result;           /**< Result being accumulated */
+    common_sampler *smpl = nullptr;       /**< Sampler owned by this slot */
+
+    std::vector<llama_token> cache_tokens; /**< Tokens resident (or being prefilled) in the slot's sequence */
+    size_t n_past = 0;                    /**< Number of cache_tokens already evaluated */
+    size_t n_remain = 0;                  /**< Tokens left to predict (when n_predict != -1) */
+    stop_string_matcher stop_matcher;     /**< request.antiprompt matched against result.text */
+    size_t n_sent = 0;                    /**< Bytes of result.text already passed to on_token */
+    llama_token sampled = LLAMA_TOKEN_NULL; /**< Last sampled token, decoded in the next step */
+    int32_t i_batch = -1;                 /**< Index of this slot's logits in the current batch */
+};
+
+
+/**
+ * @struct cactus_batch_engine
+ * @brief Continuous batching scheduler serving many requests from one cactus_context
+ *
+ * Each slot owns a KV cache sequence (seq_id = slot + 1, sequence 0 stays with the
+ * single-stream cactus_context API), a sampler and stop state. Every step() builds one
+ * llama_batch holding a decode token for each generating slot plus prefill chunks of
+ * newly admitted prompts, so decode steps of all active requests share a forward pass.
+ * Idle slots keep their KV contents and new requests are routed to the slot sharing the
+ * longest prefix. submit() and cancel() may be called from other threads while another
+ * thread drives step() or run(); the owning cactus_context must not be used for other
+ * generation meanwhile.
+ */
+struct cactus_batch_engine {
+    cactus_context &cctx;                 /**< Context providing the model and llama_context */
+    std::vector<cactus_batch_slot> slots; /**< Decoding slots */
+    int32_t n_ctx_slot = 0;               /**< Context budget per slot */
+
+    /**
+     * @brief Creates an engine with n_slots slots on a loaded context
+     *
+     * @param cctx Loaded (non-embedding) context
+     * @param n_slots Number of concurrent requests, at most the context's n_parallel
+     */
+    cactus_batch_engine(cactus_context &cctx, int n_slots);
+
+
+    /**
+     * @brief Destructor, frees the slot samplers and their KV sequences
+     */
+    ~cactus_batch_engine();
+
+
+    /**
+     * @brief Queues a request
+     *
+     * @param request The request to queue
+     * @return Request id, used to match results and for cancel()
+     */
+    int32_t submit(const cactus_batch_request &request);
+
+
+    /**
+     * @brief Stops a queued or running request; its result is reported as usual
+     *
+     * @param request_id Id returned by submit()
+     */
+    void cancel(int32_t request_id);
+
+
+    /**
+     * @brief Admits queued requests and decodes one batch
+     *
+     * @return true while requests are queued or running
+     */
+    bool step();
+
+
+    /**
+     * @brief Runs step() until all submitted requests have finished
+     *
+     * @return Results of the finished requests, in completion order
+     */
+    std::vector<cactus_batch_result> run();
+
+
+    /**
+     * @brief Returns and clears the results of requests finished so far
+     */
+    std::vector<cactus_batch_result> takeResults();
+
+private:
+    llama_batch batch;
+    common_sampler_pool *sampler_pool = nullptr; /**< Threads sampling the slots of a step */
+    int32_t next_request_id = 0;
+    std::mutex mutex;
+    std::deque<std::pair<int32_t, cactus_batch_request>> queue;
+    std::set<int32_t> cancelled;
+    std::vector<cactus_batch_result> finished;
+
+    bool hasWork();
+    void admit(cactus_batch_slot &slot, int32_t request_id, cactus_batch_request &&request, std::vector<llama_token> &&prompt_tokens);
+    void release(cactus_batch_slot &slot);
+    void processToken(cactus_batch_slot &slot, llama_token token);
+};
+
+
 /** @var cactus_verbose
  *  @brief Flag controlling verbose logging
  */
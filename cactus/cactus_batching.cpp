@@ -0,0 +1,418 @@
+#include "cactus.h"
+#include "common.h"
+#include "llama.h"
+#include <algorithm>
+#include <vector>
+#include <string>
+
+namespace cactus {
+
+cactus_batch_engine::cactus_batch_engine(cactus_context &cctx_, int n_slots) : cctx(cctx_) {
+    LM_GGML_ASSERT(cctx.ctx != nullptr && cctx.model != nullptr);
+
+    const int n_batch = (int) llama_n_batch(cctx.ctx);
+    if (n_slots > n_batch) {
+        LOG_WARNING("Clamping batch engine slots from %d to n_batch (%d)", n_slots, n_batch);
+        n_slots = n_batch;
+    }
+    const int n_seq_max = (int) llama_n_seq_max(cctx.ctx);
+    if (n_slots > n_seq_max) {
+        // the KV cache (and the sliding-window cache in particular) is sized for n_seq_max sequences
+        LOG_WARNING("Clamping batch engine slots from %d to n_seq_max (%d)", n_slots, n_seq_max);
+        n_slots = n_seq_max;
+    }
+    if (n_slots > session_staging_seq_id - 1) {
+        // sequence 0 belongs to the single-stream API, slot i uses seq_id = i + 1 and the
+        // session staging sequence stays above the last slot
+        LOG_WARNING("Clamping batch engine slots from %d to %d", n_slots, session_staging_seq_id - 1);
+        n_slots = session_staging_seq_id - 1;
+    }
+    n_slots = std::max(1, n_slots);
+
+    n_ctx_slot = (int32_t) llama_n_ctx(cctx.ctx) / n_slots;
+    batch = llama_batch_init(n_batch, 0, 1);
+    sampler_pool = common_sampler_pool_init(std::min(cctx.params.cpuparams.n_threads, n_slots));
+
+    slots.resize(n_slots);
+    for (int i = 0; i < n_slots; ++i) {
+        slots[i].id = i;
+        slots[i].seq_id = i + 1; // sequence 0 belongs to the single-stream API
+        llama_kv_self_seq_rm(cctx.ctx, slots[i].seq_id, -1, -1);
+    }
+
+    LOG_INFO("Batch engine initialized: n_slots=%d, n_ctx_slot=%d, n_batch=%d", n_slots, n_ctx_slot, n_batch);
+}
+
+
+cactus_batch_engine::~cactus_batch_engine() {
+    common_sampler_pool_free(sampler_pool);
+    for (auto &slot : slots) {
+        if (slot.smpl != nullptr) {
+            common_sampler_free(slot.smpl);
+            slot.smpl = nullptr;
+        }
+        if (cctx.ctx) {
+            llama_kv_self_seq_rm(cctx.ctx, slot.seq_id, -1, -1);
+        }
+    }
+    llama_batch_free(batch);
+}
+
+
+int32_t cactus_batch_engine::submit(const cactus_batch_request &request) {
+    std::lock_guard<std::mutex> lock(mutex);
+    const int32_t request_id = next_request_id++;
+    queue.emplace_back(request_id, request);
+    return request_id;
+}
+
+
+void cactus_batch_engine::cancel(int32_t request_id) {
+    std::lock_guard<std::mutex> lock(mutex);
+    cancelled.insert(request_id);
+}
+
+
+std::vector<cactus_batch_result> cactus_batch_engine::takeResults() {
+    std::lock_guard<std::mutex> lock(mutex);
+    std::vector<cactus_batch_result> out;
+    out.swap(finished);
+    return out;
+}
+
+
+std::vector<cactus_batch_result> cactus_batch_engine::run() {
+    while (step()) {
+    }
+    return takeResults();
+}
+
+
+bool cactus_batch_engine::hasWork() {
+    for (const auto &slot : slots) {
+        if (slot.state != cactus_batch_slot::SLOT_IDLE) {
+            return true;
+        }
+    }
+    std::lock_guard<std::mutex> lock(mutex);
+    return !queue.empty();
+}
+
+
+/**
+ * @brief Assigns a request to an idle slot
+ *
+ * Reuses the part of the slot's KV sequence that matches the new prompt, like
+ * cactus_context::loadPrompt does for sequence 0, or a longer prefix shared with
+ * other requests when the KV cache is paged.
+ */
+void cactus_batch_engine::admit(cactus_batch_slot &slot, int32_t request_id, cactus_batch_request &&request, std::vector<llama_token> &&prompt_tokens) {
+    slot.request_id = request_id;
+    slot.request = std::move(request);
+    slot.result = cactus_batch_result();
+    slot.result.id = request_id;
+    slot.result.num_prompt_tokens = prompt_tokens.size();
+
+    if (prompt_tokens.empty()) {
+        LOG_ERROR("Batch request %d has an empty prompt", request_id);
+        slot.result.failed = true;
+        release(slot);
+        return;
+    }
+
+    // Keep the first token (usually BOS) and the tail of prompts that do not fit the slot
+    if (prompt_tokens.size() >= (size_t) n_ctx_slot) {
+        const size_t n_tail = std::max(1, n_ctx_slot / 2 - 1);
+        prompt_tokens.erase(prompt_tokens.begin() + 1, prompt_tokens.end() - n_tail);
+        slot.result.truncated = true;
+        LOG_VERBOSE("batch request %d truncated to %zu tokens", request_id, prompt_tokens.size());
+    }
+
+    if (cctx.params.logits_top_k > 0 && !slot.request.sampling.grammar.empty()) {
+        LOG_ERROR("Batch request %d uses a grammar, which needs the full vocabulary, but logits_top_k is set", request_id);
+        slot.result.failed = true;
+        release(slot);
+        return;
+    }
+    slot.smpl = common_sampler_init(cctx.model, slot.request.sampling);
+    if (slot.smpl == nullptr) {
+        LOG_ERROR("Failed to initialize sampler for batch request %d", request_id);
+        slot.result.failed = true;
+        release(slot);
+        return;
+    }
+    for (const llama_token token : prompt_tokens) {
+        common_sampler_accept(slot.smpl, token, false);
+    }
+
+    // The sequence may have been cleared behind our back (e.g. llama_kv_self_clear)
+    if (llama_kv_self_seq_pos_max(cctx.ctx, slot.seq_id) + 1 != (llama_pos) slot.cache_tokens.size()) {
+        slot.cache_tokens.clear();
+    }
+
+    slot.n_past = common_part(slot.cache_tokens, prompt_tokens);
+    if (slot.n_past == prompt_tokens.size()) {
+        slot.n_past--; // evaluate the last token again to get logits for sampling
+    }
+    if (!llama_kv_self_seq_rm(cctx.ctx, slot.seq_id, slot.n_past, -1)) {
+        llama_kv_self_seq_rm(cctx.ctx, slot.seq_id, -1, -1);
+        slot.n_past = 0;
+    }
+    // A paged KV cache may hold a longer prefix that another request has computed
+    slot.n_past = llama_kv_self_seq_attach_prefix(cctx.ctx, slot.seq_id, prompt_tokens.data(),
+        (int32_t) prompt_tokens.size() - 1, (int32_t) slot.n_past);
+
+    slot.cache_tokens = std::move(prompt_tokens);
+    slot.result.num_prompt_tokens_cached = slot.n_past;
+    slot.n_remain = slot.request.n_predict > 0 ? slot.request.n_predict : 0;
+    slot.stop_matcher.init(slot.request.antiprompt);
+    slot.n_sent = 0;
+    slot.sampled = LLAMA_TOKEN_NULL;
+    slot.i_batch = -1;
+    slot.state = cactus_batch_slot::SLOT_PROMPT;
+
+    LOG_VERBOSE("batch request %d assigned to slot %d, n_prompt: %zu, n_cached: %zu",
+        request_id, slot.id, slot.cache_tokens.size(), slot.n_past);
+}
+
+
+/**
+ * @brief Finishes the slot's request and makes the slot available again
+ *
+ * The KV sequence is left in place so a follow-up request can reuse it.
+ */
+void cactus_batch_engine::release(cactus_batch_slot &slot) {
+    if (slot.smpl != nullptr) {
+        common_sampler_free(slot.smpl);
+        slot.smpl = nullptr;
+    }
+    // Only evaluated tokens stay resident
+    slot.cache_tokens.resize(slot.n_past);
+
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        cancelled.erase(slot.request_id);
+        finished.push_back(std::move(slot.result));
+    }
+
+    slot.result = cactus_batch_result();
+    slot.request = cactus_batch_request();
+    slot.request_id = -1;
+    slot.i_batch = -1;
+    slot.sampled = LLAMA_TOKEN_NULL;
+    slot.state = cactus_batch_slot::SLOT_IDLE;
+}
+
+
+/**
+ * @brief Accepts the token sampled for the slot from the last batch and applies stop criteria
+ *
+ * @param slot The slot
+ * @param token Token sampled by the slot's sampler
+ */
+void cactus_batch_engine::processToken(cactus_batch_slot &slot, llama_token token) {
+    const llama_vocab *vocab = llama_model_get_vocab(cctx.model);
+
+    completion_token_output out;
+    out.tok = token;
+
+    const int32_t n_probs = slot.request.sampling.n_probs;
+    if (n_probs > 0) {
+        const llama_token_data_array *cur_p = common_sampler_get_candidates(slot.smpl);
+        for (size_t i = 0; i < std::min((size_t) cur_p->size, (size_t) n_probs); ++i) {
+            out.probs.push_back({cur_p->data[i].id, cur_p->data[i].p});
+        }
+        slot.result.token_probs.push_back(out);
+    }
+
+    common_sampler_accept(slot.smpl, out.tok, true);
+    slot.result.num_tokens_predicted++;
+    slot.sampled = out.tok;
+    slot.state = cactus_batch_slot::SLOT_GENERATING;
+    if (slot.n_remain > 0) {
+        slot.n_remain--;
+    }
+
+    bool done = false;
+    if (llama_vocab_is_eog(vocab, out.tok)) {
+        slot.result.stopped_eos = true;
+        done = true;
+    } else {
+        const std::string token_text = common_token_to_piece(cctx.ctx, out.tok);
+        slot.result.text += token_text;
+        slot.stop_matcher.feed(token_text.data(), token_text.size());
+
+        if (slot.stop_matcher.full_pos != std::string::npos) {
+            slot.result.text.erase(slot.stop_matcher.full_pos);
+            slot.result.stopping_word = slot.stop_matcher.stops[slot.stop_matcher.full_index];
+            slot.result.stopped_word = true;
+            done = true;
+        }
+    }
+
+    if (!done && slot.request.n_predict > 0 && slot.n_remain == 0) {
+        slot.result.stopped_limit = true;
+        done = true;
+    }
+    if (!done && slot.n_past + 1 >= (size_t) n_ctx_slot) {
+        LOG_VERBOSE("batch request %d reached the slot context limit (%d)", slot.request_id, n_ctx_slot);
+        slot.result.stopped_limit = true;
+        done = true;
+    }
+
+    // Text that may still turn into a stop string is held back until the request ends
+    size_t n_send = slot.result.text.size();
+    if (!done) {
+        n_send = std::min(n_send, slot.stop_matcher.partial_pos());
+    }
+    n_send = std::max(n_send, slot.n_sent);
+    const std::string piece = slot.result.text.substr(slot.n_sent, n_send - slot.n_sent);
+    slot.n_sent = n_send;
+
+    if (slot.request.on_token && !slot.request.on_token(slot.request_id, out, piece)) {
+        done = true;
+    }
+
+    if (done) {
+        release(slot);
+    }
+}
+
+
+/**
+ * @brief Admits queued requests and decodes one batch
+ *
+ * Generating slots contribute one token each, then the remaining n_batch budget is
+ * filled with prompt chunks of slots that are still prefilling.
+ *
+ * @return true while requests are queued or running
+ */
+bool cactus_batch_engine::step() {
+    // --- Admission ---
+    for (;;) {
+        cactus_batch_slot *idle = nullptr;
+        for (auto &slot : slots) {
+            if (slot.state == cactus_batch_slot::SLOT_IDLE) {
+                idle = &slot;
+                break;
+            }
+        }
+        if (idle == nullptr) break;
+
+        std::pair<int32_t, cactus_batch_request> item;
+        bool is_cancelled = false;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            if (queue.empty()) break;
+            item = std::move(queue.front());
+            queue.pop_front();
+            is_cancelled = cancelled.erase(item.first) > 0;
+            if (is_cancelled) {
+                cactus_batch_result result;
+                result.id = item.first;
+                finished.push_back(std::move(result));
+            }
+        }
+        if (is_cancelled) continue;
+
+        std::vector<llama_token> prompt_tokens = ::common_tokenize(cctx.ctx, item.second.prompt, true, true);
+
+        // Route the request to the idle slot sharing the longest cached prefix
+        cactus_batch_slot *best = idle;
+        size_t best_lcp = 0;
+        for (auto &slot : slots) {
+            if (slot.state != cactus_batch_slot::SLOT_IDLE) continue;
+            const size_t lcp = common_part(slot.cache_tokens, prompt_tokens);
+            if (lcp > best_lcp) {
+                best_lcp = lcp;
+                best = &slot;
+            }
+        }
+        admit(*best, item.first, std::move(item.second), std::move(prompt_tokens));
+    }
+
+    // --- Cancellation of running requests ---
+    for (auto &slot : slots) {
+        if (slot.state == cactus_batch_slot::SLOT_IDLE) continue;
+        bool is_cancelled;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            is_cancelled = cancelled.count(slot.request_id) > 0;
+        }
+        if (is_cancelled) {
+            release(slot);
+        }
+    }
+
+    // --- Batch assembly ---
+    const int32_t n_batch = (int32_t) llama_n_batch(cctx.ctx);
+    std::vector<int32_t> n_batched(slots.size(), 0);
+    llama_batch_clear(&batch);
+
+    for (auto &slot : slots) {
+        slot.i_batch = -1;
+        if (slot.state != cactus_batch_slot::SLOT_GENERATING) continue;
+
+        slot.i_batch = batch.n_tokens;
+        llama_batch_add(&batch, slot.sampled, (llama_pos) slot.n_past, {slot.seq_id}, true);
+        slot.cache_tokens.push_back(slot.sampled);
+        n_batched[slot.id] = 1;
+    }
+
+    for (auto &slot : slots) {
+        if (slot.state != cactus_batch_slot::SLOT_PROMPT) continue;
+
+        const size_t n_prompt = slot.cache_tokens.size();
+        while (slot.n_past + n_batched[slot.id] < n_prompt && batch.n_tokens < n_batch) {
+            const size_t pos = slot.n_past + n_batched[slot.id];
+            const bool is_last = pos + 1 == n_prompt;
+            if (is_last) {
+                slot.i_batch = batch.n_tokens;
+            }
+            llama_batch_add(&batch, slot.cache_tokens[pos], (llama_pos) pos, {slot.seq_id}, is_last);
+            n_batched[slot.id]++;
+        }
+    }
+
+    if (batch.n_tokens == 0) {
+        return hasWork();
+    }
+
+    // --- Decode ---
+    const int ret = llama_decode(cctx.ctx, batch);
+    if (ret != 0) {
+        LOG_ERROR("Batch engine: llama_decode failed (%d) with %d tokens", ret, batch.n_tokens);
+        for (auto &slot : slots) {
+            if (n_batched[slot.id] == 0) continue;
+            if (slot.state == cactus_batch_slot::SLOT_GENERATING) {
+                slot.cache_tokens.pop_back();
+            }
+            slot.result.failed = true;
+            release(slot);
+        }
+        return hasWork();
+    }
+
+    for (auto &slot : slots) {
+        slot.n_past += n_batched[slot.id];
+    }
+
+    // --- Sampling ---
+    // The slots' samplers run in parallel, the rest of the token handling stays on this thread
+    std::vector<common_sampler_seq> seqs;
+    std::vector<cactus_batch_slot *> sampled_slots;
+    for (auto &slot : slots) {
+        if (slot.state != cactus_batch_slot::SLOT_IDLE && slot.i_batch >= 0) {
+            seqs.push_back({slot.smpl, slot.i_batch});
+            sampled_slots.push_back(&slot);
+        }
+    }
+    common_sampler_sample_batch(seqs, cctx.ctx, sampler_pool);
+    for (size_t i = 0; i < seqs.size(); ++i) {
+        processToken(*sampled_slots[i], seqs[i].token);
+    }
+
+    return hasWork();
+}
+
+} // namespace cactus
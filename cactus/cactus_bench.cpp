@@ -1,15 +1,122 @@
 #include "cactus.h"
-#include "llama.h" 
+#include "common.h"
+#include "llama.h"
+#include "json.hpp"
 #include <vector>
 #include <string>
-#include <cmath> 
-#include <algorithm> 
+#include <cmath>
+#include <cstdio>
+#include <algorithm>
+#include <random>
+
+#if defined(__APPLE__)
+#include <mach/mach.h>
+#endif
 
 namespace cactus {
 
+// Version of the JSON document produced by benchSuite; bump on any incompatible change
+#define CACTUS_BENCH_SCHEMA_VERSION 1
+
+/**
+ * @brief Reads the resident set size of the process
+ *
+ * @param peak Receives the peak resident set size (0 if unavailable)
+ * @return Current resident set size in bytes (0 if unavailable)
+ */
+static size_t process_rss_bytes(size_t &peak) {
+    peak = 0;
+#if defined(__APPLE__)
+    mach_task_basic_info_data_t info;
+    mach_msg_type_number_t count = MACH_TASK_BASIC_INFO_COUNT;
+    if (task_info(mach_task_self(), MACH_TASK_BASIC_INFO, (task_info_t) &info, &count) != KERN_SUCCESS) {
+        return 0;
+    }
+    peak = info.resident_size_max;
+    return info.resident_size;
+#elif defined(__linux__)
+    FILE *f = fopen("/proc/self/status", "r");
+    if (!f) {
+        return 0;
+    }
+    size_t rss = 0;
+    char line[256];
+    while (fgets(line, sizeof(line), f)) {
+        unsigned long kb = 0;
+        if (sscanf(line, "VmRSS: %lu kB", &kb) == 1) {
+            rss = (size_t) kb * 1024;
+        } else if (sscanf(line, "VmHWM: %lu kB", &kb) == 1) {
+            peak = (size_t) kb * 1024;
+        }
+    }
+    fclose(f);
+    return rss;
+#else
+    return 0;
+#endif
+}
+
+/**
+ * @brief Summary statistics of a set of samples
+ */
+static nlohmann::ordered_json summarize(std::vector<double> samples) {
+    nlohmann::ordered_json out;
+    if (samples.empty()) {
+        return out;
+    }
+    std::sort(samples.begin(), samples.end());
+
+    double sum = 0.0;
+    for (double v : samples) sum += v;
+    const double mean = sum / samples.size();
+    double var = 0.0;
+    for (double v : samples) var += (v - mean) * (v - mean);
+    const double stddev = samples.size() > 1 ? std::sqrt(var / (samples.size() - 1)) : 0.0;
+
+    // nearest-rank percentiles
+    auto percentile = [&samples](double p) {
+        size_t rank = (size_t) std::ceil(p * samples.size());
+        rank = std::min(std::max(rank, (size_t) 1), samples.size());
+        return samples[rank - 1];
+    };
+
+    out["n"]    = samples.size();
+    out["mean"] = mean;
+    out["std"]  = stddev;
+    out["min"]  = samples.front();
+    out["p50"]  = percentile(0.50);
+    out["p90"]  = percentile(0.90);
+    out["p99"]  = percentile(0.99);
+    out["max"]  = samples.back();
+    return out;
+}
+
+/**
+ * @brief Decodes n_tokens random tokens for sequence 0 starting at pos, in chunks of n_batch
+ *
+ * @return true if every chunk was decoded
+ */
+static bool bench_decode_sequence(llama_context *bctx, llama_batch &batch, std::mt19937 &rng, int n_vocab,
+                                  llama_pos pos, int n_tokens, int n_batch) {
+    for (int i = 0; i < n_tokens; i += n_batch) {
+        const int n_eval = std::min(n_batch, n_tokens - i);
+        llama_batch_clear(&batch);
+        for (int k = 0; k < n_eval; ++k) {
+            llama_batch_add(&batch, (llama_token) (rng() % n_vocab), pos + i + k, {0}, i + k == n_tokens - 1);
+        }
+        if (llama_decode(bctx, batch) != 0) {
+            return false;
+        }
+    }
+    llama_synchronize(bctx);
+    return true;
+}
+
 /**
  * @brief Benchmarks the model performance
- * 
+ *
+ * Runs a single sweep point through benchSuite and keeps the original result layout.
+ *
  * @param pp Prompt processing tokens
  * @param tg Text generation iterations
  * @param pl Parallel tokens to predict
@@ -18,185 +125,256 @@ namespace cactus {
  */
 std::string cactus_context::bench(int pp, int tg, int pl, int nr)
 {
-    if (is_predicting) {
-        LOG_ERROR("cannot benchmark while predicting", "");
-        return std::string("[]");
-    }
-    // Ensure context and model are valid
-    if (!ctx || !model) {
-        LOG_ERROR("Context or model not initialized for benchmarking.");
+    cactus_bench_params bp;
+    bp.n_prompt   = {pp};
+    bp.n_gen      = {tg};
+    bp.n_parallel = {pl};
+    bp.repetitions = nr;
+
+    const std::string suite = benchSuite(bp);
+    const nlohmann::ordered_json doc = nlohmann::ordered_json::parse(suite, nullptr, false);
+    if (doc.is_discarded() || !doc.contains("results") || doc["results"].empty()) {
         return std::string("[]");
     }
 
-    // Set the predicting flag to true to prevent concurrent operations
-    is_predicting = true; 
-
-    // Initialize average and standard deviation variables
-    double pp_avg = 0.0;
-    double tg_avg = 0.0;
-    double pp_std = 0.0;
-    double tg_std = 0.0;
+    const auto &res = doc["results"][0];
+    auto stat = [&res](const char *phase, const char *key) {
+        if (res.contains(phase) && res[phase].contains("tokens_per_second") && res[phase]["tokens_per_second"].contains(key)) {
+            return res[phase]["tokens_per_second"][key].get<double>();
+        }
+        return 0.0;
+    };
+
+    const auto &m = doc["model"];
+    nlohmann::ordered_json result = nlohmann::ordered_json::array({
+        m["desc"], m["size"], m["n_params"],
+        stat("prompt", "mean"), stat("prompt", "std"),
+        stat("generation", "mean"), stat("generation", "std")
+    });
+    std::string result_str = result.dump();
+    LOG_INFO("Benchmark finished. Result: %s", result_str.c_str());
+    return result_str;
+}
 
-    // Use the minimum of the prompt processing tokens and the batch size
-    int batch_size = std::min(pp, (int)params.n_batch); 
+/**
+ * @brief Runs a benchmark sweep on dedicated contexts
+ *
+ * @param bp Sweep definition
+ * @return JSON document (see cactus_bench_params)
+ */
+std::string cactus_context::benchSuite(const cactus_bench_params &bp)
+{
+    nlohmann::ordered_json doc;
+    doc["schema"] = "cactus-bench";
+    doc["schema_version"] = CACTUS_BENCH_SCHEMA_VERSION;
+    doc["results"] = nlohmann::ordered_json::array();
 
-    // Check if the batch size is valid
-    if (batch_size <= 0) {
-         LOG_ERROR("Invalid batch size for benchmark: %d (pp=%d, n_batch=%d)", batch_size, pp, params.n_batch);
-         is_predicting = false;
-         return std::string("[]");
+    if (is_predicting) {
+        LOG_ERROR("cannot benchmark while predicting", "");
+        doc["error"] = "cannot benchmark while predicting";
+        return doc.dump();
     }
-
-    llama_batch batch = llama_batch_init(
-        batch_size,
-        0, // No embeddings needed for benchmark
-        pl // Number of sequences corresponds to parallel predictions
-    );
-
-    // Check if the batch was initialized successfully
-    if (!batch.token) {
-        LOG_ERROR("Failed to initialize llama_batch for benchmark.");
-        is_predicting = false;
-        return std::string("[]");
+    if (!ctx || !model) {
+        LOG_ERROR("Context or model not initialized for benchmarking.");
+        doc["error"] = "model not loaded";
+        return doc.dump();
     }
 
-    LOG_INFO("Starting benchmark: pp=%d, tg=%d, pl=%d, nr=%d, batch_size=%d", pp, tg, pl, nr, batch_size);
-
-    for (int i = 0; i < nr; ++i)
-    {
-        if (is_interrupted) {
-            LOG_INFO("Benchmark interrupted.");
-            break;
-        }
-
-        // --- Prompt Processing Phase --- 
+    is_predicting = true;
 
-        llama_batch_clear(&batch);
-        const int n_tokens_pp = pp;
-
-        // Add tokens for prompt processing - ensure we don't exceed batch capacity
-        for (int k = 0; k < n_tokens_pp; ++k) {
-             if (batch.n_tokens >= batch_size) {
-                 LOG_ERROR("Benchmark batch capacity (%d) exceeded during PP phase.", batch_size);
-                 goto cleanup_and_exit;
-             }
-             // Use sequence ID 0 for the prompt
-             llama_batch_add(&batch, 0, k, {0}, false); 
-        }
-
-        // Only need logits for the *last* token of the prompt to predict the next one
-        if (batch.n_tokens > 0) {
-            batch.logits[batch.n_tokens - 1] = 1; 
-        }
-
-        llama_kv_self_clear(ctx); // Clear KV cache before prompt processing
-
-        const int64_t t_pp_start = llama_time_us();
-        if (llama_decode(ctx, batch) != 0)
-        {
-            LOG_ERROR("llama_decode() failed during prompt processing benchmark", "");
-             continue;
+    char model_desc[128];
+    llama_model_desc(model, model_desc, sizeof(model_desc));
+    doc["model"] = {
+        {"desc", model_desc},
+        {"size", llama_model_size(model)},
+        {"n_params", llama_model_n_params(model)},
+    };
+    doc["build"] = {
+        {"number", LLAMA_BUILD_NUMBER},
+        {"commit", LLAMA_COMMIT},
+        {"system_info", llama_print_system_info()},
+    };
+
+    const std::vector<int> threads = bp.n_threads.empty() ? std::vector<int>{params.cpuparams.n_threads} : bp.n_threads;
+    const std::vector<lm_ggml_type> types_k = bp.type_k.empty() ? std::vector<lm_ggml_type>{params.cache_type_k} : bp.type_k;
+    const std::vector<lm_ggml_type> types_v = bp.type_v.empty() ? std::vector<lm_ggml_type>{params.cache_type_v} : bp.type_v;
+    const int n_vocab = llama_vocab_n_tokens(llama_model_get_vocab(model));
+    const int repetitions = std::max(1, bp.repetitions);
+
+    // One generation step decodes one token per parallel sequence in a single batch
+    const int n_parallel_limit = std::min<int>(params.n_batch, LLAMA_MAX_SEQ);
+
+    // One context per KV cache type, sized for the largest valid point of the sweep
+    int n_ctx_needed = 1;
+    int n_parallel_max = 1;
+    for (int pp : bp.n_prompt) for (int tg : bp.n_gen) for (int depth : bp.n_depth) for (int pl : bp.n_parallel) {
+        if (pl > n_parallel_limit) {
+            continue;
         }
-        const int64_t t_pp_end = llama_time_us();
-        // Don't clear KV cache here, text generation needs it
+        n_ctx_needed = std::max(n_ctx_needed, depth + pp + std::max(1, pl) * tg);
+        n_parallel_max = std::max(n_parallel_max, pl);
+    }
 
-        if (is_interrupted) {
-             LOG_INFO("Benchmark interrupted after PP phase.");
-             break;
+    std::mt19937 rng(1234);
+
+    for (lm_ggml_type type_k : types_k) for (lm_ggml_type type_v : types_v) {
+        llama_context_params cparams = common_context_params_to_llama(params);
+        cparams.n_ctx      = n_ctx_needed;
+        cparams.n_seq_max  = n_parallel_max;
+        cparams.type_k     = type_k;
+        cparams.type_v     = type_v;
+        cparams.embeddings = false;
+        cparams.cb_eval    = nullptr; // attention scoring tracks the main context only
+
+        // The loaded context is reused when it already fits; its cache is cleared below
+        const bool reuse = !params.embedding && params.cb_eval == nullptr &&
+                           type_k == params.cache_type_k && type_v == params.cache_type_v &&
+                           (int) llama_n_ctx(ctx) >= n_ctx_needed && (int) llama_n_seq_max(ctx) >= n_parallel_max;
+        const int32_t n_threads_ctx = llama_n_threads(ctx);
+        const int32_t n_threads_batch_ctx = llama_n_threads_batch(ctx);
+        if (reuse) {
+            llama_kv_self_clear(ctx);
+            embd.clear();
+            kv_scores.clear();
         }
 
-        // --- Text Generation Phase --- 
+        llama_context *bctx = reuse ? ctx : llama_init_from_model(model, cparams);
+        const int n_batch = bctx ? (int) llama_n_batch(bctx) : 0;
+        llama_batch batch = llama_batch_init(std::max(n_batch, n_parallel_max), 0, 1);
 
-        const int64_t t_tg_start = llama_time_us();
+        for (int n_threads : threads) for (int pp : bp.n_prompt) for (int tg : bp.n_gen)
+        for (int depth : bp.n_depth) for (int pl : bp.n_parallel) {
+            if (is_interrupted) {
+                break;
+            }
 
-        // KV cache position after prompt processing
-        int n_past_tg = batch.n_tokens;
+            nlohmann::ordered_json res;
+            res["n_prompt"]   = pp;
+            res["n_gen"]      = tg;
+            res["n_depth"]    = depth;
+            res["n_parallel"] = pl;
+            res["n_threads"]  = n_threads;
+            res["type_k"]     = lm_ggml_type_name(type_k);
+            res["type_v"]     = lm_ggml_type_name(type_v);
+            // a reused context keeps its own batch sizes
+            res["n_batch"]    = bctx ? (int) llama_n_batch(bctx) : (int) cparams.n_batch;
+            res["n_ubatch"]   = bctx ? (int) llama_n_ubatch(bctx) : (int) cparams.n_ubatch;
+            res["repetitions"] = repetitions;
+
+            if (!bctx) {
+                res["error"] = "failed to create context for this KV cache type";
+                doc["results"].push_back(res);
+                continue;
+            }
+            if (pp < 0 || tg < 0 || depth < 0 || pl < 1) {
+                res["error"] = "invalid sweep point";
+                doc["results"].push_back(res);
+                continue;
+            }
+            if (pl > n_parallel_limit || pl > n_batch) {
+                res["error"] = "n_parallel exceeds n_batch or LLAMA_MAX_SEQ";
+                doc["results"].push_back(res);
+                continue;
+            }
 
-        // Text generation iterations
-        for (int k = 0; k < tg; ++k) 
-        {
-            llama_batch_clear(&batch);
+            llama_set_n_threads(bctx, n_threads, n_threads);
+
+            std::vector<double> pp_tps, pp_ms, tg_tps, tg_token_ms;
+            std::string error;
+
+            // warmup: first decodes pay for graph allocation and page faults
+            llama_kv_self_clear(bctx);
+            bench_decode_sequence(bctx, batch, rng, n_vocab, 0, std::min(std::max(pp, 1), n_batch), n_batch);
+
+            for (int rep = 0; rep < repetitions && error.empty() && !is_interrupted; ++rep) {
+                llama_kv_self_clear(bctx);
+
+                if (depth > 0 && !bench_decode_sequence(bctx, batch, rng, n_vocab, 0, depth, n_batch)) {
+                    error = "llama_decode failed while filling the context to depth";
+                    break;
+                }
+
+                if (pp > 0) {
+                    const int64_t t_start = llama_time_us();
+                    if (!bench_decode_sequence(bctx, batch, rng, n_vocab, depth, pp, n_batch)) {
+                        error = "llama_decode failed during prompt processing";
+                        break;
+                    }
+                    const double t_ms = (llama_time_us() - t_start) / 1000.0;
+                    pp_ms.push_back(t_ms);
+                    pp_tps.push_back(t_ms > 0 ? 1e3 * pp / t_ms : 0.0);
+                }
+
+                // parallel sequences share the prompt
+                for (int j = 1; j < pl; ++j) {
+                    llama_kv_self_seq_cp(bctx, 0, j, -1, -1);
+                }
+
+                if (tg > 0) {
+                    const int64_t t_start = llama_time_us();
+                    for (int k = 0; k < tg; ++k) {
+                        llama_batch_clear(&batch);
+                        for (int j = 0; j < pl; ++j) {
+                            llama_batch_add(&batch, (llama_token) (rng() % n_vocab), depth + pp + k, {(llama_seq_id) j}, true);
+                        }
+                        const int64_t t_token = llama_time_us();
+                        if (llama_decode(bctx, batch) != 0) {
+                            error = "llama_decode failed during text generation";
+                            break;
+                        }
+                        llama_synchronize(bctx);
+                        tg_token_ms.push_back((llama_time_us() - t_token) / 1000.0);
+                    }
+                    if (!error.empty()) {
+                        break;
+                    }
+                    const double t_ms = (llama_time_us() - t_start) / 1000.0;
+                    tg_tps.push_back(t_ms > 0 ? 1e3 * pl * tg / t_ms : 0.0);
+                }
+            }
 
-            // For each iteration, predict 'pl' tokens in parallel
-            for (int j = 0; j < pl; ++j)
-            {
-                 if (batch.n_tokens >= batch_size) {
-                      LOG_ERROR("Benchmark batch capacity (%d) exceeded during TG phase.", batch_size);
-                      goto cleanup_and_exit; 
-                 }
-                 // Predict token at position n_past_tg + k for sequence j
-                 llama_batch_add(&batch, 0, n_past_tg + k, {(llama_seq_id)j}, true); 
+            if (!pp_tps.empty()) {
+                res["prompt"] = {
+                    {"tokens_per_second", summarize(pp_tps)},
+                    {"ms", summarize(pp_ms)},
+                };
+            }
+            if (!tg_tps.empty()) {
+                res["generation"] = {
+                    {"tokens_per_second", summarize(tg_tps)},
+                    {"step_ms", summarize(tg_token_ms)},
+                };
             }
 
-            if (llama_decode(ctx, batch) != 0)
-            {
-                LOG_ERROR("llama_decode() failed during text generation benchmark", "");
-                 break; 
+            size_t peak_rss = 0;
+            const size_t rss = process_rss_bytes(peak_rss);
+            res["memory"] = {
+                {"compute_buffer_bytes", llama_get_compute_buffer_size(bctx)},
+                {"kv_buffer_bytes", llama_get_kv_self_buffer_size(bctx)},
+                {"rss_bytes", rss},
+                {"peak_rss_bytes", peak_rss},
+            };
+            if (!error.empty()) {
+                LOG_ERROR("Benchmark point failed: %s", error.c_str());
+                res["error"] = error;
             }
             if (is_interrupted) {
-                 LOG_INFO("Benchmark interrupted during TG phase.");
-                 goto cleanup_and_exit; // Use goto to ensure cleanup
+                res["interrupted"] = true;
             }
+            doc["results"].push_back(res);
         }
 
-        const int64_t t_tg_end = llama_time_us();
-
-        // Calculate times and speeds for this repetition
-        const double t_pp = (t_pp_end - t_pp_start) / 1000000.0;
-        const double t_tg = (t_tg_end - t_tg_start) / 1000000.0;
-
-        // Avoid division by zero
-        const double speed_pp = (t_pp > 0) ? (double)n_tokens_pp / t_pp : 0.0;
-
-        // Total tokens generated = pl * tg
-        const double speed_tg = (t_tg > 0) ? (double)(pl * tg) / t_tg : 0.0; 
-
-        // Accumulate stats
-        pp_avg += speed_pp;
-        tg_avg += speed_tg;
-        pp_std += speed_pp * speed_pp;
-        tg_std += speed_tg * speed_tg;
-    }
-
-cleanup_and_exit: // Label for cleanup
-    llama_batch_free(batch); // Free the batch
-    llama_kv_self_clear(ctx); // Clear KV cache finally
-    is_predicting = false; // Reset prediction flag
-
-    // Final calculations
-    // Adjust count if interrupted (approximation)
-    int valid_repetitions = is_interrupted ? 0 : nr; 
-    if (valid_repetitions > 0) {
-        pp_avg /= valid_repetitions;
-        tg_avg /= valid_repetitions;
-
-        if (valid_repetitions > 1) {
-             // Prevent negative results from sqrt due to floating point inaccuracies
-             double pp_var = pp_std / (valid_repetitions - 1) - pp_avg * pp_avg * valid_repetitions / (valid_repetitions - 1);
-             double tg_var = tg_std / (valid_repetitions - 1) - tg_avg * tg_avg * valid_repetitions / (valid_repetitions - 1);
-             pp_std = (pp_var > 0) ? sqrt(pp_var) : 0.0;
-             tg_std = (tg_var > 0) ? sqrt(tg_var) : 0.0;
-        } else {
-            pp_std = 0.0;
-            tg_std = 0.0;
+        llama_batch_free(batch);
+        if (reuse) {
+            llama_kv_self_clear(ctx);
+            llama_set_n_threads(ctx, n_threads_ctx, n_threads_batch_ctx);
+        } else if (bctx) {
+            llama_free(bctx);
         }
-    } else { // If no valid repetitions completed
-         pp_avg = 0.0; tg_avg = 0.0; pp_std = 0.0; tg_std = 0.0;
     }
 
-    // Format result string
-    char model_desc[128];
-    llama_model_desc(model, model_desc, sizeof(model_desc));
-    std::string result_str = "[\"" + std::string(model_desc) + "\"," +
-                             std::to_string(llama_model_size(model)) + "," +
-                             std::to_string(llama_model_n_params(model)) + "," +
-                             std::to_string(pp_avg) + "," +
-                             std::to_string(pp_std) + "," +
-                             std::to_string(tg_avg) + "," +
-                             std::to_string(tg_std) +
-                             "]";
-    LOG_INFO("Benchmark finished. Result: %s", result_str.c_str());
-    return result_str;
+    is_predicting = false;
+    return doc.dump();
 }
 
-} // namespace cactus 
\ No newline at end of file
+} // namespace cactus
@@ -27,6 +27,8 @@ cactus_context::~cactus_context() {
         llama_model_free(vocoder_model);
         vocoder_model = nullptr;
     }
+    freeDraftModel();
+    llama_kv_cache_view_free(&kv_view);
 }
 
 
@@ -53,7 +55,7 @@ void cactus_context::rewind() {
     incomplete = false;
     n_remain = 0;
     n_past = 0;
-    embd.clear(); 
+    // embd is kept: it mirrors the KV cache and lets loadPrompt reuse the shared prefix
     if (ctx_sampling) {
         common_sampler_reset(ctx_sampling);
     }
@@ -75,6 +77,11 @@ bool cactus_context::initSampling() {
         return false;
     }
 
+    if (this->params.logits_top_k > 0 && !this->params.sampling.grammar.empty()) {
+        LOG_ERROR("Cannot initialize sampler: grammar sampling needs the full vocabulary, disable logits_top_k.");
+        return false;
+    }
+
     this->ctx_sampling = common_sampler_init(this->model, this->params.sampling);
     
     if (!this->ctx_sampling) {
@@ -3,6 +3,8 @@
 #include "llama.h" 
 #include <vector>
 #include <cstdio> 
+#include <algorithm>
+#include <string>
 
 namespace cactus {
 
@@ -53,4 +55,108 @@ std::vector<float> cactus_context::getEmbedding(common_params &embd_params)
     return out;
 }
 
-} // namespace cactus 
\ No newline at end of file
+/**
+ * @brief Generates embeddings for many texts with batched decoding
+ * 
+ * Texts are tokenized and packed into one llama_batch (one sequence id per text) until
+ * the micro-batch or the sequence ids run out, so a single forward pass embeds several texts. Pooled vectors
+ * are read per sequence with llama_get_embeddings_seq; without pooling the embedding of
+ * each text's last token is returned. No sampler is involved.
+ * 
+ * @param texts Texts to embed
+ * @return One normalized embedding per text (zero vector for texts that could not be embedded)
+ */
+std::vector<std::vector<float>> cactus_context::getEmbeddings(const std::vector<std::string> &texts)
+{
+    if (!ctx || !model) {
+        LOG_ERROR("Context or model not initialized for embedding generation.");
+        return {};
+    }
+
+    const int n_embd = llama_model_n_embd(model);
+    std::vector<std::vector<float>> out(texts.size(), std::vector<float>(n_embd, 0.0f));
+
+    if (!params.embedding) {
+        LOG_WARNING("Embedding mode not enabled for this context.");
+        return out;
+    }
+
+    is_interrupted = false;
+
+    const enum llama_pooling_type pooling_type = llama_pooling_type(ctx);
+    const bool use_encode = llama_model_has_encoder(model) && !llama_model_has_decoder(model);
+
+    // Pooling happens per micro-batch, so a text must not be split across ubatches
+    const int n_batch_max = (int) std::min(llama_n_batch(ctx), llama_n_ubatch(ctx));
+    // Each text of a batch takes its own sequence id. The KV cache is cleared before every batch, so
+    // any id below LLAMA_MAX_SEQ is free regardless of n_seq_max; recurrent caches only hold n_seq_max states
+    const size_t n_seq_batch_max = llama_model_is_recurrent(model) ? llama_n_seq_max(ctx) : LLAMA_MAX_SEQ;
+
+    llama_batch batch = llama_batch_init(n_batch_max, 0, 1);
+    std::vector<size_t> batch_texts;  // index into texts for each sequence of the batch
+    std::vector<int32_t> batch_last;  // batch index of each sequence's last token
+
+    auto flush = [&]() {
+        if (batch.n_tokens == 0) {
+            return;
+        }
+
+        // Every batch reuses sequence ids 0..n-1 from scratch
+        llama_kv_self_clear(ctx);
+        embd.clear();
+
+        const int ret = use_encode ? llama_encode(ctx, batch) : llama_decode(ctx, batch);
+        if (ret != 0) {
+            LOG_ERROR("Failed to decode embedding batch of %d tokens (%zu texts), error %d", batch.n_tokens, batch_texts.size(), ret);
+        } else {
+            for (size_t s = 0; s < batch_texts.size(); ++s) {
+                const float *data = pooling_type == LLAMA_POOLING_TYPE_NONE
+                    ? llama_get_embeddings_ith(ctx, batch_last[s])
+                    : llama_get_embeddings_seq(ctx, (llama_seq_id) s);
+                if (!data) {
+                    LOG_WARNING("Failed to retrieve embeddings for text %zu.", batch_texts[s]);
+                    continue;
+                }
+                common_embd_normalize(data, out[batch_texts[s]].data(), n_embd, params.embd_normalize);
+            }
+        }
+
+        llama_batch_clear(&batch);
+        batch_texts.clear();
+        batch_last.clear();
+    };
+
+    for (size_t i = 0; i < texts.size(); ++i) {
+        if (is_interrupted) {
+            LOG_INFO("Batch embedding interrupted after %zu of %zu texts.", i, texts.size());
+            break;
+        }
+
+        std::vector<llama_token> tokens = ::common_tokenize(ctx, texts[i], true, true);
+        if (tokens.empty()) {
+            LOG_WARNING("Text %zu produced no tokens, returning a zero embedding.", i);
+            continue;
+        }
+        if ((int) tokens.size() > n_batch_max) {
+            LOG_WARNING("Text %zu has %zu tokens, truncating to the micro-batch size %d.", i, tokens.size(), n_batch_max);
+            tokens.resize(n_batch_max);
+        }
+
+        if (batch.n_tokens + (int) tokens.size() > n_batch_max || batch_texts.size() >= n_seq_batch_max) {
+            flush();
+        }
+
+        const llama_seq_id seq_id = (llama_seq_id) batch_texts.size();
+        for (size_t j = 0; j < tokens.size(); ++j) {
+            llama_batch_add(&batch, tokens[j], (llama_pos) j, {seq_id}, j + 1 == tokens.size());
+        }
+        batch_texts.push_back(i);
+        batch_last.push_back(batch.n_tokens - 1);
+    }
+    flush();
+
+    llama_batch_free(batch);
+    return out;
+}
+
+} // namespace cactus
@@ -10,6 +10,12 @@
 #include <cstdlib> 
 #include <sstream> 
 #include <iostream> 
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <thread>
 
 
 /**
@@ -51,6 +57,216 @@ static char* safe_strdup(const std::string& str) {
 }
 
 
+/**
+ * @brief Copies completion parameters into the context and initializes sampling.
+ * @param context The cactus context.
+ * @param params The completion parameters.
+ * @return true on success, false if sampling could not be initialized.
+ */
+static bool prepare_completion(cactus::cactus_context* context, const cactus_completion_params_c_t* params) {
+    context->rewind();
+
+    context->params.prompt = params->prompt;
+
+    if (params->image_path) {
+        context->params.image.clear();
+        context->params.image.push_back(params->image_path);
+    } else {
+        context->params.image.clear();
+    }
+
+    if (params->n_threads > 0) {
+         context->params.cpuparams.n_threads = params->n_threads;
+    }
+    context->params.n_predict = params->n_predict;
+    context->params.sampling.seed = params->seed;
+    context->params.sampling.temp = params->temperature;
+    context->params.sampling.top_k = params->top_k;
+    context->params.sampling.top_p = params->top_p;
+    context->params.sampling.min_p = params->min_p;
+    context->params.sampling.typ_p = params->typical_p;
+    context->params.sampling.penalty_last_n = params->penalty_last_n;
+    context->params.sampling.penalty_repeat = params->penalty_repeat;
+    context->params.sampling.penalty_freq = params->penalty_freq;
+    context->params.sampling.penalty_present = params->penalty_present;
+    context->params.sampling.mirostat = params->mirostat;
+    context->params.sampling.mirostat_tau = params->mirostat_tau;
+    context->params.sampling.mirostat_eta = params->mirostat_eta;
+    context->params.sampling.ignore_eos = params->ignore_eos;
+    context->params.sampling.n_probs = params->n_probs;
+    context->params.antiprompt = c_str_array_to_vector(params->stop_sequences, params->stop_sequence_count);
+    if (params->grammar) {
+         context->params.sampling.grammar = params->grammar;
+    }
+
+    return context->initSampling();
+}
+
+
+/**
+ * @brief Fills a completion result from the context state after generation.
+ * @param context The cactus context.
+ * @param result The result structure to fill (strings are allocated with safe_strdup).
+ */
+static void fill_completion_result(cactus::cactus_context* context, cactus_completion_result_c_t* result) {
+    result->text = safe_strdup(context->generated_text);
+    result->tokens_predicted = context->num_tokens_predicted;
+    result->tokens_evaluated = context->num_prompt_tokens;
+    result->truncated = context->truncated;
+    result->stopped_eos = context->stopped_eos;
+    result->stopped_word = context->stopped_word;
+    result->stopped_limit = context->stopped_limit;
+    result->stopping_word = safe_strdup(context->stopping_word);
+
+    const cactus::cactus_completion_timings timings = context->getTimings();
+    result->timings.prompt_n = timings.prompt_n;
+    result->timings.prompt_ms = timings.prompt_ms;
+    result->timings.ttft_ms = timings.ttft_ms;
+    result->timings.predicted_n = timings.predicted_n;
+    result->timings.decode_ms = timings.decode_ms;
+    result->timings.sampling_ms = timings.sampling_ms;
+    result->timings.detokenize_ms = timings.detokenize_ms;
+    result->timings.callback_ms = timings.callback_ms;
+    result->timings.total_ms = timings.total_ms;
+    result->timings.prompt_per_second = timings.prompt_per_second;
+    result->timings.predicted_per_second = timings.predicted_per_second;
+    result->timings.itl_p50_ms = timings.itl_p50_ms;
+    result->timings.itl_p90_ms = timings.itl_p90_ms;
+    result->timings.itl_p99_ms = timings.itl_p99_ms;
+}
+
+
+/**
+ * @brief Completion stream shared between the generating thread and the host.
+ *
+ * Events and piece bytes live in two preallocated rings. The generating thread is the only
+ * writer of events_written/text_written and the host the only writer of events_read/text_read,
+ * so publishing and draining never lock; the mutex is only taken to sleep when a ring is full
+ * (producer) or empty (consumer).
+ */
+struct cactus_token_stream {
+    cactus::cactus_context* context = nullptr;
+
+    std::vector<cactus_token_event_c_t> events; // event ring
+    std::vector<uint64_t> event_text_end;       // text ring position after each event's bytes
+    std::vector<char> text;                     // piece bytes referenced by events
+    std::atomic<uint64_t> events_written{0};
+    std::atomic<uint64_t> events_read{0};
+    std::atomic<uint64_t> text_read{0};
+    uint64_t text_written = 0;                  // producer only
+    int32_t n_published = 0;                    // producer only
+
+    std::atomic<bool> finished{false};
+    std::atomic<bool> cancelled{false};
+    std::atomic<bool> producer_waiting{false};
+    std::atomic<bool> consumer_waiting{false};
+    std::mutex wait_mutex;
+    std::condition_variable wait_cv;
+
+    std::thread worker;
+    int status = 0;
+
+    void notify_if(const std::atomic<bool>& waiting) {
+        if (waiting.load()) {
+            // taking the lock orders the notification after the waiter's predicate check
+            { std::lock_guard<std::mutex> lock(wait_mutex); }
+            wait_cv.notify_all();
+        }
+    }
+
+    template <typename Pred>
+    void producer_wait(Pred ready) {
+        if (ready()) {
+            return;
+        }
+        std::unique_lock<std::mutex> lock(wait_mutex);
+        producer_waiting = true;
+        wait_cv.wait(lock, [&] { return ready() || cancelled.load(); });
+        producer_waiting = false;
+    }
+
+    /** @brief Copies a generated token into the rings; returns false if the stream was cancelled. */
+    bool publish(const cactus::completion_token_output& out, size_t text_offset, const char* piece, size_t len) {
+        const uint64_t n_events = events.size();
+        const uint64_t n_text = text.size();
+        len = std::min<size_t>(len, n_text);
+
+        const uint64_t w = events_written.load(std::memory_order_relaxed);
+        producer_wait([&] { return w - events_read.load() < n_events; });
+
+        // keep each piece contiguous, skipping the tail of the text ring if needed
+        uint64_t start = text_written;
+        if (start % n_text + len > n_text) {
+            start += n_text - start % n_text;
+        }
+        producer_wait([&] { return start + len - text_read.load() <= n_text; });
+        if (cancelled.load()) {
+            return false;
+        }
+
+        char* dst = text.data() + start % n_text;
+        if (len > 0) {
+            memcpy(dst, piece, len);
+        }
+        text_written = start + len;
+
+        cactus_token_event_c_t& ev = events[w % n_events];
+        ev.token = out.tok;
+        ev.index = n_published++;
+        ev.text_offset = (int32_t) text_offset;
+        ev.text_len = (int32_t) len;
+        ev.text = dst;
+        ev.n_probs = (int32_t) std::min<size_t>(out.probs.size(), CACTUS_TOKEN_EVENT_MAX_PROBS);
+        for (int32_t i = 0; i < ev.n_probs; ++i) {
+            ev.prob_tokens[i] = out.probs[i].tok;
+            ev.probs[i] = out.probs[i].prob;
+        }
+        ev.t_token_us = context->t_last_token_us - context->t_completion_start_us;
+        event_text_end[w % n_events] = text_written;
+
+        events_written.store(w + 1);
+        notify_if(consumer_waiting);
+        return true;
+    }
+
+    void run() {
+        try {
+            context->beginCompletion();
+            context->loadPrompt();
+
+            while (context->has_next_token && !context->is_interrupted) {
+                const size_t text_size_before = context->generated_text.size();
+                const cactus::completion_token_output token_with_probs = context->doCompletion();
+
+                if (token_with_probs.tok == -1 && !context->has_next_token) {
+                    break;
+                }
+                if (token_with_probs.tok != -1) {
+                    const std::string& generated = context->generated_text;
+                    if (!publish(token_with_probs, text_size_before, generated.data() + text_size_before,
+                                 generated.size() - text_size_before)) {
+                        context->is_interrupted = true;
+                        break;
+                    }
+                }
+            }
+            status = 0;
+        } catch (const std::exception& e) {
+            std::cerr << "Error during streamed completion: " << e.what() << std::endl;
+            context->is_interrupted = true;
+            status = -3;
+        } catch (...) {
+            context->is_interrupted = true;
+            status = -4;
+        }
+
+        finished = true;
+        { std::lock_guard<std::mutex> lock(wait_mutex); }
+        wait_cv.notify_all();
+    }
+};
+
+
 extern "C" {
 
 /**
@@ -181,42 +397,7 @@ int cactus_completion_c(
     memset(result, 0, sizeof(cactus_completion_result_c_t));
 
     try {
-        context->rewind();
-
-        context->params.prompt = params->prompt;
-
-        if (params->image_path) {
-            context->params.image.clear();
-            context->params.image.push_back(params->image_path);
-        } else {
-            context->params.image.clear();
-        }
-
-        if (params->n_threads > 0) {
-             context->params.cpuparams.n_threads = params->n_threads;
-        }
-        context->params.n_predict = params->n_predict;
-        context->params.sampling.seed = params->seed;
-        context->params.sampling.temp = params->temperature;
-        context->params.sampling.top_k = params->top_k;
-        context->params.sampling.top_p = params->top_p;
-        context->params.sampling.min_p = params->min_p;
-        context->params.sampling.typ_p = params->typical_p;
-        context->params.sampling.penalty_last_n = params->penalty_last_n;
-        context->params.sampling.penalty_repeat = params->penalty_repeat;
-        context->params.sampling.penalty_freq = params->penalty_freq;
-        context->params.sampling.penalty_present = params->penalty_present;
-        context->params.sampling.mirostat = params->mirostat;
-        context->params.sampling.mirostat_tau = params->mirostat_tau;
-        context->params.sampling.mirostat_eta = params->mirostat_eta;
-        context->params.sampling.ignore_eos = params->ignore_eos;
-        context->params.sampling.n_probs = params->n_probs;
-        context->params.antiprompt = c_str_array_to_vector(params->stop_sequences, params->stop_sequence_count);
-        if (params->grammar) {
-             context->params.sampling.grammar = params->grammar;
-        }
-
-        if (!context->initSampling()) {
+        if (!prepare_completion(context, params)) {
             return -2; 
         }
         context->beginCompletion();
@@ -224,6 +405,7 @@ int cactus_completion_c(
 
         // --- Streaming loop --- 
         while (context->has_next_token && !context->is_interrupted) {
+            const size_t text_size_before = context->generated_text.size();
             const cactus::completion_token_output token_with_probs = context->doCompletion();
 
             if (token_with_probs.tok == -1 && !context->has_next_token) {
@@ -233,10 +415,13 @@ int cactus_completion_c(
             if (token_with_probs.tok != -1 && params->token_callback) {
                 // Format token data (simple example: just the text)
                 // A more complex implementation could create JSON here
-                std::string token_text = common_token_to_piece(context->ctx, token_with_probs.tok);
+                // doCompletion already appended the piece to generated_text
+                const std::string token_text = context->generated_text.substr(text_size_before);
+                const int64_t t_callback_start_us = lm_ggml_time_us();
                 
                 // Call the Dart callback
                 bool continue_completion = params->token_callback(token_text.c_str());
+                context->timings.callback_ms += (lm_ggml_time_us() - t_callback_start_us) / 1000.0;
                 if (!continue_completion) {
                     context->is_interrupted = true; 
                     break;
@@ -245,15 +430,7 @@ int cactus_completion_c(
         }
 
         // --- Fill final result struct --- 
-        result->text = safe_strdup(context->generated_text);
-        result->tokens_predicted = context->num_tokens_predicted;
-        result->tokens_evaluated = context->num_prompt_tokens;
-        result->truncated = context->truncated;
-        result->stopped_eos = context->stopped_eos;
-        result->stopped_word = context->stopped_word;
-        result->stopped_limit = context->stopped_limit;
-        result->stopping_word = safe_strdup(context->stopping_word);
-        // TODO: Populate timings 
+        fill_completion_result(context, result);
 
         context->is_predicting = false;
         return 0; // Success
@@ -289,6 +466,259 @@ void cactus_stop_completion_c(cactus_context_handle_t handle) {
 }
 
 
+/**
+ * @brief Saves the cached tokens and KV cache of the context to a session file.
+ * @param handle The handle to the cactus context.
+ * @param path The session file path.
+ * @return 0 on success, negative value on error.
+ *         -1: Invalid arguments.
+ *         -2: Saving failed.
+ *         -3: Exception occurred.
+ *         -4: Unknown exception occurred.
+ */
+int cactus_save_session_c(cactus_context_handle_t handle, const char* path) {
+    if (!handle || !path) {
+        return -1;
+    }
+    cactus::cactus_context* context = reinterpret_cast<cactus::cactus_context*>(handle);
+
+    try {
+        return context->saveSession(path) ? 0 : -2;
+    } catch (const std::exception& e) {
+        std::cerr << "Exception in cactus_save_session_c: " << e.what() << std::endl;
+        return -3;
+    } catch (...) {
+        std::cerr << "Unknown exception in cactus_save_session_c." << std::endl;
+        return -4;
+    }
+}
+
+
+/**
+ * @brief Restores a session file, keeping only the prefix shared with the upcoming prompt.
+ * @param handle The handle to the cactus context.
+ * @param path The session file path.
+ * @param prompt The upcoming prompt, or nullptr to restore the whole session.
+ * @return Number of restored tokens, or a negative value on error.
+ *         -1: Invalid arguments.
+ *         -2: Loading failed.
+ *         -3: Exception occurred.
+ *         -4: Unknown exception occurred.
+ */
+int32_t cactus_load_session_c(cactus_context_handle_t handle, const char* path, const char* prompt) {
+    if (!handle || !path) {
+        return -1;
+    }
+    cactus::cactus_context* context = reinterpret_cast<cactus::cactus_context*>(handle);
+
+    try {
+        std::vector<llama_token> prompt_tokens;
+        if (prompt && context->ctx) {
+            prompt_tokens = ::common_tokenize(context->ctx, prompt, true, true);
+        }
+        const int n_restored = context->loadSession(path, prompt_tokens);
+        return n_restored < 0 ? -2 : n_restored;
+    } catch (const std::exception& e) {
+        std::cerr << "Exception in cactus_load_session_c: " << e.what() << std::endl;
+        return -3;
+    } catch (...) {
+        std::cerr << "Unknown exception in cactus_load_session_c." << std::endl;
+        return -4;
+    }
+}
+
+
+/**
+ * @brief Saves the grammars compiled for the model vocabulary to a file.
+ * @param handle The handle to the cactus context.
+ * @param path The grammar cache file path.
+ * @return 0 on success, negative value on error.
+ *         -1: Invalid arguments.
+ *         -2: Saving failed.
+ *         -3: Exception occurred.
+ *         -4: Unknown exception occurred.
+ */
+int cactus_save_grammar_cache_c(cactus_context_handle_t handle, const char* path) {
+    if (!handle || !path) {
+        return -1;
+    }
+    cactus::cactus_context* context = reinterpret_cast<cactus::cactus_context*>(handle);
+
+    try {
+        return context->saveGrammarCache(path) ? 0 : -2;
+    } catch (const std::exception& e) {
+        std::cerr << "Exception in cactus_save_grammar_cache_c: " << e.what() << std::endl;
+        return -3;
+    } catch (...) {
+        std::cerr << "Unknown exception in cactus_save_grammar_cache_c." << std::endl;
+        return -4;
+    }
+}
+
+
+/**
+ * @brief Loads grammars compiled for the model vocabulary from a file.
+ * @param handle The handle to the cactus context.
+ * @param path The grammar cache file path.
+ * @return 0 on success, negative value on error.
+ *         -1: Invalid arguments.
+ *         -2: Loading failed.
+ *         -3: Exception occurred.
+ *         -4: Unknown exception occurred.
+ */
+int cactus_load_grammar_cache_c(cactus_context_handle_t handle, const char* path) {
+    if (!handle || !path) {
+        return -1;
+    }
+    cactus::cactus_context* context = reinterpret_cast<cactus::cactus_context*>(handle);
+
+    try {
+        return context->loadGrammarCache(path) ? 0 : -2;
+    } catch (const std::exception& e) {
+        std::cerr << "Exception in cactus_load_grammar_cache_c: " << e.what() << std::endl;
+        return -3;
+    } catch (...) {
+        std::cerr << "Unknown exception in cactus_load_grammar_cache_c." << std::endl;
+        return -4;
+    }
+}
+
+
+/**
+ * @brief Starts a completion whose tokens are published into a ring buffer drained by the host.
+ * @param handle The handle to the cactus context.
+ * @param params A pointer to the completion parameters (token_callback is ignored).
+ * @param capacity Maximum number of unreleased events; <= 0 selects 256.
+ * @return A stream handle, or nullptr if the arguments are invalid or sampling could not be initialized.
+ */
+cactus_token_stream_handle_t cactus_completion_stream_start_c(
+    cactus_context_handle_t handle,
+    const cactus_completion_params_c_t* params,
+    int32_t capacity
+) {
+    if (!handle || !params || !params->prompt) {
+        return nullptr;
+    }
+    cactus::cactus_context* context = reinterpret_cast<cactus::cactus_context*>(handle);
+
+    try {
+        if (!prepare_completion(context, params)) {
+            return nullptr;
+        }
+
+        const size_t n_events = capacity > 0 ? (size_t) capacity : 256;
+        // owned here until the worker runs, so a failed allocation or thread start frees it
+        std::unique_ptr<cactus_token_stream> stream(new cactus_token_stream());
+        stream->context = context;
+        stream->events.assign(n_events, cactus_token_event_c_t{});
+        stream->event_text_end.assign(n_events, 0);
+        stream->text.resize(std::max<size_t>(4096, n_events * 64));
+        cactus_token_stream* raw = stream.get();
+        stream->worker = std::thread([raw]() { raw->run(); });
+        return stream.release();
+    } catch (const std::exception& e) {
+        std::cerr << "Exception in cactus_completion_stream_start_c: " << e.what() << std::endl;
+        context->is_predicting = false;
+        return nullptr;
+    }
+}
+
+
+/**
+ * @brief Returns a pointer to the next contiguous run of published events.
+ * @return Number of events (0 on timeout), -1 when finished and drained, -2 on invalid arguments.
+ */
+int32_t cactus_completion_stream_acquire_c(
+    cactus_token_stream_handle_t stream,
+    const cactus_token_event_c_t** events,
+    int32_t max_events,
+    int32_t timeout_ms
+) {
+    if (!stream || !events || max_events <= 0) {
+        return -2;
+    }
+
+    const uint64_t r = stream->events_read.load(std::memory_order_relaxed);
+    auto ready = [stream, r]() { return stream->events_written.load() > r || stream->finished.load(); };
+
+    if (!ready() && timeout_ms != 0) {
+        std::unique_lock<std::mutex> lock(stream->wait_mutex);
+        stream->consumer_waiting = true;
+        if (timeout_ms < 0) {
+            stream->wait_cv.wait(lock, ready);
+        } else {
+            stream->wait_cv.wait_for(lock, std::chrono::milliseconds(timeout_ms), ready);
+        }
+        stream->consumer_waiting = false;
+    }
+
+    const uint64_t available = stream->events_written.load() - r;
+    if (available == 0) {
+        return stream->finished.load() && stream->events_written.load() == r ? -1 : 0;
+    }
+
+    const uint64_t n_ring = stream->events.size();
+    const uint64_t n = std::min<uint64_t>({available, n_ring - r % n_ring, (uint64_t) max_events});
+    *events = &stream->events[r % n_ring];
+    return (int32_t) n;
+}
+
+
+/**
+ * @brief Releases acquired events so the generating thread can reuse their slots.
+ */
+void cactus_completion_stream_release_c(cactus_token_stream_handle_t stream, int32_t n_events) {
+    if (!stream || n_events <= 0) {
+        return;
+    }
+    const uint64_t r = stream->events_read.load(std::memory_order_relaxed);
+    const uint64_t n = std::min<uint64_t>((uint64_t) n_events, stream->events_written.load() - r);
+    if (n == 0) {
+        return;
+    }
+
+    const uint64_t n_ring = stream->events.size();
+    stream->text_read.store(stream->event_text_end[(r + n - 1) % n_ring]);
+    stream->events_read.store(r + n);
+    stream->notify_if(stream->producer_waiting);
+}
+
+
+/**
+ * @brief Stops the stream if needed, joins the generating thread, fills the result and frees the stream.
+ * @return 0 on success, -1 on invalid arguments, -3/-4 if generation threw an exception.
+ */
+int cactus_completion_stream_finish_c(
+    cactus_token_stream_handle_t stream,
+    cactus_completion_result_c_t* result
+) {
+    if (!stream) {
+        return -1;
+    }
+    if (result) {
+        memset(result, 0, sizeof(cactus_completion_result_c_t));
+    }
+
+    if (!stream->finished.load()) {
+        stream->context->is_interrupted = true;
+    }
+    stream->cancelled = true;
+    { std::lock_guard<std::mutex> lock(stream->wait_mutex); }
+    stream->wait_cv.notify_all();
+    if (stream->worker.joinable()) {
+        stream->worker.join();
+    }
+
+    const int status = stream->status;
+    if (result && status == 0) {
+        fill_completion_result(stream->context, result);
+    }
+    stream->context->is_predicting = false;
+    delete stream;
+    return status;
+}
+
+
 /**
  * @brief Tokenizes a given text using the context's tokenizer.
  * The caller is responsible for freeing the returned token array using cactus_free_token_array_c.
@@ -384,19 +814,8 @@ cactus_float_array_c_t cactus_embedding_c(cactus_context_handle_t handle, const
     }
 
     try {
-        context->rewind();
-        context->params.prompt = text;
-        context->params.n_predict = 0; 
-
-        if (!context->initSampling()) { return result; }
-        context->beginCompletion();
-        context->loadPrompt();
-        context->doCompletion(); 
-
-        common_params dummy_embd_params;
-        dummy_embd_params.embd_normalize = context->params.embd_normalize;
-
-        std::vector<float> embedding_vec = context->getEmbedding(dummy_embd_params);
+        std::vector<std::vector<float>> embeddings = context->getEmbeddings({text});
+        std::vector<float> embedding_vec = embeddings.empty() ? std::vector<float>() : embeddings[0];
 
         if (!embedding_vec.empty()) {
             result.count = embedding_vec.size();
@@ -407,21 +826,75 @@ cactus_float_array_c_t cactus_embedding_c(cactus_context_handle_t handle, const
                 result.count = 0; 
             }
         }
-        context->is_predicting = false;
         return result;
 
     } catch (const std::exception& e) {
         std::cerr << "Error during embedding generation: " << e.what() << std::endl;
-        context->is_predicting = false;
         return {nullptr, 0};
     } catch (...) {
         std::cerr << "Unknown error during embedding generation." << std::endl;
-        context->is_predicting = false;
         return {nullptr, 0};
     }
 }
 
 
+/**
+ * @brief Generates embeddings for a list of texts using batched decoding.
+ * Embedding mode must be enabled during context initialization.
+ * The caller is responsible for freeing the returned values using cactus_free_embedding_batch_c.
+ * @param handle The handle to the cactus context.
+ * @param texts An array of C strings to embed.
+ * @param count The number of strings in the array.
+ * @return A cactus_embedding_batch_c_t with n_texts rows of n_embd values.
+ *         The 'values' field will be nullptr and the counts 0 on failure or if embedding is not enabled.
+ */
+cactus_embedding_batch_c_t cactus_embedding_batch_c(cactus_context_handle_t handle, const char** texts, int32_t count) {
+    cactus_embedding_batch_c_t result = {nullptr, 0, 0};
+    if (!handle || !texts || count <= 0) {
+        return result;
+    }
+    cactus::cactus_context* context = reinterpret_cast<cactus::cactus_context*>(handle);
+    if (!context->ctx || !context->params.embedding) {
+        std::cerr << "Error: Embedding mode not enabled or context not initialized." << std::endl;
+        return result;
+    }
+
+    try {
+        std::vector<std::string> texts_vec;
+        texts_vec.reserve(count);
+        for (int32_t i = 0; i < count; ++i) {
+            texts_vec.emplace_back(texts[i] ? texts[i] : "");
+        }
+
+        std::vector<std::vector<float>> embeddings = context->getEmbeddings(texts_vec);
+        if (embeddings.size() != texts_vec.size()) {
+            return result;
+        }
+
+        const int32_t n_embd = llama_model_n_embd(context->model);
+        result.values = (float*)malloc((size_t)count * n_embd * sizeof(float));
+        if (!result.values) {
+            return result;
+        }
+        for (int32_t i = 0; i < count; ++i) {
+            std::copy(embeddings[i].begin(), embeddings[i].end(), result.values + (size_t)i * n_embd);
+        }
+        result.n_texts = count;
+        result.n_embd = n_embd;
+        return result;
+
+    } catch (const std::exception& e) {
+        std::cerr << "Error during batch embedding generation: " << e.what() << std::endl;
+        if (result.values) free(result.values);
+        return {nullptr, 0, 0};
+    } catch (...) {
+        std::cerr << "Unknown error during batch embedding generation." << std::endl;
+        if (result.values) free(result.values);
+        return {nullptr, 0, 0};
+    }
+}
+
+
 
 /**
  * @brief Frees a C string that was allocated by one of the cactus_ffi functions.
@@ -454,6 +927,16 @@ void cactus_free_float_array_c(cactus_float_array_c_t arr) {
     }
 }
 
+/**
+ * @brief Frees the values of an embedding batch allocated by cactus_embedding_batch_c.
+ * @param batch The embedding batch to free.
+ */
+void cactus_free_embedding_batch_c(cactus_embedding_batch_c_t batch) {
+    if (batch.values) {
+        free(batch.values);
+    }
+}
+
 /**
  * @brief Frees the members of a cactus_completion_result_c_t structure that were dynamically allocated.
  * Specifically, this frees the 'text' and 'stopping_word' C strings.
@@ -513,6 +996,49 @@ int cactus_load_vocoder_c(
 }
 
 
+/**
+ * @brief Loads a draft model for speculative decoding into the given cactus context.
+ * @param handle The handle to the cactus context.
+ * @param params A pointer to the draft model parameters.
+ * @return 0 on success, negative value on error.
+ *         -1: Invalid arguments.
+ *         -2: Draft model loading failed.
+ *         -3: Exception occurred.
+ *         -4: Unknown exception occurred.
+ */
+int cactus_load_draft_model_c(
+    cactus_context_handle_t handle,
+    const cactus_draft_model_params_c_t* params
+) {
+    if (!handle || !params || !params->model_path) {
+        std::cerr << "Error: Invalid arguments to cactus_load_draft_model_c." << std::endl;
+        return -1; // Invalid arguments
+    }
+    cactus::cactus_context* context = reinterpret_cast<cactus::cactus_context*>(handle);
+
+    try {
+        common_params_speculative spec_cpp_params = context->params.speculative;
+        spec_cpp_params.model.path = params->model_path;
+        if (params->n_max > 0) spec_cpp_params.n_max = params->n_max;
+        if (params->n_min >= 0) spec_cpp_params.n_min = params->n_min;
+        if (params->p_min > 0.0f) spec_cpp_params.p_min = params->p_min;
+        if (params->n_ctx > 0) spec_cpp_params.n_ctx = params->n_ctx;
+
+        if (!context->loadDraftModel(spec_cpp_params)) {
+            std::cerr << "Error: Failed to load draft model." << std::endl;
+            return -2; // Draft model loading failed
+        }
+        return 0; // Success
+    } catch (const std::exception& e) {
+        std::cerr << "Exception in cactus_load_draft_model_c: " << e.what() << std::endl;
+        return -3; // Exception occurred
+    } catch (...) {
+        std::cerr << "Unknown exception in cactus_load_draft_model_c." << std::endl;
+        return -4; // Unknown exception
+    }
+}
+
+
 /**
  * @brief Synthesizes speech from the given text input and saves it to a WAV file.
  * A vocoder model must be loaded first using cactus_load_vocoder_c.
@@ -553,4 +1079,48 @@ int cactus_synthesize_speech_c(
     }
 }
 
+/**
+ * @brief Synthesizes speech from the given text input, passing PCM chunks to a callback as they are vocoded.
+ * A vocoder model must be loaded first using cactus_load_vocoder_c.
+ * @param handle The handle to the cactus context.
+ * @param params A pointer to the speech synthesis parameters (output_wav_path is ignored and may be NULL).
+ * @param audio_callback Called with each chunk of samples; returning false stops synthesis.
+ * @return 0 on success, negative value on error.
+ *         -1: Invalid arguments.
+ *         -2: Speech synthesis failed.
+ *         -3: Exception occurred.
+ *         -4: Unknown exception occurred.
+ */
+int cactus_synthesize_speech_stream_c(
+    cactus_context_handle_t handle,
+    const cactus_synthesize_speech_params_c_t* params,
+    bool (*audio_callback)(const float* samples, int32_t n_samples, int32_t sample_rate)
+) {
+    if (!handle || !params || !params->text_input || !audio_callback) {
+        std::cerr << "Error: Invalid arguments to cactus_synthesize_speech_stream_c." << std::endl;
+        return -1; // Invalid arguments
+    }
+    cactus::cactus_context* context = reinterpret_cast<cactus::cactus_context*>(handle);
+
+    try {
+        std::string text_input_str = params->text_input;
+        std::string speaker_id_str = params->speaker_id ? params->speaker_id : "";
+        auto on_audio = [audio_callback](const float* samples, size_t n_samples, int sample_rate) {
+            return audio_callback(samples, static_cast<int32_t>(n_samples), sample_rate);
+        };
+
+        if (!context->synthesizeSpeechStream(text_input_str, on_audio, speaker_id_str)) {
+            std::cerr << "Error: Speech synthesis failed." << std::endl;
+            return -2; // Synthesis failed
+        }
+        return 0; // Success
+    } catch (const std::exception& e) {
+        std::cerr << "Exception in cactus_synthesize_speech_stream_c: " << e.what() << std::endl;
+        return -3; // Exception occurred
+    } catch (...) {
+        std::cerr << "Unknown exception in cactus_synthesize_speech_stream_c." << std::endl;
+        return -4; // Unknown exception
+    }
+}
+
 } // extern "C" 
\ No newline at end of file
@@ -87,6 +87,28 @@ typedef struct cactus_completion_params_c {
 } cactus_completion_params_c_t;
 
 
+#define CACTUS_TOKEN_EVENT_MAX_PROBS 16
+
+/**
+ * @brief One generated token in a completion stream (see cactus_completion_stream_start_c).
+ *        Events and their text live in memory owned by the stream; they stay valid until
+ *        released with cactus_completion_stream_release_c.
+ */
+typedef struct cactus_token_event_c {
+    int32_t token;                                     // Token id
+    int32_t index;                                     // Position of the token in the completion
+    int32_t text_offset;                               // Byte offset of the piece in the generated text
+    int32_t text_len;                                  // Byte length of the piece
+    const char* text;                                  // Piece bytes (not NUL-terminated)
+    int32_t n_probs;                                   // Valid entries in prob_tokens/probs (<= n_probs requested)
+    int32_t prob_tokens[CACTUS_TOKEN_EVENT_MAX_PROBS];
+    float probs[CACTUS_TOKEN_EVENT_MAX_PROBS];
+    int64_t t_token_us;                                // Time the token was produced, since the start of the completion
+} cactus_token_event_c_t;
+
+typedef struct cactus_token_stream* cactus_token_stream_handle_t;
+
+
 typedef struct cactus_token_array_c {
     int32_t* tokens;
     int32_t count;
@@ -97,6 +119,32 @@ typedef struct cactus_float_array_c {
     int32_t count;
 } cactus_float_array_c_t;
 
+typedef struct cactus_embedding_batch_c {
+    float* values;   // n_texts * n_embd values, row-major (one row per input text)
+    int32_t n_texts;
+    int32_t n_embd;
+} cactus_embedding_batch_c_t;
+
+/**
+ * @brief Per-phase timings of a completion, in milliseconds (mirrors cactus_completion_timings).
+ */
+typedef struct cactus_completion_timings_c {
+    int32_t prompt_n;            // Prompt tokens evaluated (cached prefix excluded)
+    double prompt_ms;            // Prefill: tokenizing and evaluating the prompt
+    double ttft_ms;              // Time to first generated token
+    int32_t predicted_n;         // Generated tokens
+    double decode_ms;            // Decoding generated tokens, including speculative rounds
+    double sampling_ms;          // Sampling generated tokens
+    double detokenize_ms;        // Converting generated tokens to text
+    double callback_ms;          // Time spent in token_callback
+    double total_ms;             // Time from start of generation to the last token
+    double prompt_per_second;
+    double predicted_per_second;
+    double itl_p50_ms;           // Inter-token latency percentiles
+    double itl_p90_ms;
+    double itl_p99_ms;
+} cactus_completion_timings_c_t;
+
 typedef struct cactus_completion_result_c {
     char* text; 
     int32_t tokens_predicted;
@@ -106,6 +154,7 @@ typedef struct cactus_completion_result_c {
     bool stopped_word;
     bool stopped_limit;
     char* stopping_word; 
+    cactus_completion_timings_c_t timings;
 } cactus_completion_result_c_t;
 
 
@@ -138,6 +187,18 @@ typedef struct cactus_synthesize_speech_params_c {
 } cactus_synthesize_speech_params_c_t;
 
 
+/**
+ * @brief Parameters for speculative decoding (mirrors internal common_params_speculative).
+ */
+typedef struct cactus_draft_model_params_c {
+    const char* model_path; // Local path to the draft model file (must share the target vocabulary)
+    int32_t n_max;          // Maximum number of tokens to draft per step
+    int32_t n_min;          // Minimum number of drafted tokens to run a speculative step
+    float p_min;            // Stop drafting when the draft model's top probability falls below this
+    int32_t n_ctx;          // Draft context size (0 = same as the target context)
+} cactus_draft_model_params_c_t;
+
+
 /**
  * @brief Initializes a cactus context with the given parameters.
  *
@@ -181,6 +242,104 @@ CACTUS_FFI_EXPORT int cactus_completion_c(
 CACTUS_FFI_EXPORT void cactus_stop_completion_c(cactus_context_handle_t handle);
 
 
+/**
+ * @brief Saves the context's cached tokens and KV cache to a session file. Repeated saves to
+ *        the same path only append the tokens added since the previous save or load.
+ *
+ * @param handle The context handle.
+ * @param path Session file path.
+ * @return 0 on success, negative on failure.
+ */
+CACTUS_FFI_EXPORT int cactus_save_session_c(cactus_context_handle_t handle, const char* path);
+
+/**
+ * @brief Restores a session file, keeping only the prefix shared with the given prompt.
+ *        A following completion with that prompt reuses the restored tokens.
+ *
+ * @param handle The context handle.
+ * @param path Session file path.
+ * @param prompt Upcoming prompt, or NULL to restore the whole session.
+ * @return Number of tokens restored into the KV cache, negative on failure.
+ */
+CACTUS_FFI_EXPORT int32_t cactus_load_session_c(cactus_context_handle_t handle, const char* path, const char* prompt);
+
+/**
+ * @brief Saves the grammars compiled for the model's vocabulary, so a later process can
+ *        start grammar-constrained completions without recomputing them.
+ *
+ * @param handle The context handle.
+ * @param path Grammar cache file path.
+ * @return 0 on success, negative on failure.
+ */
+CACTUS_FFI_EXPORT int cactus_save_grammar_cache_c(cactus_context_handle_t handle, const char* path);
+
+/**
+ * @brief Loads grammars saved by cactus_save_grammar_cache_c. Fails if the file was saved
+ *        for a different vocabulary.
+ *
+ * @param handle The context handle.
+ * @param path Grammar cache file path.
+ * @return 0 on success, negative on failure.
+ */
+CACTUS_FFI_EXPORT int cactus_load_grammar_cache_c(cactus_context_handle_t handle, const char* path);
+
+
+/**
+ * @brief Starts a completion on a background thread that publishes tokens into a preallocated
+ *        single-producer/single-consumer ring buffer. The host drains tokens in batches with
+ *        cactus_completion_stream_acquire_c / cactus_completion_stream_release_c instead of
+ *        receiving one callback per token. params->token_callback is ignored.
+ *        The context must not be used for anything else until cactus_completion_stream_finish_c.
+ *
+ * @param handle The context handle.
+ * @param params Completion parameters.
+ * @param capacity Maximum number of unreleased events (<= 0 selects a default). Generation
+ *        pauses while the ring is full.
+ * @return A stream handle, or NULL on failure.
+ */
+CACTUS_FFI_EXPORT cactus_token_stream_handle_t cactus_completion_stream_start_c(
+    cactus_context_handle_t handle,
+    const cactus_completion_params_c_t* params,
+    int32_t capacity
+);
+
+/**
+ * @brief Returns the next contiguous batch of published events without copying.
+ *
+ * @param stream The stream handle.
+ * @param events Receives a pointer to the first available event.
+ * @param max_events Maximum number of events to return.
+ * @param timeout_ms How long to wait for an event when none is available (0 polls, < 0 waits indefinitely).
+ * @return Number of events available (0 on timeout), -1 once generation has finished and all
+ *         events were released, -2 on invalid arguments.
+ */
+CACTUS_FFI_EXPORT int32_t cactus_completion_stream_acquire_c(
+    cactus_token_stream_handle_t stream,
+    const cactus_token_event_c_t** events,
+    int32_t max_events,
+    int32_t timeout_ms
+);
+
+/**
+ * @brief Releases the first n_events acquired events, making their slots reusable.
+ */
+CACTUS_FFI_EXPORT void cactus_completion_stream_release_c(cactus_token_stream_handle_t stream, int32_t n_events);
+
+/**
+ * @brief Stops generation if it is still running, waits for the background thread, fills the
+ *        final result and frees the stream. Unreleased events are discarded.
+ *
+ * @param stream The stream handle.
+ * @param result Optional result structure; free with cactus_free_completion_result_members_c.
+ * @return 0 on success, -1 on invalid arguments, -2 if sampling could not be initialized,
+ *         -3/-4 if generation threw an exception.
+ */
+CACTUS_FFI_EXPORT int cactus_completion_stream_finish_c(
+    cactus_token_stream_handle_t stream,
+    cactus_completion_result_c_t* result
+);
+
+
 /**
  * @brief Tokenizes the given text.
  *
@@ -212,6 +371,19 @@ CACTUS_FFI_EXPORT char* cactus_detokenize_c(cactus_context_handle_t handle, cons
 CACTUS_FFI_EXPORT cactus_float_array_c_t cactus_embedding_c(cactus_context_handle_t handle, const char* text);
 
 
+/**
+ * @brief Generates embeddings for many texts at once. Context must be initialized with embedding=true.
+ *        Texts are packed into shared batches (one sequence per text), so throughput scales with
+ *        the batch size instead of paying per-call overhead.
+ *
+ * @param handle The context handle.
+ * @param texts Array of texts to embed.
+ * @param count Number of texts.
+ * @return A struct with one embedding row per text. Caller must free it using cactus_free_embedding_batch_c.
+ */
+CACTUS_FFI_EXPORT cactus_embedding_batch_c_t cactus_embedding_batch_c(cactus_context_handle_t handle, const char** texts, int32_t count);
+
+
 /**
  * @brief Loads the vocoder model required for Text-to-Speech.
  *        This should be called after cactus_init_context_c if TTS is needed.
@@ -227,6 +399,20 @@ CACTUS_FFI_EXPORT int cactus_load_vocoder_c(
 );
 
 
+/**
+ * @brief Loads a draft model and enables speculative decoding for subsequent completions.
+ *        Completions requesting n_probs > 0 decode without speculation.
+ *
+ * @param handle The context handle returned by cactus_init_context_c.
+ * @param params Draft model path and drafting limits.
+ * @return 0 on success, non-zero on failure.
+ */
+CACTUS_FFI_EXPORT int cactus_load_draft_model_c(
+    cactus_context_handle_t handle,
+    const cactus_draft_model_params_c_t* params
+);
+
+
 /**
  * @brief Synthesizes speech from the given text and saves it to a WAV file.
  *        Both the main TTS model (via cactus_init_context_c) and the vocoder model
@@ -241,6 +427,23 @@ CACTUS_FFI_EXPORT int cactus_synthesize_speech_c(
     const cactus_synthesize_speech_params_c_t* params
 );
 
+/**
+ * @brief Synthesizes speech from the given text, streaming PCM audio while it is generated.
+ *        The vocoder model must be loaded via cactus_load_vocoder_c. params->output_wav_path
+ *        is ignored; the host owns the audio delivered to the callback.
+ *
+ * @param handle The context handle.
+ * @param params Parameters for synthesis, including input text.
+ * @param audio_callback Receives mono float PCM chunks (valid only during the call) and the
+ *        sample rate. Return false to stop synthesis early.
+ * @return 0 on success, non-zero on failure.
+ */
+CACTUS_FFI_EXPORT int cactus_synthesize_speech_stream_c(
+    cactus_context_handle_t handle,
+    const cactus_synthesize_speech_params_c_t* params,
+    bool (*audio_callback)(const float* samples, int32_t n_samples, int32_t sample_rate)
+);
+
 
 /** @brief Frees a string allocated by the C API. */
 CACTUS_FFI_EXPORT void cactus_free_string_c(char* str);
@@ -251,6 +454,9 @@ CACTUS_FFI_EXPORT void cactus_free_token_array_c(cactus_token_array_c_t arr);
 /** @brief Frees a float array allocated by the C API. */
 CACTUS_FFI_EXPORT void cactus_free_float_array_c(cactus_float_array_c_t arr);
 
+/** @brief Frees the values of an embedding batch allocated by cactus_embedding_batch_c. */
+CACTUS_FFI_EXPORT void cactus_free_embedding_batch_c(cactus_embedding_batch_c_t batch);
+
 /** @brief Frees the members *within* a completion result struct (like text, stopping_word). */
 CACTUS_FFI_EXPORT void cactus_free_completion_result_members_c(cactus_completion_result_c_t* result);
 
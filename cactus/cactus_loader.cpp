@@ -15,6 +15,23 @@ namespace cactus {
 bool cactus_context::loadModel(common_params &params_)
 {
     params = params_;
+
+    if (params.kv_evict == COMMON_KV_EVICT_HEAVY_HITTER) {
+        // the attention weights are only materialized by the unified cache without flash attention
+        if (params.flash_attn || params.kv_block_size > 0 || params.cb_eval != nullptr) {
+            LOG_WARNING("heavy-hitter eviction needs the attention weights, falling back to attention sinks");
+            params.kv_evict = COMMON_KV_EVICT_SINK;
+        } else {
+            params.cb_eval = scoreAttention;
+            params.cb_eval_user_data = this;
+            if (!params.swa_full) {
+                // evicted positions are picked across all layers, so sliding-window layers must keep them too
+                LOG_WARNING("heavy-hitter eviction needs full-size sliding-window caches, enabling swa_full");
+                params.swa_full = true;
+            }
+        }
+    }
+
     llama_init = common_init_from_params(params); 
     model = llama_init.model.get();
     ctx = llama_init.context.get();
@@ -26,6 +43,11 @@ bool cactus_context::loadModel(common_params &params_)
     templates = common_chat_templates_init(model, params.chat_template);
     n_ctx = llama_n_ctx(ctx);
 
+    if (!params.speculative.model.path.empty() && !loadDraftModel(params.speculative)) {
+        LOG_ERROR("unable to load draft model: %s", params.speculative.model.path.c_str());
+        return false;
+    }
+
     if (!params.mmproj.path.empty() && model != nullptr) {
         struct mtmd_context_params mtmd_params = mtmd_context_params_default();
         mtmd_params.use_gpu = params.mmproj_use_gpu;
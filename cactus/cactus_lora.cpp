@@ -6,6 +6,18 @@
 
 namespace cactus {
 
+/**
+ * @brief Drops the cached prompt of sequence 0
+ * 
+ * Its KV cells were computed with the previous adapters, so loadPrompt must not reuse them.
+ */
+static void drop_cached_prompt(cactus_context &cctx) {
+    llama_kv_self_seq_rm(cctx.ctx, 0, -1, -1);
+    cctx.embd.clear();
+    cctx.kv_scores.clear();
+    cctx.n_past = 0;
+}
+
 /**
  * @brief Applies LoRA adapters to the model
  * 
@@ -35,6 +47,7 @@ int cactus_context::applyLoraAdapters(std::vector<common_adapter_lora_info> lora
     this->lora = lora_adapters; 
 
     common_set_adapter_lora(ctx, this->lora); 
+    drop_cached_prompt(*this);
     LOG_INFO("Applied %zu LoRA adapters.", this->lora.size());
     return 0;
 }
@@ -50,6 +63,7 @@ void cactus_context::removeLoraAdapters() {
     }
     this->lora.clear(); 
     common_set_adapter_lora(ctx, this->lora); 
+    drop_cached_prompt(*this);
     LOG_INFO("Removed all LoRA adapters.");
 }
 
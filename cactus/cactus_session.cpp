@@ -0,0 +1,263 @@
+#include "cactus.h"
+#include "common.h"
+#include "llama.h"
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <vector>
+#include <string>
+
+namespace cactus {
+
+// A session file is a sequence of append-only records. Record i holds the tokens at positions
+// [p0, p0 + n_tokens) and the KV cells of sequence 0 for exactly those positions, so saving after
+// a turn only writes the tokens added since the previous save.
+#define CACTUS_SESSION_MAGIC   0x53455343u // 'CSES'
+#define CACTUS_SESSION_VERSION 2u
+
+struct session_record_header {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t p0;          /**< Position of the first token in the record */
+    uint32_t n_tokens;    /**< Number of tokens (and KV cells) in the record */
+    uint64_t state_size;  /**< Size of the llama_state_seq_get_data blob that follows the tokens */
+};
+
+struct session_record {
+    uint32_t p0;
+    uint32_t n_tokens;
+    uint64_t state_size;
+    long     state_offset; /**< File offset of the state blob */
+};
+
+/**
+ * @brief Reads the record headers and tokens of a session file
+ *
+ * Stops at the first truncated or inconsistent record, so a save interrupted mid-write only
+ * loses that record.
+ *
+ * @param file Open session file
+ * @param records Receives the valid records
+ * @param tokens Receives the tokens of all valid records
+ * @return Size in bytes of the valid part of the file
+ */
+static long read_session_index(FILE *file, std::vector<session_record> &records, std::vector<llama_token> &tokens) {
+    records.clear();
+    tokens.clear();
+
+    long valid_bytes = 0;
+    while (true) {
+        session_record_header header;
+        if (fread(&header, sizeof(header), 1, file) != 1) {
+            break;
+        }
+        if (header.magic != CACTUS_SESSION_MAGIC || header.version != CACTUS_SESSION_VERSION ||
+            header.p0 != tokens.size() || header.n_tokens == 0) {
+            LOG_WARNING("Session file: invalid record at offset %ld, ignoring the rest of the file", valid_bytes);
+            break;
+        }
+
+        const size_t n_prev = tokens.size();
+        tokens.resize(n_prev + header.n_tokens);
+        if (fread(tokens.data() + n_prev, sizeof(llama_token), header.n_tokens, file) != header.n_tokens) {
+            tokens.resize(n_prev);
+            break;
+        }
+
+        const long state_offset = ftell(file);
+        if (fseek(file, (long) header.state_size, SEEK_CUR) != 0 || ftell(file) - state_offset != (long) header.state_size) {
+            tokens.resize(n_prev);
+            break;
+        }
+        // fseek past EOF succeeds, so check that the blob is really there
+        if (header.state_size > 0) {
+            fseek(file, -1, SEEK_CUR);
+            if (fgetc(file) == EOF) {
+                tokens.resize(n_prev);
+                break;
+            }
+        }
+
+        records.push_back({header.p0, header.n_tokens, header.state_size, state_offset});
+        valid_bytes = ftell(file);
+    }
+    return valid_bytes;
+}
+
+bool cactus_context::saveSession(const std::string &path) {
+    if (!ctx || !model) {
+        LOG_ERROR("Model not loaded. Cannot save session.");
+        return false;
+    }
+    if (llama_model_is_recurrent(model)) {
+        LOG_ERROR("Session files are not supported for recurrent models");
+        return false;
+    }
+    if (std::find(embd.begin(), embd.end(), LLAMA_TOKEN_NULL) != embd.end()) {
+        LOG_ERROR("Cannot save a session that contains image positions");
+        return false;
+    }
+
+    // Append when the file already holds a prefix of the cached tokens, otherwise start over
+    size_t n_saved = 0;
+    if (path == session_path && session_tokens.size() <= embd.size() &&
+        std::equal(session_tokens.begin(), session_tokens.end(), embd.begin())) {
+        n_saved = session_tokens.size();
+    }
+    if (n_saved == 0) {
+        session_file_bytes = 0;
+    }
+    if (n_saved == embd.size() && n_saved > 0) {
+        return true;
+    }
+
+    const llama_pos p0 = (llama_pos) n_saved;
+    const llama_pos p1 = (llama_pos) embd.size();
+    std::vector<uint8_t> state;
+    if (p1 > p0) {
+        const llama_seq_id staging = session_staging_seq_id;
+        llama_kv_self_seq_rm(ctx, staging, -1, -1);
+        llama_kv_self_seq_cp(ctx, 0, staging, p0, p1);
+        state.resize(llama_state_seq_get_size(ctx, staging));
+        const size_t n_written = llama_state_seq_get_data(ctx, state.data(), state.size(), staging);
+        llama_kv_self_seq_rm(ctx, staging, -1, -1);
+        if (n_written != state.size()) {
+            LOG_ERROR("Failed to copy session state for positions [%d, %d)", p0, p1);
+            return false;
+        }
+    }
+
+    FILE *file = fopen(path.c_str(), n_saved > 0 ? "r+b" : "wb");
+    if (!file) {
+        LOG_ERROR("Failed to open session file '%s' for writing", path.c_str());
+        return false;
+    }
+
+    bool ok = fseek(file, session_file_bytes, SEEK_SET) == 0;
+    if (ok && p1 > p0) {
+        const session_record_header header = {
+            CACTUS_SESSION_MAGIC, CACTUS_SESSION_VERSION, (uint32_t) p0, (uint32_t) (p1 - p0), (uint64_t) state.size()
+        };
+        ok = fwrite(&header, sizeof(header), 1, file) == 1 &&
+             fwrite(embd.data() + p0, sizeof(llama_token), p1 - p0, file) == (size_t) (p1 - p0) &&
+             fwrite(state.data(), 1, state.size(), file) == state.size();
+    }
+    const long file_bytes = ftell(file);
+    ok = fclose(file) == 0 && ok;
+    if (!ok) {
+        LOG_ERROR("Failed to write session file '%s'", path.c_str());
+        session_path.clear();
+        session_tokens.clear();
+        return false;
+    }
+
+    // Drop stale records left behind by a previously restored, longer file
+    std::error_code ec;
+    if (std::filesystem::file_size(path, ec) > (uintmax_t) file_bytes && !ec) {
+        std::filesystem::resize_file(path, (uintmax_t) file_bytes, ec);
+    }
+
+    session_path = path;
+    session_tokens.assign(embd.begin(), embd.end());
+    session_file_bytes = file_bytes;
+    LOG_VERBOSE("Session saved to '%s': %d new tokens, %zu total", path.c_str(), p1 - p0, session_tokens.size());
+    return true;
+}
+
+int cactus_context::loadSession(const std::string &path, const std::vector<llama_token> &prompt_tokens) {
+    if (!ctx || !model) {
+        LOG_ERROR("Model not loaded. Cannot load session.");
+        return -1;
+    }
+    if (llama_model_is_recurrent(model)) {
+        LOG_ERROR("Session files are not supported for recurrent models");
+        return -1;
+    }
+
+    FILE *file = fopen(path.c_str(), "rb");
+    if (!file) {
+        LOG_ERROR("Failed to open session file '%s'", path.c_str());
+        return -1;
+    }
+
+    std::vector<session_record> records;
+    std::vector<llama_token> file_tokens;
+    const long valid_bytes = read_session_index(file, records, file_tokens);
+
+    // Only the part of the session that the upcoming prompt can reuse is worth restoring
+    size_t n_target = file_tokens.size();
+    if (!prompt_tokens.empty()) {
+        n_target = std::min(n_target, common_part(file_tokens, prompt_tokens));
+    }
+    n_target = std::min(n_target, (size_t) llama_n_ctx(ctx));
+
+    // Cells already resident in the KV cache are kept as they are
+    size_t n_restored = std::min(common_part(embd, file_tokens), n_target);
+    if (!llama_kv_self_seq_rm(ctx, 0, (llama_pos) n_restored, -1)) {
+        llama_kv_self_seq_rm(ctx, 0, -1, -1);
+        n_restored = 0;
+    }
+    embd.resize(n_restored);
+
+    const llama_seq_id staging = session_staging_seq_id;
+    std::vector<uint8_t> state;
+    for (const session_record &record : records) {
+        const size_t r0 = record.p0;
+        const size_t r1 = record.p0 + record.n_tokens;
+        if (r1 <= n_restored) {
+            continue;
+        }
+        if (r0 >= n_target) {
+            break;
+        }
+
+        state.resize(record.state_size);
+        if (fseek(file, record.state_offset, SEEK_SET) != 0 ||
+            fread(state.data(), 1, state.size(), file) != state.size()) {
+            LOG_ERROR("Failed to read session record at position %zu", r0);
+            break;
+        }
+
+        // Records restore into a staging sequence (restoring into seq 0 would replace it) and
+        // only the still-missing positions are copied over
+        if (llama_state_seq_set_data(ctx, state.data(), state.size(), staging) == 0) {
+            LOG_WARNING("Not enough KV cache space to restore session record at position %zu", r0);
+            llama_kv_self_seq_rm(ctx, staging, -1, -1);
+            break;
+        }
+        const size_t end = std::min(r1, n_target);
+        llama_kv_self_seq_cp(ctx, staging, 0, (llama_pos) n_restored, (llama_pos) end);
+        llama_kv_self_seq_rm(ctx, staging, -1, -1);
+
+        embd.insert(embd.end(), file_tokens.begin() + n_restored, file_tokens.begin() + end);
+        n_restored = end;
+    }
+    fclose(file);
+
+    // The next save appends to this file as long as it still holds a prefix of the cache
+    session_path = path;
+    session_tokens = file_tokens;
+    session_file_bytes = valid_bytes;
+
+    LOG_INFO("Session '%s': restored %zu of %zu tokens", path.c_str(), n_restored, file_tokens.size());
+    return (int) n_restored;
+}
+
+bool cactus_context::saveGrammarCache(const std::string &path) {
+    if (!model) {
+        LOG_ERROR("Model not loaded. Cannot save grammar cache.");
+        return false;
+    }
+    return llama_grammar_cache_save(llama_model_get_vocab(model), path.c_str());
+}
+
+bool cactus_context::loadGrammarCache(const std::string &path) {
+    if (!model) {
+        LOG_ERROR("Model not loaded. Cannot load grammar cache.");
+        return false;
+    }
+    return llama_grammar_cache_load(llama_model_get_vocab(model), path.c_str());
+}
+
+} // namespace cactus
@@ -0,0 +1,320 @@
+#include "cactus.h"
+#include "common.h"
+#include "llama.h"
+#include <algorithm>
+#include <cstring>
+#include <vector>
+#include <string>
+
+namespace cactus {
+
+// Draft and target vocabularies may differ by a few added tokens (same as llama.cpp's speculative example)
+#define SPEC_VOCAB_MAX_SIZE_DIFFERENCE  128
+#define SPEC_VOCAB_CHECK_START_TOKEN_ID 5
+
+/**
+ * @brief Checks that draft tokens can be verified by the target model as-is
+ *
+ * @param vocab_tgt Target model vocabulary
+ * @param vocab_dft Draft model vocabulary
+ * @return true if both vocabularies tokenize identically
+ */
+static bool vocabs_are_compatible(const llama_vocab *vocab_tgt, const llama_vocab *vocab_dft) {
+    if (llama_vocab_type(vocab_tgt) != llama_vocab_type(vocab_dft)) {
+        LOG_ERROR("Draft model vocab type must match target model vocab type");
+        return false;
+    }
+
+    if (llama_vocab_get_add_bos(vocab_tgt) != llama_vocab_get_add_bos(vocab_dft) ||
+        llama_vocab_get_add_eos(vocab_tgt) != llama_vocab_get_add_eos(vocab_dft) ||
+        llama_vocab_bos(vocab_tgt) != llama_vocab_bos(vocab_dft) ||
+        llama_vocab_eos(vocab_tgt) != llama_vocab_eos(vocab_dft)) {
+        LOG_ERROR("Draft model special tokens must match target model special tokens");
+        return false;
+    }
+
+    const int n_vocab_tgt = llama_vocab_n_tokens(vocab_tgt);
+    const int n_vocab_dft = llama_vocab_n_tokens(vocab_dft);
+    if (std::abs(n_vocab_tgt - n_vocab_dft) > SPEC_VOCAB_MAX_SIZE_DIFFERENCE) {
+        LOG_ERROR("Draft model vocab size (%d) differs too much from target model vocab size (%d)", n_vocab_dft, n_vocab_tgt);
+        return false;
+    }
+
+    for (int i = SPEC_VOCAB_CHECK_START_TOKEN_ID; i < std::min(n_vocab_tgt, n_vocab_dft); ++i) {
+        const char *token_text_tgt = llama_vocab_get_text(vocab_tgt, i);
+        const char *token_text_dft = llama_vocab_get_text(vocab_dft, i);
+        if (std::strcmp(token_text_tgt, token_text_dft) != 0) {
+            LOG_ERROR("Draft model token %d ('%s') differs from target model token ('%s')", i, token_text_dft, token_text_tgt);
+            return false;
+        }
+    }
+    return true;
+}
+
+
+/**
+ * @brief Loads the draft model used for speculative decoding
+ *
+ * @param spec_params Speculative decoding parameters (draft model path, n_max, n_min, p_min, n_ctx)
+ * @return true if loading succeeded, false otherwise
+ */
+bool cactus_context::loadDraftModel(const common_params_speculative &spec_params) {
+    freeDraftModel();
+
+    if (!model || !ctx) {
+        LOG_ERROR("Target model must be loaded before the draft model.");
+        return false;
+    }
+    if (spec_params.model.path.empty()) {
+        LOG_ERROR("Draft model path is empty.");
+        return false;
+    }
+    params.speculative = spec_params;
+
+    LOG_INFO("Loading draft model from: %s", spec_params.model.path.c_str());
+
+    auto mparams = llama_model_default_params();
+    mparams.n_gpu_layers = spec_params.n_gpu_layers >= 0 ? spec_params.n_gpu_layers : params.n_gpu_layers;
+    mparams.main_gpu     = params.main_gpu;
+    mparams.split_mode   = params.split_mode;
+    mparams.use_mmap     = params.use_mmap;
+    mparams.use_mlock    = params.use_mlock;
+
+    draft_model = llama_model_load_from_file(spec_params.model.path.c_str(), mparams);
+    if (draft_model == nullptr) {
+        LOG_ERROR("Failed to load draft model from '%s'", spec_params.model.path.c_str());
+        return false;
+    }
+
+    if (!vocabs_are_compatible(llama_model_get_vocab(model), llama_model_get_vocab(draft_model))) {
+        freeDraftModel();
+        return false;
+    }
+
+    const int n_threads = spec_params.cpuparams.n_threads > 0 ? spec_params.cpuparams.n_threads : params.cpuparams.n_threads;
+
+    auto cparams = llama_context_default_params();
+    cparams.n_ctx           = spec_params.n_ctx > 0 ? spec_params.n_ctx : n_ctx;
+    cparams.n_batch         = params.n_batch;
+    cparams.n_ubatch        = params.n_ubatch;
+    cparams.n_threads       = n_threads;
+    cparams.n_threads_batch = n_threads;
+    cparams.flash_attn      = params.flash_attn;
+    cparams.type_k          = params.cache_type_k;
+    cparams.type_v          = params.cache_type_v;
+    cparams.no_perf         = true;
+
+    draft_ctx = llama_init_from_model(draft_model, cparams);
+    if (draft_ctx == nullptr) {
+        LOG_ERROR("Failed to create context for draft model '%s'", spec_params.model.path.c_str());
+        freeDraftModel();
+        return false;
+    }
+
+    // Drafting is greedy: only the most likely candidates (and their probability) are needed
+    common_params_sampling draft_sparams;
+    draft_sparams.no_perf = true;
+    draft_sparams.top_k = 10;
+    draft_sparams.samplers = { COMMON_SAMPLER_TYPE_TOP_K };
+    draft_sampling = common_sampler_init(draft_model, draft_sparams);
+    if (draft_sampling == nullptr) {
+        LOG_ERROR("Failed to initialize draft sampler.");
+        freeDraftModel();
+        return false;
+    }
+
+    LOG_INFO("Draft model '%s' loaded successfully (n_max = %d, n_min = %d, p_min = %.2f).",
+        spec_params.model.path.c_str(), spec_params.n_max, spec_params.n_min, spec_params.p_min);
+    return true;
+}
+
+
+/**
+ * @brief Frees the draft model, its context and sampler
+ */
+void cactus_context::freeDraftModel() {
+    if (draft_sampling != nullptr) {
+        common_sampler_free(draft_sampling);
+        draft_sampling = nullptr;
+    }
+    if (draft_ctx != nullptr) {
+        llama_free(draft_ctx);
+        draft_ctx = nullptr;
+    }
+    if (draft_model != nullptr) {
+        llama_model_free(draft_model);
+        draft_model = nullptr;
+    }
+    draft_embd.clear();
+    draft_n_cut = 0;
+    spec_id_last = LLAMA_TOKEN_NULL;
+    spec_pending.clear();
+}
+
+
+/**
+ * @brief Whether nextToken can use speculative decoding for the current generation
+ */
+bool cactus_context::canSpeculate() const {
+    return draft_ctx != nullptr
+        && params.speculative.n_max > 0
+        && params.sampling.n_probs == 0               // per-token probabilities are not tracked for drafts
+        && (embd.empty() || embd.front() != LLAMA_TOKEN_NULL); // multimodal positions cannot be drafted
+}
+
+
+/**
+ * @brief Drafts up to n_draft_max tokens continuing embd + id_last with the draft model
+ *
+ * The draft KV cache mirrors draft_embd, so only the part of the target context that the
+ * draft model has not seen yet is evaluated.
+ *
+ * @param id_last Last accepted token (not yet in embd)
+ * @param n_draft_max Maximum number of tokens to draft
+ * @return Drafted tokens, possibly empty
+ */
+std::vector<llama_token> cactus_context::draftTokens(llama_token id_last, int n_draft_max) {
+    std::vector<llama_token> draft;
+    if (n_draft_max <= 0) {
+        return draft;
+    }
+
+    std::vector<llama_token> context_tokens = embd;
+    context_tokens.push_back(id_last);
+
+    // A draft context smaller than the target sees embd from draft_n_cut on. The cut only moves
+    // when the window is full, and then by half the window, so that draft_embd keeps sharing a
+    // prefix with the context and the draft cache is shifted instead of recomputed.
+    const int n_ctx_dft = (int) llama_n_ctx(draft_ctx);
+    size_t n_cut = std::min(draft_n_cut, embd.size());
+    if ((int) context_tokens.size() + n_draft_max < n_ctx_dft) {
+        n_cut = 0; // the whole context fits again (new prompt or context eviction)
+    } else if ((int) (context_tokens.size() - n_cut) + n_draft_max >= n_ctx_dft) {
+        const size_t n_keep_dft = std::max(1, n_ctx_dft / 2);
+        const size_t n_cut_new = std::max(n_cut, context_tokens.size() - std::min(n_keep_dft, context_tokens.size()));
+        const size_t n_discard = n_cut_new - n_cut;
+
+        if (n_discard > 0 && n_discard < draft_embd.size() && llama_kv_self_can_shift(draft_ctx) &&
+            llama_kv_self_seq_rm(draft_ctx, 0, 0, (llama_pos) n_discard)) {
+            llama_kv_self_seq_add(draft_ctx, 0, (llama_pos) n_discard, -1, -(llama_pos) n_discard);
+            draft_embd.erase(draft_embd.begin(), draft_embd.begin() + n_discard);
+        } else if (n_discard > 0) {
+            llama_kv_self_seq_rm(draft_ctx, 0, -1, -1);
+            draft_embd.clear();
+        }
+        n_cut = n_cut_new;
+    }
+    draft_n_cut = n_cut;
+    context_tokens.erase(context_tokens.begin(), context_tokens.begin() + n_cut);
+
+    n_draft_max = std::min(n_draft_max, n_ctx_dft - (int) context_tokens.size() - 1);
+    if (n_draft_max <= 0) {
+        return draft;
+    }
+
+    size_t n_reuse = common_part(draft_embd, context_tokens);
+    if (n_reuse == context_tokens.size()) {
+        n_reuse--; // evaluate the last token again to get logits
+    }
+    if (!llama_kv_self_seq_rm(draft_ctx, 0, n_reuse, -1)) {
+        llama_kv_self_seq_rm(draft_ctx, 0, -1, -1);
+        n_reuse = 0;
+    }
+    draft_embd.assign(context_tokens.begin(), context_tokens.begin() + n_reuse);
+
+    while (draft_embd.size() < context_tokens.size()) {
+        const int n_eval = std::min((int) (context_tokens.size() - draft_embd.size()), params.n_batch);
+        if (llama_decode(draft_ctx, llama_batch_get_one(&context_tokens[draft_embd.size()], n_eval)) != 0) {
+            LOG_WARNING("draftTokens: failed to eval draft context, n_eval: %d", n_eval);
+            draft_embd.clear();
+            llama_kv_self_seq_rm(draft_ctx, 0, -1, -1);
+            return draft;
+        }
+        draft_embd.insert(draft_embd.end(), context_tokens.begin() + draft_embd.size(), context_tokens.begin() + draft_embd.size() + n_eval);
+        n_draft_prefill += n_eval;
+    }
+
+    common_sampler_reset(draft_sampling);
+
+    for (int i = 0; i < n_draft_max; ++i) {
+        common_sampler_sample(draft_sampling, draft_ctx, -1, true);
+        const llama_token_data_array *cur_p = common_sampler_get_candidates(draft_sampling);
+
+        // Stop drafting as soon as the draft model is unsure
+        if (cur_p->size == 0 || cur_p->data[0].p < params.speculative.p_min) {
+            break;
+        }
+
+        const llama_token id = cur_p->data[0].id;
+        common_sampler_accept(draft_sampling, id, true);
+        draft.push_back(id);
+
+        if (i + 1 == n_draft_max || llama_vocab_is_eog(llama_model_get_vocab(draft_model), id)) {
+            break;
+        }
+
+        llama_token id_eval = id;
+        if (llama_decode(draft_ctx, llama_batch_get_one(&id_eval, 1)) != 0) {
+            break;
+        }
+        draft_embd.push_back(id);
+    }
+
+    return draft;
+}
+
+
+/**
+ * @brief Runs one speculative decoding round
+ *
+ * Decodes spec_id_last together with the drafted tokens in one target batch, then accepts
+ * the longest prefix the target sampler agrees with (plus the target's own next token).
+ * Verified tokens are appended to embd; the last accepted token becomes the new
+ * spec_id_last and is decoded in the next round.
+ *
+ * @return Accepted tokens (at least one), or an empty vector on decode failure
+ */
+std::vector<llama_token> cactus_context::speculativeStep() {
+    // Leave room for the verification batch in the context and for the prediction budget
+    int n_draft_max = params.speculative.n_max;
+    n_draft_max = std::min(n_draft_max, n_ctx - (int) n_past - 2);
+    if (params.n_predict != -1) {
+        n_draft_max = std::min(n_draft_max, (int) n_remain - 1);
+    }
+    n_draft_max = std::min(n_draft_max, params.n_batch - 1);
+
+    std::vector<llama_token> draft = draftTokens(spec_id_last, n_draft_max);
+    if ((int) draft.size() < params.speculative.n_min) {
+        draft.clear();
+    }
+
+    llama_batch batch = llama_batch_init(draft.size() + 1, 0, 1);
+    llama_batch_add(&batch, spec_id_last, (llama_pos) n_past, {0}, true);
+    for (size_t i = 0; i < draft.size(); ++i) {
+        llama_batch_add(&batch, draft[i], (llama_pos) (n_past + 1 + i), {0}, true);
+    }
+
+    const int ret = llama_decode(ctx, batch);
+    llama_batch_free(batch);
+    if (ret != 0) {
+        LOG_ERROR("speculativeStep: failed to eval draft batch of %zu tokens at n_past %zu", draft.size() + 1, n_past);
+        return {};
+    }
+
+    std::vector<llama_token> ids = common_sampler_sample_and_accept_n(ctx_sampling, ctx, draft);
+
+    // spec_id_last and the accepted drafts are now valid KV entries; rejected drafts are dropped
+    embd.push_back(spec_id_last);
+    embd.insert(embd.end(), ids.begin(), ids.end() - 1);
+    n_past = embd.size();
+    llama_kv_self_seq_rm(ctx, 0, n_past, -1);
+
+    n_drafted += draft.size();
+    n_draft_accepted += ids.size() - 1;
+    spec_id_last = ids.back();
+
+    LOG_VERBOSE("speculative step: drafted %zu, accepted %zu, n_past: %zu", draft.size(), ids.size() - 1, n_past);
+    return ids;
+}
+
+} // namespace cactus
@@ -1,5 +1,6 @@
 #define _USE_MATH_DEFINES 
 #include "cactus.h"
+#include "cactus_tts.h"
 #include "common.h"
 #include "llama.h"
 #include "ggml.h"
@@ -12,6 +13,9 @@
 #include <cmath> 
 #include <algorithm> 
 #include <thread> 
+#include <functional>
+#include <memory>
+#include <mutex>
 #include <map>  
 #include <regex>  
 #include <iomanip>
@@ -98,176 +102,333 @@ namespace tts_internal {
         }
     }
 
-    // very poor-man fft helper
-    static void twiddle(float * real, float * imag, int k, int N) {
-        float angle = 2.0f * M_PI * k / N;
-        *real = cosf(angle);
-        *imag = sinf(angle);
-    }
-
-    static void irfft(int n, const float * inp_cplx, float * out_real) {
-        int N = n / 2 + 1;
-
-        std::vector<float> real_input(N);
-        std::vector<float> imag_input(N);
-        for (int i = 0; i < N; ++i) {
-            real_input[i] = inp_cplx[2 * i];
-            imag_input[i] = inp_cplx[2 * i + 1];
+    irfft_plan::irfft_plan(int n) : n(n), m(n / 2) {
+        window.resize(n);
+        fill_hann_window(n, true, window.data());
+        window_sq.resize(n);
+        for (int i = 0; i < n; ++i) {
+            window_sq[i] = window[i] * window[i];
         }
 
-        std::vector<float> real_output(n);
-        std::vector<float> imag_output(n);
-
-        for (int k_loop = 0; k_loop < n; ++k_loop) { 
-            real_output[k_loop] = 0.0f;
-            imag_output[k_loop] = 0.0f;
-            for (int m = 0; m < N; ++m) {
-                float twiddle_real;
-                float twiddle_imag;
-
-                twiddle(&twiddle_real, &twiddle_imag, k_loop * m, n);
-
-                real_output[k_loop] += real_input[m] * twiddle_real - imag_input[m] * twiddle_imag;
-                imag_output[k_loop] += real_input[m] * twiddle_imag + imag_input[m] * twiddle_real;
-            }
+        post_re.resize(m);
+        post_im.resize(m);
+        for (int k = 0; k < m; ++k) {
+            const double a = 2.0 * M_PI * k / n;
+            post_re[k] = (float) cos(a);
+            post_im[k] = (float) sin(a);
         }
 
-        for (int i = 0; i < n; ++i) {
-            out_real[i] = real_output[i] / N;
+        // factor m, preferring radix 4
+        std::vector<int> radices;
+        int rest = m;
+        for (int p : {4, 2, 3, 5}) {
+            while (rest % p == 0) {
+                radices.push_back(p);
+                rest /= p;
+            }
         }
-    }
-
-    static void fold(
-        const std::vector<float> & data, // Input data (e.g., STFT frames after iFFT and windowing)
-        int64_t n_out,                   // Expected total output samples (before final padding removal)
-        int64_t n_win,                   // Window length used for STFT/iSTFT
-        int64_t n_hop,                   // Hop length used for STFT/iSTFT
-        int64_t n_pad,                   // Padding applied on each side of the frames (e.g. (n_win - n_hop)/2)
-        std::vector<float> & output      // Output folded audio
-    ) {
-        output.assign(n_out, 0.0f);
-        int64_t current_data_ptr = 0;
-
-        // Calculate num_frames based on data size and window length. This assumes data is concatenated frames.
-        int num_frames = (n_win > 0) ? (data.size() / n_win) : 0;
-
-        if (n_win > 0 && data.size() % n_win != 0) {
-            LOG_WARNING("Fold: data size (%zu) is not a multiple of window length (%lld). Results might be incorrect.", data.size(), (long long)n_win);
+        for (int p = 7; rest > 1; p += 2) {
+            while (rest % p == 0) {
+                radices.push_back(p);
+                rest /= p;
+            }
         }
 
-        for (int frame_idx = 0; frame_idx < num_frames; ++frame_idx) {
-            int64_t frame_output_start_pos = frame_idx * n_hop; 
-
-            for (int i = 0; i < n_win; ++i) {
-                int64_t target_idx = frame_output_start_pos + i;
-
-                if (target_idx < n_out && current_data_ptr < (int64_t)data.size()) {
-                     output[target_idx] += data[current_data_ptr];
+        int n_cur = m;
+        int stride = 1;
+        for (int p : radices) {
+            stage st;
+            st.radix = p;
+            st.l = n_cur / p;
+            st.stride = stride;
+            st.tw_re.resize((size_t) st.l * p);
+            st.tw_im.resize((size_t) st.l * p);
+            for (int j = 0; j < st.l; ++j) {
+                for (int q = 0; q < p; ++q) {
+                    const double a = 2.0 * M_PI * ((int64_t) j * q % n_cur) / n_cur;
+                    st.tw_re[(size_t) j * p + q] = (float) cos(a);
+                    st.tw_im[(size_t) j * p + q] = (float) sin(a);
+                }
+            }
+            if (p > 5) {
+                st.root_re.resize(p);
+                st.root_im.resize(p);
+                for (int q = 0; q < p; ++q) {
+                    st.root_re[q] = (float) cos(2.0 * M_PI * q / p);
+                    st.root_im[q] = (float) sin(2.0 * M_PI * q / p);
                 }
-                current_data_ptr++;
             }
+            stages.push_back(std::move(st));
+            n_cur /= p;
+            stride *= p;
         }
+    }
 
-        if (n_out > 2 * n_pad) {
-             std::vector<float> temp_output(output.begin() + n_pad, output.begin() + (n_out - n_pad) );
-             output = temp_output;
-        } else if (n_out > 0) { 
-            LOG_WARNING("Fold: n_out (%lld) <= 2*n_pad (%lld), cannot trim padding. Output might be empty or incorrect.", (long long)n_out, (long long)(2*n_pad));
+    void irfft_plan::run_stage(const stage & st, const float * xr, const float * xi, float * yr, float * yi) {
+        const int p = st.radix;
+        const int l = st.l;
+        const int s = st.stride;
+        const size_t ls = (size_t) l * s;
+
+        for (int j = 0; j < l; ++j) {
+            const float * twr = st.tw_re.data() + (size_t) j * p;
+            const float * twi = st.tw_im.data() + (size_t) j * p;
+            const float * ar = xr + (size_t) j * s;
+            const float * ai = xi + (size_t) j * s;
+            float * br = yr + (size_t) j * p * s;
+            float * bi = yi + (size_t) j * p * s;
+
+            if (p == 2) {
+                for (int k = 0; k < s; ++k) {
+                    const float a0r = ar[k],      a0i = ai[k];
+                    const float a1r = ar[k + ls], a1i = ai[k + ls];
+                    const float dr = a0r - a1r,   di = a0i - a1i;
+                    br[k]     = a0r + a1r;
+                    bi[k]     = a0i + a1i;
+                    br[k + s] = dr * twr[1] - di * twi[1];
+                    bi[k + s] = dr * twi[1] + di * twr[1];
+                }
+            } else if (p == 4) {
+                for (int k = 0; k < s; ++k) {
+                    const float a0r = ar[k],          a0i = ai[k];
+                    const float a1r = ar[k + ls],     a1i = ai[k + ls];
+                    const float a2r = ar[k + 2 * ls], a2i = ai[k + 2 * ls];
+                    const float a3r = ar[k + 3 * ls], a3i = ai[k + 3 * ls];
+                    const float t0r = a0r + a2r, t0i = a0i + a2i;
+                    const float t1r = a0r - a2r, t1i = a0i - a2i;
+                    const float t2r = a1r + a3r, t2i = a1i + a3i;
+                    // i * (a1 - a3) for the inverse direction
+                    const float t3r = -(a1i - a3i), t3i = a1r - a3r;
+                    const float c1r = t1r + t3r, c1i = t1i + t3i;
+                    const float c2r = t0r - t2r, c2i = t0i - t2i;
+                    const float c3r = t1r - t3r, c3i = t1i - t3i;
+                    br[k]         = t0r + t2r;
+                    bi[k]         = t0i + t2i;
+                    br[k + s]     = c1r * twr[1] - c1i * twi[1];
+                    bi[k + s]     = c1r * twi[1] + c1i * twr[1];
+                    br[k + 2 * s] = c2r * twr[2] - c2i * twi[2];
+                    bi[k + 2 * s] = c2r * twi[2] + c2i * twr[2];
+                    br[k + 3 * s] = c3r * twr[3] - c3i * twi[3];
+                    bi[k + 3 * s] = c3r * twi[3] + c3i * twr[3];
+                }
+            } else if (p == 3) {
+                const float c = -0.5f;
+                const float d = 0.86602540378443864676f; // sin(2*pi/3)
+                for (int k = 0; k < s; ++k) {
+                    const float a0r = ar[k],          a0i = ai[k];
+                    const float a1r = ar[k + ls],     a1i = ai[k + ls];
+                    const float a2r = ar[k + 2 * ls], a2i = ai[k + 2 * ls];
+                    const float sr = a1r + a2r, si = a1i + a2i;
+                    const float mr = a0r + c * sr, mi = a0i + c * si;
+                    const float nr = -d * (a1i - a2i), ni = d * (a1r - a2r);
+                    const float c1r = mr + nr, c1i = mi + ni;
+                    const float c2r = mr - nr, c2i = mi - ni;
+                    br[k]         = a0r + sr;
+                    bi[k]         = a0i + si;
+                    br[k + s]     = c1r * twr[1] - c1i * twi[1];
+                    bi[k + s]     = c1r * twi[1] + c1i * twr[1];
+                    br[k + 2 * s] = c2r * twr[2] - c2i * twi[2];
+                    bi[k + 2 * s] = c2r * twi[2] + c2i * twr[2];
+                }
+            } else if (p == 5) {
+                const float c1 =  0.30901699437494742410f; // cos(2*pi/5)
+                const float c2 = -0.80901699437494742410f; // cos(4*pi/5)
+                const float s1 =  0.95105651629515357212f; // sin(2*pi/5)
+                const float s2 =  0.58778525229247312917f; // sin(4*pi/5)
+                for (int k = 0; k < s; ++k) {
+                    const float a0r = ar[k],          a0i = ai[k];
+                    const float a1r = ar[k + ls],     a1i = ai[k + ls];
+                    const float a2r = ar[k + 2 * ls], a2i = ai[k + 2 * ls];
+                    const float a3r = ar[k + 3 * ls], a3i = ai[k + 3 * ls];
+                    const float a4r = ar[k + 4 * ls], a4i = ai[k + 4 * ls];
+                    const float p1r = a1r + a4r, p1i = a1i + a4i;
+                    const float q1r = a1r - a4r, q1i = a1i - a4i;
+                    const float p2r = a2r + a3r, p2i = a2i + a3i;
+                    const float q2r = a2r - a3r, q2i = a2i - a3i;
+                    const float m1r = a0r + c1 * p1r + c2 * p2r, m1i = a0i + c1 * p1i + c2 * p2i;
+                    const float m2r = a0r + c2 * p1r + c1 * p2r, m2i = a0i + c2 * p1i + c1 * p2i;
+                    // i * (s1 * q1 + s2 * q2) and i * (s2 * q1 - s1 * q2)
+                    const float n1r = -(s1 * q1i + s2 * q2i), n1i = s1 * q1r + s2 * q2r;
+                    const float n2r = -(s2 * q1i - s1 * q2i), n2i = s2 * q1r - s1 * q2r;
+                    const float b1r = m1r + n1r, b1i = m1i + n1i;
+                    const float b4r = m1r - n1r, b4i = m1i - n1i;
+                    const float b2r = m2r + n2r, b2i = m2i + n2i;
+                    const float b3r = m2r - n2r, b3i = m2i - n2i;
+                    br[k]         = a0r + p1r + p2r;
+                    bi[k]         = a0i + p1i + p2i;
+                    br[k + s]     = b1r * twr[1] - b1i * twi[1];
+                    bi[k + s]     = b1r * twi[1] + b1i * twr[1];
+                    br[k + 2 * s] = b2r * twr[2] - b2i * twi[2];
+                    bi[k + 2 * s] = b2r * twi[2] + b2i * twr[2];
+                    br[k + 3 * s] = b3r * twr[3] - b3i * twi[3];
+                    bi[k + 3 * s] = b3r * twi[3] + b3i * twr[3];
+                    br[k + 4 * s] = b4r * twr[4] - b4i * twi[4];
+                    bi[k + 4 * s] = b4r * twi[4] + b4i * twr[4];
+                }
+            } else {
+                // generic odd radix: direct p-point DFT per butterfly
+                const float * root_re = st.root_re.data();
+                const float * root_im = st.root_im.data();
+                for (int k = 0; k < s; ++k) {
+                    for (int q = 0; q < p; ++q) {
+                        float sum_r = 0.0f;
+                        float sum_i = 0.0f;
+                        for (int r = 0; r < p; ++r) {
+                            const int e = (r * q) % p;
+                            const float xr_ = ar[k + r * ls];
+                            const float xi_ = ai[k + r * ls];
+                            sum_r += xr_ * root_re[e] - xi_ * root_im[e];
+                            sum_i += xr_ * root_im[e] + xi_ * root_re[e];
+                        }
+                        br[k + q * s] = sum_r * twr[q] - sum_i * twi[q];
+                        bi[k + q * s] = sum_r * twi[q] + sum_i * twr[q];
+                    }
+                }
+            }
         }
     }
 
+    void irfft_plan::execute(const float * inp_cplx, float * out_real, float * scratch) const {
+        float * xr = scratch;
+        float * xi = scratch + m;
+        float * yr = scratch + 2 * m;
+        float * yi = scratch + 3 * m;
+
+        // Pack the half spectrum into an m-point complex sequence whose inverse transform
+        // interleaves the even and odd output samples. DC and Nyquist enter with their real
+        // part only, doubled, which reproduces the reference transform
+        //   out[t] = Re(sum_{k <= n/2} X[k] * e^(2*pi*i*k*t/n)) / (n/2 + 1)
+        // up to the 1/2 applied in the final scale.
+        for (int k = 0; k < m; ++k) {
+            const float zr  = k == 0 ? 2.0f * inp_cplx[0] : inp_cplx[2 * k];
+            const float zi  = k == 0 ? 0.0f : inp_cplx[2 * k + 1];
+            const float zcr = k == 0 ? 2.0f * inp_cplx[2 * m] : inp_cplx[2 * (m - k)];
+            const float zci = k == 0 ? 0.0f : -inp_cplx[2 * (m - k) + 1];
+            const float er = zr + zcr, ei = zi + zci;
+            const float dr = zr - zcr, di = zi - zci;
+            const float or_ = dr * post_re[k] - di * post_im[k];
+            const float oi  = dr * post_im[k] + di * post_re[k];
+            xr[k] = er - oi;
+            xi[k] = ei + or_;
+        }
 
-    static std::vector<float> embeddings_to_audio_samples(
-        const float * embeddings_ptr,     // Pointer to the flat embedding data
-        int num_frames,                   // Number of frames (n_codes in tts.cpp)
-        int frame_embedding_dim,          // Dimension of embedding per frame (n_embd in tts.cpp)
-        llama_model * vocoder_model,      // Vocoder model (not directly used in original tts.cpp's embd_to_audio, but good to have if params are from it)
-        llama_context * vocoder_ctx,      // Vocoder context (similarly, not directly used by original)
-        int n_threads,
-        int& out_sample_rate
-    ) {
-        LOG_INFO("embeddings_to_audio_samples: num_frames=%d, frame_embedding_dim=%d", num_frames, frame_embedding_dim);
-
-        const int n_fft = 1280;
-        const int n_hop = 320;
-        const int n_win = n_fft;
-        const int n_pad = (n_win - n_hop) / 2;
-        const int64_t n_out_padded = (num_frames > 0) ? (static_cast<int64_t>(num_frames - 1) * n_hop + n_win) : 0;
+        for (const stage & st : stages) {
+            run_stage(st, xr, xi, yr, yi);
+            std::swap(xr, yr);
+            std::swap(xi, yi);
+        }
 
-        if (num_frames == 0 || frame_embedding_dim == 0) {
-            LOG_WARNING("embeddings_to_audio_samples: No frames or zero embedding dimension. Returning empty audio.");
-            out_sample_rate = 24000; 
-            return {};
+        const float scale = 1.0f / (2.0f * (m + 1));
+        for (int t = 0; t < m; ++t) {
+            out_real[2 * t + 0] = xr[t] * scale;
+            out_real[2 * t + 1] = xi[t] * scale;
         }
-        
-        out_sample_rate = 24000; 
+    }
 
-        std::vector<float> hann_window_coeffs(n_fft);
-        fill_hann_window(n_fft, true, hann_window_coeffs.data()); // Now defined before this call
+    const irfft_plan & get_irfft_plan(int n) {
+        static std::mutex plans_mutex;
+        static std::map<int, std::unique_ptr<irfft_plan>> plans;
 
-        int half_embedding_dim = frame_embedding_dim / 2;
-        if (frame_embedding_dim % 2 != 0) {
-            LOG_WARNING("Frame embedding dimension %d is not even. Vocoding might be incorrect.", frame_embedding_dim);
+        std::lock_guard<std::mutex> lock(plans_mutex);
+        auto & plan = plans[n];
+        if (!plan) {
+            plan.reset(new irfft_plan(n));
         }
+        return *plan;
+    }
 
-        std::vector<float> complex_spectrum_ST(num_frames * frame_embedding_dim);
+    void frames_to_windowed_signal(
+        const irfft_plan & plan,
+        const float * embeddings_ptr,
+        int num_frames,
+        int frame_embedding_dim,
+        int n_threads,
+        float * out
+    ) {
+        const int n_fft = plan.n;
+        const int half_embedding_dim = frame_embedding_dim / 2;
+        // a frame costs a few microseconds, so only split when each thread gets a meaningful share
+        const int min_frames_per_thread = 8;
+        n_threads = std::max(1, std::min(n_threads, num_frames / min_frames_per_thread));
+
+        auto worker = [&](int thread_idx) {
+            std::vector<float> complex_spectrum(std::max(frame_embedding_dim, n_fft + 2), 0.0f);
+            std::vector<float> scratch(4 * plan.m);
+            for (int frame_idx = thread_idx; frame_idx < num_frames; frame_idx += n_threads) {
+                const float * frame = embeddings_ptr + (size_t) frame_idx * frame_embedding_dim;
+                for (int k = 0; k < half_embedding_dim; ++k) {
+                    float mag = expf(frame[k]);
+                    mag = std::min(mag, 100.0f);
+                    const float phi = frame[k + half_embedding_dim];
+                    complex_spectrum[2 * k + 0] = mag * cosf(phi);
+                    complex_spectrum[2 * k + 1] = mag * sinf(phi);
+                }
 
-        for (int frame_idx = 0; frame_idx < num_frames; ++frame_idx) {
-            for (int k = 0; k < half_embedding_dim; ++k) {
-                float mag_log = embeddings_ptr[frame_idx * frame_embedding_dim + k];
-                float phi     = embeddings_ptr[frame_idx * frame_embedding_dim + k + half_embedding_dim];
-                float mag = expf(mag_log);
-                mag = std::min(mag, 100.0f);
-                complex_spectrum_ST[frame_idx * frame_embedding_dim + 2 * k + 0] = mag * cosf(phi);
-                complex_spectrum_ST[frame_idx * frame_embedding_dim + 2 * k + 1] = mag * sinf(phi);
+                float * current_frame_ifft_output = out + (size_t) frame_idx * n_fft;
+                plan.execute(complex_spectrum.data(), current_frame_ifft_output, scratch.data());
+                for (int j = 0; j < n_fft; ++j) {
+                    current_frame_ifft_output[j] *= plan.window[j];
+                }
             }
-        }
-
-        std::vector<float> all_ifft_frames_windowed(num_frames * n_fft);
-        std::vector<float> hann_squared_frames(num_frames * n_fft);
+        };
 
+        if (n_threads == 1) {
+            worker(0);
+            return;
+        }
         std::vector<std::thread> workers(n_threads);
         for (int thread_idx = 0; thread_idx < n_threads; ++thread_idx) {
-            workers[thread_idx] = std::thread([&, thread_idx]() {
-
-                for (int frame_idx = thread_idx; frame_idx < num_frames; frame_idx += n_threads) {
-                    const float* current_frame_complex_spectrum = complex_spectrum_ST.data() + frame_idx * frame_embedding_dim;
-                    float* current_frame_ifft_output = all_ifft_frames_windowed.data() + frame_idx * n_fft;
-                    irfft(n_fft, current_frame_complex_spectrum, current_frame_ifft_output); 
-                    float* current_frame_hann_sq_output = hann_squared_frames.data() + frame_idx * n_fft;
-
-                    for (int j = 0; j < n_fft; ++j) {
-                        current_frame_ifft_output[j] *= hann_window_coeffs[j];
-                        current_frame_hann_sq_output[j] = hann_window_coeffs[j] * hann_window_coeffs[j];
-                    }
-                }
-            });
+            workers[thread_idx] = std::thread(worker, thread_idx);
         }
-        for (int i = 0; i < n_threads; ++i) {
-            if(workers[i].joinable()) workers[i].join();
+        for (auto & w : workers) {
+            if (w.joinable()) w.join();
         }
+    }
 
-        std::vector<float> audio_signal_folded;
-        std::vector<float> window_energy_folded;
-
-        fold(all_ifft_frames_windowed, n_out_padded, n_win, n_hop, n_pad, audio_signal_folded); 
-        fold(hann_squared_frames,      n_out_padded, n_win, n_hop, n_pad, window_energy_folded);
+    overlap_add::overlap_add(const irfft_plan & plan, int n_hop)
+        : plan(plan), n_hop(n_hop), n_pad((plan.n - n_hop) / 2), n_emitted((plan.n - n_hop) / 2) {
+    }
 
-        if (audio_signal_folded.size() != window_energy_folded.size()) {
-            LOG_ERROR("embeddings_to_audio_samples: Mismatch in folded signal size (%zu) and window energy size (%zu). Cannot normalize.", 
-                      audio_signal_folded.size(), window_energy_folded.size());
-            return {};
+    void overlap_add::add(const float * frames, int n) {
+        if (n <= 0) {
+            return;
         }
-
-        for (size_t i = 0; i < audio_signal_folded.size(); ++i) {
-            if (window_energy_folded[i] > 1e-8f) { 
-                audio_signal_folded[i] /= window_energy_folded[i];
-            } else {
-                audio_signal_folded[i] = 0.0f;
+        const int64_t end = (n_frames + n - 1) * n_hop + plan.n;
+        if (end - offset > (int64_t) signal.size()) {
+            signal.resize(end - offset, 0.0f);
+            energy.resize(end - offset, 0.0f);
+        }
+        for (int f = 0; f < n; ++f) {
+            const int64_t base = (n_frames + f) * n_hop - offset;
+            const float * frame = frames + (size_t) f * plan.n;
+            for (int j = 0; j < plan.n; ++j) {
+                signal[base + j] += frame[j];
+                energy[base + j] += plan.window_sq[j];
             }
         }
-        LOG_INFO("Audio synthesized with %zu samples. Sample rate: %d Hz.", audio_signal_folded.size(), out_sample_rate);
-        return audio_signal_folded;
+        n_frames += n;
+    }
+
+    void overlap_add::take(bool final, std::vector<float> & out) {
+        // the next frame starts at n_frames * n_hop; the last frame completes the tail, minus the trailing padding
+        int64_t limit = n_frames * n_hop;
+        if (final && n_frames > 0) {
+            limit = (n_frames - 1) * n_hop + plan.n - n_pad;
+        }
+        if (limit <= n_emitted) {
+            return;
+        }
+        out.reserve(out.size() + (limit - n_emitted));
+        for (int64_t i = n_emitted; i < limit; ++i) {
+            const float e = energy[i - offset];
+            out.push_back(e > 1e-8f ? signal[i - offset] / e : 0.0f);
+        }
+
+        const int64_t n_drop = limit - offset;
+        signal.erase(signal.begin(), signal.begin() + n_drop);
+        energy.erase(energy.begin(), energy.begin() + n_drop);
+        offset = limit;
+        n_emitted = limit;
     }
 
     // --- Text processing functions (adapted from tts.cpp) ---
@@ -586,6 +747,104 @@ namespace tts_internal {
         return result_tokens;
     }
    
+    // --- Streaming vocoder ---
+
+    // Codes are vocoded in windows of STREAM_CHUNK_CODES frames with STREAM_CONTEXT_CODES frames of
+    // context on each side (the vocoder attends over its whole input), and the resulting frames are
+    // overlap-added incrementally, so audio is emitted while codes are still being generated.
+    static const int STREAM_CHUNK_CODES   = 24;
+    static const int STREAM_CONTEXT_CODES = 8;
+    static const int STREAM_WINDOW_CODES  = STREAM_CHUNK_CODES + 2 * STREAM_CONTEXT_CODES;
+
+    struct stream_vocoder {
+        static const int n_fft = 1280;
+        static const int n_hop = 320;
+        static const int sample_rate = 24000;
+
+        llama_model   * model = nullptr;
+        llama_context * ctx   = nullptr;
+        int n_threads = 1;
+        const std::function<bool(const float *, size_t, int)> * on_audio = nullptr;
+
+        std::vector<llama_token> codes;   // offset audio codes generated so far
+        int n_frames_done = 0;            // frames already overlap-added
+        const irfft_plan & plan;         // shared inverse FFT plan and Hann window
+        overlap_add ola;                  // frames waiting for their overlapping neighbours
+        bool stopped = false;             // on_audio asked to stop
+
+        stream_vocoder(llama_model * model, llama_context * ctx, int n_threads,
+                       const std::function<bool(const float *, size_t, int)> & on_audio)
+            : model(model), ctx(ctx), n_threads(n_threads), on_audio(&on_audio), plan(get_irfft_plan(n_fft)), ola(plan, n_hop) {
+        }
+
+        // Vocodes all chunks that have enough lookahead (or everything when final) and emits finished samples
+        bool process(bool final) {
+            while (!stopped) {
+                const int n_avail = (int) codes.size();
+                const int n_todo  = n_avail - n_frames_done;
+                if (n_todo <= 0 || (!final && n_todo < STREAM_CHUNK_CODES + STREAM_CONTEXT_CODES)) {
+                    break;
+                }
+                const int n_chunk = std::min(STREAM_CHUNK_CODES, n_todo);
+                if (!vocode_chunk(n_chunk)) {
+                    return false;
+                }
+                if (!emit(false)) {
+                    break;
+                }
+            }
+            if (final && !stopped) {
+                emit(true);
+            }
+            return true;
+        }
+
+        bool vocode_chunk(int n_chunk) {
+            const int w_start = std::max(0, n_frames_done - STREAM_CONTEXT_CODES);
+            const int w_end   = std::min((int) codes.size(), n_frames_done + n_chunk + STREAM_CONTEXT_CODES);
+
+            llama_batch batch = llama_batch_init(w_end - w_start, 0, 1);
+            for (int i = w_start; i < w_end; ++i) {
+                llama_batch_add(&batch, codes[i], i - w_start, {0}, true);
+            }
+            llama_kv_self_clear(ctx);
+            const int ret = llama_decode(ctx, batch);
+            llama_batch_free(batch);
+            if (ret != 0) {
+                LOG_ERROR("stream_vocoder: llama_decode failed for codes [%d, %d)", w_start, w_end);
+                return false;
+            }
+
+            const float * embd = llama_get_embeddings(ctx);
+            if (!embd) {
+                LOG_ERROR("stream_vocoder: failed to get embeddings from vocoder model.");
+                return false;
+            }
+            const int n_embd = llama_model_n_embd(model);
+
+            std::vector<float> frames((size_t) n_chunk * n_fft);
+            frames_to_windowed_signal(plan, embd + (size_t) (n_frames_done - w_start) * n_embd, n_chunk, n_embd,
+                                      n_threads, frames.data());
+            ola.add(frames.data(), n_chunk);
+            n_frames_done += n_chunk;
+            return true;
+        }
+
+        // Emits the samples the overlap-add has finished (and the tail when final)
+        bool emit(bool final) {
+            std::vector<float> out;
+            ola.take(final, out);
+            if (out.empty()) {
+                return true;
+            }
+            if (!(*on_audio)(out.data(), out.size(), sample_rate)) {
+                stopped = true;
+                return false;
+            }
+            return true;
+        }
+    };
+
 } // namespace tts_internal
 
 
@@ -621,14 +880,11 @@ bool cactus_context::loadVocoderModel(const common_params_vocoder &vocoder_param
 
     auto cparams = llama_context_default_params();
 
-    // Context size for vocoders is usually small or fixed.
-    // This might need to be determined from model metadata or tts.cpp example.
-    // Max codes generated by primary TTS model is params.n_predict.
-    // Vocoder context and batch size should accommodate this.
-    int max_codes = params.n_predict > 0 ? params.n_predict : 768; 
-    cparams.n_ctx   = max_codes > 0 ? (uint32_t)max_codes : 1024;
-    cparams.n_batch = max_codes > 0 ? (uint32_t)max_codes : 1024; 
-    cparams.n_ubatch = max_codes > 0 ? (uint32_t)max_codes : 1024; 
+    // Codes are vocoded in fixed-size windows (see tts_internal::stream_vocoder), so the vocoder
+    // context only has to hold one window regardless of how many codes the TTS model generates.
+    cparams.n_ctx    = tts_internal::STREAM_WINDOW_CODES;
+    cparams.n_batch  = tts_internal::STREAM_WINDOW_CODES;
+    cparams.n_ubatch = tts_internal::STREAM_WINDOW_CODES;
     cparams.attention_type = LLAMA_ATTENTION_TYPE_NON_CAUSAL;
     cparams.embeddings = true; 
     cparams.n_threads = params.cpuparams.n_threads;
@@ -647,15 +903,11 @@ bool cactus_context::loadVocoderModel(const common_params_vocoder &vocoder_param
     return true;
 }
 
-bool cactus_context::synthesizeSpeech(const std::string& text, const std::string& output_wav_path, const std::string& speaker_id_or_path) {
+bool cactus_context::generateAudioCodes(const std::string& text, const std::string& speaker_id_or_path, const std::function<bool(llama_token)>& on_code) {
     if (!this->ctx || !this->model) {
         LOG_ERROR("Primary TTS model or context not loaded. Cannot synthesize speech.");
         return false;
     }
-    if (!this->vocoder_model || !this->vocoder_ctx) {
-         LOG_ERROR("Vocoder model and context must be loaded via loadVocoderModel() first.");
-        return false;
-    }
 
     nlohmann::ordered_json speaker_json;
     std::string actual_speaker_file_path = speaker_id_or_path;
@@ -675,7 +927,6 @@ bool cactus_context::synthesizeSpeech(const std::string& text, const std::string
 
     if (!vocab) { LOG_ERROR("Failed to get vocabulary from primary TTS model."); return false; }
     
-    llama_batch batch = llama_batch_init(params.n_batch, 0, 1);
     std::vector<llama_token> prompt_tokens;
     tts_internal::prompt_initialize(prompt_tokens, vocab);
 
@@ -695,27 +946,29 @@ bool cactus_context::synthesizeSpeech(const std::string& text, const std::string
 
     tts_internal::prompt_add_string(prompt_tokens, vocab, "\n<|audio_start|>\n", true, true);
 
-    if (prompt_tokens.empty()) { LOG_ERROR("Failed to tokenize prompt."); llama_batch_free(batch); return false; }
+    if (prompt_tokens.empty()) { LOG_ERROR("Failed to tokenize prompt."); return false; }
     LOG_INFO("Prompt tokenized into %zu tokens.", prompt_tokens.size());
 
-    for (size_t i = 0; i < prompt_tokens.size(); ++i) {
-        llama_batch_add(&batch, prompt_tokens[i], i, {0}, false);
-    }
+    // The prompt is evaluated in chunks of n_batch, like loadPrompt does for text prompts
+    const int n_batch = (int) llama_n_batch(this->ctx);
+    llama_batch batch = llama_batch_init(n_batch, 0, 1);
 
-    // Ensure logits are requested for the last token of the initial prompt
-    if (batch.n_tokens > 0) {
-        batch.logits[batch.n_tokens - 1] = true;
-    }
-    
     llama_kv_self_clear(this->ctx);
-    if (llama_decode(this->ctx, batch) != 0) {
-        LOG_ERROR("llama_decode failed for initial prompt processing.");
-        llama_batch_free(batch);
-        return false; 
+    this->embd.clear(); // Cached prompt tokens no longer match the KV cache
+    for (size_t i = 0; i < prompt_tokens.size(); i += n_batch) {
+        const size_t n_eval = std::min((size_t) n_batch, prompt_tokens.size() - i);
+        llama_batch_clear(&batch);
+        for (size_t j = 0; j < n_eval; ++j) {
+            // Logits are only needed for the last token of the prompt
+            llama_batch_add(&batch, prompt_tokens[i + j], i + j, {0}, i + j + 1 == prompt_tokens.size());
+        }
+        if (llama_decode(this->ctx, batch) != 0) {
+            LOG_ERROR("llama_decode failed for initial prompt processing at token %zu.", i);
+            llama_batch_free(batch);
+            return false;
+        }
     }
     
-    std::vector<float> tts_model_output_embeddings; 
-    std::vector<llama_token> generated_codes;
     int n_max_codes = params.n_predict > 0 ? params.n_predict : 768;
     int eos_token = llama_vocab_eos(vocab); // Correct non-deprecated version
 
@@ -735,7 +988,11 @@ bool cactus_context::synthesizeSpeech(const std::string& text, const std::string
         LOG_WARNING("Could not tokenize word separator '%s'. Guide token logic might be impaired.", separator_str.c_str());
     }
 
+    // Only tokens from the OuteTTS audio range are codes; they are offset into the vocoder's vocabulary
+    const llama_token audio_code_min = 151672;
+    const llama_token audio_code_max = 155772; // As per original tts.cpp
 
+    size_t n_codes = 0;
     for (int i = 0; i < n_max_codes; ++i) {
         llama_token id = common_sampler_sample(this->ctx_sampling, this->ctx, batch.n_tokens - 1);
 
@@ -750,7 +1007,13 @@ bool cactus_context::synthesizeSpeech(const std::string& text, const std::string
         common_sampler_accept(this->ctx_sampling, id, true);
 
         if (id == eos_token) { LOG_INFO("EOS token encountered during code generation."); break; }
-        generated_codes.push_back(id);
+
+        if (id >= audio_code_min && id <= audio_code_max) {
+            ++n_codes;
+            if (!on_code(id - audio_code_min)) {
+                break;
+            }
+        }
 
         batch.n_tokens = 0; 
         llama_batch_add(&batch, id, prompt_tokens.size() + i, {0}, true);
@@ -762,89 +1025,63 @@ bool cactus_context::synthesizeSpeech(const std::string& text, const std::string
         }
     }
 
-    if (!generated_codes.empty()) {
-        LOG_INFO("Generated %zu raw tokens before filtering.", generated_codes.size());
-        
-        // Filter codes to keep only actual audio codes from the OuteTTS range
-        const llama_token audio_code_min = 151672;
-        const llama_token audio_code_max = 155772; // As per original tts.cpp
-
-        std::vector<llama_token> filtered_codes;
-        for (llama_token code : generated_codes) {
-            if (code >= audio_code_min && code <= audio_code_max) {
-                filtered_codes.push_back(code - audio_code_min); // Offset immediately
-            }
-        }
-        generated_codes = filtered_codes; // Replace with filtered and offset codes
+    LOG_INFO("Generated %zu audio codes.", n_codes);
+    llama_batch_free(batch);
+    return true;
+}
 
-        LOG_INFO("Filtered and offset to %zu audio codes.", generated_codes.size());
+bool cactus_context::synthesizeSpeechStream(
+    const std::string& text,
+    const std::function<bool(const float*, size_t, int)>& on_audio,
+    const std::string& speaker_id_or_path
+) {
+    if (!this->vocoder_model || !this->vocoder_ctx) {
+        LOG_ERROR("Vocoder model and context must be loaded via loadVocoderModel() first.");
+        return false;
     }
 
-    if (!generated_codes.empty()) {
-        LOG_INFO("Processing %zu audio codes with vocoder model.", generated_codes.size());
-        llama_batch vocoder_batch = llama_batch_init(generated_codes.size(), 0, 1);
-        for(size_t i=0; i < generated_codes.size(); ++i) {
-            llama_batch_add(&vocoder_batch, generated_codes[i], i, {0}, true);
-        }
+    tts_internal::stream_vocoder vocoder(this->vocoder_model, this->vocoder_ctx, params.cpuparams.n_threads, on_audio);
+    bool vocoder_ok = true;
 
-        if (!this->vocoder_model || !this->vocoder_ctx) {
-             LOG_ERROR("Vocoder model not loaded.");
-             llama_batch_free(batch);
-             llama_batch_free(vocoder_batch);
-             return false;
-        }
-        
-        llama_kv_self_clear(this->vocoder_ctx);
-        if (llama_decode(this->vocoder_ctx, vocoder_batch) != 0) {
-             LOG_ERROR("llama_decode failed for vocoder model processing codes.");
-             llama_batch_free(batch);
-             llama_batch_free(vocoder_batch);
-             return false; 
-        }
-
-        const float * vocoder_embeddings_output = llama_get_embeddings(this->vocoder_ctx);
-        if (!vocoder_embeddings_output) {
-             LOG_ERROR("Failed to get embeddings from vocoder model.");
-             llama_batch_free(batch);
-             llama_batch_free(vocoder_batch);
-             return false;
-        }
-        
-        int n_embd_vocoder = llama_model_n_embd(this->vocoder_model);
-        tts_model_output_embeddings.assign(vocoder_embeddings_output, vocoder_embeddings_output + generated_codes.size() * n_embd_vocoder);
-        LOG_INFO("Successfully extracted %zu embedding values.", tts_model_output_embeddings.size());
-        llama_batch_free(vocoder_batch);
-    } else { LOG_WARNING("No codes generated or all codes were filtered out."); }
-
-    if (tts_model_output_embeddings.empty() && !generated_codes.empty()) {
-        LOG_ERROR("No embeddings generated from vocoder model, though there were codes.");
-        llama_batch_free(batch);
+    const bool generated = generateAudioCodes(text, speaker_id_or_path, [&](llama_token code) {
+        vocoder.codes.push_back(code);
+        vocoder_ok = vocoder.process(false);
+        return vocoder_ok && !vocoder.stopped;
+    });
+    if (!generated || !vocoder_ok) {
         return false;
     }
+    if (vocoder.codes.empty()) {
+        LOG_WARNING("No codes generated or all codes were filtered out.");
+        return true;
+    }
+    return vocoder.process(true);
+}
 
+bool cactus_context::synthesizeSpeech(const std::string& text, const std::string& output_wav_path, const std::string& speaker_id_or_path) {
+    std::vector<float> audio_samples;
     int vocoder_sample_rate = 24000;
-    std::vector<float> audio_samples = tts_internal::embeddings_to_audio_samples(
-        tts_model_output_embeddings.data(),
-        generated_codes.size(), // This is now the size of filtered_codes
-        llama_model_n_embd(this->vocoder_model),
-        this->vocoder_model, this->vocoder_ctx,
-        params.cpuparams.n_threads, vocoder_sample_rate
-    );
+
+    const bool ok = synthesizeSpeechStream(text, [&](const float * samples, size_t n_samples, int sample_rate) {
+        audio_samples.insert(audio_samples.end(), samples, samples + n_samples);
+        vocoder_sample_rate = sample_rate;
+        return true;
+    }, speaker_id_or_path);
+    if (!ok) {
+        return false;
+    }
 
     if (audio_samples.empty()) {
         LOG_ERROR("Failed to generate audio samples from embeddings.");
-        llama_batch_free(batch);
         return false;
     }
     if (!tts_internal::save_wav16(output_wav_path, audio_samples, vocoder_sample_rate)) {
         LOG_ERROR("Failed to save audio samples to file.");
-        llama_batch_free(batch);
         return false;
     }
 
     LOG_INFO("Speech synthesized successfully to '%s'.", output_wav_path.c_str());
-    llama_batch_free(batch);
     return true;
 }
 
-} // namespace cactus 
\ No newline at end of file
+} // namespace cactus 
@@ -0,0 +1,86 @@
+#ifndef CACTUS_TTS_H
+#define CACTUS_TTS_H
+
+#include <cstdint>
+#include <vector>
+
+namespace cactus {
+
+// Signal processing of the vocoder's ISTFT, shared by cactus_tts.cpp and the tests
+namespace tts_internal {
+
+    // Inverse real FFT plan for the vocoder's ISTFT. The real n-point transform runs as one
+    // n/2-point complex Stockham FFT (mixed radix 2/3/4/5 plus a generic odd radix), with all
+    // twiddles precomputed once. Data is kept in split real/imag arrays so the butterfly loops
+    // over contiguous strides auto-vectorize.
+    struct irfft_plan {
+        struct stage {
+            int radix;
+            int l;                     // butterflies per stride group (n_cur / radix)
+            int stride;                // distance between consecutive elements of a group
+            std::vector<float> tw_re;  // twiddle w^(j*q) for j < l, q < radix, indexed [j*radix + q]
+            std::vector<float> tw_im;
+            std::vector<float> root_re;  // e^(2*pi*i*q/radix), used by the generic radix only
+            std::vector<float> root_im;
+        };
+
+        int n = 0;                     // real transform size
+        int m = 0;                     // complex transform size (n / 2)
+        std::vector<stage> stages;
+        std::vector<float> post_re;    // e^(2*pi*i*k/n) for the real-to-complex packing, k < m
+        std::vector<float> post_im;
+        std::vector<float> window;     // periodic Hann window of n samples
+        std::vector<float> window_sq;
+
+        explicit irfft_plan(int n);
+
+        // One Stockham pass x -> y; the caller swaps the buffers between stages
+        static void run_stage(const stage & st, const float * xr, const float * xi, float * yr, float * yi);
+
+        // inp_cplx holds n/2 + 1 interleaved complex bins, out_real receives
+        //   out[t] = Re(sum_{k <= n/2} X[k] * e^(2*pi*i*k*t/n)) / (n/2 + 1)
+        // scratch must hold 4 * m floats; safe to call concurrently with distinct scratch buffers
+        void execute(const float * inp_cplx, float * out_real, float * scratch) const;
+    };
+
+    // Plans are immutable once built and shared by all vocoding threads
+    const irfft_plan & get_irfft_plan(int n);
+
+    // Vocoder frames (log-magnitude | phase) -> windowed time-domain frames of plan.n samples
+    void frames_to_windowed_signal(
+        const irfft_plan & plan,
+        const float * embeddings_ptr,     // num_frames rows of frame_embedding_dim values
+        int num_frames,
+        int frame_embedding_dim,
+        int n_threads,
+        float * out                       // num_frames * plan.n samples
+    );
+
+    // Overlap-add of windowed frames, normalized by the overlap-added squared window and
+    // emitted as soon as no later frame can reach a sample. The first and last n_pad samples
+    // of the padded signal are never emitted.
+    struct overlap_add {
+        const irfft_plan & plan;
+        int n_hop;
+        int n_pad;
+
+        int64_t n_frames = 0;             // frames added so far
+        int64_t n_emitted;                // next (padded) sample index to emit
+        int64_t offset = 0;               // padded sample index of signal[0]
+        std::vector<float> signal;        // overlap-added windowed frames
+        std::vector<float> energy;        // overlap-added squared window
+
+        overlap_add(const irfft_plan & plan, int n_hop);
+
+        // Appends n windowed frames of plan.n samples after the frames already added
+        void add(const float * frames, int n);
+
+        // Appends the samples no later frame can change to out; with final, also the tail
+        void take(bool final, std::vector<float> & out);
+    };
+
+} // namespace tts_internal
+
+} // namespace cactus
+
+#endif // CACTUS_TTS_H
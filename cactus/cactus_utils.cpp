@@ -2,6 +2,7 @@
 #include "llama.h" 
 #include "common.h"
 
+#include <deque>
 #include <vector>
 #include <string>
 #include <stdarg.h> 
@@ -153,6 +154,116 @@ size_t find_partial_stop_string(const std::string &stop,
     return std::string::npos;
 }
 
+void stop_string_matcher::init(const std::vector<std::string> &stop_strings)
+{
+    stops = stop_strings;
+
+    // Only bytes that occur in a stop string need their own column in the transition table
+    memset(byte_class, 0, sizeof(byte_class));
+    n_classes = 1;
+    for (const std::string &stop : stops) {
+        for (const unsigned char c : stop) {
+            if (byte_class[c] == 0) {
+                byte_class[c] = (uint8_t) n_classes++;
+            }
+        }
+    }
+
+    // Trie of the stop strings
+    next.assign(n_classes, -1);
+    depth.assign(1, 0);
+    match.assign(1, -1);
+    for (size_t i = 0; i < stops.size(); ++i) {
+        if (stops[i].empty()) continue;
+
+        int32_t node = 0;
+        for (const unsigned char c : stops[i]) {
+            const size_t edge = (size_t) node * n_classes + byte_class[c];
+            if (next[edge] < 0) {
+                next[edge] = (int32_t) depth.size();
+                next.insert(next.end(), n_classes, -1);
+                depth.push_back(depth[node] + 1);
+                match.push_back(-1);
+            }
+            node = next[edge];
+        }
+        if (match[node] < 0) {
+            match[node] = (int32_t) i;
+        }
+    }
+
+    // Failure links, folded into a complete transition table in breadth-first order
+    std::vector<int32_t> fail(depth.size(), 0);
+    std::deque<int32_t> queue;
+    for (int32_t cls = 0; cls < n_classes; ++cls) {
+        int32_t &child = next[cls];
+        if (child < 0) {
+            child = 0;
+        } else {
+            queue.push_back(child);
+        }
+    }
+    while (!queue.empty()) {
+        const int32_t node = queue.front();
+        queue.pop_front();
+
+        // A node without its own stop string reports the longest one ending in its suffix
+        if (match[node] < 0) {
+            match[node] = match[fail[node]];
+        }
+        for (int32_t cls = 0; cls < n_classes; ++cls) {
+            const size_t edge = (size_t) node * n_classes + cls;
+            const int32_t fallback = next[(size_t) fail[node] * n_classes + cls];
+            if (next[edge] < 0) {
+                next[edge] = fallback;
+            } else {
+                fail[next[edge]] = fallback;
+                queue.push_back(next[edge]);
+            }
+        }
+    }
+
+    reset();
+}
+
+void stop_string_matcher::reset()
+{
+    state = 0;
+    n_fed = 0;
+    full_pos = std::string::npos;
+    full_index = -1;
+}
+
+void stop_string_matcher::feed(const char *data, size_t size)
+{
+    if (next.empty()) {
+        n_fed += size;
+        return;
+    }
+    for (size_t i = 0; i < size; ++i) {
+        state = next[(size_t) state * n_classes + byte_class[(unsigned char) data[i]]];
+        n_fed++;
+
+        // The longest stop string ending here is the one starting earliest
+        const int32_t index = match[state];
+        if (index >= 0) {
+            const size_t start = n_fed - stops[index].size();
+            if (full_pos == std::string::npos || start < full_pos) {
+                full_pos = start;
+                full_index = index;
+            }
+        }
+    }
+}
+
+size_t stop_string_matcher::partial_pos() const
+{
+    if (depth.empty() || depth[state] == 0) {
+        return std::string::npos;
+    }
+    return n_fed - depth[state];
+}
+
 /**
  * @brief Formats incomplete UTF-8 multibyte characters for output
  * 
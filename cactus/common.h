@@ -172,6 +172,7 @@ struct common_params_sampling {
     std::string                         grammar; // optional BNF-like grammar to constrain sampling
     bool                                grammar_lazy = false;
     std::vector<common_grammar_trigger> grammar_triggers; // optional triggers (for lazy grammars)
+    bool                                grammar_jump_forward = true; // decode text forced by the grammar without sampling it
     std::set<llama_token>               preserved_tokens;
 
     std::vector<llama_logit_bias> logit_bias; // logit biases to apply
@@ -216,6 +217,14 @@ enum common_reasoning_format {
     COMMON_REASONING_FORMAT_DEEPSEEK, // Extract thinking tag contents and return as `message.reasoning_content`
 };
 
+enum common_kv_evict {
+    COMMON_KV_EVICT_HALF,         // discard half of the tokens after n_keep at once
+    COMMON_KV_EVICT_SINK,         // keep n_sink attention sinks and evict the oldest n_evict tokens after them
+    COMMON_KV_EVICT_HEAVY_HITTER, // keep the sinks and the recent half, evict the n_evict tokens with the least attention
+                                  // (every generated token syncs and copies the softmax of each layer to the host,
+                                  //  without flash attention; prompt batches are not scored)
+};
+
 struct common_params {
     bool vocab_only               = false;
     int32_t n_predict             =    -1; // new tokens to predict
@@ -237,6 +246,12 @@ struct common_params {
     float   yarn_beta_slow        =  1.0f; // YaRN high correction dim
     int32_t yarn_orig_ctx         =     0; // YaRN original context length
     float   defrag_thold          =  0.1f; // KV cache defragmentation threshold
+    int32_t logits_top_k          =     0; // output only the top k logits of each token (0 = full vocabulary)
+    int32_t kv_block_size         =     0; // cells per block of a paged KV cache (0 = contiguous unified cache, see llama_context_params)
+    int32_t n_sink                =     4; // attention sink tokens kept at the start of the context (sink and heavy-hitter eviction)
+    int32_t n_evict               =     0; // tokens evicted per step when the context is full (0 = n_ctx/16)
+
+    enum common_kv_evict kv_evict = COMMON_KV_EVICT_HALF; // how a full context makes room for new tokens
 
     // offload params
     std::vector<lm_ggml_backend_dev_t> devices; // devices to use for offloading
@@ -331,6 +346,7 @@ struct common_params {
     bool display_prompt    = true;  // print prompt before generation
     bool dump_kv_cache     = false; // dump the KV cache contents for debugging purposes
     bool no_kv_offload     = false; // disable KV offloading
+    bool swa_full          = false; // cache the full context for sliding-window layers instead of their window
     bool warmup            = true;  // warmup run
     bool check_tensors     = false; // validate tensor data
 
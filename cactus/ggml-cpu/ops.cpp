@@ -7,6 +7,7 @@
 #include "vec.h"
 
 #include <float.h>
+#include <algorithm>
 
 #if defined(_MSC_VER)
 // disable "possible loss of data" to avoid hundreds of casts
@@ -6813,6 +6814,9 @@ static void lm_ggml_compute_forward_argsort_f32(
 
     lm_ggml_sort_order order = (lm_ggml_sort_order) lm_ggml_get_op_params_i32(dst, 0);
 
+    // set by lm_ggml_top_k: only the first k indices of a row are used, so the rest can stay unsorted
+    const int32_t k = lm_ggml_get_op_params_i32(dst, 1);
+
     for (int64_t i = ith; i < nr; i += nth) {
         int32_t * dst_data = (int32_t *)((char *) dst->data + i*nb1);
         const float * src_data = (float *)((char *) src0->data + i*nb01);
@@ -6821,16 +6825,27 @@ static void lm_ggml_compute_forward_argsort_f32(
             dst_data[j] = j;
         }
 
-        // C doesn't have a functional sort, so we do a bubble sort instead
-        for (int64_t j = 0; j < ne0; j++) {
-            for (int64_t k = j + 1; k < ne0; k++) {
-                if ((order == LM_GGML_SORT_ORDER_ASC  && src_data[dst_data[j]] > src_data[dst_data[k]]) ||
-                    (order == LM_GGML_SORT_ORDER_DESC && src_data[dst_data[j]] < src_data[dst_data[k]])) {
-                    int32_t tmp = dst_data[j];
-                    dst_data[j] = dst_data[k];
-                    dst_data[k] = tmp;
+        // ties are broken by the index, so that the order does not depend on the sort algorithm
+        // NaNs go last in either order, so the comparator stays a strict weak ordering
+        auto cmp = [src_data, order](int32_t a, int32_t b) {
+            const float va = src_data[a];
+            const float vb = src_data[b];
+            if (isnan(va) || isnan(vb)) {
+                if (isnan(va) != isnan(vb)) {
+                    return isnan(vb);
                 }
+                return a < b;
+            }
+            if (va != vb) {
+                return order == LM_GGML_SORT_ORDER_ASC ? va < vb : va > vb;
             }
+            return a < b;
+        };
+
+        if (k > 0 && k < ne0) {
+            std::partial_sort(dst_data, dst_data + k, dst_data + ne0, cmp);
+        } else {
+            std::sort(dst_data, dst_data + ne0, cmp);
         }
     }
 }
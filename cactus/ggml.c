@@ -4342,6 +4342,9 @@ struct lm_ggml_tensor * lm_ggml_top_k(
 
     struct lm_ggml_tensor * result = lm_ggml_argsort(ctx, a, LM_GGML_SORT_ORDER_DESC);
 
+    // only the first k indices of each row are viewed - backends may leave the rest unsorted
+    lm_ggml_set_op_params_i32(result, 1, k);
+
     result = lm_ggml_view_4d(ctx, result,
                 k, result->ne[1], result->ne[2], result->ne[3],
                    result->nb[1], result->nb[2], result->nb[3],
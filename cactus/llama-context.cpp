@@ -22,6 +22,10 @@ llama_context::llama_context(
     model(model) {
     LLAMA_LOG_INFO("%s: constructing llama_context\n", __func__);
 
+    if (params.n_seq_max > LLAMA_MAX_SEQ) {
+        throw std::runtime_error(format("n_seq_max must be <= %d", LLAMA_MAX_SEQ));
+    }
+
     t_start_us = model.t_start_us;
     t_load_us  = model.t_load_us;
 
@@ -35,10 +39,13 @@ llama_context::llama_context(
     cparams.yarn_beta_fast   = params.yarn_beta_fast;
     cparams.yarn_beta_slow   = params.yarn_beta_slow;
     cparams.defrag_thold     = params.defrag_thold;
+    cparams.logits_top_k     = std::max(0, std::min<int32_t>(params.logits_top_k, model.vocab.n_tokens()));
+    cparams.kv_block_size    = params.kv_block_size;
     cparams.embeddings       = params.embeddings;
     cparams.offload_kqv      = params.offload_kqv;
     cparams.flash_attn       = params.flash_attn;
     cparams.no_perf          = params.no_perf;
+    cparams.swa_full         = params.swa_full;
     cparams.pooling_type     = params.pooling_type;
     cparams.warmup           = false;
 
@@ -105,6 +112,8 @@ llama_context::llama_context(
     LLAMA_LOG_INFO("%s: n_ubatch      = %u\n",   __func__, cparams.n_ubatch);
     LLAMA_LOG_INFO("%s: causal_attn   = %d\n",   __func__, cparams.causal_attn);
     LLAMA_LOG_INFO("%s: flash_attn    = %d\n",   __func__, cparams.flash_attn);
+    LLAMA_LOG_INFO("%s: logits_top_k  = %d\n",   __func__, cparams.logits_top_k);
+    LLAMA_LOG_INFO("%s: kv_block_size = %u\n",   __func__, cparams.kv_block_size);
     LLAMA_LOG_INFO("%s: freq_base     = %.1f\n", __func__, cparams.rope_freq_base);
     LLAMA_LOG_INFO("%s: freq_scale    = %g\n",   __func__, cparams.rope_freq_scale);
 
@@ -179,7 +188,7 @@ llama_context::llama_context(
     // init the memory module
     // TODO: for now, always create a unified KV cache
     if (!hparams.vocab_only) {
-        kv_self.reset(static_cast<llama_kv_cache_unified *>(model.create_memory()));
+        kv_self.reset(static_cast<llama_kv_cache_unified *>(model.create_memory(cparams)));
 
         LLAMA_LOG_DEBUG("%s: n_ctx = %u\n", __func__, cparams.n_ctx);
 
@@ -306,6 +315,9 @@ llama_context::llama_context(
 
         // simulate full KV cache
         kv_self->n = kv_self->size;
+        if (kv_self->swa) {
+            kv_self->swa->n = kv_self->swa->size;
+        }
 
         cross.v_embd.clear();
 
@@ -447,6 +459,18 @@ uint32_t llama_context::n_seq_max() const {
     return cparams.n_seq_max;
 }
 
+size_t llama_context::compute_buffer_size() const {
+    size_t size = 0;
+    for (auto * backend : backend_ptrs) {
+        size += lm_ggml_backend_sched_get_buffer_size(sched.get(), backend);
+    }
+    return size;
+}
+
+size_t llama_context::kv_self_buffer_size() const {
+    return kv_self ? kv_self->total_size() : 0;
+}
+
 uint32_t llama_context::n_threads() const {
     return cparams.n_threads;
 }
@@ -513,7 +537,8 @@ public:
 
     void set_input(const llama_ubatch * ubatch) override;
 
-    lm_ggml_tensor * k_shift; // I32 [kv_size]
+    lm_ggml_tensor * k_shift;               // I32 [kv_size]
+    lm_ggml_tensor * k_shift_swa = nullptr; // I32 [kv_size_swa], with a cache for the sliding-window layers
 
     const llama_kv_cache_unified * kv_self;
 };
@@ -530,6 +555,16 @@ void llm_graph_input_k_shift::set_input(const llama_ubatch * ubatch) {
             data[i] = kv_self->cells[i].delta;
         }
     }
+
+    if (k_shift_swa) {
+        assert(lm_ggml_backend_buffer_is_host(k_shift_swa->buffer));
+
+        int32_t * data = (int32_t *) k_shift_swa->data;
+
+        for (uint32_t i = 0; i < kv_self->swa->size; ++i) {
+            data[i] = kv_self->swa->cells[i].delta;
+        }
+    }
 }
 
 llm_graph_result_ptr llama_context::build_kv_self_shift(
@@ -551,6 +586,11 @@ llm_graph_result_ptr llama_context::build_kv_self_shift(
     inp->k_shift = lm_ggml_new_tensor_1d(ctx0, LM_GGML_TYPE_I32, cparams.n_ctx);
     lm_ggml_set_input(inp->k_shift);
 
+    if (kv_self->swa) {
+        inp->k_shift_swa = lm_ggml_new_tensor_1d(ctx0, LM_GGML_TYPE_I32, kv_self->swa->size);
+        lm_ggml_set_input(inp->k_shift_swa);
+    }
+
     for (uint32_t il = 0; il < n_layer; ++il) {
         const int64_t n_head_kv    = hparams.n_head_kv(il);
         const int64_t n_embd_k_gqa = hparams.n_embd_k_gqa(il);
@@ -564,14 +604,18 @@ llm_graph_result_ptr llama_context::build_kv_self_shift(
 
         lm_ggml_tensor * rope_factors = kv_self->cbs.get_rope_factors(n_ctx_per_seq(), il);
 
+        const llama_kv_cache_unified * kv = kv_self->layer_cache(il);
+
         lm_ggml_tensor * k =
-            lm_ggml_view_3d(ctx0, kv_self->k_l[il],
-                n_embd_head_k, n_head_kv, kv_self->size,
-                lm_ggml_row_size(kv_self->k_l[il]->type, n_embd_head_k),
-                lm_ggml_row_size(kv_self->k_l[il]->type, n_embd_k_gqa),
+            lm_ggml_view_3d(ctx0, kv->k_l[il],
+                n_embd_head_k, n_head_kv, kv->size,
+                lm_ggml_row_size(kv->k_l[il]->type, n_embd_head_k),
+                lm_ggml_row_size(kv->k_l[il]->type, n_embd_k_gqa),
                 0);
 
-        lm_ggml_tensor * cur = build_rope_shift(ctx0, k, inp->k_shift, rope_factors, freq_base_l, freq_scale_l);
+        lm_ggml_tensor * k_shift = kv == kv_self.get() ? inp->k_shift : inp->k_shift_swa;
+
+        lm_ggml_tensor * cur = build_rope_shift(ctx0, k, k_shift, rope_factors, freq_base_l, freq_scale_l);
 
         lm_ggml_build_forward_expand(gf, cur);
     }
@@ -675,6 +719,11 @@ llm_graph_result_ptr llama_context::build_kv_self_defrag(
         }
 
         for (uint32_t il = 0; il < hparams.n_layer; ++il) { // NOLINT
+            // the cache of the sliding-window layers is not defragmented
+            if (!kv_self->k_l[il]) {
+                continue;
+            }
+
             const int64_t n_embd_k_gqa = hparams.n_embd_k_gqa(il);
             const int64_t n_embd_v_gqa = hparams.n_embd_v_gqa(il);
 
@@ -762,6 +811,14 @@ void llama_context::kv_self_update() {
             for (uint32_t i = 0; i < kv->size; ++i) {
                 kv->cells[i].delta = 0;
             }
+
+            if (kv->swa) {
+                kv->swa->has_shift = false;
+
+                for (uint32_t i = 0; i < kv->swa->size; ++i) {
+                    kv->swa->cells[i].delta = 0;
+                }
+            }
         }
     }
 
@@ -798,6 +855,9 @@ void llama_context::kv_self_update() {
 
         // simulate full KV cache
         kv_self->n = kv_self->size;
+        if (kv_self->swa) {
+            kv_self->swa->n = kv_self->swa->size;
+        }
 
         llama_token token = model.vocab.token_bos(); // not actually used by llama_build_graph, but required to choose between token and embedding inputs graph
         llama_ubatch ubatch = { true, n_tokens, n_tokens / n_seqs, n_seqs, &token, nullptr, nullptr, nullptr, nullptr, nullptr};
@@ -821,12 +881,21 @@ float * llama_context::get_logits() {
     // reorder logits for backward compatibility
     output_reorder();
 
+    // the rows only hold the top-k logits, see get_logits_top_k_ith
+    if (cparams.logits_top_k > 0) {
+        return nullptr;
+    }
+
     return logits;
 }
 
 float * llama_context::get_logits_ith(int32_t i) {
     int32_t j = -1;
 
+    if (cparams.logits_top_k > 0) {
+        return nullptr;
+    }
+
     try {
         if (logits == nullptr) {
             throw std::runtime_error("no logits");
@@ -862,6 +931,52 @@ float * llama_context::get_logits_ith(int32_t i) {
     }
 }
 
+int32_t llama_context::get_logits_top_k_ith(int32_t i, const float ** logits, const llama_token ** ids) {
+    int32_t j = -1;
+
+    const int32_t k = cparams.logits_top_k;
+    if (k <= 0) {
+        return 0;
+    }
+
+    try {
+        if (this->logits == nullptr) {
+            throw std::runtime_error("no logits");
+        }
+
+        if (i < 0) {
+            j = n_outputs + i;
+            if (j < 0) {
+                throw std::runtime_error(format("negative index out of range [0, %d)", n_outputs));
+            }
+        } else if ((size_t) i >= output_ids.size()) {
+            throw std::runtime_error(format("out of range [0, %zu)", output_ids.size()));
+        } else {
+            j = output_ids[i];
+        }
+
+        if (j < 0) {
+            throw std::runtime_error(format("batch.logits[%d] != true", i));
+        }
+        if (j >= n_outputs) {
+            // This should not happen
+            throw std::runtime_error(format("corrupt output buffer (j=%d, n_outputs=%d)", j, n_outputs));
+        }
+
+        *logits = this->logits     + (size_t) j*k;
+        *ids    = this->logits_ids + (size_t) j*k;
+
+        return k;
+    } catch (const std::exception & err) {
+        LLAMA_LOG_ERROR("%s: invalid logits id %d, reason: %s\n", __func__, i, err.what());
+#ifndef NDEBUG
+        LM_GGML_ABORT("fatal error");
+#else
+        return -1;
+#endif
+    }
+}
+
 float * llama_context::get_embeddings() {
     // reorder embeddings for backward compatibility
     output_reorder();
@@ -1192,6 +1307,9 @@ int llama_context::decode(llama_batch & inp_batch) {
 
     const int32_t n_vocab = vocab.n_tokens();
 
+    // number of logits per output that are copied to the host
+    const int32_t n_logits = cparams.logits_top_k > 0 ? cparams.logits_top_k : n_vocab;
+
     const int64_t n_tokens_all = batch.n_tokens;
     const int64_t n_embd       = hparams.n_embd;
 
@@ -1208,6 +1326,17 @@ int llama_context::decode(llama_batch & inp_batch) {
         }
     }
 
+    if (batch.seq_id) {
+        for (int64_t i = 0; i < n_tokens_all; ++i) {
+            for (int32_t s = 0; s < batch.n_seq_id[i]; ++s) {
+                if (batch.seq_id[i][s] < 0 || batch.seq_id[i][s] >= LLAMA_MAX_SEQ) {
+                    LLAMA_LOG_ERROR("%s: invalid seq_id[%" PRId64 "][%d] = %d >= %d\n", __func__, i, s, batch.seq_id[i][s], LLAMA_MAX_SEQ);
+                    return -1;
+                }
+            }
+        }
+    }
+
     LM_GGML_ASSERT(n_tokens_all <= cparams.n_batch);
 
     LM_GGML_ASSERT((cparams.causal_attn || cparams.n_ubatch >= n_tokens_all) && "non-causal attention requires n_ubatch >= n_tokens");
@@ -1296,7 +1425,15 @@ int llama_context::decode(llama_batch & inp_batch) {
                 return 1;
             }
 
-            if (!kv_self->recurrent) {
+            // the cache of the sliding-window layers sets its n as well
+            if (kv_self->swa && !kv_self->swa->find_slot(ubatch)) {
+                LLAMA_LOG_WARN("%s: failed to find SWA cache slot for ubatch of size %d\n", __func__, ubatch.n_tokens);
+
+                return 1;
+            }
+
+            // the paged cache sets n to the number of cells gathered for the ubatch
+            if (!kv_self->recurrent && !kv_self->paged) {
                 // a heuristic, to avoid attending the full cache if it is not yet utilized
                 // after enough generations, the benefit from this heuristic disappears
                 // if we start defragmenting the cache, the benefit from this will be more important
@@ -1350,12 +1487,25 @@ int llama_context::decode(llama_batch & inp_batch) {
             LM_GGML_ASSERT(backend_res != nullptr);
             LM_GGML_ASSERT(logits != nullptr);
 
-            float * logits_out = logits + n_outputs_prev*n_vocab;
+            float * logits_out = logits + n_outputs_prev*n_logits;
 
             if (n_outputs) {
                 LM_GGML_ASSERT( n_outputs_prev + n_outputs <= n_outputs_all);
-                LM_GGML_ASSERT((n_outputs_prev + n_outputs)*n_vocab <= (int64_t) logits_size);
-                lm_ggml_backend_tensor_get_async(backend_res, t_logits, logits_out, 0, n_outputs*n_vocab*sizeof(float));
+                LM_GGML_ASSERT((n_outputs_prev + n_outputs)*n_logits <= (int64_t) logits_size);
+
+                if (cparams.logits_top_k > 0) {
+                    // only the k largest logits of each output and their ids leave the device
+                    lm_ggml_tensor * t_top_k     = res->get_logits_top_k();
+                    lm_ggml_tensor * t_top_k_ids = res->get_logits_top_k_ids();
+                    LM_GGML_ASSERT(t_top_k != nullptr && t_top_k_ids != nullptr);
+
+                    llama_token * ids_out = logits_ids + n_outputs_prev*n_logits;
+
+                    lm_ggml_backend_tensor_get_async(lm_ggml_backend_sched_get_tensor_backend(sched.get(), t_top_k),     t_top_k,     logits_out, 0, n_outputs*n_logits*sizeof(float));
+                    lm_ggml_backend_tensor_get_async(lm_ggml_backend_sched_get_tensor_backend(sched.get(), t_top_k_ids), t_top_k_ids, ids_out,    0, n_outputs*n_logits*sizeof(llama_token));
+                } else {
+                    lm_ggml_backend_tensor_get_async(backend_res, t_logits, logits_out, 0, n_outputs*n_logits*sizeof(float));
+                }
             }
         }
 
@@ -1490,8 +1640,12 @@ int32_t llama_context::output_reserve(int32_t n_outputs) {
         has_embd   = true;
     }
 
-    logits_size = has_logits ? n_vocab*n_outputs_max : 0;
-    embd_size   = has_embd   ?  n_embd*n_outputs_max : 0;
+    // with logits_top_k, only the top k logits of each output are kept, together with their ids
+    const int64_t n_logits = cparams.logits_top_k > 0 ? cparams.logits_top_k : n_vocab;
+    const bool    has_ids  = has_logits && cparams.logits_top_k > 0;
+
+    logits_size = has_logits ? n_logits*n_outputs_max : 0;
+    embd_size   = has_embd   ?   n_embd*n_outputs_max : 0;
 
     if (output_ids.empty()) {
         // init, never resized afterwards
@@ -1499,7 +1653,7 @@ int32_t llama_context::output_reserve(int32_t n_outputs) {
     }
 
     const size_t prev_size = buf_output ? lm_ggml_backend_buffer_get_size(buf_output.get()) : 0;
-    const size_t new_size  = (logits_size + embd_size) * sizeof(float);
+    const size_t new_size  = (logits_size + embd_size) * sizeof(float) + (has_ids ? logits_size * sizeof(llama_token) : 0);
 
     // alloc only when more than the current capacity is required
     // TODO: also consider shrinking the buffer
@@ -1511,6 +1665,7 @@ int32_t llama_context::output_reserve(int32_t n_outputs) {
 #endif
             buf_output = nullptr;
             logits = nullptr;
+            logits_ids = nullptr;
             embd = nullptr;
         }
 
@@ -1533,6 +1688,8 @@ int32_t llama_context::output_reserve(int32_t n_outputs) {
     logits = has_logits ? output_base               : nullptr;
     embd   = has_embd   ? output_base + logits_size : nullptr;
 
+    logits_ids = has_ids ? (llama_token *) (output_base + logits_size + embd_size) : nullptr;
+
     // set all ids as invalid (negative)
     std::fill(output_ids.begin(), output_ids.end(), -1);
 
@@ -1545,8 +1702,8 @@ int32_t llama_context::output_reserve(int32_t n_outputs) {
 void llama_context::output_reorder() {
     auto & out_ids = sbatch.out_ids;
     if (!out_ids.empty()) {
-        const uint32_t n_vocab = model.vocab.n_tokens();
-        const uint32_t n_embd  = model.hparams.n_embd;
+        const uint32_t n_logits = cparams.logits_top_k > 0 ? cparams.logits_top_k : model.vocab.n_tokens();
+        const uint32_t n_embd   = model.hparams.n_embd;
 
         LM_GGML_ASSERT((size_t) n_outputs == out_ids.size());
 
@@ -1562,8 +1719,13 @@ void llama_context::output_reorder() {
             if (j_min == i) { continue; }
             std::swap(out_ids[i], out_ids[j_min]);
             if (logits_size > 0) {
-                for (uint32_t k = 0; k < n_vocab; k++) {
-                    std::swap(logits[i*n_vocab + k], logits[j_min*n_vocab + k]);
+                for (uint32_t k = 0; k < n_logits; k++) {
+                    std::swap(logits[i*n_logits + k], logits[j_min*n_logits + k]);
+                }
+                if (logits_ids) {
+                    for (uint32_t k = 0; k < n_logits; k++) {
+                        std::swap(logits_ids[i*n_logits + k], logits_ids[j_min*n_logits + k]);
+                    }
                 }
             }
             if (embd_size > 0) {
@@ -1585,7 +1747,19 @@ void llama_context::output_reorder() {
 //
 
 int32_t llama_context::graph_max_nodes() const {
-    return std::max<int32_t>(65536, 5*model.n_tensors());
+    int32_t n_nodes = std::max<int32_t>(65536, 5*model.n_tensors());
+
+    // the paged KV cache stores a ubatch with 2 views and a copy per run, for K and V of each layer
+    if (kv_self && kv_self->paged) {
+        n_nodes += 6*model.hparams.n_layer*static_cast<const llama_kv_cache_paged *>(kv_self.get())->get_n_runs_max();
+    }
+
+    // and so does the cache of the sliding-window layers
+    if (kv_self && kv_self->swa) {
+        n_nodes += 6*model.hparams.n_layer*kv_self->swa->get_n_runs_max();
+    }
+
+    return n_nodes;
 }
 
 lm_ggml_cgraph * llama_context::graph_init() {
@@ -2052,13 +2226,19 @@ size_t llama_context::state_write_data(llama_io_write_i & io) {
     {
         LLAMA_LOG_DEBUG("%s: - writing logits\n", __func__);
 
-        const uint64_t logits_size = std::min((uint64_t) this->logits_size, (uint64_t) n_outputs * model.vocab.n_tokens());
+        const uint64_t n_logits    = cparams.logits_top_k > 0 ? cparams.logits_top_k : model.vocab.n_tokens();
+        const uint64_t logits_size = std::min((uint64_t) this->logits_size, (uint64_t) n_outputs * n_logits);
 
         io.write(&logits_size, sizeof(logits_size));
 
         if (logits_size) {
             io.write(logits, logits_size * sizeof(float));
         }
+
+        // the ids of the top-k logits follow them
+        if (logits_size && logits_ids) {
+            io.write(logits_ids, logits_size * sizeof(llama_token));
+        }
     }
 
     // write embeddings
@@ -2140,6 +2320,10 @@ size_t llama_context::state_read_data(llama_io_read_i & io) {
         if (logits_size) {
             io.read_to(this->logits, logits_size * sizeof(float));
         }
+
+        if (logits_size && this->logits_ids) {
+            io.read_to(this->logits_ids, logits_size * sizeof(llama_token));
+        }
     }
 
     // read embeddings
@@ -2226,6 +2410,7 @@ llama_context_params llama_context_default_params() {
         /*.yarn_beta_slow              =*/ 1.0f,
         /*.yarn_orig_ctx               =*/ 0,
         /*.defrag_thold                =*/ -1.0f,
+        /*.kv_block_size               =*/ 0,
         /*.cb_eval                     =*/ nullptr,
         /*.cb_eval_user_data           =*/ nullptr,
         /*.type_k                      =*/ LM_GGML_TYPE_F16,
@@ -2235,8 +2420,10 @@ llama_context_params llama_context_default_params() {
         /*.offload_kqv                 =*/ true,
         /*.flash_attn                  =*/ false,
         /*.no_perf                     =*/ true,
+        /*.swa_full                    =*/ false,
         /*.abort_callback              =*/ nullptr,
         /*.abort_callback_data         =*/ nullptr,
+        /*.logits_top_k                =*/ 0,
     };
 
     return result;
@@ -2307,6 +2494,14 @@ uint32_t llama_n_seq_max(const llama_context * ctx) {
     return ctx->n_seq_max();
 }
 
+size_t llama_get_compute_buffer_size(const llama_context * ctx) {
+    return ctx->compute_buffer_size();
+}
+
+size_t llama_get_kv_self_buffer_size(const llama_context * ctx) {
+    return ctx->kv_self_buffer_size();
+}
+
 const llama_model * llama_get_model(const llama_context * ctx) {
     return &ctx->get_model();
 }
@@ -2378,6 +2573,12 @@ float * llama_get_logits_ith(llama_context * ctx, int32_t i) {
     return ctx->get_logits_ith(i);
 }
 
+int32_t llama_get_logits_top_k_ith(llama_context * ctx, int32_t i, const float ** logits, const llama_token ** ids) {
+    ctx->synchronize();
+
+    return ctx->get_logits_top_k_ith(i, logits, ids);
+}
+
 float * llama_get_embeddings(llama_context * ctx) {
     ctx->synchronize();
 
@@ -2625,6 +2826,20 @@ llama_pos llama_kv_self_seq_pos_max(llama_context * ctx, llama_seq_id seq_id) {
     return kv->seq_pos_max(seq_id);
 }
 
+int32_t llama_kv_self_seq_attach_prefix(
+        llama_context * ctx,
+         llama_seq_id   seq_id,
+    const llama_token * tokens,
+              int32_t   n_tokens,
+              int32_t   n_past) {
+    auto * kv = ctx->get_kv_self();
+    if (!kv) {
+        return n_past;
+    }
+
+    return kv->seq_attach_prefix(seq_id, tokens, n_tokens, n_past);
+}
+
 // deprecated
 void llama_kv_cache_defrag(llama_context * ctx) {
     return llama_kv_self_defrag(ctx);
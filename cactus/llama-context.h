@@ -38,6 +38,10 @@ struct llama_context {
     uint32_t n_threads()       const;
     uint32_t n_threads_batch() const;
 
+    // memory of the context's own buffers, in bytes
+    size_t compute_buffer_size() const;
+    size_t kv_self_buffer_size() const;
+
           llama_kv_cache * get_kv_self();
     const llama_kv_cache * get_kv_self() const;
 
@@ -48,6 +52,8 @@ struct llama_context {
     float * get_logits();
     float * get_logits_ith(int32_t i);
 
+    int32_t get_logits_top_k_ith(int32_t i, const float ** logits, const llama_token ** ids);
+
     float * get_embeddings();
     float * get_embeddings_ith(int32_t i);
     float * get_embeddings_seq(llama_seq_id seq_id);
@@ -205,10 +211,13 @@ private:
     // TODO: remove
     bool logits_all = false;
 
-    // decode output (2-dimensional array: [n_outputs][n_vocab])
+    // decode output (2-dimensional array: [n_outputs][n_vocab], or [n_outputs][logits_top_k] with logits_top_k > 0)
     size_t  logits_size = 0; // capacity (of floats) for logits
     float * logits      = nullptr;
 
+    // token ids of the top-k logits (2-dimensional array: [n_outputs][logits_top_k]), same capacity as the logits
+    llama_token * logits_ids = nullptr;
+
     // embeddings output (2-dimensional array: [n_outputs][n_embd])
     // populated only when pooling_type == LLAMA_POOLING_TYPE_NONE
     size_t  embd_size = 0; // capacity (of floats) for embeddings
@@ -24,11 +24,16 @@ struct llama_cparams {
     float yarn_beta_slow;
     float defrag_thold;
 
+    int32_t logits_top_k; // > 0: the graph outputs only the top k logits (and their ids) of each output
+
+    uint32_t kv_block_size; // > 0: paged KV cache, see llama_kv_cache_paged
+
     bool embeddings;
     bool causal_attn;
     bool offload_kqv;
     bool flash_attn;
     bool no_perf;
+    bool swa_full; // the sliding-window layers use the cells of the full context, see llama_kv_cache_swa
     bool warmup;
 
     enum llama_pooling_type pooling_type;
@@ -3,10 +3,13 @@
 #include "llama-impl.h"
 #include "llama-vocab.h"
 #include "llama-sampling.h"
+#include "unicode.h"
 
 #include <cmath>
+#include <cstring>
 #include <algorithm>
 #include <stdexcept>
+#include <unordered_map>
 
 //
 // helpers
@@ -823,11 +826,14 @@ llama_grammar_stacks & llama_grammar_get_stacks(struct llama_grammar * grammar)
     return grammar->stacks;
 }
 
-void llama_grammar_accept(struct llama_grammar * grammar, uint32_t chr) {
+static llama_grammar_stacks llama_grammar_accept_chr(
+        const llama_grammar_rules  & rules,
+        const llama_grammar_stacks & stacks,
+        uint32_t                     chr) {
     llama_grammar_stacks stacks_new;
-    stacks_new.reserve(grammar->stacks.size());
+    stacks_new.reserve(stacks.size());
 
-    for (const auto & stack : grammar->stacks) {
+    for (const auto & stack : stacks) {
         if (stack.empty()) {
             continue;
         }
@@ -841,11 +847,50 @@ void llama_grammar_accept(struct llama_grammar * grammar, uint32_t chr) {
             if (!llama_grammar_is_end_of_sequence(pos)) {
                 new_stack.push_back(pos);
             }
-            llama_grammar_advance_stack(grammar->rules, new_stack, stacks_new);
+            llama_grammar_advance_stack(rules, new_stack, stacks_new);
+        }
+    }
+
+    return stacks_new;
+}
+
+void llama_grammar_accept(struct llama_grammar * grammar, uint32_t chr) {
+    grammar->stacks = llama_grammar_accept_chr(grammar->rules, grammar->stacks, chr);
+}
+
+std::string llama_grammar_forced_str_impl(const struct llama_grammar & grammar, size_t max_chars) {
+    std::string result;
+
+    if (grammar.awaiting_trigger || grammar.partial_utf8.n_remain != 0) {
+        return result;
+    }
+
+    llama_grammar_stacks stacks = grammar.stacks;
+    for (size_t n = 0; n < max_chars && !stacks.empty(); ++n) {
+        // a character is forced when every stack expects exactly that character
+        uint32_t chr = 0;
+        for (const auto & stack : stacks) {
+            if (stack.empty()) {
+                // generation may end here
+                return result;
+            }
+            const llama_grammar_element * pos = stack.back();
+            if (pos->type != LLAMA_GRETYPE_CHAR ||
+                pos[1].type == LLAMA_GRETYPE_CHAR_ALT || pos[1].type == LLAMA_GRETYPE_CHAR_RNG_UPPER ||
+                (chr != 0 && pos->value != chr)) {
+                return result;
+            }
+            chr = pos->value;
+        }
+        if (chr == 0) {
+            break;
         }
+
+        stacks = llama_grammar_accept_chr(grammar.rules, stacks, chr);
+        result += unicode_cpt_to_utf8(chr);
     }
 
-    grammar->stacks = std::move(stacks_new);
+    return result;
 }
 
 llama_grammar_candidates llama_grammar_reject_candidates_for_stack(
@@ -903,6 +948,1202 @@ llama_grammar_candidates llama_grammar_reject_candidates_for_stack(
     return rejects;
 }
 
+// bounds of a grammar automaton: recursive grammars (e.g. nested JSON) reach a new state per nesting
+// level, and each stored mask takes n_vocab/8 bytes. once full, masks of new states are computed
+// without being stored
+static constexpr size_t LLAMA_GRAMMAR_AUTOMATON_MAX_STATES = 4096;
+static constexpr size_t LLAMA_GRAMMAR_AUTOMATON_MAX_MASKS  = 256;
+
+// automata kept per vocabulary
+static constexpr size_t LLAMA_GRAMMAR_AUTOMATON_CACHE_MAX = 8;
+
+#define LLAMA_GRAMMAR_AUTOMATON_MAGIC   0x41524743u // 'CGRA'
+#define LLAMA_GRAMMAR_AUTOMATON_VERSION 1u
+
+// computing a mask walks the whole vocabulary trie, which only pays off when the candidates cover a
+// good part of the vocabulary (e.g. not when checking a single sampled token)
+static constexpr size_t LLAMA_GRAMMAR_MASK_MIN_CANDIDATES_DIV = 8;
+
+std::unique_ptr<llama_grammar_vocab_trie> llama_grammar_vocab_trie_init(const llama_vocab & vocab) {
+    auto trie = std::make_unique<llama_grammar_vocab_trie>();
+
+    const uint32_t n_vocab = vocab.n_tokens();
+    trie->n_vocab = n_vocab;
+
+    struct edge_ref {
+        uint32_t parent;
+        uint32_t code_point;
+        uint32_t child;
+    };
+    struct token_ref {
+        uint32_t    node;
+        llama_token id;
+        llama_partial_utf8 partial_utf8;
+    };
+
+    std::vector<edge_ref>  edges;
+    std::vector<token_ref> tokens;
+    std::unordered_map<uint64_t, uint32_t> children; // (parent << 32 | code point) -> child
+
+    uint32_t n_nodes = 1;
+
+    for (uint32_t id = 0; id < n_vocab; ++id) {
+        if (vocab.is_eog(id)) {
+            trie->eog.push_back(id);
+            continue;
+        }
+
+        const std::string & piece = vocab.token_to_piece(id);
+        if (piece.empty() || piece[0] == 0) {
+            continue;
+        }
+
+        const auto decoded = decode_utf8(piece, {});
+        if (decoded.second.n_remain < 0) {
+            continue;
+        }
+
+        uint32_t node = 0;
+        for (auto it = decoded.first.begin(), end = decoded.first.end() - 1; it != end; ++it) {
+            const uint64_t key = (uint64_t) node << 32 | *it;
+            auto child = children.find(key);
+            if (child == children.end()) {
+                child = children.emplace(key, n_nodes).first;
+                edges.push_back({ node, *it, n_nodes });
+                n_nodes++;
+            }
+            node = child->second;
+        }
+
+        tokens.push_back({ node, (llama_token) id, decoded.second });
+    }
+
+    std::sort(edges.begin(), edges.end(), [](const edge_ref & a, const edge_ref & b) {
+        return a.parent != b.parent ? a.parent < b.parent : a.code_point < b.code_point;
+    });
+    std::stable_sort(tokens.begin(), tokens.end(), [](const token_ref & a, const token_ref & b) {
+        return a.node < b.node;
+    });
+
+    trie->nodes.resize(n_nodes);
+    trie->edges.reserve(edges.size());
+
+    size_t ie = 0;
+    size_t it = 0;
+    for (uint32_t node = 0; node < n_nodes; ++node) {
+        auto & nd = trie->nodes[node];
+
+        nd.edge_begin = trie->edges.size();
+        for (; ie < edges.size() && edges[ie].parent == node; ++ie) {
+            trie->edges.push_back({ edges[ie].code_point, edges[ie].child });
+        }
+        nd.edge_end = trie->edges.size();
+
+        nd.token_begin   = trie->tokens.size();
+        nd.partial_begin = trie->partials.size();
+        for (; it < tokens.size() && tokens[it].node == node; ++it) {
+            if (tokens[it].partial_utf8.n_remain == 0) {
+                trie->tokens.push_back(tokens[it].id);
+            } else {
+                trie->partials.push_back({ tokens[it].id, tokens[it].partial_utf8 });
+            }
+        }
+        nd.token_end   = trie->tokens.size();
+        nd.partial_end = trie->partials.size();
+    }
+
+    LLAMA_LOG_DEBUG("%s: %u nodes, %zu tokens, %zu partial tokens\n", __func__, n_nodes, trie->tokens.size(), trie->partials.size());
+
+    return trie;
+}
+
+// marks the tokens below node that some stack in stacks (positioned after the prefix leading to node)
+// accepts; same rules as llama_grammar_reject_candidates_for_stack, applied to a whole subtree at once
+static void llama_grammar_walk_trie(
+        const llama_grammar_rules      & rules,
+        const llama_grammar_vocab_trie & trie,
+        uint32_t                         node,
+        const llama_grammar_stacks     & stacks,
+        llama_grammar_token_mask       & mask) {
+    const auto & nd = trie.nodes[node];
+
+    // pieces that end here were fully consumed by at least one stack
+    for (uint32_t i = nd.token_begin; i < nd.token_end; ++i) {
+        const llama_token id = trie.tokens[i];
+        mask[id >> 5] |= 1u << (id & 31);
+    }
+
+    // pieces that end in an incomplete sequence need a stack that can still match its completion
+    for (uint32_t i = nd.partial_begin; i < nd.partial_end; ++i) {
+        const auto & partial = trie.partials[i];
+        for (const auto & stack : stacks) {
+            if (!stack.empty() && llama_grammar_match_partial_char(stack.back(), partial.partial_utf8)) {
+                mask[partial.id >> 5] |= 1u << (partial.id & 31);
+                break;
+            }
+        }
+    }
+
+    llama_grammar_stacks next_stacks;
+    for (uint32_t i = nd.edge_begin; i < nd.edge_end; ++i) {
+        const auto & edge = trie.edges[i];
+
+        next_stacks.clear();
+        for (const auto & stack : stacks) {
+            if (stack.empty()) {
+                continue;
+            }
+
+            const auto match = llama_grammar_match_char(stack.back(), edge.code_point);
+            if (match.first) {
+                llama_grammar_stack new_stack(stack.begin(), stack.end() - 1);
+                if (!llama_grammar_is_end_of_sequence(match.second)) {
+                    new_stack.push_back(match.second);
+                }
+                llama_grammar_advance_stack(rules, new_stack, next_stacks);
+            }
+        }
+
+        if (!next_stacks.empty()) {
+            llama_grammar_walk_trie(rules, trie, edge.node, next_stacks, mask);
+        }
+    }
+}
+
+// allow-mask for the given stacks, assuming no pending partial UTF-8 sequence
+static llama_grammar_token_mask llama_grammar_compute_mask(
+        const llama_grammar_rules  & rules,
+        const llama_grammar_stacks & stacks,
+        const llama_vocab          & vocab) {
+    const auto & trie = vocab.grammar_trie();
+
+    llama_grammar_token_mask mask((trie.n_vocab + 31) / 32, 0);
+
+    for (const auto & stack : stacks) {
+        if (stack.empty()) {
+            for (const llama_token id : trie.eog) {
+                mask[id >> 5] |= 1u << (id & 31);
+            }
+            break;
+        }
+    }
+
+    llama_grammar_walk_trie(rules, trie, 0, stacks, mask);
+
+    return mask;
+}
+
+//
+// grammar automaton
+//
+
+static uint64_t llama_grammar_fnv1a(uint64_t hash, const void * data, size_t size) {
+    const uint8_t * bytes = (const uint8_t *) data;
+    for (size_t i = 0; i < size; ++i) {
+        hash ^= bytes[i];
+        hash *= 0x100000001b3ull;
+    }
+    return hash;
+}
+
+static uint64_t llama_grammar_rules_hash(const llama_grammar_rules & rules) {
+    uint64_t hash = 0xcbf29ce484222325ull;
+    for (const auto & rule : rules) {
+        const uint64_t size = rule.size();
+        hash = llama_grammar_fnv1a(hash, &size, sizeof(size));
+        for (const auto & elem : rule) {
+            const uint32_t fields[2] = { (uint32_t) elem.type, elem.value };
+            hash = llama_grammar_fnv1a(hash, fields, sizeof(fields));
+        }
+    }
+    return hash;
+}
+
+// automata are only valid for the exact vocabulary they were computed with
+static uint64_t llama_grammar_vocab_hash(const llama_vocab & vocab) {
+    uint64_t hash = 0xcbf29ce484222325ull;
+    const uint32_t n_vocab = vocab.n_tokens();
+    hash = llama_grammar_fnv1a(hash, &n_vocab, sizeof(n_vocab));
+    for (uint32_t id = 0; id < n_vocab; ++id) {
+        const std::string & piece = vocab.token_to_piece(id);
+        const uint32_t header[2] = { (uint32_t) piece.size(), (uint32_t) vocab.is_eog(id) };
+        hash = llama_grammar_fnv1a(hash, header, sizeof(header));
+        hash = llama_grammar_fnv1a(hash, piece.data(), piece.size());
+    }
+    return hash;
+}
+
+static std::shared_ptr<llama_grammar_automaton> llama_grammar_automaton_init(const llama_grammar_rules & rules) {
+    auto automaton = std::make_shared<llama_grammar_automaton>();
+    automaton->rules_hash = llama_grammar_rules_hash(rules);
+
+    uint32_t offset = 0;
+    for (const auto & rule : rules) {
+        automaton->rule_offsets.push_back(offset);
+        offset += rule.size();
+    }
+    return automaton;
+}
+
+uint32_t llama_grammar_automaton::intern(const llama_grammar_state_key & key) {
+    std::lock_guard<std::mutex> lock(mutex);
+
+    const auto it = state_ids.find(key);
+    if (it != state_ids.end()) {
+        return it->second;
+    }
+    if (states.size() >= LLAMA_GRAMMAR_AUTOMATON_MAX_STATES) {
+        return no_state;
+    }
+
+    const uint32_t id = states.size();
+    states.push_back({ key, nullptr, {} });
+    state_ids.emplace(key, id);
+    return id;
+}
+
+static void llama_grammar_attach_automaton(struct llama_grammar & grammar, std::shared_ptr<llama_grammar_automaton> automaton) {
+    grammar.automaton = std::move(automaton);
+
+    grammar.rule_index.clear();
+    for (size_t i = 0; i < grammar.rules.size(); ++i) {
+        grammar.rule_index.emplace_back(grammar.rules[i].data(), (uint32_t) i);
+    }
+    std::sort(grammar.rule_index.begin(), grammar.rule_index.end());
+}
+
+static llama_grammar_state_key llama_grammar_state_key_of(const struct llama_grammar & grammar) {
+    const auto & offsets = grammar.automaton->rule_offsets;
+
+    llama_grammar_state_key key;
+    key.reserve(grammar.stacks.size());
+    for (const auto & stack : grammar.stacks) {
+        auto & positions = key.emplace_back();
+        positions.reserve(stack.size());
+        for (const llama_grammar_element * elem : stack) {
+            // last rule starting at or before elem
+            auto it = std::upper_bound(grammar.rule_index.begin(), grammar.rule_index.end(),
+                std::make_pair(elem, UINT32_MAX));
+            LM_GGML_ASSERT(it != grammar.rule_index.begin());
+            --it;
+            positions.push_back(offsets[it->second] + (uint32_t) (elem - it->first));
+        }
+    }
+    return key;
+}
+
+static llama_grammar_stacks llama_grammar_stacks_of(const struct llama_grammar & grammar, const llama_grammar_state_key & key) {
+    const auto & offsets = grammar.automaton->rule_offsets;
+
+    llama_grammar_stacks stacks;
+    stacks.reserve(key.size());
+    for (const auto & positions : key) {
+        auto & stack = stacks.emplace_back();
+        stack.reserve(positions.size());
+        for (const uint32_t pos : positions) {
+            const size_t rule = std::upper_bound(offsets.begin(), offsets.end(), pos) - offsets.begin() - 1;
+            stack.push_back(&grammar.rules[rule][pos - offsets[rule]]);
+        }
+    }
+    return stacks;
+}
+
+// state of the current stacks, or no_state if the automaton is full
+static uint32_t llama_grammar_current_state(const struct llama_grammar & grammar) {
+    return grammar.automaton->intern(llama_grammar_state_key_of(grammar));
+}
+
+// a loaded automaton must only reference elements that exist in the rules it is attached to
+static bool llama_grammar_automaton_verify(
+        const llama_grammar_automaton & loaded,
+        const llama_grammar_automaton & expected,
+        const llama_grammar_rules     & rules) {
+    if (loaded.rule_offsets != expected.rule_offsets) {
+        return false;
+    }
+    const uint32_t n_elements = rules.empty() ? 0 : expected.rule_offsets.back() + rules.back().size();
+    for (const auto & state : loaded.states) {
+        for (const auto & positions : state.key) {
+            for (const uint32_t pos : positions) {
+                if (pos >= n_elements) {
+                    return false;
+                }
+            }
+        }
+    }
+    return true;
+}
+
+std::shared_ptr<llama_grammar_automaton> llama_grammar_automaton_cache::get(const std::string & key, const llama_grammar_rules & rules) {
+    std::lock_guard<std::mutex> lock(mutex);
+
+    auto automaton = llama_grammar_automaton_init(rules);
+
+    for (auto it = entries.begin(); it != entries.end(); ++it) {
+        if (it->first == key) {
+            if (it->second->rules_hash != automaton->rules_hash ||
+                (!it->second->verified && !llama_grammar_automaton_verify(*it->second, *automaton, rules))) {
+                entries.erase(it);
+                break;
+            }
+            it->second->verified = true;
+            entries.splice(entries.begin(), entries, it);
+            return it->second;
+        }
+    }
+
+    entries.emplace_front(key, automaton);
+    if (entries.size() > LLAMA_GRAMMAR_AUTOMATON_CACHE_MAX) {
+        entries.pop_back();
+    }
+    return automaton;
+}
+
+template <typename T>
+static void llama_grammar_write(std::vector<uint8_t> & buf, const T & value) {
+    const uint8_t * bytes = (const uint8_t *) &value;
+    buf.insert(buf.end(), bytes, bytes + sizeof(T));
+}
+
+static void llama_grammar_write_u32s(std::vector<uint8_t> & buf, const std::vector<uint32_t> & values) {
+    llama_grammar_write(buf, (uint32_t) values.size());
+    const uint8_t * bytes = (const uint8_t *) values.data();
+    buf.insert(buf.end(), bytes, bytes + values.size() * sizeof(uint32_t));
+}
+
+bool llama_grammar_automaton_cache::save(const llama_vocab & vocab, const char * path) {
+    std::vector<uint8_t> buf;
+
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+
+        llama_grammar_write(buf, (uint32_t) LLAMA_GRAMMAR_AUTOMATON_MAGIC);
+        llama_grammar_write(buf, (uint32_t) LLAMA_GRAMMAR_AUTOMATON_VERSION);
+        llama_grammar_write(buf, llama_grammar_vocab_hash(vocab));
+        llama_grammar_write(buf, (uint32_t) vocab.n_tokens());
+        llama_grammar_write(buf, (uint32_t) entries.size());
+
+        for (const auto & entry : entries) {
+            auto & automaton = *entry.second;
+            std::lock_guard<std::mutex> lock_automaton(automaton.mutex);
+
+            llama_grammar_write(buf, (uint32_t) entry.first.size());
+            buf.insert(buf.end(), entry.first.begin(), entry.first.end());
+            llama_grammar_write(buf, automaton.rules_hash);
+            llama_grammar_write_u32s(buf, automaton.rule_offsets);
+
+            llama_grammar_write(buf, (uint32_t) automaton.states.size());
+            for (const auto & state : automaton.states) {
+                llama_grammar_write(buf, (uint32_t) state.key.size());
+                for (const auto & positions : state.key) {
+                    llama_grammar_write_u32s(buf, positions);
+                }
+
+                llama_grammar_write(buf, (uint8_t) (state.mask != nullptr));
+                if (state.mask) {
+                    llama_grammar_write_u32s(buf, *state.mask);
+                }
+
+                llama_grammar_write(buf, (uint32_t) state.next.size());
+                for (const auto & next : state.next) {
+                    llama_grammar_write(buf, (int32_t) next.first);
+                    llama_grammar_write(buf, next.second);
+                }
+            }
+        }
+    }
+
+    FILE * file = fopen(path, "wb");
+    if (!file) {
+        LLAMA_LOG_ERROR("%s: failed to open %s for writing\n", __func__, path);
+        return false;
+    }
+    const bool ok = fwrite(buf.data(), 1, buf.size(), file) == buf.size();
+    if (fclose(file) != 0 || !ok) {
+        LLAMA_LOG_ERROR("%s: failed to write %s\n", __func__, path);
+        return false;
+    }
+    return true;
+}
+
+namespace {
+
+struct llama_grammar_reader {
+    const uint8_t * pos;
+    const uint8_t * end;
+    bool ok = true;
+
+    template <typename T>
+    T read() {
+        T value {};
+        if ((size_t) (end - pos) < sizeof(T)) {
+            ok = false;
+            pos = end;
+            return value;
+        }
+        memcpy(&value, pos, sizeof(T));
+        pos += sizeof(T);
+        return value;
+    }
+
+    std::vector<uint32_t> read_u32s() {
+        const uint32_t n = read<uint32_t>();
+        if (!ok || (size_t) (end - pos) / sizeof(uint32_t) < n) {
+            ok = false;
+            return {};
+        }
+        std::vector<uint32_t> values(n);
+        memcpy(values.data(), pos, n * sizeof(uint32_t));
+        pos += n * sizeof(uint32_t);
+        return values;
+    }
+
+    std::string read_str() {
+        const uint32_t n = read<uint32_t>();
+        if (!ok || (size_t) (end - pos) < n) {
+            ok = false;
+            return {};
+        }
+        std::string str((const char *) pos, n);
+        pos += n;
+        return str;
+    }
+};
+
+}
+
+bool llama_grammar_automaton_cache::load(const llama_vocab & vocab, const char * path) {
+    FILE * file = fopen(path, "rb");
+    if (!file) {
+        LLAMA_LOG_ERROR("%s: failed to open %s\n", __func__, path);
+        return false;
+    }
+    std::vector<uint8_t> buf;
+    {
+        uint8_t chunk[1 << 16];
+        size_t n;
+        while ((n = fread(chunk, 1, sizeof(chunk), file)) > 0) {
+            buf.insert(buf.end(), chunk, chunk + n);
+        }
+    }
+    fclose(file);
+
+    llama_grammar_reader reader { buf.data(), buf.data() + buf.size() };
+
+    const uint32_t magic   = reader.read<uint32_t>();
+    const uint32_t version = reader.read<uint32_t>();
+    if (!reader.ok || magic != LLAMA_GRAMMAR_AUTOMATON_MAGIC || version != LLAMA_GRAMMAR_AUTOMATON_VERSION) {
+        LLAMA_LOG_ERROR("%s: %s is not a grammar cache file\n", __func__, path);
+        return false;
+    }
+
+    const uint64_t vocab_hash = reader.read<uint64_t>();
+    const uint32_t n_vocab    = reader.read<uint32_t>();
+    if (!reader.ok || n_vocab != vocab.n_tokens() || vocab_hash != llama_grammar_vocab_hash(vocab)) {
+        LLAMA_LOG_ERROR("%s: %s was saved for a different vocabulary\n", __func__, path);
+        return false;
+    }
+    const size_t n_words = (n_vocab + 31) / 32;
+
+    std::vector<std::pair<std::string, std::shared_ptr<llama_grammar_automaton>>> loaded;
+
+    const uint32_t n_entries = reader.read<uint32_t>();
+    for (uint32_t ie = 0; ie < n_entries && reader.ok; ++ie) {
+        auto automaton = std::make_shared<llama_grammar_automaton>();
+
+        std::string key = reader.read_str();
+        automaton->rules_hash   = reader.read<uint64_t>();
+        automaton->rule_offsets = reader.read_u32s();
+        automaton->verified     = false;
+
+        const uint32_t n_states = reader.read<uint32_t>();
+        for (uint32_t is = 0; is < n_states && reader.ok; ++is) {
+            llama_grammar_automaton::state state;
+
+            const uint32_t n_stacks = reader.read<uint32_t>();
+            for (uint32_t k = 0; k < n_stacks && reader.ok; ++k) {
+                state.key.push_back(reader.read_u32s());
+            }
+
+            if (reader.read<uint8_t>()) {
+                auto mask = reader.read_u32s();
+                if (mask.size() != n_words) {
+                    reader.ok = false;
+                    break;
+                }
+                state.mask = std::make_shared<const llama_grammar_token_mask>(std::move(mask));
+                automaton->n_masks++;
+            }
+
+            const uint32_t n_next = reader.read<uint32_t>();
+            for (uint32_t k = 0; k < n_next && reader.ok; ++k) {
+                const int32_t  token = reader.read<int32_t>();
+                const uint32_t next  = reader.read<uint32_t>();
+                if (next >= n_states || token < 0 || (uint32_t) token >= n_vocab) {
+                    reader.ok = false;
+                    break;
+                }
+                state.next.emplace(token, next);
+            }
+
+            automaton->state_ids.emplace(state.key, is);
+            automaton->states.push_back(std::move(state));
+        }
+
+        loaded.emplace_back(std::move(key), std::move(automaton));
+    }
+
+    if (!reader.ok) {
+        LLAMA_LOG_ERROR("%s: %s is truncated or corrupted\n", __func__, path);
+        return false;
+    }
+
+    std::lock_guard<std::mutex> lock(mutex);
+    for (auto & entry : loaded) {
+        entries.remove_if([&](const auto & e) { return e.first == entry.first; });
+        entries.emplace_front(std::move(entry));
+    }
+    while (entries.size() > LLAMA_GRAMMAR_AUTOMATON_CACHE_MAX) {
+        entries.pop_back();
+    }
+
+    LLAMA_LOG_INFO("%s: loaded %zu grammar automata from %s\n", __func__, loaded.size(), path);
+    return true;
+}
+
+static void llama_grammar_apply_mask(const llama_grammar_token_mask & mask, llama_token_data_array * cur_p) {
+    // branch-free select, so the loop vectorizes
+    for (size_t i = 0; i < cur_p->size; ++i) {
+        const llama_token id = cur_p->data[i].id;
+        const bool allowed = (mask[id >> 5] >> (id & 31)) & 1;
+        cur_p->data[i].logit = allowed ? cur_p->data[i].logit : -INFINITY;
+    }
+}
+
+//
+// trigger patterns
+//
+
+// bounds of a trigger DFA; patterns beyond them keep std::regex
+static constexpr size_t LLAMA_GRAMMAR_TRIGGER_MAX_INSTS  = 8192;
+static constexpr size_t LLAMA_GRAMMAR_TRIGGER_MAX_STATES = 4096;
+static constexpr int    LLAMA_GRAMMAR_TRIGGER_MAX_REPEAT = 1000;
+
+namespace {
+
+struct llama_grammar_regex_node {
+    enum type_t { SET, CAT, ALT, REPEAT, GROUP, BOL, EOL };
+
+    type_t   type;
+    uint32_t set    = 0;    // SET: index in the DFA's sets
+    int      min    = 0;    // REPEAT
+    int      max    = -1;   // REPEAT, -1 if unbounded
+    bool     greedy = true; // REPEAT
+    uint32_t group  = 0;    // GROUP: capture index, 0 if non-capturing
+
+    std::vector<llama_grammar_regex_node> children;
+
+    llama_grammar_regex_node(type_t type, uint32_t set = 0) : type(type), set(set) {}
+};
+
+// recursive descent over an ECMAScript pattern, bytewise like std::regex on char. anything it does not
+// know (backreferences, assertions other than ^ and $, lookarounds, POSIX classes) clears ok
+struct llama_grammar_regex_parser {
+    const std::string             & src;
+    std::vector<std::bitset<256>> & sets;
+
+    size_t   pos      = 0;
+    bool     ok       = true;
+    uint32_t n_groups = 0;
+
+    llama_grammar_regex_parser(const std::string & src, std::vector<std::bitset<256>> & sets) : src(src), sets(sets) {}
+
+    bool at_end() const { return pos >= src.size(); }
+
+    llama_grammar_regex_node fail() {
+        ok = false;
+        return { llama_grammar_regex_node::CAT };
+    }
+
+    static std::bitset<256> char_set(const char * chars) {
+        std::bitset<256> set;
+        for (const char * c = chars; *c; ++c) {
+            set.set((unsigned char) *c);
+        }
+        return set;
+    }
+
+    static std::bitset<256> range_set(unsigned char lo, unsigned char hi) {
+        std::bitset<256> set;
+        for (unsigned c = lo; c <= hi; ++c) {
+            set.set(c);
+        }
+        return set;
+    }
+
+    static int hex_value(char c) {
+        if ('0' <= c && c <= '9') return c - '0';
+        if ('a' <= c && c <= 'f') return c - 'a' + 10;
+        if ('A' <= c && c <= 'F') return c - 'A' + 10;
+        return -1;
+    }
+
+    // escape after the backslash; single is the byte it stands for, or -1 for a class escape
+    bool parse_escape(bool in_class, std::bitset<256> & set, int & single) {
+        if (at_end()) {
+            return false;
+        }
+        const char c = src[pos++];
+        const std::bitset<256> digits = range_set('0', '9');
+        const std::bitset<256> word   = digits | range_set('a', 'z') | range_set('A', 'Z') | char_set("_");
+        const std::bitset<256> space  = char_set(" \t\n\v\f\r");
+
+        single = -1;
+        switch (c) {
+            case 'd': set |= digits;  return true;
+            case 'D': set |= ~digits; return true;
+            case 'w': set |= word;    return true;
+            case 'W': set |= ~word;   return true;
+            case 's': set |= space;   return true;
+            case 'S': set |= ~space;  return true;
+            case 'n': single = '\n'; break;
+            case 't': single = '\t'; break;
+            case 'r': single = '\r'; break;
+            case 'f': single = '\f'; break;
+            case 'v': single = '\v'; break;
+            case 'b':
+                if (!in_class) {
+                    return false; // word boundary
+                }
+                single = '\b';
+                break;
+            case '0':
+                if (!at_end() && is_digit_char(src[pos])) {
+                    return false;
+                }
+                single = 0;
+                break;
+            case 'x':
+            case 'u': {
+                const size_t n = c == 'x' ? 2 : 4;
+                if (pos + n > src.size()) {
+                    return false;
+                }
+                int value = 0;
+                for (size_t i = 0; i < n; ++i) {
+                    const int digit = hex_value(src[pos++]);
+                    if (digit < 0) {
+                        return false;
+                    }
+                    value = value * 16 + digit;
+                }
+                if (value >= 0x80 && c == 'u') {
+                    return false; // not a single byte
+                }
+                single = value;
+                break;
+            }
+            default:
+                if (('a' <= c && c <= 'z') || ('A' <= c && c <= 'Z') || is_digit_char(c)) {
+                    return false; // backreferences, \B, \c and unknown escapes
+                }
+                single = (unsigned char) c;
+                break;
+        }
+        set.set(single);
+        return true;
+    }
+
+    // one element of a bracket expression
+    bool parse_class_atom(std::bitset<256> & set, int & single) {
+        const char c = src[pos++];
+        if (c == '\\') {
+            return parse_escape(true, set, single);
+        }
+        if (c == '[' && !at_end() && (src[pos] == ':' || src[pos] == '.' || src[pos] == '=')) {
+            return false;
+        }
+        single = (unsigned char) c;
+        set.set(single);
+        return true;
+    }
+
+    llama_grammar_regex_node parse_class() {
+        std::bitset<256> set;
+        bool negated = false;
+        if (!at_end() && src[pos] == '^') {
+            negated = true;
+            pos++;
+        }
+        while (!at_end() && src[pos] != ']') {
+            std::bitset<256> atom;
+            int lo;
+            if (!parse_class_atom(atom, lo)) {
+                return fail();
+            }
+            if (pos + 1 < src.size() && src[pos] == '-' && src[pos + 1] != ']') {
+                pos++;
+                std::bitset<256> unused;
+                int hi;
+                if (!parse_class_atom(unused, hi) || lo < 0 || hi < 0 || lo > hi) {
+                    return fail();
+                }
+                atom = range_set((unsigned char) lo, (unsigned char) hi);
+            }
+            set |= atom;
+        }
+        if (at_end()) {
+            return fail();
+        }
+        pos++;
+
+        if (negated) {
+            set.flip();
+        }
+        sets.push_back(set);
+        return { llama_grammar_regex_node::SET, (uint32_t) sets.size() - 1 };
+    }
+
+    llama_grammar_regex_node parse_atom() {
+        const char c = src[pos++];
+        switch (c) {
+            case '(': {
+                uint32_t group = 0;
+                if (!at_end() && src[pos] == '?') {
+                    if (pos + 1 >= src.size() || src[pos + 1] != ':') {
+                        return fail(); // lookarounds
+                    }
+                    pos += 2;
+                } else {
+                    group = ++n_groups;
+                }
+                llama_grammar_regex_node node = { llama_grammar_regex_node::GROUP };
+                node.group = group;
+                node.children.push_back(parse_alternates());
+                if (!ok || at_end() || src[pos] != ')') {
+                    return fail();
+                }
+                pos++;
+                return node;
+            }
+            case '[':
+                return parse_class();
+            case '.': {
+                std::bitset<256> set;
+                set.set();
+                set.reset('\n');
+                set.reset('\r');
+                sets.push_back(set);
+                return { llama_grammar_regex_node::SET, (uint32_t) sets.size() - 1 };
+            }
+            case '^':
+                return { llama_grammar_regex_node::BOL };
+            case '$':
+                return { llama_grammar_regex_node::EOL };
+            case '\\': {
+                std::bitset<256> set;
+                int single;
+                if (!parse_escape(false, set, single)) {
+                    return fail();
+                }
+                sets.push_back(set);
+                return { llama_grammar_regex_node::SET, (uint32_t) sets.size() - 1 };
+            }
+            case '*':
+            case '+':
+            case '?':
+            case '{':
+            case '}':
+            case ']':
+                return fail();
+            default: {
+                std::bitset<256> set;
+                set.set((unsigned char) c);
+                sets.push_back(set);
+                return { llama_grammar_regex_node::SET, (uint32_t) sets.size() - 1 };
+            }
+        }
+    }
+
+    bool parse_int(int & value) {
+        if (at_end() || !is_digit_char(src[pos])) {
+            return false;
+        }
+        value = 0;
+        while (!at_end() && is_digit_char(src[pos])) {
+            value = std::min(value * 10 + (src[pos++] - '0'), LLAMA_GRAMMAR_TRIGGER_MAX_REPEAT + 1);
+        }
+        return true;
+    }
+
+    // applies the quantifier at pos, if any, to atom
+    llama_grammar_regex_node parse_quantifier(llama_grammar_regex_node && atom) {
+        int min;
+        int max;
+        switch (src[pos]) {
+            case '*': min = 0; max = -1; pos++; break;
+            case '+': min = 1; max = -1; pos++; break;
+            case '?': min = 0; max =  1; pos++; break;
+            case '{':
+                pos++;
+                if (!parse_int(min)) {
+                    return fail();
+                }
+                max = min;
+                if (!at_end() && src[pos] == ',') {
+                    pos++;
+                    max = -1;
+                    if (!at_end() && src[pos] != '}' && (!parse_int(max) || max < min)) {
+                        return fail();
+                    }
+                }
+                if (at_end() || src[pos] != '}' || std::max(min, max) > LLAMA_GRAMMAR_TRIGGER_MAX_REPEAT) {
+                    return fail();
+                }
+                pos++;
+                break;
+            default:
+                return std::move(atom);
+        }
+
+        llama_grammar_regex_node node = { llama_grammar_regex_node::REPEAT };
+        node.min = min;
+        node.max = max;
+        if (!at_end() && src[pos] == '?') {
+            node.greedy = false;
+            pos++;
+        }
+        if (!at_end() && (src[pos] == '*' || src[pos] == '+' || src[pos] == '?' || src[pos] == '{')) {
+            return fail();
+        }
+        node.children.push_back(std::move(atom));
+        return node;
+    }
+
+    llama_grammar_regex_node parse_sequence() {
+        llama_grammar_regex_node seq = { llama_grammar_regex_node::CAT };
+        while (ok && !at_end() && src[pos] != '|' && src[pos] != ')') {
+            llama_grammar_regex_node atom = parse_atom();
+            if (ok && !at_end()) {
+                atom = parse_quantifier(std::move(atom));
+            }
+            seq.children.push_back(std::move(atom));
+        }
+        return seq;
+    }
+
+    llama_grammar_regex_node parse_alternates() {
+        llama_grammar_regex_node alt = { llama_grammar_regex_node::ALT };
+        alt.children.push_back(parse_sequence());
+        while (ok && !at_end() && src[pos] == '|') {
+            pos++;
+            alt.children.push_back(parse_sequence());
+        }
+        if (alt.children.size() == 1) {
+            return std::move(alt.children[0]);
+        }
+        return alt;
+    }
+};
+
+}
+
+// appends the program of node; false once the program is too large
+static bool llama_grammar_trigger_emit(const llama_grammar_regex_node & node, std::vector<llama_grammar_trigger_dfa::inst> & prog) {
+    using dfa = llama_grammar_trigger_dfa;
+
+    if (prog.size() > LLAMA_GRAMMAR_TRIGGER_MAX_INSTS) {
+        return false;
+    }
+    switch (node.type) {
+        case llama_grammar_regex_node::SET:
+            prog.push_back({ dfa::OP_SET, node.set });
+            break;
+        case llama_grammar_regex_node::BOL:
+            prog.push_back({ dfa::OP_BOL });
+            break;
+        case llama_grammar_regex_node::EOL:
+            prog.push_back({ dfa::OP_EOL });
+            break;
+        case llama_grammar_regex_node::CAT:
+            for (const auto & child : node.children) {
+                if (!llama_grammar_trigger_emit(child, prog)) {
+                    return false;
+                }
+            }
+            break;
+        case llama_grammar_regex_node::GROUP:
+            if (node.group == 1) {
+                prog.push_back({ dfa::OP_SAVE });
+            }
+            return llama_grammar_trigger_emit(node.children[0], prog);
+        case llama_grammar_regex_node::ALT: {
+            // earlier alternatives first
+            std::vector<size_t> jumps;
+            for (size_t i = 0; i + 1 < node.children.size(); ++i) {
+                const size_t split = prog.size();
+                prog.push_back({ dfa::OP_SPLIT, (uint32_t) split + 1 });
+                if (!llama_grammar_trigger_emit(node.children[i], prog)) {
+                    return false;
+                }
+                jumps.push_back(prog.size());
+                prog.push_back({ dfa::OP_JMP });
+                prog[split].y = (uint32_t) prog.size();
+            }
+            if (!llama_grammar_trigger_emit(node.children.back(), prog)) {
+                return false;
+            }
+            for (const size_t jump : jumps) {
+                prog[jump].x = (uint32_t) prog.size();
+            }
+            break;
+        }
+        case llama_grammar_regex_node::REPEAT: {
+            const auto & child = node.children[0];
+            for (int i = 0; i < node.min; ++i) {
+                if (!llama_grammar_trigger_emit(child, prog)) {
+                    return false;
+                }
+            }
+            // greedy repetitions prefer another iteration, lazy ones prefer to stop
+            std::vector<size_t> splits;
+            if (node.max < 0) {
+                splits.push_back(prog.size());
+                prog.push_back({ dfa::OP_SPLIT });
+                if (!llama_grammar_trigger_emit(child, prog)) {
+                    return false;
+                }
+                prog.push_back({ dfa::OP_JMP, (uint32_t) splits[0] });
+            } else {
+                for (int i = node.min; i < node.max; ++i) {
+                    splits.push_back(prog.size());
+                    prog.push_back({ dfa::OP_SPLIT });
+                    if (!llama_grammar_trigger_emit(child, prog)) {
+                        return false;
+                    }
+                }
+            }
+            const uint32_t exit = (uint32_t) prog.size();
+            for (const size_t split : splits) {
+                prog[split].x = node.greedy ? (uint32_t) split + 1 : exit;
+                prog[split].y = node.greedy ? exit : (uint32_t) split + 1;
+            }
+            break;
+        }
+    }
+    return prog.size() <= LLAMA_GRAMMAR_TRIGGER_MAX_INSTS;
+}
+
+// instructions reachable from pcs without consuming a byte that consume a byte, match, or wait for the end
+// of the text (unless at_end). seen is scratch space of prog.size() entries, all false
+static std::vector<uint32_t> llama_grammar_trigger_closure(
+        const llama_grammar_trigger_dfa & dfa,
+        const std::vector<uint32_t>     & pcs,
+        bool                              at_start,
+        bool                              at_end,
+        std::vector<uint8_t>            & seen) {
+    std::vector<uint32_t> result;
+    std::vector<uint32_t> visited;
+    std::vector<uint32_t> stack(pcs.rbegin(), pcs.rend());
+    while (!stack.empty()) {
+        const uint32_t pc = stack.back();
+        stack.pop_back();
+        if (seen[pc]) {
+            continue;
+        }
+        seen[pc] = 1;
+        visited.push_back(pc);
+
+        const auto & in = dfa.prog[pc];
+        switch (in.op) {
+            case llama_grammar_trigger_dfa::OP_SPLIT:
+                stack.push_back(in.y);
+                stack.push_back(in.x);
+                break;
+            case llama_grammar_trigger_dfa::OP_JMP:
+                stack.push_back(in.x);
+                break;
+            case llama_grammar_trigger_dfa::OP_SAVE:
+                stack.push_back(pc + 1);
+                break;
+            case llama_grammar_trigger_dfa::OP_BOL:
+                if (at_start) {
+                    stack.push_back(pc + 1);
+                }
+                break;
+            case llama_grammar_trigger_dfa::OP_EOL:
+                result.push_back(pc);
+                if (at_end) {
+                    stack.push_back(pc + 1);
+                }
+                break;
+            case llama_grammar_trigger_dfa::OP_SET:
+            case llama_grammar_trigger_dfa::OP_MATCH:
+                result.push_back(pc);
+                break;
+        }
+    }
+    for (const uint32_t pc : visited) {
+        seen[pc] = 0;
+    }
+    std::sort(result.begin(), result.end());
+    return result;
+}
+
+std::shared_ptr<const llama_grammar_trigger_dfa> llama_grammar_trigger_dfa_init(const std::string & pattern) {
+    using dfa_t = llama_grammar_trigger_dfa;
+
+    auto dfa = std::make_shared<dfa_t>();
+
+    llama_grammar_regex_parser parser(pattern, dfa->sets);
+    const llama_grammar_regex_node root = parser.parse_alternates();
+    if (!parser.ok || !parser.at_end()) {
+        return nullptr;
+    }
+    if (!llama_grammar_trigger_emit(root, dfa->prog)) {
+        return nullptr;
+    }
+    dfa->prog.push_back({ dfa_t::OP_MATCH });
+
+    // bytes in exactly the same sets behave the same in every state
+    std::map<std::vector<bool>, uint32_t> classes;
+    std::vector<uint8_t> representative;
+    for (int c = 0; c < 256; ++c) {
+        std::vector<bool> signature(dfa->sets.size());
+        for (size_t i = 0; i < dfa->sets.size(); ++i) {
+            signature[i] = dfa->sets[i][c];
+        }
+        const auto it = classes.emplace(std::move(signature), (uint32_t) classes.size());
+        if (it.second) {
+            representative.push_back((uint8_t) c);
+        }
+        dfa->byte_class[c] = (uint8_t) it.first->second;
+    }
+    dfa->n_classes = (uint32_t) classes.size();
+
+    // subset construction; state 0 is the empty set, state 1 the start
+    std::vector<uint8_t> seen(dfa->prog.size(), 0);
+    std::vector<std::vector<uint32_t>> states = {
+        {},
+        llama_grammar_trigger_closure(*dfa, { 0 }, true, false, seen),
+    };
+    std::map<std::vector<uint32_t>, uint32_t> state_ids = { { states[0], 0 } };
+    state_ids.emplace(states[1], 1);
+
+    for (size_t id = 0; id < states.size(); ++id) {
+        const std::vector<uint32_t> pcs = states[id];
+        const auto final_pcs = llama_grammar_trigger_closure(*dfa, pcs, false, true, seen);
+        dfa->accept.push_back(std::any_of(final_pcs.begin(), final_pcs.end(), [&](uint32_t pc) {
+            return dfa->prog[pc].op == dfa_t::OP_MATCH;
+        }));
+
+        for (uint32_t cls = 0; cls < dfa->n_classes; ++cls) {
+            std::vector<uint32_t> from;
+            for (const uint32_t pc : pcs) {
+                const auto & in = dfa->prog[pc];
+                if (in.op == dfa_t::OP_SET && dfa->sets[in.x][representative[cls]]) {
+                    from.push_back(pc + 1);
+                }
+            }
+            auto to = llama_grammar_trigger_closure(*dfa, from, false, false, seen);
+            const auto it = state_ids.emplace(std::move(to), (uint32_t) states.size());
+            if (it.second) {
+                if (states.size() >= LLAMA_GRAMMAR_TRIGGER_MAX_STATES) {
+                    return nullptr;
+                }
+                states.push_back(it.first->first);
+            }
+            dfa->next.push_back(it.first->second);
+        }
+    }
+
+    return dfa;
+}
+
+uint32_t llama_grammar_trigger_dfa::step(uint32_t state, const std::string & piece) const {
+    for (const char c : piece) {
+        if (state == dead_state) {
+            break;
+        }
+        state = next[(size_t) state * n_classes + byte_class[(uint8_t) c]];
+    }
+    return state;
+}
+
+size_t llama_grammar_trigger_dfa::group_start(const std::string & text) const {
+    // breadth-first simulation of the program (Pike VM): threads are kept in the order a backtracking
+    // matcher would try them, and of the threads reaching an instruction at a position only the first
+    // one survives, so the first thread matching at the end carries the capture std::regex would report
+    struct thread {
+        uint32_t pc;
+        size_t   start;
+    };
+
+    std::vector<thread> clist;
+    std::vector<thread> nlist;
+    std::vector<thread> stack;
+    std::vector<size_t> seen(prog.size(), SIZE_MAX); // position at which an instruction was last reached
+
+    auto add = [&](std::vector<thread> & list, thread t, size_t pos) {
+        stack.push_back(t);
+        while (!stack.empty()) {
+            t = stack.back();
+            stack.pop_back();
+            if (seen[t.pc] == pos) {
+                continue;
+            }
+            seen[t.pc] = pos;
+
+            const inst & in = prog[t.pc];
+            switch (in.op) {
+                case OP_SPLIT:
+                    stack.push_back({ in.y, t.start });
+                    stack.push_back({ in.x, t.start });
+                    break;
+                case OP_JMP:
+                    stack.push_back({ in.x, t.start });
+                    break;
+                case OP_SAVE:
+                    stack.push_back({ t.pc + 1, pos });
+                    break;
+                case OP_BOL:
+                    if (pos == 0) {
+                        stack.push_back({ t.pc + 1, t.start });
+                    }
+                    break;
+                case OP_EOL:
+                    if (pos == text.size()) {
+                        stack.push_back({ t.pc + 1, t.start });
+                    }
+                    break;
+                case OP_SET:
+                case OP_MATCH:
+                    list.push_back(t);
+                    break;
+            }
+        }
+    };
+
+    add(clist, { 0, text.size() }, 0);
+    for (size_t pos = 0; pos < text.size() && !clist.empty(); ++pos) {
+        const uint8_t c = text[pos];
+        nlist.clear();
+        for (const thread & t : clist) {
+            const inst & in = prog[t.pc];
+            if (in.op == OP_SET && sets[in.x][c]) {
+                add(nlist, { t.pc + 1, t.start }, pos + 1);
+            }
+        }
+        std::swap(clist, nlist);
+    }
+    for (const thread & t : clist) {
+        if (prog[t.pc].op == OP_MATCH) {
+            return t.start;
+        }
+    }
+    return text.size();
+}
+
 ////////////////////
 
 struct llama_grammar * llama_grammar_init_impl(
@@ -960,7 +2201,7 @@ struct llama_grammar * llama_grammar_init_impl(
     // Important: vec_rules has to be moved here, not copied, because stacks contains
     // pointers to elements of vec_rules. If vec_rules were copied into llama_grammar
     // then the pointers would be invalidated when the local vec_rules goes out of scope.
-    return new llama_grammar {
+    auto * result = new llama_grammar {
         vocab,
         std::move(vec_rules),
         std::move(stacks),
@@ -970,7 +2211,15 @@ struct llama_grammar * llama_grammar_init_impl(
         /* .trigger_buffer = */   "",
         /* .trigger_tokens   = */ {},
         /* .trigger_patterns    = */ {},
+        /* .automaton = */        nullptr,
+        /* .rule_index = */       {},
     };
+
+    if (vocab) {
+        llama_grammar_attach_automaton(*result, llama_grammar_automaton_init(result->rules));
+    }
+
+    return result;
 }
 
 struct llama_grammar * llama_grammar_init_impl(
@@ -1059,13 +2308,17 @@ struct llama_grammar * llama_grammar_init_impl(
         LM_GGML_ASSERT(trigger_patterns != nullptr);
         auto & trigger = vec_trigger_patterns.emplace_back();
         trigger.pattern = trigger_patterns[i];
-        trigger.regex = std::regex(trigger.pattern);
+        trigger.dfa = llama_grammar_trigger_dfa_init(trigger.pattern);
+        if (!trigger.dfa) {
+            LLAMA_LOG_DEBUG("%s: matching trigger pattern with std::regex: '%s'\n", __func__, trigger.pattern.c_str());
+            trigger.regex = std::regex(trigger.pattern);
+        }
     }
 
     // Important: vec_rules has to be moved here, not copied, because stacks contains
     // pointers to elements of vec_rules. If vec_rules were copied into llama_grammar
     // then the pointers would be invalidated when the local vec_rules goes out of scope.
-    return new llama_grammar {
+    auto * result = new llama_grammar {
         vocab,
         std::move(vec_rules),
         std::move(stacks),
@@ -1075,7 +2328,17 @@ struct llama_grammar * llama_grammar_init_impl(
         /* .trigger_buffer = */   "",
         std::move(vec_trigger_tokens),
         std::move(vec_trigger_patterns),
+        /* .automaton = */        nullptr,
+        /* .rule_index = */       {},
     };
+
+    // instances of the same grammar share one automaton
+    if (vocab) {
+        const std::string key = std::string(grammar_root) + '\n' + grammar_str;
+        llama_grammar_attach_automaton(*result, vocab->grammar_automata().get(key, result->rules));
+    }
+
+    return result;
 }
 
 void llama_grammar_free_impl(struct llama_grammar * grammar) {
@@ -1097,8 +2360,14 @@ struct llama_grammar * llama_grammar_clone_impl(const struct llama_grammar & gra
         grammar.trigger_buffer,
         grammar.trigger_tokens,
         grammar.trigger_patterns,
+        /* .automaton = */  nullptr,
+        /* .rule_index = */ {},
     };
 
+    if (grammar.automaton) {
+        llama_grammar_attach_automaton(*result, grammar.automaton);
+    }
+
     // redirect elements in stacks to point to new rules
     for (size_t is = 0; is < result->stacks.size(); is++) {
         for (size_t ie = 0; ie < result->stacks[is].size(); ie++) {
@@ -1122,6 +2391,34 @@ void llama_grammar_apply_impl(const struct llama_grammar & grammar, llama_token_
         return;
     }
 
+    // the mask only depends on the stacks when no UTF-8 sequence is pending
+    if (grammar.partial_utf8.n_remain == 0 && grammar.automaton) {
+        auto & automaton = *grammar.automaton;
+        const uint32_t id = llama_grammar_current_state(grammar);
+
+        std::shared_ptr<const llama_grammar_token_mask> mask;
+        if (id != llama_grammar_automaton::no_state) {
+            std::lock_guard<std::mutex> lock(automaton.mutex);
+            mask = automaton.states[id].mask;
+        }
+        if (!mask && cur_p->size >= grammar.vocab->n_tokens() / LLAMA_GRAMMAR_MASK_MIN_CANDIDATES_DIV) {
+            mask = std::make_shared<const llama_grammar_token_mask>(
+                llama_grammar_compute_mask(grammar.rules, grammar.stacks, *grammar.vocab));
+            if (id != llama_grammar_automaton::no_state) {
+                std::lock_guard<std::mutex> lock(automaton.mutex);
+                auto & state = automaton.states[id];
+                if (!state.mask && automaton.n_masks < LLAMA_GRAMMAR_AUTOMATON_MAX_MASKS) {
+                    state.mask = mask;
+                    automaton.n_masks++;
+                }
+            }
+        }
+        if (mask) {
+            llama_grammar_apply_mask(*mask, cur_p);
+            return;
+        }
+    }
+
     bool allow_eog = false;
     for (const auto & stack : grammar.stacks) {
         if (stack.empty()) {
@@ -1173,13 +2470,24 @@ void llama_grammar_accept_impl(struct llama_grammar & grammar, llama_token token
         } else {
             grammar.trigger_buffer += piece;
 
-            std::smatch match;
-            for (const auto & trigger_pattern : grammar.trigger_patterns) {
-                if (std::regex_match(grammar.trigger_buffer, match, trigger_pattern.regex)) {
+            for (auto & trigger_pattern : grammar.trigger_patterns) {
+                // start of the first match group, npos while the pattern does not match the whole buffer
+                size_t start = std::string::npos;
+                if (trigger_pattern.dfa) {
+                    trigger_pattern.dfa_state = trigger_pattern.dfa->step(trigger_pattern.dfa_state, piece);
+                    if (trigger_pattern.dfa->accept[trigger_pattern.dfa_state]) {
+                        start = trigger_pattern.dfa->group_start(grammar.trigger_buffer);
+                    }
+                } else {
+                    std::smatch match;
+                    if (std::regex_match(grammar.trigger_buffer, match, trigger_pattern.regex)) {
+                        start = match.position(1);
+                    }
+                }
+                if (start != std::string::npos) {
                     grammar.awaiting_trigger = false;
                     // get from the first match to the end of the string
-                    auto constrained_str = grammar.trigger_buffer.substr(match.position(1));
-                    // std::string constrained_str(match[1].first, grammar.trigger_buffer.end());
+                    auto constrained_str = grammar.trigger_buffer.substr(start);
                     grammar.trigger_buffer.clear();
                     llama_grammar_accept_str(grammar, constrained_str);
                     LLAMA_LOG_DEBUG("Grammar triggered on regex: '%s'\n", constrained_str.c_str());
@@ -1200,6 +2508,38 @@ void llama_grammar_accept_impl(struct llama_grammar & grammar, llama_token token
         LM_GGML_ABORT("fatal error");
     }
 
+    // follow the automaton when the token starts and ends on a code point boundary
+    if (grammar.partial_utf8.n_remain == 0 && grammar.automaton) {
+        auto & automaton = *grammar.automaton;
+        const uint32_t from = llama_grammar_current_state(grammar);
+        if (from != llama_grammar_automaton::no_state) {
+            const llama_grammar_automaton::state * to = nullptr;
+            {
+                std::lock_guard<std::mutex> lock(automaton.mutex);
+                const auto it = automaton.states[from].next.find(token);
+                if (it != automaton.states[from].next.end()) {
+                    to = &automaton.states[it->second];
+                }
+            }
+            if (to) {
+                // keys are immutable once interned
+                grammar.stacks = llama_grammar_stacks_of(grammar, to->key);
+                return;
+            }
+
+            llama_grammar_accept_str(grammar, piece);
+
+            if (grammar.partial_utf8.n_remain == 0) {
+                const uint32_t next = llama_grammar_current_state(grammar);
+                if (next != llama_grammar_automaton::no_state) {
+                    std::lock_guard<std::mutex> lock(automaton.mutex);
+                    automaton.states[from].next.emplace(token, next);
+                }
+            }
+            return;
+        }
+    }
+
     llama_grammar_accept_str(grammar, piece);
 }
 
@@ -2,9 +2,15 @@
 
 #include "llama.h"
 
+#include <bitset>
+#include <deque>
+#include <list>
 #include <map>
+#include <memory>
+#include <mutex>
 #include <regex>
 #include <string>
+#include <unordered_map>
 #include <vector>
 
 struct llama_vocab;
@@ -76,6 +82,91 @@ std::vector<llama_grammar_candidate> llama_grammar_reject_candidates_for_stack(
         const llama_grammar_stack      & stack,
         const llama_grammar_candidates & candidates);
 
+// token pieces of a vocabulary decoded into a code point trie
+// candidate rejection walks each shared prefix once for all the tokens that start with it, instead of
+// decoding and matching every token separately
+struct llama_grammar_vocab_trie {
+    struct node {
+        uint32_t edge_begin;    // children: edges[edge_begin, edge_end)
+        uint32_t edge_end;
+        uint32_t token_begin;   // tokens whose piece ends at this node: tokens[token_begin, token_end)
+        uint32_t token_end;
+        uint32_t partial_begin; // tokens whose piece ends at this node inside an incomplete UTF-8 sequence
+        uint32_t partial_end;
+    };
+
+    struct edge {
+        uint32_t code_point;
+        uint32_t node;
+    };
+
+    struct partial_token {
+        llama_token        id;
+        llama_partial_utf8 partial_utf8;
+    };
+
+    uint32_t n_vocab = 0;
+
+    std::vector<node>          nodes; // nodes[0] is the root
+    std::vector<edge>          edges; // sorted by code point within a node
+    std::vector<llama_token>   tokens;
+    std::vector<partial_token> partials;
+    std::vector<llama_token>   eog;   // end-of-generation tokens, allowed when a stack is complete
+
+    // tokens that are never in the trie (empty pieces, pieces starting with 0, invalid UTF-8) are always rejected
+};
+
+std::unique_ptr<llama_grammar_vocab_trie> llama_grammar_vocab_trie_init(const llama_vocab & vocab);
+
+// allow-mask over the vocabulary, one bit per token
+using llama_grammar_token_mask = std::vector<uint32_t>;
+
+// a set of stacks with every element given by its position in the flattened rules
+// (rule_offsets[rule] + index), so that it does not depend on where the rules are allocated
+using llama_grammar_state_key = std::vector<std::vector<uint32_t>>;
+
+// grammar compiled into an automaton over complete tokens
+// a state is a distinct configuration of the pushdown stacks; each state owns the allow-mask of the
+// vocabulary for that configuration and its transitions on accepted tokens. states are discovered as
+// generation reaches them (recursive grammars have unboundedly many) and are shared by every grammar
+// instance built from the same grammar text, so masks are computed once per state. the whole automaton
+// can be serialized with the vocabulary's llama_grammar_automaton_cache
+struct llama_grammar_automaton {
+    struct state {
+        llama_grammar_state_key                         key;
+        std::shared_ptr<const llama_grammar_token_mask> mask; // null until computed
+        std::unordered_map<llama_token, uint32_t>       next; // transitions on tokens that leave no partial UTF-8 sequence
+    };
+
+    static constexpr uint32_t no_state = UINT32_MAX;
+
+    uint64_t              rules_hash = 0;
+    std::vector<uint32_t> rule_offsets;
+    bool                  verified = true; // false for loaded automata until checked against the rules
+
+    std::mutex                                  mutex;
+    std::deque<state>                           states;
+    std::map<llama_grammar_state_key, uint32_t> state_ids;
+    size_t                                      n_masks = 0;
+
+    // returns the id of the state with this key, adding it if there is room
+    uint32_t intern(const llama_grammar_state_key & key);
+};
+
+// compiled automata of a vocabulary, keyed by grammar text and root symbol
+struct llama_grammar_automaton_cache {
+    std::mutex mutex;
+
+    // most recently used first
+    std::list<std::pair<std::string, std::shared_ptr<llama_grammar_automaton>>> entries;
+
+    // returns the automaton for this grammar, replacing a cached one that was compiled from different rules
+    std::shared_ptr<llama_grammar_automaton> get(const std::string & key, const llama_grammar_rules & rules);
+
+    bool save(const llama_vocab & vocab, const char * path);
+    bool load(const llama_vocab & vocab, const char * path);
+};
+
 struct llama_grammar_parser {
     std::map<std::string, uint32_t> symbol_ids;
 
@@ -106,9 +197,54 @@ struct llama_grammar_parser {
     void print(FILE * file);
 };
 
+// trigger pattern compiled into a DFA over bytes, stepped as pieces are generated instead of matching
+// the whole buffer again. covers the ECMAScript subset that trigger patterns use (literals, escapes,
+// classes, groups, alternation, greedy and lazy quantifiers, ^ and $); other patterns keep std::regex.
+// the start of the first group is only needed once the DFA accepts, and is then found by running the
+// pattern's program over the buffer with the priorities of a backtracking matcher
+struct llama_grammar_trigger_dfa {
+    enum opcode : uint8_t {
+        OP_SET,   // consume a byte of sets[x]
+        OP_SPLIT, // continue at x, then at y
+        OP_JMP,   // continue at x
+        OP_SAVE,  // record the start of the first group
+        OP_BOL,   // assert the start of the text
+        OP_EOL,   // assert the end of the text
+        OP_MATCH,
+    };
+
+    struct inst {
+        opcode   op;
+        uint32_t x = 0;
+        uint32_t y = 0;
+    };
+
+    static constexpr uint32_t dead_state  = 0;
+    static constexpr uint32_t start_state = 1;
+
+    std::vector<inst>             prog;
+    std::vector<std::bitset<256>> sets;
+
+    uint8_t               byte_class[256] = {}; // bytes that no set tells apart share a class
+    uint32_t              n_classes = 0;
+    std::vector<uint32_t> next;                 // transitions, state * n_classes + class
+    std::vector<uint8_t>  accept;               // whether the text read so far is a full match
+
+    uint32_t step(uint32_t state, const std::string & piece) const;
+
+    // start of the first group in a text that the DFA accepts (text.size() if the group did not participate)
+    size_t group_start(const std::string & text) const;
+};
+
+// null if the pattern uses a construct the DFA does not support, or is too large
+std::shared_ptr<const llama_grammar_trigger_dfa> llama_grammar_trigger_dfa_init(const std::string & pattern);
+
 struct llama_grammar_trigger_pattern {
     std::string pattern;
-    std::regex  regex;
+    std::regex  regex; // only compiled when there is no dfa
+
+    std::shared_ptr<const llama_grammar_trigger_dfa> dfa;
+    uint32_t dfa_state = llama_grammar_trigger_dfa::start_state; // state after the trigger buffer
 };
 
 struct llama_grammar {
@@ -132,6 +268,11 @@ struct llama_grammar {
                              trigger_patterns;         // Regular expressions that trigger a lazy grammar. Must be a full match of the entire generated
                                                        // string, and the grammar will be given the string from the first match group onwards.
 
+    // shared automaton of this grammar (null without a vocab)
+    std::shared_ptr<llama_grammar_automaton> automaton;
+
+    // first element of each rule, sorted by address, to turn stacks into llama_grammar_state_key
+    std::vector<std::pair<const llama_grammar_element *, uint32_t>> rule_index;
 };
 
 //
@@ -171,3 +312,9 @@ void llama_grammar_accept_impl(
 void llama_grammar_accept_str(
               struct llama_grammar & grammar,
                  const std::string & piece);
+
+// text that every continuation accepted by the grammar starts with, up to max_chars code points.
+// empty while awaiting a trigger, in the middle of a UTF-8 sequence, or where generation may end
+std::string llama_grammar_forced_str_impl(
+        const struct llama_grammar & grammar,
+                            size_t   max_chars);
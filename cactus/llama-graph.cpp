@@ -431,7 +431,26 @@ void llm_graph_input_attn_no_cache::set_input(const llama_ubatch * ubatch) {
 }
 
 void llm_graph_input_attn_kv_unified::set_input(const llama_ubatch * ubatch) {
-    if (self_kq_mask || self_kq_mask_swa) {
+    // with a paged cache, the i-th KV entry is the i-th gathered cell, the padding is masked
+    const std::vector<uint32_t> * cell_ids = nullptr;
+
+    if (self_kv_idxs) {
+        LM_GGML_ASSERT(lm_ggml_backend_buffer_is_host(self_kv_idxs->buffer));
+
+        cell_ids = &static_cast<const llama_kv_cache_paged *>(kv_self)->cell_ids;
+
+        int32_t * data = (int32_t *) self_kv_idxs->data;
+
+        const int64_t n_kv = kv_self->n;
+        for (int64_t i = 0; i < n_kv; ++i) {
+            data[i] = i < (int64_t) cell_ids->size() ? (*cell_ids)[i] : 0;
+        }
+    }
+
+    // with a cache of their own, the sliding-window layers attend to its cells
+    const llama_kv_cache_unified * kv_swa = kv_self->swa.get();
+
+    if (self_kq_mask || (self_kq_mask_swa && !kv_swa)) {
         const int64_t n_kv         = kv_self->n;
         const int64_t n_tokens     = ubatch->n_tokens;
         const int64_t n_seq_tokens = ubatch->n_seq_tokens;
@@ -445,7 +464,7 @@ void llm_graph_input_attn_kv_unified::set_input(const llama_ubatch * ubatch) {
             data = (float *) self_kq_mask->data;
         }
 
-        if (self_kq_mask_swa) {
+        if (self_kq_mask_swa && !kv_swa) {
             LM_GGML_ASSERT(lm_ggml_backend_buffer_is_host(self_kq_mask_swa->buffer));
             data_swa = (float *) self_kq_mask_swa->data;
         }
@@ -469,15 +488,20 @@ void llm_graph_input_attn_kv_unified::set_input(const llama_ubatch * ubatch) {
                 for (int j = 0; j < n_seq_tokens; ++j) {
                     const llama_pos pos = ubatch->pos[s*n_seq_tokens + j];
                     for (int i = 0; i < n_kv; ++i) {
+                        const int64_t c = !cell_ids ? i : i < (int64_t) cell_ids->size() ? (int64_t) (*cell_ids)[i] : -1;
+
+                        const llama_pos p_kv = c >= 0 ? kv_self->cells[c].pos : -1;
+
                         float f;
                         // mask the token if:
-                        if (!kv_self->cells[i].has_seq_id(seq_id) // not the correct sequence
-                            || (cparams.causal_attn && kv_self->cells[i].pos > pos) // for causal, mask future tokens
+                        if (c < 0 // padding of the gathered cells
+                            || !kv_self->cells[c].has_seq_id(seq_id) // not the correct sequence
+                            || (cparams.causal_attn && p_kv > pos) // for causal, mask future tokens
                         ) {
                             f = -INFINITY;
                         } else {
                             if (hparams.use_alibi) {
-                                f = -std::abs(kv_self->cells[i].pos - pos);
+                                f = -std::abs(p_kv - pos);
                             } else {
                                 f = 0.0f;
                             }
@@ -492,11 +516,11 @@ void llm_graph_input_attn_kv_unified::set_input(const llama_ubatch * ubatch) {
                         if (data_swa) {
                             if (hparams.n_attn_chunk) {
                                 llama_pos pos_chunk_start = (pos / hparams.n_attn_chunk) * hparams.n_attn_chunk;
-                                if (kv_self->cells[i].pos < pos_chunk_start || pos < pos_chunk_start) {
+                                if (p_kv < pos_chunk_start || pos < pos_chunk_start) {
                                     f = -INFINITY;
                                 }
                             } else {
-                                if (pos - kv_self->cells[i].pos >= (int32_t)hparams.n_swa) {
+                                if (pos - p_kv >= (int32_t)hparams.n_swa) {
                                     f = -INFINITY;
                                 }
                             }
@@ -525,6 +549,51 @@ void llm_graph_input_attn_kv_unified::set_input(const llama_ubatch * ubatch) {
             }
         }
     }
+
+    if (self_kq_mask_swa && kv_swa) {
+        const int64_t n_kv         = kv_swa->n;
+        const int64_t n_tokens     = ubatch->n_tokens;
+        const int64_t n_seq_tokens = ubatch->n_seq_tokens;
+        const int64_t n_seqs       = ubatch->n_seqs;
+
+        LM_GGML_ASSERT(lm_ggml_backend_buffer_is_host(self_kq_mask_swa->buffer));
+        float * data = (float *) self_kq_mask_swa->data;
+
+        // same as above, over the cells of the sliding-window cache, which are not in the order of their positions
+        for (int s = 0; s < n_seqs; ++s) {
+            const llama_seq_id seq_id = ubatch->seq_id[s][0];
+
+            for (int j = 0; j < n_seq_tokens; ++j) {
+                const llama_pos pos = ubatch->pos[s*n_seq_tokens + j];
+
+                for (int i = 0; i < n_kv; ++i) {
+                    const llama_pos p_kv = kv_swa->cells[i].pos;
+
+                    float f;
+                    if (!kv_swa->cells[i].has_seq_id(seq_id)
+                        || (cparams.causal_attn && p_kv > pos)
+                        || pos - p_kv >= (int32_t) hparams.n_swa) {
+                        f = -INFINITY;
+                    } else {
+                        if (hparams.use_alibi) {
+                            f = -std::abs(p_kv - pos);
+                        } else {
+                            f = 0.0f;
+                        }
+                    }
+
+                    data[s*(n_kv*n_seq_tokens) + j*n_kv + i] = f;
+                }
+            }
+        }
+
+        // mask padded tokens
+        for (int i = n_tokens; i < LM_GGML_PAD(n_tokens, LM_GGML_KQ_MASK_PAD); ++i) {
+            for (int j = 0; j < n_kv; ++j) {
+                data[i*n_kv + j] = -INFINITY;
+            }
+        }
+    }
 }
 
 void llm_graph_input_attn_cross::set_input(const llama_ubatch * ubatch) {
@@ -1216,7 +1285,8 @@ lm_ggml_tensor * llm_graph_context::build_attn_mha(
          lm_ggml_tensor * kq_mask,
          lm_ggml_tensor * v_mla,
              bool      v_trans,
-             float     kq_scale) const {
+             float     kq_scale,
+             int       il) const {
   //const int64_t n_embd_k_gqa = hparams.n_embd_k_gqa(il);
   //const int64_t n_embd_v_gqa = hparams.n_embd_v_gqa(il);
 
@@ -1289,6 +1359,7 @@ lm_ggml_tensor * llm_graph_context::build_attn_mha(
         }
 
         kq = lm_ggml_soft_max_ext(ctx0, kq, kq_mask, kq_scale, hparams.f_max_alibi_bias);
+        cb(kq, "kq_soft_max_ext", il);
 
         if (!v_trans) {
             // note: avoid this branch
@@ -1361,7 +1432,7 @@ lm_ggml_tensor * llm_graph_context::build_attn(
     lm_ggml_tensor * v = lm_ggml_permute(ctx0, v_cur, 0, 2, 1, 3);
     //cb(k, "v", il);
 
-    lm_ggml_tensor * cur = build_attn_mha(gf, q, k, v, kq_b, kq_mask, v_mla, false, kq_scale);
+    lm_ggml_tensor * cur = build_attn_mha(gf, q, k, v, kq_b, kq_mask, v_mla, false, kq_scale, il);
 
     cb(cur, "kqv_out", il);
 
@@ -1396,13 +1467,21 @@ llm_graph_input_attn_kv_unified * llm_graph_context::build_attn_inp_kv_unified()
     if (hparams.n_swa_pattern > 1) {
         LM_GGML_ASSERT(hparams.n_swa > 0);
 
-        inp->self_kq_mask_swa = lm_ggml_new_tensor_2d(ctx0, LM_GGML_TYPE_F32, n_kv, LM_GGML_PAD(n_tokens, LM_GGML_KQ_MASK_PAD));
+        const auto n_kv_swa = kv_self->swa ? kv_self->swa->n : n_kv;
+
+        inp->self_kq_mask_swa = lm_ggml_new_tensor_2d(ctx0, LM_GGML_TYPE_F32, n_kv_swa, LM_GGML_PAD(n_tokens, LM_GGML_KQ_MASK_PAD));
         //cb(inp->self_kq_mask_swa, "KQ_mask_swa", -1);
         lm_ggml_set_input(inp->self_kq_mask_swa);
 
         inp->self_kq_mask_swa_cnv = cparams.flash_attn ? lm_ggml_cast(ctx0, inp->self_kq_mask_swa, LM_GGML_TYPE_F16) : inp->self_kq_mask_swa;
     }
 
+    if (kv_self->paged) {
+        inp->self_kv_idxs = lm_ggml_new_tensor_1d(ctx0, LM_GGML_TYPE_I32, n_kv);
+        //cb(inp->self_kv_idxs, "kv_idxs", -1);
+        lm_ggml_set_input(inp->self_kv_idxs);
+    }
+
     return (llm_graph_input_attn_kv_unified *) res->add_input(std::move(inp));
 }
 
@@ -1425,53 +1504,72 @@ lm_ggml_tensor * llm_graph_context::build_attn(
     lm_ggml_build_forward_expand(gf, v_cur);
 
     const llama_kv_cache_unified * kv_self = static_cast<const llama_kv_cache_unified *>(memory);
-    const auto & n_ctx = cparams.n_ctx;
 
     const int64_t n_embd_k_gqa = hparams.n_embd_k_gqa(il);
     const int64_t n_embd_v_gqa = hparams.n_embd_v_gqa(il);
 
     const auto n_tokens = q_cur->ne[2];
 
+    if (kv_self->paged) {
+        return build_attn_paged(inp, gf, wo, wo_b, q_cur, k_cur, v_cur, kq_b, v_mla, kq_scale, il);
+    }
+
+    // the sliding-window layers may have a cache of their own
+    const llama_kv_cache_unified * kv = kv_self->layer_cache(il);
+
+    const auto & n_ctx = kv->size;
+
     const bool v_trans = !cparams.flash_attn;
 
-    // store to KV cache
+    // store to KV cache, one copy for each run of consecutive cells
     {
-        LM_GGML_ASSERT(!kv_self->recurrent);
+        LM_GGML_ASSERT(!kv->recurrent);
 
-        const auto kv_head = kv_self->head;
+        LM_GGML_ASSERT(kv != kv_self || kv_self->size == cparams.n_ctx);
 
-        LM_GGML_ASSERT(kv_self->size == n_ctx);
+        // the worst-case graph is built without a slot for its ubatch
+        std::vector<llama_kv_cache_unified::copy_run> runs = kv->runs;
+        if (runs.empty() || runs.back().i0 + runs.back().n != n_tokens) {
+            runs = { { 0, kv != kv_self ? 0 : kv->head, (uint32_t) n_tokens } };
+        }
 
-        lm_ggml_tensor * k_cache_view = lm_ggml_view_1d(ctx0, kv_self->k_l[il], n_tokens*n_embd_k_gqa, lm_ggml_row_size(kv_self->k_l[il]->type, n_embd_k_gqa)*kv_head);
-        //cb(k_cache_view, "k_cache_view", il);
+        v_cur = lm_ggml_reshape_2d(ctx0, v_cur, n_embd_v_gqa, n_tokens);
 
-        // note: storing RoPE-ed version of K in the KV cache
-        lm_ggml_build_forward_expand(gf, lm_ggml_cpy(ctx0, k_cur, k_cache_view));
+        for (const auto & run : runs) {
+            const auto kv_head = run.c0;
 
-        v_cur = lm_ggml_reshape_2d(ctx0, v_cur, n_embd_v_gqa, n_tokens);
+            lm_ggml_tensor * k_run = runs.size() == 1 ? k_cur : lm_ggml_view_3d(ctx0, k_cur, k_cur->ne[0], k_cur->ne[1], run.n, k_cur->nb[1], k_cur->nb[2], run.i0*k_cur->nb[2]);
+            lm_ggml_tensor * v_run = runs.size() == 1 ? v_cur : lm_ggml_view_2d(ctx0, v_cur, n_embd_v_gqa, run.n, v_cur->nb[1], run.i0*v_cur->nb[1]);
 
-        lm_ggml_tensor * v_cache_view = nullptr;
+            lm_ggml_tensor * k_cache_view = lm_ggml_view_1d(ctx0, kv->k_l[il], run.n*n_embd_k_gqa, lm_ggml_row_size(kv->k_l[il]->type, n_embd_k_gqa)*kv_head);
+            //cb(k_cache_view, "k_cache_view", il);
 
-        if (!v_trans) {
-            v_cache_view = lm_ggml_view_1d(ctx0, kv_self->v_l[il], n_tokens*n_embd_v_gqa, lm_ggml_row_size(kv_self->v_l[il]->type, n_embd_v_gqa)*kv_head);
-        } else {
-            // note: the V cache is transposed when not using flash attention
-            v_cache_view = lm_ggml_view_2d(ctx0, kv_self->v_l[il], n_tokens, n_embd_v_gqa,
-                    (  n_ctx)*lm_ggml_element_size(kv_self->v_l[il]),
-                    (kv_head)*lm_ggml_element_size(kv_self->v_l[il]));
+            // note: storing RoPE-ed version of K in the KV cache
+            lm_ggml_build_forward_expand(gf, lm_ggml_cpy(ctx0, k_run, k_cache_view));
 
-            v_cur = lm_ggml_transpose(ctx0, v_cur);
-        }
-        //cb(v_cache_view, "v_cache_view", il);
+            lm_ggml_tensor * v_cache_view = nullptr;
+
+            if (!v_trans) {
+                v_cache_view = lm_ggml_view_1d(ctx0, kv->v_l[il], run.n*n_embd_v_gqa, lm_ggml_row_size(kv->v_l[il]->type, n_embd_v_gqa)*kv_head);
+            } else {
+                // note: the V cache is transposed when not using flash attention
+                v_cache_view = lm_ggml_view_2d(ctx0, kv->v_l[il], run.n, n_embd_v_gqa,
+                        (  n_ctx)*lm_ggml_element_size(kv->v_l[il]),
+                        (kv_head)*lm_ggml_element_size(kv->v_l[il]));
 
-        lm_ggml_build_forward_expand(gf, lm_ggml_cpy(ctx0, v_cur, v_cache_view));
+                v_run = lm_ggml_transpose(ctx0, v_run);
+            }
+            //cb(v_cache_view, "v_cache_view", il);
+
+            lm_ggml_build_forward_expand(gf, lm_ggml_cpy(ctx0, v_run, v_cache_view));
+        }
     }
 
     const bool is_swa = hparams.is_swa(il);
 
     const auto & kq_mask = is_swa ? inp->get_kq_mask_swa() : inp->get_kq_mask();
 
-    const auto n_kv = kv_self->n;
+    const auto n_kv = kv->n;
 
     const int64_t n_head_kv = hparams.n_head_kv(il);
 
@@ -1482,26 +1580,26 @@ lm_ggml_tensor * llm_graph_context::build_attn(
     //cb(q, "q", il);
 
     lm_ggml_tensor * k =
-        lm_ggml_view_3d(ctx0, kv_self->k_l[il],
+        lm_ggml_view_3d(ctx0, kv->k_l[il],
                 n_embd_head_k, n_kv, n_head_kv,
-                lm_ggml_row_size(kv_self->k_l[il]->type, n_embd_k_gqa),
-                lm_ggml_row_size(kv_self->k_l[il]->type, n_embd_head_k),
+                lm_ggml_row_size(kv->k_l[il]->type, n_embd_k_gqa),
+                lm_ggml_row_size(kv->k_l[il]->type, n_embd_head_k),
                 0);
     //cb(k, "k", il);
 
     lm_ggml_tensor * v = !v_trans ?
-        lm_ggml_view_3d(ctx0, kv_self->v_l[il],
+        lm_ggml_view_3d(ctx0, kv->v_l[il],
                 n_embd_head_v, n_kv, n_head_kv,
-                lm_ggml_row_size(kv_self->v_l[il]->type, n_embd_v_gqa),
-                lm_ggml_row_size(kv_self->v_l[il]->type, n_embd_head_v),
+                lm_ggml_row_size(kv->v_l[il]->type, n_embd_v_gqa),
+                lm_ggml_row_size(kv->v_l[il]->type, n_embd_head_v),
                 0) :
-        lm_ggml_view_3d(ctx0, kv_self->v_l[il],
+        lm_ggml_view_3d(ctx0, kv->v_l[il],
                 n_kv, n_embd_head_v, n_head_kv,
-                lm_ggml_element_size(kv_self->v_l[il])*n_ctx,
-                lm_ggml_element_size(kv_self->v_l[il])*n_ctx*n_embd_head_v,
+                lm_ggml_element_size(kv->v_l[il])*n_ctx,
+                lm_ggml_element_size(kv->v_l[il])*n_ctx*n_embd_head_v,
                 0);
 
-    lm_ggml_tensor * cur = build_attn_mha(gf, q, k, v, kq_b, kq_mask, v_mla, v_trans, kq_scale);
+    lm_ggml_tensor * cur = build_attn_mha(gf, q, k, v, kq_b, kq_mask, v_mla, v_trans, kq_scale, il);
     cb(cur, "kqv_out", il);
 
     if (wo) {
@@ -1519,6 +1617,101 @@ lm_ggml_tensor * llm_graph_context::build_attn(
     return cur;
 }
 
+lm_ggml_tensor * llm_graph_context::build_attn_paged(
+        llm_graph_input_attn_kv_unified * inp,
+        lm_ggml_cgraph * gf,
+        lm_ggml_tensor * wo,
+        lm_ggml_tensor * wo_b,
+        lm_ggml_tensor * q_cur,
+        lm_ggml_tensor * k_cur,
+        lm_ggml_tensor * v_cur,
+        lm_ggml_tensor * kq_b,
+        lm_ggml_tensor * v_mla,
+            float     kq_scale,
+            int       il) const {
+    const llama_kv_cache_paged * kv_self = static_cast<const llama_kv_cache_paged *>(memory);
+
+    const int64_t n_embd_k_gqa = hparams.n_embd_k_gqa(il);
+    const int64_t n_embd_v_gqa = hparams.n_embd_v_gqa(il);
+
+    const auto n_tokens = q_cur->ne[2];
+
+    lm_ggml_tensor * k_l = kv_self->k_l[il];
+    lm_ggml_tensor * v_l = kv_self->v_l[il];
+
+    // store to KV cache, one copy for each run of consecutive cells
+    {
+        LM_GGML_ASSERT(k_cur->ne[2] == n_tokens);
+
+        // the worst-case graph is built without a slot for its ubatch
+        std::vector<llama_kv_cache_paged::copy_run> runs = kv_self->runs;
+        if (runs.empty() || runs.back().i0 + runs.back().n != n_tokens) {
+            runs = { { 0, 0, (uint32_t) n_tokens } };
+        }
+
+        v_cur = lm_ggml_reshape_2d(ctx0, v_cur, n_embd_v_gqa, n_tokens);
+
+        for (const auto & run : runs) {
+            lm_ggml_tensor * k_run = lm_ggml_view_3d(ctx0, k_cur, k_cur->ne[0], k_cur->ne[1], run.n, k_cur->nb[1], k_cur->nb[2], run.i0*k_cur->nb[2]);
+            lm_ggml_tensor * k_cache_view = lm_ggml_view_1d(ctx0, k_l, run.n*n_embd_k_gqa, lm_ggml_row_size(k_l->type, n_embd_k_gqa)*run.c0);
+
+            // note: storing RoPE-ed version of K in the KV cache
+            lm_ggml_build_forward_expand(gf, lm_ggml_cpy(ctx0, k_run, k_cache_view));
+
+            lm_ggml_tensor * v_run = lm_ggml_view_2d(ctx0, v_cur, n_embd_v_gqa, run.n, v_cur->nb[1], run.i0*v_cur->nb[1]);
+            lm_ggml_tensor * v_cache_view = lm_ggml_view_1d(ctx0, v_l, run.n*n_embd_v_gqa, lm_ggml_row_size(v_l->type, n_embd_v_gqa)*run.c0);
+
+            lm_ggml_build_forward_expand(gf, lm_ggml_cpy(ctx0, v_run, v_cache_view));
+        }
+    }
+
+    const bool is_swa = hparams.is_swa(il);
+
+    const auto & kq_mask = is_swa ? inp->get_kq_mask_swa() : inp->get_kq_mask();
+
+    const auto n_kv = kv_self->n;
+
+    const int64_t n_head_kv = hparams.n_head_kv(il);
+
+    const auto & n_embd_head_k = hparams.n_embd_head_k;
+    const auto & n_embd_head_v = hparams.n_embd_head_v;
+
+    lm_ggml_tensor * q = lm_ggml_permute(ctx0, q_cur, 0, 2, 1, 3);
+    //cb(q, "q", il);
+
+    // gather the n_kv cells of the sequences of the ubatch
+    lm_ggml_tensor * k_rows = lm_ggml_get_rows(ctx0, lm_ggml_reshape_2d(ctx0, k_l, n_embd_k_gqa, kv_self->size), inp->self_kv_idxs);
+    lm_ggml_tensor * v_rows = lm_ggml_get_rows(ctx0, lm_ggml_reshape_2d(ctx0, v_l, n_embd_v_gqa, kv_self->size), inp->self_kv_idxs);
+
+    lm_ggml_tensor * k =
+        lm_ggml_view_3d(ctx0, k_rows,
+                n_embd_head_k, n_kv, n_head_kv,
+                lm_ggml_row_size(k_rows->type, n_embd_k_gqa),
+                lm_ggml_row_size(k_rows->type, n_embd_head_k),
+                0);
+    //cb(k, "k", il);
+
+    lm_ggml_tensor * v =
+        lm_ggml_view_3d(ctx0, v_rows,
+                n_embd_head_v, n_kv, n_head_kv,
+                lm_ggml_row_size(v_rows->type, n_embd_v_gqa),
+                lm_ggml_row_size(v_rows->type, n_embd_head_v),
+                0);
+
+    lm_ggml_tensor * cur = build_attn_mha(gf, q, k, v, kq_b, kq_mask, v_mla, false, kq_scale, il);
+    cb(cur, "kqv_out", il);
+
+    if (wo) {
+        cur = build_lora_mm(wo, cur);
+    }
+
+    if (wo_b) {
+        cur = lm_ggml_add(ctx0, cur, wo_b);
+    }
+
+    return cur;
+}
+
 llm_graph_input_attn_cross * llm_graph_context::build_attn_inp_cross() const {
     auto inp = std::make_unique<llm_graph_input_attn_cross>(cross);
 
@@ -1561,7 +1754,7 @@ lm_ggml_tensor * llm_graph_context::build_attn(
     lm_ggml_tensor * v = lm_ggml_permute(ctx0, v_cur, 0, 2, 1, 3);
     //cb(k, "v", il);
 
-    lm_ggml_tensor * cur = build_attn_mha(gf, q, k, v, kq_b, kq_mask, v_mla, false, kq_scale);
+    lm_ggml_tensor * cur = build_attn_mha(gf, q, k, v, kq_b, kq_mask, v_mla, false, kq_scale, il);
 
     cb(cur, "kqv_out", il);
 
@@ -1730,3 +1923,29 @@ void llm_graph_context::build_pooling(
 
     lm_ggml_build_forward_expand(gf, cur);
 }
+
+void llm_graph_context::build_logits_top_k(lm_ggml_cgraph * gf) const {
+    if (cparams.embeddings || cparams.logits_top_k <= 0 || res->t_logits == nullptr) {
+        return;
+    }
+
+    lm_ggml_tensor * logits = res->t_logits;
+
+    const int64_t n_vocab   = logits->ne[0];
+    const int64_t n_outputs = logits->ne[1];
+    const int64_t k         = std::min<int64_t>(cparams.logits_top_k, n_vocab);
+
+    lm_ggml_tensor * ids = lm_ggml_cont(ctx0, lm_ggml_top_k(ctx0, logits, k));
+    cb(ids, "result_top_k_ids", -1);
+
+    // gather the k logits of each row: one 1-element "row" per vocab entry, batched over the outputs
+    lm_ggml_tensor * cur = lm_ggml_get_rows(ctx0, lm_ggml_reshape_3d(ctx0, logits, 1, n_vocab, n_outputs), ids);
+    cur = lm_ggml_reshape_2d(ctx0, cur, k, n_outputs);
+    cb(cur, "result_top_k", -1);
+
+    res->t_logits_top_k     = cur;
+    res->t_logits_top_k_ids = ids;
+
+    lm_ggml_build_forward_expand(gf, ids);
+    lm_ggml_build_forward_expand(gf, cur);
+}
@@ -262,6 +262,8 @@ public:
     lm_ggml_tensor * self_kq_mask_swa     = nullptr; // F32 [n_kv, n_batch]
     lm_ggml_tensor * self_kq_mask_swa_cnv = nullptr; //     [n_kv, n_batch]
 
+    lm_ggml_tensor * self_kv_idxs = nullptr; // I32 [n_kv], paged cache only: the cells gathered for the ubatch
+
     const llama_hparams & hparams;
     const llama_cparams & cparams;
 
@@ -298,6 +300,8 @@ public:
     virtual ~llm_graph_result_i() = default;
 
     virtual lm_ggml_tensor * get_logits()      = 0;
+    virtual lm_ggml_tensor * get_logits_top_k()     = 0;
+    virtual lm_ggml_tensor * get_logits_top_k_ids() = 0;
     virtual lm_ggml_tensor * get_embd()        = 0;
     virtual lm_ggml_tensor * get_embd_pooled() = 0;
 
@@ -312,6 +316,8 @@ public:
     virtual ~llm_graph_result() = default;
 
     lm_ggml_tensor * get_logits()      override { return t_logits; }
+    lm_ggml_tensor * get_logits_top_k()     override { return t_logits_top_k; }
+    lm_ggml_tensor * get_logits_top_k_ids() override { return t_logits_top_k_ids; }
     lm_ggml_tensor * get_embd()        override { return t_embd; }
     lm_ggml_tensor * get_embd_pooled() override { return t_embd_pooled; }
 
@@ -328,6 +334,8 @@ public:
 
     // important graph nodes
     lm_ggml_tensor * t_logits      = nullptr;
+    lm_ggml_tensor * t_logits_top_k     = nullptr; // [k, n_outputs], only with cparams.logits_top_k > 0
+    lm_ggml_tensor * t_logits_top_k_ids = nullptr; // [k, n_outputs]
     lm_ggml_tensor * t_embd        = nullptr;
     lm_ggml_tensor * t_embd_pooled = nullptr;
 
@@ -510,7 +518,8 @@ struct llm_graph_context {
              lm_ggml_tensor * kq_mask,
              lm_ggml_tensor * v_mla, // [n_embd_head_v_mla, n_embd_head_v, n_head_v]
                     bool   v_trans,
-                   float   kq_scale) const;
+                   float   kq_scale,
+                     int   il) const;
 
     llm_graph_input_attn_no_cache * build_attn_inp_no_cache() const;
 
@@ -542,6 +551,20 @@ struct llm_graph_context {
                   float   kq_scale,
                     int   il) const;
 
+    // build_attn with a paged cache: the ubatch is stored in runs of cells and attends to the gathered cells
+    lm_ggml_tensor * build_attn_paged(
+            llm_graph_input_attn_kv_unified * inp,
+            lm_ggml_cgraph * gf,
+            lm_ggml_tensor * wo,
+            lm_ggml_tensor * wo_b,
+            lm_ggml_tensor * q_cur, // [n_embd_head_q, n_head_q, n_tokens]
+            lm_ggml_tensor * k_cur, // [n_embd_head_k, n_head_k, n_tokens]
+            lm_ggml_tensor * v_cur, // [n_embd_head_v, n_head_v, n_tokens]
+            lm_ggml_tensor * kq_b,
+            lm_ggml_tensor * v_mla, // [n_embd_head_v_mla, n_embd_head_v, n_head_v]
+                  float   kq_scale,
+                    int   il) const;
+
     llm_graph_input_attn_cross * build_attn_inp_cross() const;
 
     lm_ggml_tensor * build_attn(
@@ -591,4 +614,6 @@ struct llm_graph_context {
             lm_ggml_tensor * cls_b,
             lm_ggml_tensor * cls_out,
             lm_ggml_tensor * cls_out_b) const;
+
+    void build_logits_top_k(lm_ggml_cgraph * gf) const;
 };
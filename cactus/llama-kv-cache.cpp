@@ -14,6 +14,8 @@
 llama_kv_cache_unified::llama_kv_cache_unified(const llama_hparams & hparams, callbacks cbs) : hparams(hparams), cbs(std::move(cbs)) {
 }
 
+llama_kv_cache_unified::~llama_kv_cache_unified() = default;
+
 bool llama_kv_cache_unified::init(
         const llama_model & model,
       const llama_cparams & cparams,
@@ -42,6 +44,27 @@ bool llama_kv_cache_unified::init(
     cells.clear();
     cells.resize(kv_size);
 
+    index_rebuild();
+
+    // the sliding-window layers get a cache sized for their window instead of the context
+    // note: the chunked attention of llama4 reuses the SWA mask, its layers need the full context
+    uint32_t n_keep   = 0;
+    uint32_t size_swa = 0;
+
+    if (!recurrent && !paged && !layer_filter && !cparams.swa_full &&
+        hparams.n_swa > 0 && hparams.n_swa_pattern > 1 && hparams.n_attn_chunk == 0) {
+        // the batch engine uses the seq ids [1, n_seq_max] next to seq 0, and session save/load stages a
+        // record in one more sequence while all of them hold their windows, hence n_seq_max + 2 windows
+        n_keep   = hparams.n_swa + cparams.n_ubatch;
+        size_swa = LM_GGML_PAD((cparams.n_seq_max + 2)*n_keep + cparams.n_ubatch, get_padding(cparams));
+
+        if (size_swa < kv_size) {
+            layer_filter = [this](int32_t il) { return !hparams.is_swa(il); };
+        } else {
+            size_swa = 0;
+        }
+    }
+
     // create a context for each buffer type
     std::map<lm_ggml_backend_buffer_type_t, lm_ggml_context *> ctx_map;
     auto ctx_for_buft = [&](lm_ggml_backend_buffer_type_t buft) -> lm_ggml_context * {
@@ -71,6 +94,12 @@ bool llama_kv_cache_unified::init(
     v_l.reserve(n_layer);
 
     for (int i = 0; i < n_layer; i++) {
+        if (layer_filter && !layer_filter(i)) {
+            k_l.push_back(nullptr);
+            v_l.push_back(nullptr);
+            continue;
+        }
+
         const uint32_t n_embd_k_gqa = hparams.n_embd_k_gqa(i) + hparams.n_embd_k_s();
         const uint32_t n_embd_v_gqa = hparams.n_embd_v_gqa(i) + hparams.n_embd_v_s();
 
@@ -118,14 +147,24 @@ bool llama_kv_cache_unified::init(
         bufs.emplace_back(buf);
     }
 
+    if (size_swa > 0) {
+        LLAMA_LOG_INFO("%s: n_swa = %u, the sliding-window layers use %u cells\n", __func__, hparams.n_swa, size_swa);
+
+        swa = std::make_unique<llama_kv_cache_swa>(hparams, cbs, n_keep);
+
+        if (!swa->init(model, cparams, type_k, type_v, size_swa, offload)) {
+            return false;
+        }
+    }
+
     return true;
 }
 
 int32_t llama_kv_cache_unified::get_n_tokens() const {
     int32_t result = 0;
 
-    for (uint32_t i = 0; i < size; i++) {
-        result += cells[i].seq_id.size();
+    for (const auto & ids : seq_cells) {
+        result += ids.size();
     }
 
     return result;
@@ -141,13 +180,19 @@ size_t llama_kv_cache_unified::total_size() const {
         size += lm_ggml_backend_buffer_get_size(buf.get());
     }
 
+    if (swa) {
+        size += swa->total_size();
+    }
+
     return size;
 }
 
 llama_pos llama_kv_cache_unified::pos_max() const {
     llama_pos pos_max = -1;
-    for (const auto & cell : cells) {
-        pos_max = std::max(pos_max, cell.pos);
+    for (const auto & ids : seq_cells) {
+        if (!ids.empty()) {
+            pos_max = std::max(pos_max, ids.rbegin()->first);
+        }
     }
 
     return pos_max;
@@ -161,11 +206,16 @@ void llama_kv_cache_unified::clear() {
         cells[i].tail = -1;
     }
     head = 0;
-    used = 0;
+
+    index_rebuild();
 
     for (auto & buf : bufs) {
         lm_ggml_backend_buffer_clear(buf.get(), 0);
     }
+
+    if (swa) {
+        swa->clear();
+    }
 }
 
 bool llama_kv_cache_unified::seq_rm(llama_seq_id seq_id, llama_pos p0, llama_pos p1) {
@@ -208,27 +258,38 @@ bool llama_kv_cache_unified::seq_rm(llama_seq_id seq_id, llama_pos p0, llama_pos
         return true;
     }
 
-    for (uint32_t i = 0; i < size; ++i) {
-        if (cells[i].pos >= p0 && cells[i].pos < p1) {
-            if (seq_id < 0) {
-                cells[i].seq_id.clear();
-            } else if (cells[i].has_seq_id(seq_id)) {
-                cells[i].seq_id.erase(seq_id);
-            } else {
-                continue;
-            }
-            if (cells[i].is_empty()) {
-                // keep count of the number of used cells
-                if (cells[i].pos >= 0) {
-                    used--;
-                }
+    // the sliding-window layers can continue a sequence only from a position they still hold the window of
+    if (swa && seq_id >= 0 && p0 > 0 && p1 > seq_pos_max(seq_id) && seq_cells_count(seq_id, p0, p1) > 0) {
+        const llama_pos p_win = std::max(0, p0 - (llama_pos) hparams.n_swa + 1);
 
-                cells[i].pos = -1;
-                cells[i].src = -1;
+        if (swa->seq_cells_count(seq_id, p_win, p0) != seq_cells_count(seq_id, p_win, p0)) {
+            return false;
+        }
+    }
 
-                if (new_head == size) {
-                    new_head = i;
-                }
+    if (swa) {
+        swa->seq_rm(seq_id, p0, p1);
+    }
+
+    std::vector<uint32_t> ids;
+
+    if (seq_id < 0) {
+        for (llama_seq_id s = 0; s < LLAMA_MAX_SEQ; ++s) {
+            seq_cells_range(s, p0, p1, ids);
+        }
+
+        for (const uint32_t i : ids) {
+            if (!cells[i].is_empty()) {
+                cell_clear(i);
+                new_head = std::min(new_head, i);
+            }
+        }
+    } else {
+        seq_cells_range(seq_id, p0, p1, ids);
+
+        for (const uint32_t i : ids) {
+            if (cell_seq_rm(i, seq_id)) {
+                new_head = std::min(new_head, i);
             }
         }
     }
@@ -277,6 +338,8 @@ void llama_kv_cache_unified::seq_cp(llama_seq_id seq_id_src, llama_seq_id seq_id
                 cell_src.seq_id.insert(seq_id_dst);
                 tail_dst.tail = tail_src.tail;
             }
+
+            index_rebuild();
         }
 
         return;
@@ -285,36 +348,62 @@ void llama_kv_cache_unified::seq_cp(llama_seq_id seq_id_src, llama_seq_id seq_id
     // otherwise, this is the KV of a Transformer-like model
     head = 0;
 
-    for (uint32_t i = 0; i < size; ++i) {
-        if (cells[i].has_seq_id(seq_id_src) && cells[i].pos >= p0 && cells[i].pos < p1) {
-            cells[i].seq_id.insert(seq_id_dst);
-        }
+    std::vector<uint32_t> ids;
+    seq_cells_range(seq_id_src, p0, p1, ids);
+
+    for (const uint32_t i : ids) {
+        cell_seq_add(i, seq_id_dst);
+    }
+
+    if (swa) {
+        swa->seq_cp(seq_id_src, seq_id_dst, p0, p1);
     }
 }
 
 void llama_kv_cache_unified::seq_keep(llama_seq_id seq_id) {
     uint32_t new_head = size;
 
-    for (uint32_t i = 0; i < size; ++i) {
-        if (recurrent && (llama_seq_id) i != seq_id) {
-            cells[i].tail = -1;
+    if (recurrent) {
+        for (uint32_t i = 0; i < size; ++i) {
+            if ((llama_seq_id) i != seq_id) {
+                cells[i].tail = -1;
+            }
+
+            if (!cells[i].has_seq_id(seq_id)) {
+                cells[i].pos = -1;
+                cells[i].src = -1;
+                cells[i].seq_id.clear();
+
+                if (new_head == size){
+                    new_head = i;
+                }
+            } else {
+                cells[i].seq_id.clear();
+                cells[i].seq_id.insert(seq_id);
+            }
         }
 
-        if (!cells[i].has_seq_id(seq_id)) {
-            if (cells[i].pos >= 0) {
-                used--;
+        index_rebuild();
+    } else {
+        std::vector<uint32_t> ids;
+
+        for (llama_seq_id s = 0; s < LLAMA_MAX_SEQ; ++s) {
+            if (s == seq_id) {
+                continue;
             }
 
-            cells[i].pos = -1;
-            cells[i].src = -1;
-            cells[i].seq_id.clear();
+            ids.clear();
+            seq_cells_range(s, -1, -1, ids);
 
-            if (new_head == size){
-                new_head = i;
+            for (const uint32_t i : ids) {
+                if (cell_seq_rm(i, s)) {
+                    new_head = std::min(new_head, i);
+                }
             }
-        } else {
-            cells[i].seq_id.clear();
-            cells[i].seq_id.insert(seq_id);
+        }
+
+        if (swa) {
+            swa->seq_keep(seq_id);
         }
     }
 
@@ -354,29 +443,27 @@ void llama_kv_cache_unified::seq_add(llama_seq_id seq_id, llama_pos p0, llama_po
                     cell.pos += delta;
                 }
             }
+
+            index_rebuild();
         }
         return;
     }
 
-    for (uint32_t i = 0; i < size; ++i) {
-        if (cells[i].has_seq_id(seq_id) && cells[i].pos >= p0 && cells[i].pos < p1) {
-            has_shift = true;
-            cells[i].pos   += delta;
-            cells[i].delta += delta;
+    std::vector<uint32_t> ids;
+    seq_cells_range(seq_id, p0, p1, ids);
 
-            if (cells[i].pos < 0) {
-                if (!cells[i].is_empty()) {
-                    used--;
-                }
-                cells[i].pos = -1;
-                cells[i].seq_id.clear();
-                if (new_head == size) {
-                    new_head = i;
-                }
-            }
+    for (const uint32_t i : ids) {
+        has_shift = true;
+
+        if (cell_pos_add(i, delta)) {
+            new_head = std::min(new_head, i);
         }
     }
 
+    if (swa) {
+        swa->seq_add(seq_id, p0, p1, delta);
+    }
+
     // If we freed up a slot, set head to it so searching can start there.
     // Otherwise we just start the next search from the beginning.
     head = new_head != size ? new_head : 0;
@@ -410,34 +497,33 @@ void llama_kv_cache_unified::seq_div(llama_seq_id seq_id, llama_pos p0, llama_po
                     cell.pos /= d;
                 }
             }
+
+            index_rebuild();
         }
 
         return;
     }
 
-    for (uint32_t i = 0; i < size; ++i) {
-        if (cells[i].has_seq_id(seq_id) && cells[i].pos >= p0 && cells[i].pos < p1) {
-            has_shift = true;
+    std::vector<uint32_t> ids;
+    seq_cells_range(seq_id, p0, p1, ids);
 
-            {
-                llama_pos p_old = cells[i].pos;
-                cells[i].pos   /= d;
-                cells[i].delta += cells[i].pos - p_old;
-            }
-        }
+    for (const uint32_t i : ids) {
+        has_shift = true;
+
+        cell_pos_div(i, d);
+    }
+
+    if (swa) {
+        swa->seq_div(seq_id, p0, p1, d);
     }
 }
 
 llama_pos llama_kv_cache_unified::seq_pos_max(llama_seq_id seq_id) const {
-    llama_pos result = 0;
-
-    for (uint32_t i = 0; i < size; ++i) {
-        if (cells[i].has_seq_id(seq_id)) {
-            result = std::max(result, cells[i].pos);
-        }
+    if (seq_id < 0 || seq_id >= LLAMA_MAX_SEQ || seq_cells[seq_id].empty()) {
+        return 0;
     }
 
-    return result;
+    return std::max(0, seq_cells[seq_id].rbegin()->first);
 }
 
 void llama_kv_cache_unified::defrag() {
@@ -447,6 +533,10 @@ void llama_kv_cache_unified::defrag() {
 }
 
 void llama_kv_cache_unified::restore() {
+    if (swa) {
+        swa->restore();
+    }
+
     if (pending.ranges.empty()) {
         return;
     }
@@ -461,15 +551,7 @@ void llama_kv_cache_unified::restore() {
 
     for (auto & range : pending.ranges) {
         for (uint32_t i = range.c0; i < range.c1; ++i) {
-            cells[i].seq_id.clear();
-
-            // keep count of the number of used cells
-            if (cells[i].pos >= 0) {
-                used--;
-            }
-
-            cells[i].pos = -1;
-            cells[i].src = -1;
+            cell_clear(i);
         }
 
         new_head = std::min(new_head, range.c0);
@@ -486,6 +568,10 @@ void llama_kv_cache_unified::commit() {
         return;
     }
 
+    if (swa) {
+        swa->commit();
+    }
+
     if (pending.ranges.empty()) {
         LLAMA_LOG_WARN("%s: no pending KV cache updates to commit - might indicate a bug (ref: %s)\n",
                 __func__, "https://github.com/ggml-org/llama.cpp/pull/12695");
@@ -667,8 +753,8 @@ bool llama_kv_cache_unified::find_slot(
         // allow getting the range of used cells, from head to head + n
         head = min;
         n    = max - min + 1;
-        used = std::count_if(cells.begin(), cells.end(),
-            [](const llama_kv_cell& cell){ return !cell.is_empty(); });
+
+        index_rebuild();
 
         // sanity check
         return n >= n_seqs;
@@ -681,48 +767,41 @@ bool llama_kv_cache_unified::find_slot(
         return false;
     }
 
-    uint32_t n_tested = 0;
-
-    while (true) {
-        if (head + n_tokens > size) {
-            n_tested += size - head;
-            head = 0;
-            continue;
-        }
+    for (uint32_t s = 0; s < n_seqs; s++) {
+        for (int32_t j = 0; j < ubatch.n_seq_id[s]; j++) {
+            const llama_seq_id seq_id = ubatch.seq_id[s][j];
 
-        bool found = true;
-        for (uint32_t i = 0; i < n_tokens; i++) {
-            if (cells[head + i].pos >= 0) {
-                found = false;
-                head     += i + 1;
-                n_tested += i + 1;
-                break;
+            if (seq_id < 0 || seq_id >= LLAMA_MAX_SEQ) {
+                LLAMA_LOG_ERROR("%s: seq_id = %d is out of range [0, %d)\n", __func__, seq_id, LLAMA_MAX_SEQ);
+                return false;
             }
         }
+    }
 
-        if (found) {
-            break;
-        }
+    // first fit after the head, then from the start of the cache
+    uint32_t slot = free_find(head, n_tokens);
+    if (slot == size) {
+        slot = free_find(0, n_tokens);
+    }
 
-        if (n_tested >= size) {
-            //LLAMA_LOG_ERROR("%s: failed to find a slot for %d tokens\n", __func__, n_tokens);
-            return false;
-        }
+    if (slot == size) {
+        //LLAMA_LOG_ERROR("%s: failed to find a slot for %d tokens\n", __func__, n_tokens);
+        return false;
     }
 
+    head = slot;
+
     for (uint32_t s = 0; s < n_seqs; s++) {
         for (uint32_t i = 0; i < n_seq_tokens; ++i) {
             uint32_t k = s*n_seq_tokens + i;
             cells[head + k].pos = ubatch.pos[k];
 
             for (int32_t j = 0; j < ubatch.n_seq_id[s]; j++) {
-                cells[head + k].seq_id.insert(ubatch.seq_id[s][j]);
+                cell_seq_add(head + k, ubatch.seq_id[s][j]);
             }
         }
     }
 
-    used += n_tokens;
-
     pending.ranges.push_back({head, head + n_tokens});
 
     return true;
@@ -734,32 +813,33 @@ uint32_t llama_kv_cache_unified::get_padding(const llama_cparams & cparams) cons
 }
 
 uint32_t llama_kv_cache_unified::cell_max() const {
-    for (uint32_t i = size; i > 0; --i) {
-        const llama_kv_cell & cell = cells[i - 1];
-
-        if (cell.pos >= 0 && !cell.is_empty()) {
-            return i;
-        }
+    // the cells after the last used one form the last free range
+    if (!free_ranges.empty() && free_ranges.rbegin()->second == size) {
+        return free_ranges.rbegin()->first;
     }
 
-    return 0;
+    return size;
 }
 
 size_t llama_kv_cache_unified::size_k_bytes() const {
-    size_t size_k_bytes = 0;
+    size_t size_k_bytes = swa ? swa->size_k_bytes() : 0;
 
     for (const auto & k : k_l) {
-        size_k_bytes += lm_ggml_nbytes(k);
+        if (k) {
+            size_k_bytes += lm_ggml_nbytes(k);
+        }
     }
 
     return size_k_bytes;
 }
 
 size_t llama_kv_cache_unified::size_v_bytes() const {
-    size_t size_v_bytes = 0;
+    size_t size_v_bytes = swa ? swa->size_v_bytes() : 0;
 
     for (const auto & v : v_l) {
-        size_v_bytes += lm_ggml_nbytes(v);
+        if (v) {
+            size_v_bytes += lm_ggml_nbytes(v);
+        }
     }
 
     return size_v_bytes;
@@ -895,6 +975,8 @@ bool llama_kv_cache_unified::defrag_prepare(int32_t n_max_nodes) {
         return false;
     }
 
+    index_rebuild();
+
     LLAMA_LOG_DEBUG("(tmp log) KV defrag cell moves: %u\n", n_moves);
 
     LLAMA_LOG_DEBUG("expected gf nodes: %u\n", 6*n_moves*n_layer);
@@ -938,15 +1020,21 @@ void llama_kv_cache_unified::state_write(llama_io_write_i & io, llama_seq_id seq
 
     state_write_meta(io, cell_ranges, seq_id);
     state_write_data(io, cell_ranges);
+
+    if (swa) {
+        swa->state_write(io, seq_id);
+    }
 }
 
 void llama_kv_cache_unified::state_read(llama_io_read_i & io, llama_seq_id seq_id) {
     uint32_t cell_count;
     io.read_to(&cell_count, sizeof(cell_count));
 
+    std::vector<slot_range> ranges;
+
     bool res = true;
-    res = res && state_read_meta(io, cell_count, seq_id);
-    res = res && state_read_data(io, cell_count);
+    res = res && state_read_meta(io, cell_count, ranges, seq_id);
+    res = res && state_read_data(io, cell_count, ranges);
 
     if (!res) {
         if (seq_id == -1) {
@@ -956,6 +1044,14 @@ void llama_kv_cache_unified::state_read(llama_io_read_i & io, llama_seq_id seq_i
         }
         throw std::runtime_error("failed to restore kv cache");
     }
+
+    if (swa) {
+        swa->state_read(io, seq_id);
+    }
+}
+
+const llama_kv_cache_unified * llama_kv_cache_unified::layer_cache(int32_t il) const {
+    return swa && hparams.is_swa(il) ? swa.get() : this;
 }
 
 void llama_kv_cache_unified::state_write_meta(llama_io_write_i & io, const std::vector<std::pair<uint32_t, uint32_t>> & cell_ranges, llama_seq_id seq_id) const {
@@ -981,14 +1077,21 @@ void llama_kv_cache_unified::state_write_data(llama_io_write_i & io, const std::
     const uint32_t v_trans = this->v_trans ? 1 : 0;
     const uint32_t n_layer = hparams.n_layer;
 
-    io.write(&v_trans, sizeof(v_trans));
-    io.write(&n_layer, sizeof(n_layer));
+    // only the layers of this cache are written
+    const uint32_t n_layer_held = std::count_if(k_l.begin(), k_l.end(), [](const lm_ggml_tensor * k) { return k != nullptr; });
+
+    io.write(&v_trans,      sizeof(v_trans));
+    io.write(&n_layer_held, sizeof(n_layer_held));
 
     std::vector<uint8_t> tmp_buf;
 
     // Iterate and write all the keys first, each row is a cell
     // Get whole range at a time
     for (uint32_t il = 0; il < n_layer; ++il) {
+        if (!k_l[il]) {
+            continue;
+        }
+
         const uint32_t n_embd_k_gqa = hparams.n_embd_k_gqa(il) + hparams.n_embd_k_s();
 
         // Write key type
@@ -1009,6 +1112,10 @@ void llama_kv_cache_unified::state_write_data(llama_io_write_i & io, const std::
 
     if (!v_trans) {
         for (uint32_t il = 0; il < n_layer; ++il) {
+            if (!v_l[il]) {
+                continue;
+            }
+
             const uint32_t n_embd_v_gqa = hparams.n_embd_v_gqa(il) + hparams.n_embd_v_s();
 
             // Write value type
@@ -1030,6 +1137,10 @@ void llama_kv_cache_unified::state_write_data(llama_io_write_i & io, const std::
         // When v is transposed, we also need the element size and get the element ranges from each row
         const uint32_t kv_size = size;
         for (uint32_t il = 0; il < n_layer; ++il) {
+            if (!v_l[il]) {
+                continue;
+            }
+
             const uint32_t n_embd_v_gqa = hparams.n_embd_v_gqa(il) + hparams.n_embd_v_s();
 
             // Write value type
@@ -1057,15 +1168,22 @@ void llama_kv_cache_unified::state_write_data(llama_io_write_i & io, const std::
     }
 }
 
-bool llama_kv_cache_unified::state_read_meta(llama_io_read_i & io, uint32_t cell_count, llama_seq_id dest_seq_id) {
+bool llama_kv_cache_unified::state_read_meta(llama_io_read_i & io, uint32_t cell_count, std::vector<slot_range> & ranges, llama_seq_id dest_seq_id) {
     if (dest_seq_id != -1) {
         // single sequence
 
         seq_rm(dest_seq_id, -1, -1);
 
+        if (cell_count == 0) {
+            return true;
+        }
+
         llama_sbatch sbatch;
         llama_ubatch batch = sbatch.reserve_ubatch(cell_count, /* has_embd */ false);
 
+        // the tokens of the restored cells are not known
+        batch.token = nullptr;
+
         batch.n_tokens = cell_count;
         batch.n_seq_tokens = cell_count;
         batch.n_seqs = 1;
@@ -1086,19 +1204,34 @@ bool llama_kv_cache_unified::state_read_meta(llama_io_read_i & io, uint32_t cell
         }
         batch.n_seq_id[0] = 1;
         batch.seq_id[0] = &dest_seq_id;
+
+        // the slot is recorded as pending ranges until the commit
+        const size_t n_pending = pending.ranges.size();
+
         if (!find_slot(batch)) {
             LLAMA_LOG_ERROR("%s: failed to find available cells in kv cache\n", __func__);
             return false;
         }
+        if (!recurrent) {
+            ranges.assign(pending.ranges.begin() + n_pending, pending.ranges.end());
+        }
         commit();
 
-        // DEBUG CHECK: kv.head should be our first cell, kv.head + cell_count - 1 should be our last cell (verify seq_id and pos values)
-        // Assume that this is one contiguous block of cells
-        LM_GGML_ASSERT(head + cell_count <= size);
-        LM_GGML_ASSERT(cells[head].pos == batch.pos[0]);
-        LM_GGML_ASSERT(cells[head + cell_count - 1].pos == batch.pos[cell_count - 1]);
-        LM_GGML_ASSERT(cells[head].has_seq_id(dest_seq_id));
-        LM_GGML_ASSERT(cells[head + cell_count - 1].has_seq_id(dest_seq_id));
+        if (recurrent) {
+            ranges.push_back({ head, head + cell_count });
+        }
+
+        // DEBUG CHECK: the ranges should cover cell_count cells, from the first to the last token (verify seq_id and pos values)
+        uint32_t cell_count_check = 0;
+        for (const auto & range : ranges) {
+            LM_GGML_ASSERT(range.c1 <= size);
+            cell_count_check += range.c1 - range.c0;
+        }
+        LM_GGML_ASSERT(cell_count_check == cell_count);
+        LM_GGML_ASSERT(cells[ranges.front().c0].pos == batch.pos[0]);
+        LM_GGML_ASSERT(cells[ranges.back().c1 - 1].pos == batch.pos[cell_count - 1]);
+        LM_GGML_ASSERT(cells[ranges.front().c0].has_seq_id(dest_seq_id));
+        LM_GGML_ASSERT(cells[ranges.back().c1 - 1].has_seq_id(dest_seq_id));
     } else {
         // whole KV cache restore
 
@@ -1124,11 +1257,8 @@ bool llama_kv_cache_unified::state_read_meta(llama_io_read_i & io, uint32_t cell
                 llama_seq_id seq_id;
                 io.read_to(&seq_id, sizeof(seq_id));
 
-                // TODO: llama_kv_cache_unified should have a notion of max sequences
-                //if (seq_id < 0 || (uint32_t) seq_id >= llama_n_seq_max(ctx)) {
-                if (seq_id < 0) {
-                    //LLAMA_LOG_ERROR("%s: invalid seq_id, %d is out of range [0, %u)\n", __func__, seq_id, llama_n_seq_max(ctx));
-                    LLAMA_LOG_ERROR("%s: invalid seq_id, %d is out of range [0, inf)\n", __func__, seq_id);
+                if (seq_id < 0 || seq_id >= LLAMA_MAX_SEQ) {
+                    LLAMA_LOG_ERROR("%s: invalid seq_id, %d is out of range [0, %d)\n", __func__, seq_id, LLAMA_MAX_SEQ);
                     return false;
                 }
 
@@ -1146,7 +1276,10 @@ bool llama_kv_cache_unified::state_read_meta(llama_io_read_i & io, uint32_t cell
         }
 
         head = 0;
-        used = cell_count;
+
+        index_rebuild();
+
+        ranges.push_back({ 0, cell_count });
     }
 
     if (recurrent) {
@@ -1160,14 +1293,17 @@ bool llama_kv_cache_unified::state_read_meta(llama_io_read_i & io, uint32_t cell
     return true;
 }
 
-bool llama_kv_cache_unified::state_read_data(llama_io_read_i & io, uint32_t cell_count) {
+bool llama_kv_cache_unified::state_read_data(llama_io_read_i & io, uint32_t cell_count, const std::vector<slot_range> & ranges) {
     uint32_t v_trans;
-    uint32_t n_layer;
-    io.read_to(&v_trans, sizeof(v_trans));
-    io.read_to(&n_layer, sizeof(n_layer));
+    uint32_t n_layer_ref;
+    io.read_to(&v_trans,     sizeof(v_trans));
+    io.read_to(&n_layer_ref, sizeof(n_layer_ref));
+
+    const uint32_t n_layer      = hparams.n_layer;
+    const uint32_t n_layer_held = std::count_if(k_l.begin(), k_l.end(), [](const lm_ggml_tensor * k) { return k != nullptr; });
 
-    if (n_layer != hparams.n_layer) {
-        LLAMA_LOG_ERROR("%s: mismatched layer count (%u instead of %u)\n", __func__, n_layer, hparams.n_layer);
+    if (n_layer_ref != n_layer_held) {
+        LLAMA_LOG_ERROR("%s: mismatched layer count (%u instead of %u)\n", __func__, n_layer_ref, n_layer_held);
         return false;
     }
     if (cell_count > size) {
@@ -1181,6 +1317,10 @@ bool llama_kv_cache_unified::state_read_data(llama_io_read_i & io, uint32_t cell
 
     // For each layer, read the keys for each cell, one row is one cell, read as one contiguous block
     for (uint32_t il = 0; il < n_layer; ++il) {
+        if (!k_l[il]) {
+            continue;
+        }
+
         const uint32_t n_embd_k_gqa = hparams.n_embd_k_gqa(il) + hparams.n_embd_k_s();
 
         // Read type of key
@@ -1201,14 +1341,19 @@ bool llama_kv_cache_unified::state_read_data(llama_io_read_i & io, uint32_t cell
             return false;
         }
 
-        if (cell_count) {
-            // Read and set the keys for the whole cell range
-            lm_ggml_backend_tensor_set(k_l[il], io.read(cell_count * k_size_row), head * k_size_row, cell_count * k_size_row);
+        // Read and set the keys for each cell range
+        for (const auto & range : ranges) {
+            const size_t range_size = range.c1 - range.c0;
+            lm_ggml_backend_tensor_set(k_l[il], io.read(range_size * k_size_row), range.c0 * k_size_row, range_size * k_size_row);
         }
     }
 
     if (!v_trans) {
         for (uint32_t il = 0; il < n_layer; ++il) {
+            if (!v_l[il]) {
+                continue;
+            }
+
             const uint32_t n_embd_v_gqa = hparams.n_embd_v_gqa(il) + hparams.n_embd_v_s();
 
             // Read type of value
@@ -1229,14 +1374,19 @@ bool llama_kv_cache_unified::state_read_data(llama_io_read_i & io, uint32_t cell
                 return false;
             }
 
-            if (cell_count) {
-                // Read and set the values for the whole cell range
-                lm_ggml_backend_tensor_set(v_l[il], io.read(cell_count * v_size_row), head * v_size_row, cell_count * v_size_row);
+            // Read and set the values for each cell range
+            for (const auto & range : ranges) {
+                const size_t range_size = range.c1 - range.c0;
+                lm_ggml_backend_tensor_set(v_l[il], io.read(range_size * v_size_row), range.c0 * v_size_row, range_size * v_size_row);
             }
         }
     } else {
         // For each layer, read the values for each cell (transposed)
         for (uint32_t il = 0; il < n_layer; ++il) {
+            if (!v_l[il]) {
+                continue;
+            }
+
             const uint32_t n_embd_v_gqa = hparams.n_embd_v_gqa(il) + hparams.n_embd_v_s();
 
             // Read type of value
@@ -1265,11 +1415,12 @@ bool llama_kv_cache_unified::state_read_data(llama_io_read_i & io, uint32_t cell
                 return false;
             }
 
-            if (cell_count) {
-                // For each row in the transposed matrix, read the values for the whole cell range
-                for (uint32_t j = 0; j < n_embd_v_gqa; ++j) {
-                    const size_t dst_offset = (head + j * size) * v_size_el;
-                    lm_ggml_backend_tensor_set(v_l[il], io.read(cell_count * v_size_el), dst_offset, cell_count * v_size_el);
+            // For each row in the transposed matrix, read the values for each cell range
+            for (uint32_t j = 0; j < n_embd_v_gqa; ++j) {
+                for (const auto & range : ranges) {
+                    const size_t range_size = range.c1 - range.c0;
+                    const size_t dst_offset = (range.c0 + j * size) * v_size_el;
+                    lm_ggml_backend_tensor_set(v_l[il], io.read(range_size * v_size_el), dst_offset, range_size * v_size_el);
                 }
             }
         }
@@ -1278,6 +1429,1110 @@ bool llama_kv_cache_unified::state_read_data(llama_io_read_i & io, uint32_t cell
     return true;
 }
 
+void llama_kv_cache_unified::cell_seq_add(uint32_t i, llama_seq_id seq_id) {
+    llama_kv_cell & cell = cells[i];
+
+    if (cell.has_seq_id(seq_id)) {
+        return;
+    }
+
+    if (cell.is_empty()) {
+        used++;
+        free_rm(i);
+    }
+
+    cell.seq_id.insert(seq_id);
+    seq_cells[seq_id].emplace(cell.pos, i);
+}
+
+bool llama_kv_cache_unified::cell_seq_rm(uint32_t i, llama_seq_id seq_id) {
+    llama_kv_cell & cell = cells[i];
+
+    if (!cell.has_seq_id(seq_id)) {
+        return false;
+    }
+
+    cell.seq_id.erase(seq_id);
+    seq_cells[seq_id].erase({ cell.pos, i });
+
+    if (!cell.is_empty()) {
+        return false;
+    }
+
+    cell.pos = -1;
+    cell.src = -1;
+
+    used--;
+    free_add(i);
+
+    return true;
+}
+
+void llama_kv_cache_unified::cell_clear(uint32_t i) {
+    llama_kv_cell & cell = cells[i];
+
+    const bool was_used = !cell.is_empty();
+
+    for (const llama_seq_id seq_id : cell.seq_id) {
+        seq_cells[seq_id].erase({ cell.pos, i });
+    }
+
+    cell.seq_id.clear();
+    cell.pos = -1;
+    cell.src = -1;
+
+    if (was_used) {
+        used--;
+        free_add(i);
+    }
+}
+
+bool llama_kv_cache_unified::cell_pos_add(uint32_t i, llama_pos delta) {
+    llama_kv_cell & cell = cells[i];
+
+    for (const llama_seq_id seq_id : cell.seq_id) {
+        seq_cells[seq_id].erase({ cell.pos, i });
+    }
+
+    cell.pos   += delta;
+    cell.delta += delta;
+
+    if (cell.pos < 0) {
+        const bool was_used = !cell.is_empty();
+
+        cell.pos = -1;
+        cell.seq_id.clear();
+
+        if (was_used) {
+            used--;
+            free_add(i);
+        }
+
+        return true;
+    }
+
+    for (const llama_seq_id seq_id : cell.seq_id) {
+        seq_cells[seq_id].emplace(cell.pos, i);
+    }
+
+    return false;
+}
+
+void llama_kv_cache_unified::cell_pos_div(uint32_t i, int d) {
+    llama_kv_cell & cell = cells[i];
+
+    for (const llama_seq_id seq_id : cell.seq_id) {
+        seq_cells[seq_id].erase({ cell.pos, i });
+    }
+
+    const llama_pos p_old = cell.pos;
+    cell.pos   /= d;
+    cell.delta += cell.pos - p_old;
+
+    for (const llama_seq_id seq_id : cell.seq_id) {
+        seq_cells[seq_id].emplace(cell.pos, i);
+    }
+}
+
+void llama_kv_cache_unified::seq_cells_range(llama_seq_id seq_id, llama_pos p0, llama_pos p1, std::vector<uint32_t> & ids) const {
+    if (seq_id < 0 || seq_id >= LLAMA_MAX_SEQ) {
+        return;
+    }
+
+    if (p0 < 0) {
+        p0 = std::numeric_limits<llama_pos>::min();
+    }
+
+    if (p1 < 0) {
+        p1 = std::numeric_limits<llama_pos>::max();
+    }
+
+    if (p0 >= p1) {
+        return;
+    }
+
+    const auto & cs = seq_cells[seq_id];
+
+    const auto end = cs.lower_bound({ p1, 0 });
+    for (auto it = cs.lower_bound({ p0, 0 }); it != end; ++it) {
+        ids.push_back(it->second);
+    }
+}
+
+uint32_t llama_kv_cache_unified::seq_cells_count(llama_seq_id seq_id, llama_pos p0, llama_pos p1) const {
+    std::vector<uint32_t> ids;
+    seq_cells_range(seq_id, p0, p1, ids);
+
+    return ids.size();
+}
+
+uint32_t llama_kv_cache_unified::free_find(uint32_t c, uint32_t n) const {
+    // the range holding c, or the first one after it
+    auto it = free_ranges.upper_bound(c);
+    if (it != free_ranges.begin() && std::prev(it)->second > c) {
+        --it;
+    }
+
+    for (; it != free_ranges.end(); ++it) {
+        const uint32_t c0 = std::max(it->first, c);
+
+        if (it->second - c0 >= n) {
+            return c0;
+        }
+    }
+
+    return size;
+}
+
+void llama_kv_cache_unified::free_take(uint32_t c, uint32_t n, std::vector<uint32_t> & ids) const {
+    const size_t n_ids = ids.size() + n;
+
+    // [c, size), then [0, c)
+    for (const uint32_t c_begin : { c, 0u }) {
+        const uint32_t c_end = c_begin == c ? size : c;
+
+        auto it = free_ranges.upper_bound(c_begin);
+        if (it != free_ranges.begin() && std::prev(it)->second > c_begin) {
+            --it;
+        }
+
+        for (; it != free_ranges.end() && it->first < c_end && ids.size() < n_ids; ++it) {
+            const uint32_t c1 = std::min(it->second, c_end);
+
+            for (uint32_t i = std::max(it->first, c_begin); i < c1 && ids.size() < n_ids; ++i) {
+                ids.push_back(i);
+            }
+        }
+
+        if (c == 0) {
+            break;
+        }
+    }
+}
+
+void llama_kv_cache_unified::index_rebuild() {
+    used = 0;
+
+    free_ranges.clear();
+    seq_cells.assign(LLAMA_MAX_SEQ, {});
+
+    uint32_t c0 = size; // start of the current run of empty cells
+
+    for (uint32_t i = 0; i < size; ++i) {
+        const llama_kv_cell & cell = cells[i];
+
+        if (cell.is_empty()) {
+            if (c0 == size) {
+                c0 = i;
+            }
+            continue;
+        }
+
+        if (c0 != size) {
+            free_ranges.emplace(c0, i);
+            c0 = size;
+        }
+
+        used++;
+
+        for (const llama_seq_id seq_id : cell.seq_id) {
+            seq_cells[seq_id].emplace(cell.pos, i);
+        }
+    }
+
+    if (c0 != size) {
+        free_ranges.emplace(c0, size);
+    }
+}
+
+void llama_kv_cache_unified::free_add(uint32_t i) {
+    uint32_t c1 = i + 1;
+
+    const auto next = free_ranges.find(c1);
+    if (next != free_ranges.end()) {
+        c1 = next->second;
+        free_ranges.erase(next);
+    }
+
+    const auto it = free_ranges.lower_bound(i);
+    if (it != free_ranges.begin() && std::prev(it)->second == i) {
+        std::prev(it)->second = c1;
+        return;
+    }
+
+    free_ranges.emplace_hint(it, i, c1);
+}
+
+void llama_kv_cache_unified::free_rm(uint32_t i) {
+    auto it = free_ranges.upper_bound(i);
+    LM_GGML_ASSERT(it != free_ranges.begin());
+
+    --it;
+
+    const uint32_t c0 = it->first;
+    const uint32_t c1 = it->second;
+    LM_GGML_ASSERT(i < c1);
+
+    it = free_ranges.erase(it);
+
+    if (i + 1 < c1) {
+        it = free_ranges.emplace_hint(it, i + 1, c1);
+    }
+
+    if (c0 < i) {
+        free_ranges.emplace_hint(it, c0, i);
+    }
+}
+
+//
+// llama_kv_cache_swa
+//
+
+llama_kv_cache_swa::llama_kv_cache_swa(const llama_hparams & hparams, callbacks cbs, uint32_t n_keep) :
+    llama_kv_cache_unified(hparams, std::move(cbs)), n_keep(n_keep) {
+    LM_GGML_ASSERT(n_keep >= hparams.n_swa);
+
+    layer_filter = [&hparams](int32_t il) { return hparams.is_swa(il); };
+}
+
+bool llama_kv_cache_swa::init(
+        const llama_model & model,
+      const llama_cparams & cparams,
+                lm_ggml_type   type_k,
+                lm_ggml_type   type_v,
+                 uint32_t   kv_size,
+                     bool   offload) {
+    if (!llama_kv_cache_unified::init(model, cparams, type_k, type_v, kv_size, offload)) {
+        return false;
+    }
+
+    n_pad = get_padding(cparams);
+
+    // with the oldest cells dropped first, the free cells after the head are mostly contiguous
+    n_runs_max = std::min(cparams.n_ubatch, 2*std::max(cparams.n_seq_max + 1, 8u));
+
+    return true;
+}
+
+void llama_kv_cache_swa::commit() {
+    pending.ranges.clear();
+}
+
+bool llama_kv_cache_swa::find_slot(const llama_ubatch & ubatch) {
+    const uint32_t n_tokens     = ubatch.n_tokens;
+    const uint32_t n_seqs       = ubatch.n_seqs;
+    const uint32_t n_seq_tokens = ubatch.n_seq_tokens;
+
+    // drop the cells older than the kept positions of each sequence
+    std::vector<uint32_t> ids;
+
+    for (llama_seq_id s = 0; s < LLAMA_MAX_SEQ; ++s) {
+        if (seq_cells[s].empty()) {
+            continue;
+        }
+
+        const llama_pos p_keep = seq_cells[s].rbegin()->first + 1 - (llama_pos) n_keep;
+        if (p_keep <= 0) {
+            continue;
+        }
+
+        ids.clear();
+        seq_cells_range(s, 0, p_keep, ids);
+
+        for (const uint32_t i : ids) {
+            cell_seq_rm(i, s);
+        }
+    }
+
+    if (n_tokens > size - used) {
+        LLAMA_LOG_ERROR("%s: n_tokens = %d > free cells = %d\n", __func__, n_tokens, size - used);
+        return false;
+    }
+
+    // a contiguous slot after the head if there is one, otherwise the first free cells after it
+    ids.clear();
+
+    const uint32_t slot = free_find(head, n_tokens);
+    if (slot != size) {
+        for (uint32_t i = 0; i < n_tokens; ++i) {
+            ids.push_back(slot + i);
+        }
+    } else {
+        free_take(head, n_tokens, ids);
+    }
+
+    runs.clear();
+
+    for (uint32_t k = 0; k < n_tokens; ++k) {
+        if (runs.empty() || runs.back().c0 + runs.back().n != ids[k]) {
+            runs.push_back({ k, ids[k], 0 });
+        }
+        runs.back().n++;
+    }
+
+    if (runs.size() > n_runs_max) {
+        LLAMA_LOG_ERROR("%s: the free cells are split in more than %u runs\n", __func__, n_runs_max);
+        runs.clear();
+        return false;
+    }
+
+    for (uint32_t s = 0; s < n_seqs; s++) {
+        for (uint32_t i = 0; i < n_seq_tokens; ++i) {
+            const uint32_t k = s*n_seq_tokens + i;
+
+            cells[ids[k]].pos = ubatch.pos[k];
+
+            for (int32_t j = 0; j < ubatch.n_seq_id[s]; j++) {
+                cell_seq_add(ids[k], ubatch.seq_id[s][j]);
+            }
+        }
+    }
+
+    for (const auto & run : runs) {
+        pending.ranges.push_back({ run.c0, run.c0 + run.n });
+    }
+
+    head = ids.back() + 1 < size ? ids.back() + 1 : 0;
+    n    = std::min(size, std::max(n_pad, LM_GGML_PAD(cell_max(), n_pad)));
+
+    return true;
+}
+
+//
+// llama_kv_cache_paged
+//
+
+llama_kv_cache_paged::llama_kv_cache_paged(const llama_hparams & hparams, callbacks cbs, uint32_t block_size) :
+    llama_kv_cache_unified(hparams, std::move(cbs)), block_size(block_size) {
+    LM_GGML_ASSERT(block_size > 0);
+
+    paged = true;
+}
+
+bool llama_kv_cache_paged::init(
+        const llama_model & model,
+      const llama_cparams & cparams,
+                lm_ggml_type   type_k,
+                lm_ggml_type   type_v,
+                 uint32_t   kv_size,
+                     bool   offload) {
+    // the K/V tensors hold all kv_size cells from the start; only their assignment to sequences is paged
+    if (!llama_kv_cache_unified::init(model, cparams, type_k, type_v, kv_size, offload)) {
+        return false;
+    }
+
+    LM_GGML_ASSERT(!recurrent && "the paged KV cache does not support recurrent models");
+
+    // the cells are gathered by rows, so the values are not transposed in the cache
+    v_trans = false;
+
+    n_blocks = (size + block_size - 1)/block_size;
+    n_pad    = get_padding(cparams);
+    n_ubatch = cparams.n_ubatch;
+
+    // a ubatch needs a new run for each block it starts and each time the sequence changes
+    n_runs_max = std::min(n_ubatch, 2*std::max(cparams.n_seq_max, 16u) + n_ubatch/block_size + 1);
+
+    block_mark.assign(n_blocks, 0);
+    mark_epoch = 0;
+
+    LLAMA_LOG_INFO("%s: block_size = %u, n_blocks = %u, n_runs_max = %u\n", __func__, block_size, n_blocks, n_runs_max);
+
+    rebuild();
+
+    return true;
+}
+
+void llama_kv_cache_paged::clear() {
+    llama_kv_cache_unified::clear();
+
+    rebuild();
+}
+
+void llama_kv_cache_paged::defrag() {
+    // nothing to do: a sequence never needs contiguous cells
+}
+
+void llama_kv_cache_paged::restore() {
+    if (pending.ranges.empty()) {
+        return;
+    }
+
+    std::vector<llama_seq_id> seqs;
+
+    for (const auto & range : pending.ranges) {
+        for (uint32_t i = range.c0; i < range.c1; ++i) {
+            if (cells[i].pos < 0) {
+                continue;
+            }
+
+            seqs.insert(seqs.end(), cells[i].seq_id.begin(), cells[i].seq_id.end());
+
+            cell_free(i);
+        }
+    }
+
+    std::sort(seqs.begin(), seqs.end());
+    seqs.erase(std::unique(seqs.begin(), seqs.end()), seqs.end());
+
+    for (const llama_seq_id seq_id : seqs) {
+        table_prune(seq_id);
+    }
+
+    release();
+
+    pending.ranges.clear();
+}
+
+void llama_kv_cache_paged::commit() {
+    // the blocks completed by the ubatches can extend a cached prefix, parents are inserted before children
+    std::vector<uint32_t> blocks;
+
+    const uint32_t mark = mark_next();
+
+    for (const auto & range : pending.ranges) {
+        for (uint32_t b = range.c0/block_size; b*block_size < range.c1; ++b) {
+            if (block_mark[b] != mark) {
+                block_mark[b] = mark;
+                blocks.push_back(b);
+            }
+        }
+    }
+
+    std::sort(blocks.begin(), blocks.end(), [&](uint32_t a, uint32_t b) {
+        return cells[block_begin(a)].pos < cells[block_begin(b)].pos;
+    });
+
+    for (const uint32_t b : blocks) {
+        prefix_insert(b);
+    }
+
+    llama_kv_cache_unified::commit();
+}
+
+bool llama_kv_cache_paged::seq_rm(llama_seq_id seq_id, llama_pos p0, llama_pos p1) {
+    if (p0 < 0) {
+        p0 = 0;
+    }
+
+    if (p1 < 0) {
+        p1 = std::numeric_limits<llama_pos>::max();
+    }
+
+    std::vector<uint32_t> ids;
+
+    if (seq_id < 0) {
+        for (llama_seq_id s = 0; s < (llama_seq_id) seq_blocks.size(); ++s) {
+            seq_cells_range(s, p0, p1, ids);
+        }
+
+        for (const uint32_t i : ids) {
+            if (!cells[i].is_empty()) {
+                cell_free(i);
+            }
+        }
+
+        for (llama_seq_id s = 0; s < (llama_seq_id) seq_blocks.size(); ++s) {
+            table_prune(s);
+        }
+    } else if ((size_t) seq_id < seq_blocks.size()) {
+        seq_cells_range(seq_id, p0, p1, ids);
+
+        for (const uint32_t i : ids) {
+            if (cell_seq_rm(i, seq_id)) {
+                cell_released(i);
+            }
+        }
+
+        table_prune(seq_id);
+    }
+
+    release();
+
+    return true;
+}
+
+void llama_kv_cache_paged::seq_cp(llama_seq_id seq_id_src, llama_seq_id seq_id_dst, llama_pos p0, llama_pos p1) {
+    if (seq_id_src == seq_id_dst || seq_id_src < 0 || seq_id_dst < 0 || (size_t) seq_id_src >= seq_blocks.size()) {
+        return;
+    }
+
+    if (p0 < 0) {
+        p0 = 0;
+    }
+
+    if (p1 < 0) {
+        p1 = std::numeric_limits<llama_pos>::max();
+    }
+
+    // the cells are shared, the blocks holding them are added to the table of the destination
+    auto & blocks_dst = table(seq_id_dst);
+
+    const uint32_t mark = mark_next();
+    for (const uint32_t b : blocks_dst) {
+        block_mark[b] = mark;
+    }
+
+    std::vector<uint32_t> ids;
+    seq_cells_range(seq_id_src, p0, p1, ids);
+
+    for (const uint32_t i : ids) {
+        cell_seq_add(i, seq_id_dst);
+
+        const uint32_t b = i / block_size;
+        if (block_mark[b] != mark) {
+            block_mark[b] = mark;
+            blocks_dst.push_back(b);
+        }
+    }
+}
+
+void llama_kv_cache_paged::seq_keep(llama_seq_id seq_id) {
+    std::vector<uint32_t> ids;
+
+    for (llama_seq_id s = 0; s < (llama_seq_id) seq_blocks.size(); ++s) {
+        if (s == seq_id) {
+            continue;
+        }
+
+        ids.clear();
+        seq_cells_range(s, -1, -1, ids);
+
+        for (const uint32_t i : ids) {
+            if (cell_seq_rm(i, s)) {
+                cell_released(i);
+            }
+        }
+
+        seq_blocks[s].clear();
+    }
+
+    release();
+}
+
+void llama_kv_cache_paged::seq_add(llama_seq_id seq_id, llama_pos p0, llama_pos p1, llama_pos delta) {
+    if (delta == 0 || seq_id < 0 || (size_t) seq_id >= seq_blocks.size()) {
+        return;
+    }
+
+    if (p0 < 0) {
+        p0 = 0;
+    }
+
+    if (p1 < 0) {
+        p1 = std::numeric_limits<llama_pos>::max();
+    }
+
+    if (p0 == p1) {
+        return;
+    }
+
+    bool removed = false;
+
+    std::vector<uint32_t> ids;
+    seq_cells_range(seq_id, p0, p1, ids);
+
+    for (const uint32_t i : ids) {
+        const uint32_t b = i / block_size;
+
+        // the cached data is only valid at the positions it was computed for
+        if (prefix[b].cached) {
+            prefix_drop(b);
+        }
+
+        has_shift = true;
+
+        if (cell_pos_add(i, delta)) {
+            cell_released(i);
+            removed = true;
+        }
+    }
+
+    // the removed cells may have been shared with other sequences
+    if (removed) {
+        for (llama_seq_id s = 0; s < (llama_seq_id) seq_blocks.size(); ++s) {
+            table_prune(s);
+        }
+    }
+
+    release();
+}
+
+void llama_kv_cache_paged::seq_div(llama_seq_id seq_id, llama_pos p0, llama_pos p1, int d) {
+    if (d == 1 || seq_id < 0 || (size_t) seq_id >= seq_blocks.size()) {
+        return;
+    }
+
+    if (p0 < 0) {
+        p0 = 0;
+    }
+
+    if (p1 < 0) {
+        p1 = std::numeric_limits<llama_pos>::max();
+    }
+
+    if (p0 == p1) {
+        return;
+    }
+
+    std::vector<uint32_t> ids;
+    seq_cells_range(seq_id, p0, p1, ids);
+
+    for (const uint32_t i : ids) {
+        const uint32_t b = i / block_size;
+
+        if (prefix[b].cached) {
+            prefix_drop(b);
+        }
+
+        has_shift = true;
+
+        cell_pos_div(i, d);
+    }
+
+    release();
+}
+
+int32_t llama_kv_cache_paged::seq_attach_prefix(llama_seq_id seq_id, const llama_token * tokens, int32_t n_tokens, int32_t n_past) {
+    if (seq_id < 0 || n_past < 0) {
+        return n_past;
+    }
+
+    std::vector<uint32_t> chain;
+
+    for (int32_t i = 0; i + (int32_t) block_size <= n_tokens; i += block_size) {
+        const int32_t b = prefix_find(chain.empty() ? -1 : chain.back(), tokens + i);
+        if (b < 0) {
+            break;
+        }
+
+        chain.push_back(b);
+    }
+
+    const int32_t n_match = chain.size()*block_size;
+    if (n_match <= n_past) {
+        return n_past;
+    }
+
+    // the sequence keeps the cached blocks it already uses, its own cells after them are replaced
+    size_t d0 = 0;
+    while (d0 < chain.size() && prefix_holds(chain[d0], seq_id)) {
+        d0++;
+    }
+
+    seq_rm(seq_id, d0*block_size, -1);
+
+    auto & blocks = table(seq_id);
+
+    for (size_t d = d0; d < chain.size(); ++d) {
+        const uint32_t b = chain[d];
+
+        for (uint32_t i = block_begin(b); i < block_end(b); ++i) {
+            if (cells[i].is_empty()) {
+                cells[i].pos = d*block_size + (i - block_begin(b));
+
+                block_used[b]++;
+            }
+
+            cell_seq_add(i, seq_id);
+        }
+
+        blocks.push_back(b);
+    }
+
+    return n_match;
+}
+
+bool llama_kv_cache_paged::find_slot(const llama_ubatch & ubatch) {
+    const uint32_t n_tokens     = ubatch.n_tokens;
+    const uint32_t n_seqs       = ubatch.n_seqs;
+    const uint32_t n_seq_tokens = ubatch.n_seq_tokens;
+
+    runs.clear();
+    cell_ids.clear();
+
+    if (n_tokens > size) {
+        LLAMA_LOG_ERROR("%s: n_tokens = %d > size = %d\n", __func__, n_tokens, size);
+        return false;
+    }
+
+    std::vector<uint32_t> slots(n_tokens);
+
+    // undoes the assignment of the first k tokens
+    auto rollback = [&](uint32_t k) {
+        std::vector<llama_seq_id> seqs;
+
+        for (uint32_t i = 0; i < k; ++i) {
+            seqs.insert(seqs.end(), cells[slots[i]].seq_id.begin(), cells[slots[i]].seq_id.end());
+
+            cell_free(slots[i]);
+        }
+
+        std::sort(seqs.begin(), seqs.end());
+        seqs.erase(std::unique(seqs.begin(), seqs.end()), seqs.end());
+
+        for (const llama_seq_id seq_id : seqs) {
+            table_prune(seq_id);
+        }
+
+        release();
+    };
+
+    for (uint32_t k = 0; k < n_tokens; ++k) {
+        const uint32_t s = k / n_seq_tokens;
+
+        for (int32_t j = 0; j < ubatch.n_seq_id[s]; ++j) {
+            if (ubatch.seq_id[s][j] < 0 || ubatch.seq_id[s][j] >= LLAMA_MAX_SEQ) {
+                LLAMA_LOG_ERROR("%s: seq_id = %d is out of range [0, %d)\n", __func__, ubatch.seq_id[s][j], LLAMA_MAX_SEQ);
+                rollback(k);
+                return false;
+            }
+        }
+
+        const llama_seq_id seq_id = ubatch.seq_id[s][0];
+
+        const int32_t c = cell_alloc(seq_id);
+        if (c < 0) {
+            rollback(k);
+            return false;
+        }
+
+        cells[c].pos   = ubatch.pos[k];
+        cell_tokens[c] = ubatch.token ? ubatch.token[k] : -1;
+        for (int32_t j = 0; j < ubatch.n_seq_id[s]; ++j) {
+            cell_seq_add(c, ubatch.seq_id[s][j]);
+        }
+
+        const uint32_t b = c / block_size;
+        block_used[b]++;
+
+        // a token shared by several sequences is in the tables of all of them
+        for (int32_t j = 1; j < ubatch.n_seq_id[s]; ++j) {
+            auto & blocks = table(ubatch.seq_id[s][j]);
+            if (std::find(blocks.begin(), blocks.end(), b) == blocks.end()) {
+                blocks.push_back(b);
+            }
+        }
+
+        slots[k] = c;
+    }
+
+    for (uint32_t k = 0; k < n_tokens; ++k) {
+        if (!runs.empty() && slots[k] == runs.back().c0 + runs.back().n) {
+            runs.back().n++;
+        } else {
+            runs.push_back({ k, slots[k], 1 });
+        }
+    }
+
+    // a ubatch larger than n_ubatch only restores a state, it is never computed in a graph
+    if (n_tokens <= n_ubatch && runs.size() > n_runs_max) {
+        LLAMA_LOG_ERROR("%s: storing %u tokens needs %zu copies > %u, interleave fewer sequences in a batch\n",
+                __func__, n_tokens, runs.size(), n_runs_max);
+        rollback(n_tokens);
+        runs.clear();
+        return false;
+    }
+
+    for (const auto & run : runs) {
+        pending.ranges.push_back({ run.c0, run.c0 + run.n });
+    }
+
+    head = runs.front().c0;
+
+    // gather the cells of the sequences of the ubatch
+    std::vector<llama_seq_id> seqs;
+    for (uint32_t s = 0; s < n_seqs; ++s) {
+        seqs.insert(seqs.end(), ubatch.seq_id[s], ubatch.seq_id[s] + ubatch.n_seq_id[s]);
+    }
+
+    std::sort(seqs.begin(), seqs.end());
+    seqs.erase(std::unique(seqs.begin(), seqs.end()), seqs.end());
+
+    const uint32_t mark = mark_next();
+
+    for (const llama_seq_id seq_id : seqs) {
+        for (const uint32_t b : seq_blocks[seq_id]) {
+            if (block_mark[b] == mark) {
+                continue;
+            }
+            block_mark[b] = mark;
+
+            for (uint32_t i = block_begin(b); i < block_end(b); ++i) {
+                const llama_kv_cell & cell = cells[i];
+
+                if (cell.pos < 0) {
+                    continue;
+                }
+
+                for (const llama_seq_id id : seqs) {
+                    if (cell.has_seq_id(id)) {
+                        cell_ids.push_back(i);
+                        break;
+                    }
+                }
+            }
+        }
+    }
+
+    n = std::min(size, std::max(n_pad, (uint32_t) LM_GGML_PAD(cell_ids.size(), n_pad)));
+
+    return true;
+}
+
+void llama_kv_cache_paged::state_read(llama_io_read_i & io, llama_seq_id seq_id) {
+    llama_kv_cache_unified::state_read(io, seq_id);
+
+    // the whole cache restore sets the cells directly
+    if (seq_id == -1) {
+        rebuild();
+    }
+}
+
+std::vector<uint32_t> & llama_kv_cache_paged::table(llama_seq_id seq_id) {
+    LM_GGML_ASSERT(seq_id >= 0);
+
+    if ((size_t) seq_id >= seq_blocks.size()) {
+        seq_blocks.resize(seq_id + 1);
+    }
+
+    return seq_blocks[seq_id];
+}
+
+uint32_t llama_kv_cache_paged::mark_next() {
+    if (++mark_epoch == 0) {
+        std::fill(block_mark.begin(), block_mark.end(), 0);
+        mark_epoch = 1;
+    }
+
+    return mark_epoch;
+}
+
+int32_t llama_kv_cache_paged::cell_alloc(llama_seq_id seq_id) {
+    auto & blocks = table(seq_id);
+
+    // fill the last block of the sequence first, unless the prefix tree holds it
+    if (!blocks.empty()) {
+        const uint32_t b = blocks.back();
+
+        if (!prefix[b].cached && block_used[b] < block_end(b) - block_begin(b)) {
+            for (uint32_t i = block_begin(b); i < block_end(b); ++i) {
+                if (cells[i].pos < 0) {
+                    return i;
+                }
+            }
+        }
+    }
+
+    if (free_blocks.empty() && !prefix_evict()) {
+        return -1;
+    }
+
+    const uint32_t b = free_blocks.back();
+    free_blocks.pop_back();
+
+    blocks.push_back(b);
+
+    return block_begin(b);
+}
+
+void llama_kv_cache_paged::cell_free(uint32_t i) {
+    cell_clear(i);
+    cell_released(i);
+}
+
+void llama_kv_cache_paged::cell_released(uint32_t i) {
+    const uint32_t b = i / block_size;
+    if (--block_used[b] == 0) {
+        if (prefix[b].cached) {
+            // the data stays in the tree until the block is evicted
+            prefix[b].last_use = ++prefix_clock;
+        } else {
+            freed.push_back(b);
+        }
+    }
+}
+
+void llama_kv_cache_paged::table_prune(llama_seq_id seq_id) {
+    if (seq_id < 0 || (size_t) seq_id >= seq_blocks.size()) {
+        return;
+    }
+
+    auto & blocks = seq_blocks[seq_id];
+
+    blocks.erase(std::remove_if(blocks.begin(), blocks.end(), [&](uint32_t b) {
+        for (uint32_t i = block_begin(b); i < block_end(b); ++i) {
+            if (cells[i].has_seq_id(seq_id)) {
+                return false;
+            }
+        }
+        return true;
+    }), blocks.end());
+}
+
+void llama_kv_cache_paged::release() {
+    // the lowest block is used first, so that a sequence growing over several blocks gets adjacent ones
+    std::sort(freed.begin(), freed.end(), std::greater<uint32_t>());
+
+    free_blocks.insert(free_blocks.end(), freed.begin(), freed.end());
+    freed.clear();
+}
+
+void llama_kv_cache_paged::rebuild() {
+    index_rebuild();
+
+    block_used.assign(n_blocks, 0);
+    seq_blocks.clear();
+
+    cell_tokens.assign(size, -1);
+
+    prefix.assign(n_blocks, prefix_node());
+    prefix_roots.clear();
+
+    for (uint32_t b = 0; b < n_blocks; ++b) {
+        for (uint32_t i = block_begin(b); i < block_end(b); ++i) {
+            const llama_kv_cell & cell = cells[i];
+
+            if (cell.is_empty()) {
+                continue;
+            }
+
+            block_used[b]++;
+
+            for (const llama_seq_id seq_id : cell.seq_id) {
+                auto & blocks = table(seq_id);
+                if (blocks.empty() || blocks.back() != b) {
+                    blocks.push_back(b);
+                }
+            }
+        }
+    }
+
+    free_blocks.clear();
+    for (uint32_t b = n_blocks; b-- > 0;) {
+        if (block_used[b] == 0) {
+            free_blocks.push_back(b);
+        }
+    }
+
+    freed.clear();
+}
+
+int32_t llama_kv_cache_paged::prefix_find(int32_t parent, const llama_token * tokens) const {
+    const auto & children = parent < 0 ? prefix_roots : prefix[parent].children;
+
+    for (const uint32_t b : children) {
+        if (std::equal(tokens, tokens + block_size, cell_tokens.begin() + block_begin(b))) {
+            return b;
+        }
+    }
+
+    return -1;
+}
+
+bool llama_kv_cache_paged::prefix_holds(uint32_t b, llama_seq_id seq_id) const {
+    for (uint32_t i = block_begin(b); i < block_end(b); ++i) {
+        if (!cells[i].has_seq_id(seq_id)) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+void llama_kv_cache_paged::prefix_insert(uint32_t b) {
+    if (prefix[b].cached || block_end(b) - block_begin(b) != block_size) {
+        return;
+    }
+
+    const uint32_t c0 = block_begin(b);
+
+    const llama_pos p0 = cells[c0].pos;
+    if (p0 < 0 || p0 % block_size != 0 || cells[c0].is_empty()) {
+        return;
+    }
+
+    // the block must hold the tokens [p0, p0 + block_size) of a sequence, as computed
+    const llama_seq_id seq_id = *cells[c0].seq_id.begin();
+
+    for (uint32_t j = 0; j < block_size; ++j) {
+        const llama_kv_cell & cell = cells[c0 + j];
+
+        if (cell.pos != p0 + (llama_pos) j || cell.delta != 0 || cell_tokens[c0 + j] < 0 || !cell.has_seq_id(seq_id)) {
+            return;
+        }
+    }
+
+    // and follow a cached block of the same sequence, so that its data depends only on the tokens of the tree
+    int32_t parent = -1;
+
+    if (p0 > 0) {
+        for (const uint32_t pb : seq_blocks[seq_id]) {
+            if (prefix[pb].cached && cells[block_begin(pb)].pos == p0 - (llama_pos) block_size && prefix_holds(pb, seq_id)) {
+                parent = pb;
+                break;
+            }
+        }
+
+        if (parent < 0) {
+            return;
+        }
+    }
+
+    // another sequence computed the same tokens first
+    if (prefix_find(parent, cell_tokens.data() + c0) >= 0) {
+        return;
+    }
+
+    prefix[b].cached   = true;
+    prefix[b].parent   = parent;
+    prefix[b].last_use = 0;
+    prefix[b].children.clear();
+
+    (parent < 0 ? prefix_roots : prefix[parent].children).push_back(b);
+}
+
+void llama_kv_cache_paged::prefix_drop(uint32_t b) {
+    auto & siblings = prefix[b].parent < 0 ? prefix_roots : prefix[prefix[b].parent].children;
+    siblings.erase(std::find(siblings.begin(), siblings.end(), b));
+
+    std::vector<uint32_t> stack = { b };
+
+    while (!stack.empty()) {
+        const uint32_t c = stack.back();
+        stack.pop_back();
+
+        stack.insert(stack.end(), prefix[c].children.begin(), prefix[c].children.end());
+        prefix[c] = prefix_node();
+
+        if (block_used[c] == 0) {
+            freed.push_back(c);
+        }
+    }
+}
+
+bool llama_kv_cache_paged::prefix_evict() {
+    int32_t lru = -1;
+
+    // only leaves are evicted, so that every cached block stays reachable from the roots
+    for (uint32_t b = 0; b < n_blocks; ++b) {
+        const prefix_node & node = prefix[b];
+
+        if (node.cached && block_used[b] == 0 && node.children.empty() && (lru < 0 || node.last_use < prefix[lru].last_use)) {
+            lru = b;
+        }
+    }
+
+    if (lru < 0) {
+        return false;
+    }
+
+    prefix_drop(lru);
+    release();
+
+    return true;
+}
+
 //
 // kv cache view
 //
@@ -6,7 +6,11 @@
 
 #include "ggml-cpp.h"
 
+#include <algorithm>
 #include <functional>
+#include <iterator>
+#include <map>
+#include <memory>
 #include <set>
 #include <vector>
 
@@ -26,6 +30,12 @@ struct llama_kv_cache : public llama_memory_i {
     virtual bool get_can_shift() const = 0;
 
     bool get_can_edit() const override { return get_can_shift(); }
+
+    // makes the cached KV data of the longest known prefix of tokens part of seq_id, which holds tokens [0, n_past)
+    // returns the number of leading tokens that seq_id holds afterwards
+    virtual int32_t seq_attach_prefix(llama_seq_id /*seq_id*/, const llama_token * /*tokens*/, int32_t /*n_tokens*/, int32_t n_past) {
+        return n_past;
+    }
 };
 
 struct llama_kv_cache_guard {
@@ -43,16 +53,80 @@ private:
     llama_kv_cache * kv;
 };
 
+// the sequences of a cell, as a bitmask of the seq ids in [0, LLAMA_MAX_SEQ)
+// iterates its seq ids in increasing order, like the std::set it replaces
+struct llama_kv_seq_mask {
+    static_assert(LLAMA_MAX_SEQ <= 64, "the seq id mask holds at most 64 sequences");
+
+    uint64_t bits = 0;
+
+    struct iterator {
+        using iterator_category = std::forward_iterator_tag;
+        using value_type        = llama_seq_id;
+        using difference_type   = std::ptrdiff_t;
+        using pointer           = const llama_seq_id *;
+        using reference         = llama_seq_id;
+
+        uint64_t bits;
+
+        llama_seq_id operator*() const {
+            llama_seq_id id = 0;
+            while (!((bits >> id) & 1)) {
+                id++;
+            }
+            return id;
+        }
+
+        iterator & operator++() { bits &= bits - 1; return *this; }
+        iterator   operator++(int) { iterator it = *this; ++*this; return it; }
+
+        bool operator==(const iterator & other) const { return bits == other.bits; }
+        bool operator!=(const iterator & other) const { return bits != other.bits; }
+    };
+
+    iterator begin() const { return { bits }; }
+    iterator end()   const { return { 0 }; }
+
+    bool count(llama_seq_id id) const {
+        return id >= 0 && id < LLAMA_MAX_SEQ && ((bits >> id) & 1);
+    }
+
+    void insert(llama_seq_id id) {
+        LM_GGML_ASSERT(id >= 0 && id < LLAMA_MAX_SEQ);
+        bits |= uint64_t(1) << id;
+    }
+
+    void erase(llama_seq_id id) {
+        if (id >= 0 && id < LLAMA_MAX_SEQ) {
+            bits &= ~(uint64_t(1) << id);
+        }
+    }
+
+    void clear() { bits = 0; }
+
+    bool   empty() const { return bits == 0; }
+    size_t size()  const {
+        size_t n = 0;
+        for (uint64_t b = bits; b; b &= b - 1) {
+            n++;
+        }
+        return n;
+    }
+
+    bool operator==(const llama_kv_seq_mask & other) const { return bits == other.bits; }
+    bool operator!=(const llama_kv_seq_mask & other) const { return bits != other.bits; }
+};
+
 struct llama_kv_cell {
     llama_pos pos   = -1;
     llama_pos delta =  0;
     int32_t   src   = -1; // used by recurrent state models to copy states
     int32_t   tail  = -1;
 
-    std::set<llama_seq_id> seq_id;
+    llama_kv_seq_mask seq_id;
 
     bool has_seq_id(const llama_seq_id & id) const {
-        return seq_id.find(id) != seq_id.end();
+        return seq_id.count(id);
     }
 
     bool is_empty() const {
@@ -64,6 +138,8 @@ struct llama_kv_cell {
     }
 };
 
+class llama_kv_cache_swa;
+
 // ring-buffer of cached KV data
 // TODO: pimpl
 // TODO: add notion of max sequences
@@ -78,10 +154,10 @@ public:
             const llama_hparams & hparams,
             callbacks             cbs);
 
-    virtual ~llama_kv_cache_unified() = default;
+    virtual ~llama_kv_cache_unified();
 
     // TODO: become constructor
-    bool init(
+    virtual bool init(
             const llama_model & model,   // TODO: do not reference the model
           const llama_cparams & cparams,
                     lm_ggml_type   type_k,
@@ -94,7 +170,6 @@ public:
 
     size_t total_size() const;
 
-    // TODO: better data structures to reduce the cost of this operation
     llama_pos pos_max() const;
 
     void clear() override;
@@ -117,7 +192,7 @@ public:
     // updates the cache head
     // Note: On success, it's important that cache.head points
     // to the first cell of the slot.
-    bool find_slot(const llama_ubatch & batch);
+    virtual bool find_slot(const llama_ubatch & batch);
 
     // TODO: maybe not needed
     uint32_t get_padding(const llama_cparams & cparams) const;
@@ -152,7 +227,20 @@ public:
     // state write/load
 
     void state_write(llama_io_write_i & io, llama_seq_id seq_id = -1) const;
-    void state_read (llama_io_read_i  & io, llama_seq_id seq_id = -1);
+    virtual void state_read(llama_io_read_i & io, llama_seq_id seq_id = -1);
+
+    // the cache holding the K and V of layer il
+    const llama_kv_cache_unified * layer_cache(int32_t il) const;
+
+    // ubatch tokens [i0, i0 + n) are stored in cells [c0, c0 + n)
+    struct copy_run {
+        uint32_t i0 = 0;
+        uint32_t c0 = 0;
+        uint32_t n  = 0;
+    };
+
+    // computed by find_slot of the caches that do not store a ubatch in [head, head + n_tokens)
+    std::vector<copy_run> runs;
 
     // members
 
@@ -169,6 +257,10 @@ public:
     bool v_trans   = true;  // the value tensor is transposed
     bool can_shift = false;
 
+    // set by llama_kv_cache_paged: the ubatch attends to the cells it gathers, not to [0, n)
+    // build_attn checks it to build the gather (build_attn_paged), like recurrent selects the recurrent graph
+    bool paged = false;
+
     // Note: The value of head isn't only used to optimize searching
     // for a free KV slot. llama_decode_impl also uses it, so it
     // cannot be freely changed after a slot has been allocated.
@@ -181,10 +273,53 @@ public:
 
     std::vector<llama_kv_cell> cells;
 
-    std::vector<lm_ggml_tensor *> k_l; // per layer
+    std::vector<lm_ggml_tensor *> k_l; // per layer, nullptr for the layers of another cache
     std::vector<lm_ggml_tensor *> v_l;
 
+    // the sliding-window layers, if they have a cache of their own, see llama_kv_cache_swa
+    std::unique_ptr<llama_kv_cache_swa> swa;
+
+protected:
+    // the layers with K and V in this cache, all of them if empty
+    std::function<bool(int32_t il)> layer_filter;
+
+    // index of the cells, kept in sync with them by the cell updates below
+    std::map<uint32_t, uint32_t> free_ranges; // maximal runs [c0, c1) of empty cells, by c0
+
+    std::vector<std::set<std::pair<llama_pos, uint32_t>>> seq_cells; // (pos, cell) of the cells of each sequence
+
+    // adds seq_id to cell i, whose pos must be set first if it is empty
+    void cell_seq_add(uint32_t i, llama_seq_id seq_id);
+
+    // removes seq_id from cell i, returns true if that emptied the cell
+    bool cell_seq_rm(uint32_t i, llama_seq_id seq_id);
+
+    // removes all sequences from cell i
+    void cell_clear(uint32_t i);
+
+    // moves cell i by delta, returns true if that emptied the cell because its position became negative
+    bool cell_pos_add(uint32_t i, llama_pos delta);
+    void cell_pos_div(uint32_t i, int d);
+
+    // appends the cells of seq_id with a position in [p0, p1) to ids, in order of position
+    void seq_cells_range(llama_seq_id seq_id, llama_pos p0, llama_pos p1, std::vector<uint32_t> & ids) const;
+
+    // number of cells of seq_id with a position in [p0, p1)
+    uint32_t seq_cells_count(llama_seq_id seq_id, llama_pos p0, llama_pos p1) const;
+
+    // returns the first cell of a run of n empty cells in [c, size), or size if there is none
+    uint32_t free_find(uint32_t c, uint32_t n) const;
+
+    // appends up to n empty cells to ids, from c to the end of the cache and then from its start
+    void free_take(uint32_t c, uint32_t n, std::vector<uint32_t> & ids) const;
+
+    // recomputes used and the index after the cells were changed directly
+    void index_rebuild();
+
 private:
+    void free_add(uint32_t i);
+    void free_rm (uint32_t i);
+
     lm_ggml_type type_k = LM_GGML_TYPE_F16;
     lm_ggml_type type_v = LM_GGML_TYPE_F16;
 
@@ -194,8 +329,179 @@ private:
     void state_write_meta(llama_io_write_i & io, const std::vector<std::pair<uint32_t, uint32_t>> & cell_ranges, llama_seq_id seq_id = -1) const;
     void state_write_data(llama_io_write_i & io, const std::vector<std::pair<uint32_t, uint32_t>> & cell_ranges) const;
 
-    bool state_read_meta(llama_io_read_i & io, uint32_t cell_count, llama_seq_id dest_seq_id = -1);
-    bool state_read_data(llama_io_read_i & io, uint32_t cell_count);
+    // ranges receives the cells the restored data is written to, in order
+    bool state_read_meta(llama_io_read_i & io, uint32_t cell_count, std::vector<slot_range> & ranges, llama_seq_id dest_seq_id = -1);
+    bool state_read_data(llama_io_read_i & io, uint32_t cell_count, const std::vector<slot_range> & ranges);
+};
+
+// KV cache of the sliding-window layers of a model
+//
+// these layers attend only to the last n_swa positions of a sequence, so instead of a cell for each position of
+// the context, the cache holds the window of each sequence and n_ubatch positions before it, which lets a sequence
+// be rolled back by a ubatch. before each ubatch, the cells older than that are dropped, and the tokens of the
+// ubatch are written to the free cells that follow the head, so the cells are reused in the order they were
+// filled, like a ring buffer. the slot of a ubatch is split in copy runs when no contiguous one is free
+class llama_kv_cache_swa : public llama_kv_cache_unified {
+public:
+    llama_kv_cache_swa(
+            const llama_hparams & hparams,
+            callbacks             cbs,
+            uint32_t              n_keep);
+
+    bool init(
+            const llama_model & model,
+          const llama_cparams & cparams,
+                    lm_ggml_type   type_k,
+                    lm_ggml_type   type_v,
+                     uint32_t   kv_size,
+                         bool   offload) override;
+
+    // the cache is committed and restored along with the unified cache, possibly without pending cells
+    void commit() override;
+
+    // drops the cells out of the kept positions of every sequence, then assigns a cell to each token of the ubatch
+    // sets n to the used cells, padded
+    bool find_slot(const llama_ubatch & ubatch) override;
+
+    // max number of copy runs of a ubatch, each run adds a K and a V copy per layer to the graph
+    uint32_t get_n_runs_max() const { return n_runs_max; }
+
+    // positions kept before the next one of each sequence
+    const uint32_t n_keep;
+
+private:
+    uint32_t n_pad      = 1;
+    uint32_t n_runs_max = 0;
+};
+
+// paged KV cache: the cells are grouped in fixed-size blocks that are assigned to sequences on demand
+//
+// each sequence has a table of the blocks holding its cells. a ubatch writes its tokens to free cells of
+// the last block of their sequence, or to new blocks, and attends only to the cells of its sequences,
+// gathered through the block tables. since a slot never has to be contiguous, the cache does not fragment
+// beyond a partially filled block and never needs to be defragmented. the K/V tensors are still allocated
+// for all cells when the cache is created, so a paged cache uses as much memory as a unified one of the
+// same size, and the gather adds a get_rows per layer to every decode. it is therefore opt-in (kv_block_size > 0)
+// and meant for many sequences with shared prompt prefixes, where the prefix tree below saves their prefill
+//
+// the full blocks holding a prefix of a sequence are also kept in a radix tree keyed on their tokens. a new
+// sequence with the same prefix attaches to those blocks instead of recomputing them, and a block of the
+// tree keeps its data after the last sequence using it is removed, until it is evicted in LRU order to make
+// room for new blocks. the blocks of the tree are never written again: a sequence that continues or diverges
+// from a cached prefix stores its next tokens in blocks of its own
+class llama_kv_cache_paged : public llama_kv_cache_unified {
+public:
+    llama_kv_cache_paged(
+            const llama_hparams & hparams,
+            callbacks             cbs,
+            uint32_t              block_size);
+
+    bool init(
+            const llama_model & model,
+          const llama_cparams & cparams,
+                    lm_ggml_type   type_k,
+                    lm_ggml_type   type_v,
+                     uint32_t   kv_size,
+                         bool   offload) override;
+
+    void clear() override;
+    void defrag() override;
+
+    void restore() override;
+    void commit() override;
+
+    bool seq_rm  (llama_seq_id seq_id,                              llama_pos p0, llama_pos p1) override;
+    void seq_cp  (llama_seq_id seq_id_src, llama_seq_id seq_id_dst, llama_pos p0, llama_pos p1) override;
+    void seq_keep(llama_seq_id seq_id) override;
+    void seq_add (llama_seq_id seq_id,                              llama_pos p0, llama_pos p1, llama_pos delta) override;
+    void seq_div (llama_seq_id seq_id,                              llama_pos p0, llama_pos p1, int d) override;
+
+    int32_t seq_attach_prefix(llama_seq_id seq_id, const llama_token * tokens, int32_t n_tokens, int32_t n_past) override;
+
+    // assigns a cell to each token of the ubatch and gathers the cells it attends to
+    // sets n to the number of gathered cells, padded
+    bool find_slot(const llama_ubatch & ubatch) override;
+
+    void state_read(llama_io_read_i & io, llama_seq_id seq_id = -1) override;
+
+    // max number of copy runs of a ubatch, each run adds a K and a V copy per layer to the graph
+    uint32_t get_n_runs_max() const { return n_runs_max; }
+
+    // computed by find_slot
+    std::vector<uint32_t> cell_ids; // the cells the ubatch attends to, n >= cell_ids.size() after padding
+
+private:
+    uint32_t block_size = 0;
+    uint32_t n_blocks   = 0;
+    uint32_t n_pad      = 1;
+    uint32_t n_ubatch   = 0;
+    uint32_t n_runs_max = 0;
+
+    std::vector<uint32_t> block_used;  // number of non-empty cells in each block
+    std::vector<uint32_t> free_blocks; // stack of empty blocks, the next one to use last
+
+    std::vector<std::vector<uint32_t>> seq_blocks; // block table of each sequence, indexed by seq_id
+
+    std::vector<llama_token> cell_tokens; // token stored in each cell, -1 if unknown
+
+    // node of the prefix tree, indexed by the block it holds
+    struct prefix_node {
+        bool     cached   = false; // the block is in the tree
+        int32_t  parent   = -1;    // block holding the previous block_size tokens, -1 for the first block
+        uint64_t last_use = 0;     // when the last sequence using the block released it
+
+        std::vector<uint32_t> children;
+    };
+
+    std::vector<prefix_node> prefix;
+    std::vector<uint32_t>    prefix_roots; // cached blocks starting at position 0
+    uint64_t                 prefix_clock = 0;
+
+    // scratch
+    std::vector<uint32_t> freed;      // blocks emptied by the current operation
+    std::vector<uint32_t> block_mark; // per block, compared against mark_epoch
+    uint32_t              mark_epoch = 0;
+
+    uint32_t block_begin(uint32_t b) const { return b*block_size; }
+    uint32_t block_end  (uint32_t b) const { return std::min(size, (b + 1)*block_size); }
+
+    std::vector<uint32_t> & table(llama_seq_id seq_id);
+
+    // returns a new value for block_mark, no block is marked with it yet
+    uint32_t mark_next();
+
+    // returns a free cell for a new token of seq_id, or -1 if the cache is full
+    int32_t cell_alloc(llama_seq_id seq_id);
+
+    // empties cell i, its block is added to freed when it has no other used cell
+    void cell_free(uint32_t i);
+
+    // does the block accounting of cell i once it was emptied
+    void cell_released(uint32_t i);
+
+    // drops the blocks without a cell of seq_id from its table
+    void table_prune(llama_seq_id seq_id);
+
+    // returns the freed blocks to the free list
+    void release();
+
+    // recomputes the block tables from the cells, the prefix tree is dropped
+    void rebuild();
+
+    // returns the cached child of parent holding the next block_size tokens, or -1
+    int32_t prefix_find(int32_t parent, const llama_token * tokens) const;
+
+    // true if all cells of block b belong to seq_id
+    bool prefix_holds(uint32_t b, llama_seq_id seq_id) const;
+
+    // adds block b to the tree if it holds the next block_size tokens after a cached prefix of its sequence
+    void prefix_insert(uint32_t b);
+
+    // removes block b and the blocks after it from the tree, the unused ones are added to freed
+    void prefix_drop(uint32_t b);
+
+    // frees the least recently used cached block that no sequence uses, returns false if there is none
+    bool prefix_evict();
 };
 
 // TODO: temporary reusing llama_kv_cache_unified -- implement recurrent cache and simplify llama_kv_cache_unified
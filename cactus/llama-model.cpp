@@ -12810,7 +12810,7 @@ struct llm_build_bailingmoe : public llm_graph_context {
     }
 };
 
-llama_memory_i * llama_model::create_memory() const {
+llama_memory_i * llama_model::create_memory(const llama_cparams & cparams) const {
     llama_memory_i * res;
 
     switch (arch) {
@@ -12826,7 +12826,7 @@ llama_memory_i * llama_model::create_memory() const {
             } break;
         default:
             {
-                res = new llama_kv_cache_unified(hparams, {
+                llama_kv_cache_unified::callbacks cbs = {
                     /*.get_rope_factors =*/ [this](uint32_t n_ctx_per_seq, int il) {
                         // choose long/short freq factors based on the context size
                         if (layers[il].rope_freqs != nullptr) {
@@ -12839,7 +12839,18 @@ llama_memory_i * llama_model::create_memory() const {
 
                         return layers[il].rope_short;
                     }
-                });
+                };
+
+                // the relative position buckets of T5 are computed over the contiguous cache
+                if (cparams.kv_block_size > 0 && arch == LLM_ARCH_T5) {
+                    LLAMA_LOG_WARN("%s: the paged KV cache is not supported by this model, using the unified cache\n", __func__);
+                }
+
+                if (cparams.kv_block_size > 0 && arch != LLM_ARCH_T5) {
+                    res = new llama_kv_cache_paged(hparams, std::move(cbs), cparams.kv_block_size);
+                } else {
+                    res = new llama_kv_cache_unified(hparams, std::move(cbs));
+                }
             }
     }
 
@@ -13111,6 +13122,9 @@ llm_graph_result_ptr llama_model::build_graph(
     // add on pooling layer
     llm->build_pooling(gf, cls, cls_b, cls_out, cls_out_b);
 
+    // reduce the logits to the top k of each output on the graph
+    llm->build_logits_top_k(gf);
+
     return std::move(llm->res);
 }
 
@@ -12,6 +12,7 @@
 #include <cstdlib>
 #include <cstring>
 #include <ctime>
+#include <deque>
 #include <numeric>
 #include <random>
 #include <unordered_map>
@@ -386,9 +387,22 @@ llama_token llama_sampler_sample(struct llama_sampler * smpl, struct llama_conte
 
     // TODO: do not allocate each time
     std::vector<llama_token_data> cur;
-    cur.reserve(n_vocab);
-    for (llama_token token_id = 0; token_id < n_vocab; token_id++) {
-        cur.emplace_back(llama_token_data{token_id, logits[token_id], 0.0f});
+
+    // contexts with logits_top_k > 0 only output a compact list of candidates
+    const float       * top_k_logits = nullptr;
+    const llama_token * top_k_ids    = nullptr;
+
+    const int32_t n_top_k = llama_get_logits_top_k_ith(ctx, idx, &top_k_logits, &top_k_ids);
+    if (n_top_k > 0) {
+        cur.reserve(n_top_k);
+        for (int32_t i = 0; i < n_top_k; i++) {
+            cur.emplace_back(llama_token_data{top_k_ids[i], top_k_logits[i], 0.0f});
+        }
+    } else {
+        cur.reserve(n_vocab);
+        for (llama_token token_id = 0; token_id < n_vocab; token_id++) {
+            cur.emplace_back(llama_token_data{token_id, logits[token_id], 0.0f});
+        }
     }
 
     llama_token_data_array cur_p = {
@@ -1598,6 +1612,32 @@ struct llama_sampler * llama_sampler_init_grammar_lazy_patterns(
     return llama_sampler_init_grammar_impl(vocab, grammar_str, grammar_root, /* lazy= */ true, nullptr, 0, trigger_tokens, num_trigger_tokens, trigger_patterns, num_trigger_patterns);
 }
 
+bool llama_grammar_cache_save(const struct llama_vocab * vocab, const char * path) {
+    return vocab->grammar_automata().save(*vocab, path);
+}
+
+bool llama_grammar_cache_load(const struct llama_vocab * vocab, const char * path) {
+    return vocab->grammar_automata().load(*vocab, path);
+}
+
+int32_t llama_sampler_grammar_forced_text(const struct llama_sampler * smpl, char * buf, int32_t length, int32_t max_chars) {
+    if (smpl == nullptr || smpl->iface != &llama_sampler_grammar_i || max_chars <= 0) {
+        return 0;
+    }
+
+    const auto * ctx = (const llama_sampler_grammar *) smpl->ctx;
+    if (!ctx->grammar) {
+        return 0;
+    }
+
+    const std::string text = llama_grammar_forced_str_impl(*ctx->grammar, max_chars);
+    if ((int32_t) text.size() > length) {
+        return -(int32_t) text.size();
+    }
+    memcpy(buf, text.data(), text.size());
+    return (int32_t) text.size();
+}
+
 // penalties
 
 struct llama_sampler_penalties {
@@ -1608,10 +1648,53 @@ struct llama_sampler_penalties {
 
     ring_buffer<llama_token> prev;
 
-    // a frequency map to count token occurrences
-    std::unordered_map<llama_token, int> token_count;
+    // occurrences of each token in prev, in an open-addressing table with linear probing. it has a
+    // power of two size of at least twice penalty_last_n slots, so it never fills up; count 0 is empty
+    struct slot {
+        llama_token token;
+        int32_t     count;
+    };
+
+    std::vector<slot> counts;
 };
 
+static size_t llama_sampler_penalties_home(const llama_sampler_penalties & ctx, llama_token token) {
+    uint32_t h = (uint32_t) token;
+    h ^= h >> 16;
+    h *= 0x45d9f3bu;
+    h ^= h >> 16;
+    return h & (ctx.counts.size() - 1);
+}
+
+// slot holding token, or the empty slot where it would go
+static size_t llama_sampler_penalties_find(const llama_sampler_penalties & ctx, llama_token token) {
+    const size_t mask = ctx.counts.size() - 1;
+    size_t i = llama_sampler_penalties_home(ctx, token);
+    while (ctx.counts[i].count > 0 && ctx.counts[i].token != token) {
+        i = (i + 1) & mask;
+    }
+    return i;
+}
+
+static void llama_sampler_penalties_remove(llama_sampler_penalties & ctx, llama_token token) {
+    const size_t mask = ctx.counts.size() - 1;
+    size_t i = llama_sampler_penalties_find(ctx, token);
+    if (--ctx.counts[i].count > 0) {
+        return;
+    }
+
+    // shift back the entries of the probe run that follows, so that lookups need no tombstones
+    for (size_t j = (i + 1) & mask; ctx.counts[j].count > 0; j = (j + 1) & mask) {
+        const size_t home = llama_sampler_penalties_home(ctx, ctx.counts[j].token);
+        const bool   keep = i <= j ? (i < home && home <= j) : (i < home || home <= j);
+        if (!keep) {
+            ctx.counts[i] = ctx.counts[j];
+            ctx.counts[j].count = 0;
+            i = j;
+        }
+    }
+}
+
 static const char * llama_sampler_penalties_name(const struct llama_sampler * /*smpl*/) {
     return "penalties";
 }
@@ -1622,18 +1705,15 @@ static void llama_sampler_penalties_accept(struct llama_sampler * smpl, llama_to
         return;
     }
 
-    ctx->token_count[token]++;
-
     // if the ring buffer is full, remove the oldest token
     if (ctx->prev.size() >= (size_t) ctx->penalty_last_n) {
-        const auto old = ctx->prev.front();
-
-        ctx->token_count[old]--;
-        if (ctx->token_count[old] == 0) {
-            ctx->token_count.erase(old);
-        }
+        llama_sampler_penalties_remove(*ctx, ctx->prev.front());
     }
 
+    auto & slot = ctx->counts[llama_sampler_penalties_find(*ctx, token)];
+    slot.token = token;
+    slot.count++;
+
     ctx->prev.push_back(token);
 
 #if 0
@@ -1643,7 +1723,9 @@ static void llama_sampler_penalties_accept(struct llama_sampler * smpl, llama_to
         tmp[ctx->prev.rat(i)]++;
     }
 
-    assert(ctx->token_count == tmp);
+    for (const auto & it : tmp) {
+        assert(ctx->counts[llama_sampler_penalties_find(*ctx, it.first)].count == it.second);
+    }
 #endif
 }
 
@@ -1655,26 +1737,44 @@ static void llama_sampler_penalties_apply(struct llama_sampler * smpl, llama_tok
         return;
     }
 
-    // Apply frequency and presence penalties to the cur_p
-    for (size_t i = 0; i < cur_p->size; ++i) {
-        const auto token_iter = ctx->token_count.find(cur_p->data[i].id);
-        if (token_iter == ctx->token_count.end()) {
-            continue;
-        }
-
-        const int count = token_iter->second;
-
+    const auto penalize = [ctx](llama_token_data & cur, int count) {
         assert(count > 0 && count <= ctx->penalty_last_n);
 
         // The academic publication that described this technique actually just only divided, but that would cause tokens with negative logits to become more likely, which is obviously wrong.
         // This is common fix for this problem, which is to multiply by the penalty instead of dividing.
-        if (cur_p->data[i].logit <= 0) {
-            cur_p->data[i].logit *= ctx->penalty_repeat;
+        if (cur.logit <= 0) {
+            cur.logit *= ctx->penalty_repeat;
         } else {
-            cur_p->data[i].logit /= ctx->penalty_repeat;
+            cur.logit /= ctx->penalty_repeat;
+        }
+
+        cur.logit -= float(count) * ctx->penalty_freq + float(count > 0) * ctx->penalty_present;
+    };
+
+    // while cur_p holds the candidates in token order, as built from the logits, only the tokens of the
+    // window are visited, by index. otherwise each candidate is looked up
+    bool by_index = true;
+    for (const auto & slot : ctx->counts) {
+        if (slot.count > 0 && ((size_t) slot.token >= cur_p->size || cur_p->data[slot.token].id != slot.token)) {
+            by_index = false;
+            break;
         }
+    }
 
-        cur_p->data[i].logit -= float(count) * ctx->penalty_freq + float(count > 0) * ctx->penalty_present;
+    // Apply frequency and presence penalties to the cur_p
+    if (by_index) {
+        for (const auto & slot : ctx->counts) {
+            if (slot.count > 0) {
+                penalize(cur_p->data[slot.token], slot.count);
+            }
+        }
+    } else {
+        for (size_t i = 0; i < cur_p->size; ++i) {
+            const auto & slot = ctx->counts[llama_sampler_penalties_find(*ctx, cur_p->data[i].id)];
+            if (slot.count > 0) {
+                penalize(cur_p->data[i], slot.count);
+            }
+        }
     }
 
     cur_p->sorted = false;
@@ -1683,7 +1783,7 @@ static void llama_sampler_penalties_apply(struct llama_sampler * smpl, llama_tok
 static void llama_sampler_penalties_reset(struct llama_sampler * smpl) {
     auto * ctx = (llama_sampler_penalties *) smpl->ctx;
     ctx->prev.clear();
-    ctx->token_count.clear();
+    std::fill(ctx->counts.begin(), ctx->counts.end(), llama_sampler_penalties::slot { 0, 0 });
 }
 
 static struct llama_sampler * llama_sampler_penalties_clone(const struct llama_sampler * smpl) {
@@ -1698,7 +1798,8 @@ static struct llama_sampler * llama_sampler_penalties_clone(const struct llama_s
     {
         auto * result_ctx = (llama_sampler_penalties *) result->ctx;
 
-        result_ctx->prev = ctx->prev;
+        result_ctx->prev   = ctx->prev;
+        result_ctx->counts = ctx->counts;
     }
 
     return result;
@@ -1724,6 +1825,11 @@ struct llama_sampler * llama_sampler_init_penalties(
         float penalty_present) {
     penalty_last_n = std::max(penalty_last_n, 0);
 
+    size_t n_slots = 16;
+    while (n_slots < 2 * (size_t) penalty_last_n) {
+        n_slots *= 2;
+    }
+
     return llama_sampler_init(
         /* .iface = */ &llama_sampler_penalties_i,
         /* .ctx   = */ new llama_sampler_penalties {
@@ -1732,7 +1838,7 @@ struct llama_sampler * llama_sampler_init_penalties(
             /* .penalty_freq    = */ penalty_freq,
             /* .penalty_present = */ penalty_present,
             /* .prev            = */ ring_buffer<llama_token>(penalty_last_n),
-            /* .token_count     = */ {},
+            /* .counts          = */ std::vector<llama_sampler_penalties::slot>(n_slots, { 0, 0 }),
         }
     );
 }
@@ -1815,9 +1921,32 @@ struct llama_sampler_dry {
     const int32_t dry_penalty_last_n;
 
     std::unordered_multimap<llama_token, std::vector<llama_token>> dry_processed_breakers;
-    std::vector<int> dry_repeat_count;
-    std::unordered_map<llama_token, int> dry_max_token_repeat;
     ring_buffer<llama_token> last_tokens;
+
+    // repeats are tracked as tokens are accepted (see llama_sampler_dry_accept) instead of being searched
+    // for in the whole window on every apply
+
+    int64_t n_accepted  = 0; // the newest token is at position n_accepted - 1
+    int32_t ngram_order = 1; // 2 when only repeats of at least 2 tokens are penalized, otherwise 1
+
+    ring_buffer<uint64_t>                              last_ngrams; // n-gram ending at each position of last_tokens
+    std::unordered_map<uint64_t, std::deque<int64_t>> ngram_ends;  // positions in last_tokens where each n-gram ends
+
+    // positions e before the newest token where the text ending at e also ends the whole text, with the
+    // length of that common suffix (not limited to the window), for suffixes of at least ngram_order tokens
+    std::vector<std::pair<int64_t, int32_t>> repeats;
+    std::vector<std::pair<int64_t, int32_t>> repeats_next;
+
+    // sequence breakers by their last token, head included, built on the first accept
+    bool                                                         breakers_indexed = false;
+    std::unordered_map<llama_token, std::vector<std::vector<llama_token>>> breakers_by_end;
+    std::vector<llama_token>                                     single_token_breakers; // sorted
+
+    int64_t breaker_head = -1; // position of the newest head of a complete sequence breaker
+    int32_t breaker_tail = 0;  // longest tail of a complete sequence breaker starting at breaker_head
+
+    std::vector<std::pair<llama_token, int32_t>> dry_max_token_repeat; // scratch of apply
+    std::vector<llama_logit_bias>                to_search;            // scratch of apply
 };
 
 // Ported from Koboldcpp, original PR: https://github.com/LostRuins/koboldcpp/pull/982 (Original author: pi6am)
@@ -1867,16 +1996,102 @@ static const char * llama_sampler_dry_name(const struct llama_sampler * /*smpl*/
     return "dry";
 }
 
+static void llama_sampler_dry_index_breakers(llama_sampler_dry & ctx) {
+    ctx.breakers_by_end.clear();
+    ctx.single_token_breakers.clear();
+    for (const auto & breaker : ctx.dry_processed_breakers) {
+        std::vector<llama_token> sequence = { breaker.first };
+        sequence.insert(sequence.end(), breaker.second.begin(), breaker.second.end());
+        if (breaker.second.empty()) {
+            ctx.single_token_breakers.push_back(breaker.first);
+        }
+        ctx.breakers_by_end[sequence.back()].push_back(std::move(sequence));
+    }
+    std::sort(ctx.single_token_breakers.begin(), ctx.single_token_breakers.end());
+    ctx.breakers_indexed = true;
+}
+
 static void llama_sampler_dry_accept(struct llama_sampler * smpl, llama_token token) {
     auto * ctx = (llama_sampler_dry *) smpl->ctx;
     if (ctx->dry_multiplier == 0.0f || ctx->dry_base < 1.0f || ctx->dry_penalty_last_n == 0) {
         return;
     }
 
+    if (!ctx->breakers_indexed) {
+        llama_sampler_dry_index_breakers(*ctx);
+    }
+
+    const int64_t pos = ctx->n_accepted;
+
+    // forget the n-gram ending at the position that leaves the window
+    if (ctx->last_tokens.size() == ctx->last_tokens.capacity) {
+        const auto it = ctx->ngram_ends.find(ctx->last_ngrams.front());
+        it->second.pop_front();
+        if (it->second.empty()) {
+            ctx->ngram_ends.erase(it);
+        }
+    }
+
+    uint64_t ngram = (uint32_t) token;
+    if (ctx->ngram_order == 2) {
+        const llama_token prev = ctx->last_tokens.size() > 0 ? ctx->last_tokens.rat(0) : LLAMA_TOKEN_NULL;
+        ngram |= (uint64_t) (uint32_t) prev << 32;
+    }
+
+    // the text ending at e keeps matching a suffix of the text after token iff the newest n-gram also ends
+    // at e, and the match is then one token longer than the one ending at e - 1. so only the occurrences
+    // of the newest n-gram are visited, instead of the whole window
+    ctx->repeats_next.clear();
+    const auto ends = ctx->ngram_ends.find(ngram);
+    if (ends != ctx->ngram_ends.end()) {
+        auto prev = ctx->repeats.cbegin();
+        for (const int64_t e : ends->second) {
+            while (prev != ctx->repeats.cend() && prev->first < e - 1) {
+                ++prev;
+            }
+            const int32_t before = prev != ctx->repeats.cend() && prev->first == e - 1 ? prev->second : ctx->ngram_order - 1;
+            // no repeat is used beyond the window, so the length is kept below its size
+            ctx->repeats_next.emplace_back(e, std::min<int32_t>(before + 1, (int32_t) ctx->last_tokens.capacity));
+        }
+    }
+    std::swap(ctx->repeats, ctx->repeats_next);
+
+    ctx->ngram_ends[ngram].push_back(pos);
+    ctx->last_ngrams.push_back(ngram);
     ctx->last_tokens.push_back(token);
+    ctx->n_accepted++;
+
+    // sequence breakers completed by token. repeats never extend back over the newest breaker head, with
+    // the longest breaker starting there
+    const auto breakers = ctx->breakers_by_end.find(token);
+    if (breakers != ctx->breakers_by_end.end()) {
+        for (const auto & sequence : breakers->second) {
+            const size_t n = sequence.size();
+            if (n > ctx->last_tokens.size()) {
+                continue;
+            }
+            bool match = true;
+            for (size_t i = 1; i < n && match; ++i) {
+                match = sequence[n - 1 - i] == ctx->last_tokens.rat(i);
+            }
+            if (!match) {
+                continue;
+            }
+
+            const int64_t head = pos - (int64_t) (n - 1);
+            if (head > ctx->breaker_head) {
+                ctx->breaker_head = head;
+                ctx->breaker_tail = (int32_t) n - 1;
+            } else if (head == ctx->breaker_head) {
+                ctx->breaker_tail = std::max(ctx->breaker_tail, (int32_t) n - 1);
+            }
+        }
+    }
 }
 
 // Ported from Koboldcpp, original PR: https://github.com/LostRuins/koboldcpp/pull/982 (Original author: pi6am)
+// The repeat lengths that Koboldcpp computes with the Z-algorithm over the window on every call are kept
+// up to date by llama_sampler_dry_accept, so apply only visits the current repeats.
 static void llama_sampler_dry_apply(struct llama_sampler * smpl, llama_token_data_array * cur_p) {
     auto * ctx = (llama_sampler_dry *) smpl->ctx;
 
@@ -1891,160 +2106,56 @@ static void llama_sampler_dry_apply(struct llama_sampler * smpl, llama_token_dat
         return;
     }
 
-    ctx->dry_repeat_count.assign(last_n_repeat, 0);
-    ctx->dry_max_token_repeat.clear();
-
-    // Step 1: Look for restart sequences to limit the maximum repetition length.
-    // Work backwards through the context looking for any token that begins a restart sequence.
-    //
-    // The collection `restart_sequences` is a mapping from a "head" token to all "tail"
-    // sequences that together comprise a restart sequence. This allows us to quickly check
-    // whether each token is the head of a complete sequence. Most restart sequences are actually
-    // a single token, and for these the "tail" is an empty vector.
-    //
-    // If the token is a "head", test all restart sequences that begin with this token
-    // (there will often only be one sequence for each token, but if sequences like 'aaaq1' and
-    // 'aaa1' are used as restart strings, both could start with 'aaa' when tokenized). The
-    // longest matching sequence (if any) is used to limit the maximum repetition length.
-    //
-    // Note that in the case case of a short sequence contained in a longer one, this might fail to
-    // find the smallest value for `rep_limit`. For example, if 'amniotic' and 'ni' are both used as
-    // restart sequences, 'ni' will be found first, and since it's shorter it will fail to suppress
-    // 'otic'. This is a minor issue since fully contained restart sequences are likely to be rare.
-    //
-    // This is theoretically worst-case O(N^2) for arbitrary restart sequences, which is why we
-    // have already clamped the maximum tail sequence length when generating `restart_sequences`.
-    // With clamping, this scan is O(N) in the context length.
+    const int64_t newest       = ctx->n_accepted - 1;
+    const int64_t window_start = ctx->n_accepted - last_n_repeat;
 
+    // Step 1: Limit the maximum repetition length to the tokens after the newest restart sequence in the
+    // window. Of the restart sequences starting at the same token, the longest one counts.
     int rep_limit = last_n_repeat;
-    for (int i = 0; i < last_n_repeat; ++i) {
-        llama_token token = ctx->last_tokens.rat(i);
-        auto its = ctx->dry_processed_breakers.equal_range(token);
-        if (its.first == ctx->dry_processed_breakers.end()) {
-            continue;
-        }
-        int longest_match = -1;
-        for (auto it = its.first; it != its.second; ++it) {
-            // Note that (*it) does not contain the head character, so seq_len will be
-            // the restart sequence length minus 1.
-            // In the common case of a single-token restart sequence, (*it) will be empty
-            // and we will trivially match.
-            int seq_len = (int)it->second.size();
-            if (seq_len > longest_match && seq_len <= (int)i) {
-                bool match = true;
-                for (int offset = 0; offset < seq_len; ++offset) {
-                    // The -1 when indexing `last_tokens` is because we already matched the head.
-                    if (it->second[offset] != ctx->last_tokens.rat(i - offset - 1)) {
-                        match = false;
-                        break;
-                    }
-                }
-                if (match) {
-                    longest_match = seq_len;
-                }
-            }
-        }
-        if (longest_match >= 0) {
-            // We found a restart sequence starting `i` tokens from the end and continuing for
-            // `longest_match` tokens.
-            rep_limit = i - longest_match;
-            break;
-        }
+    if (ctx->breaker_head >= window_start) {
+        rep_limit = (int) (newest - ctx->breaker_head) - ctx->breaker_tail;
     }
     if (rep_limit < ctx->dry_allowed_length) {
         return;
     }
 
-    // Step 2: Iterate in reverse over the last N tokens of the context, using the "Z-algorithm" (in
-    // the reverse direction) to efficiently compute the positions and lengths of suffixes appearing
-    // elsewhere in the context. We limit the suffix length to `rep_limit` to respect restart sequences.
-    //
-    // This algorithm is not currently documented on Wikipedia, but there is a clear description here:
-    // https://ivanyu.me/blog/2014/10/15/z-algorithm/
-    //
-    // The code below is adapted from the public domain implementation by the same author here:
-    // https://github.com/ivanyu/string-algorithms/blob/master/z_algorithm.py
+    // Step 2: Each repeat (a suffix of the context that also ends at an earlier position) would be extended
+    // by the token that followed it there. Track the maximum repeat length for each such token.
     //
     // Example:
     // Last N tokens: a b c c b c y a b c
     // Repeat counts: 0 0 3 1 0 2 0 0 0 0
-    //                    ^
-    //   This `3` means that the last three tokens of the context (a b c) also appear here.
-    //
-    // This step is worst case O(N) since the Z-algorithm is linear, despite the appearance of nested
-    // for/while loops. This can be seen by observing that the `lt` and `rt` bounds are set after each
-    // repeated suffix is detected (i.e. after each while loop when n > 0). These bound variables
-    // ensure that the inner while loops only examine each token in the context once as the outer
-    // for loop iterates over the context.
-
-    {
-        const int last = last_n_repeat - 1;
-        int rt = 0, lt = 0;
-
-        for (int k = 1; k < last_n_repeat; ++k) {
-            if (k > rt) {
-                // If k is outside the current Z-box, do naive computation.
-                int n = 0;
-                while (n + k < last_n_repeat && ctx->last_tokens.rat(n) == ctx->last_tokens.rat(n+k)) {
-                    ++n;
-                }
-                ctx->dry_repeat_count[last - k] = std::min(n, rep_limit);
-                if (n > 0) {
-                    lt = k;
-                    rt = k + n - 1;
-                }
-            } else {
-                // If k is inside the current Z-box, consider two cases.
-
-                int p = k - lt; // Pair index.
-                int right_part_len = rt - k + 1;
-
-                if (ctx->dry_repeat_count[last - p] < right_part_len) {
-                    int n = std::min(ctx->dry_repeat_count[last - p], rep_limit);
-                    ctx->dry_repeat_count[last - k] = n;
-                } else {
-                    int i = rt + 1;
-                    while (i < last_n_repeat && ctx->last_tokens.rat(i) == ctx->last_tokens.rat(i - k)) {
-                        i += 1;
-                    }
-
-                    int n = std::min(i - k, rep_limit);
-                    ctx->dry_repeat_count[last - k] = n;
-                    lt = k;
-                    rt = i - 1;
-                }
-            }
-        }
-    }
-
-    // Step 3: Iterate over dry_repeat_count and last_tokens, examining the maximum repeat length
-    // that would be generated by emitting each new token that would extend a sequence.
-    //
-    // Following the same example as above:
-    // Last N tokens: a b c c b c y a b c
-    // Repeat counts: 0 0 3 1 0 2 0 0 0 0
     //
-    // For each non-zero, look ahead one token. This token, if emitted, would extend the repetition.
     // c: 3 -> 4 (from `a b c` to `a b c c`)
     // b: 1 -> 2 (from `c` to `c b`)
     // y: 2 -> 3 (from `b c` to `b c y`)
-
-    for (int i = 0; i < last_n_repeat - 1; ++i) {
-        int repeat_len = ctx->dry_repeat_count[i];
+    ctx->dry_max_token_repeat.clear();
+    for (const auto & repeat : ctx->repeats) {
+        if (repeat.first < window_start) {
+            continue;
+        }
+        const int repeat_len = (int) std::min<int64_t>({ repeat.second, repeat.first - window_start + 1, rep_limit });
         if (repeat_len >= ctx->dry_allowed_length) {
-            // This token ends a repeat, so the next token would continue one.
-            // By convention, the value of `repeat_len` only includes the tokens currently
-            // in the context, not the new token that would be added.
-            llama_token token = ctx->last_tokens.rat(last_n_repeat - 2 - i);
-            // Track the maximum sequence ending in this token.
-            const auto& it = ctx->dry_max_token_repeat.find(token);
-            if (it == ctx->dry_max_token_repeat.end() || it->second < repeat_len) {
-                ctx->dry_max_token_repeat[token] = repeat_len;
+            ctx->dry_max_token_repeat.emplace_back(ctx->last_tokens.rat(newest - repeat.first - 1), repeat_len);
+        }
+    }
+    if (ctx->dry_allowed_length <= 0) {
+        // every token in the window after its first position extends an empty repeat
+        for (const auto & ends : ctx->ngram_ends) {
+            if (ends.second.back() > window_start) {
+                ctx->dry_max_token_repeat.emplace_back((llama_token) ends.first, 0);
             }
         }
     }
+    if (ctx->dry_max_token_repeat.empty()) {
+        return;
+    }
 
-    // Step 4: Apply logit penalties based on the maximum repeat length for relevant tokens.
+    std::sort(ctx->dry_max_token_repeat.begin(), ctx->dry_max_token_repeat.end(), [](const auto & a, const auto & b) {
+        return a.first < b.first || (a.first == b.first && a.second > b.second);
+    });
+
+    // Step 3: Apply logit penalties based on the maximum repeat length for relevant tokens.
 
     // Prevent floating point overflow in `pow(penalty_base, exponent)` by clamping to `max_exponent`.
     // Compute it from `penalty_base` and the approximate log of `std::numeric_limits<float>::max()`
@@ -2054,28 +2165,39 @@ static void llama_sampler_dry_apply(struct llama_sampler * smpl, llama_token_dat
         max_exponent = FLOAT_MAX_LOG / std::log(ctx->dry_base);
     }
 
-    for (size_t i = 0; i < cur_p->size; ++i) {
-        const auto& af_kvp = ctx->dry_max_token_repeat.find(cur_p->data[i].id);
-        if (af_kvp != ctx->dry_max_token_repeat.end()) {
-            // Check all sequence breakers starting with this token
-            auto range = ctx->dry_processed_breakers.equal_range(cur_p->data[i].id);
-            bool is_single_token_breaker = false;
-
-            for (auto it = range.first; it != range.second; ++it) {
-                if (it->second.empty()) {
-                    is_single_token_breaker = true;
-                    break;
-                }
-            }
+    ctx->to_search.clear();
+    for (size_t i = 0; i < ctx->dry_max_token_repeat.size(); ++i) {
+        const llama_token token = ctx->dry_max_token_repeat[i].first;
+        if (i > 0 && ctx->dry_max_token_repeat[i - 1].first == token) {
+            continue; // the first entry of a token holds its maximum
+        }
 
-            // Apply penalty only if it's not a single-token sequence breaker
-            if (!is_single_token_breaker) {
-                int repeat_exp = af_kvp->second - ctx->dry_allowed_length;
-                if (max_exponent > 0 && repeat_exp > max_exponent) {
-                    repeat_exp = max_exponent;
-                }
-                float penalty = ctx->dry_multiplier * std::pow(ctx->dry_base, repeat_exp);
-                cur_p->data[i].logit -= penalty;
+        // Apply penalty only if it's not a single-token sequence breaker
+        if (std::binary_search(ctx->single_token_breakers.begin(), ctx->single_token_breakers.end(), token)) {
+            continue;
+        }
+
+        int repeat_exp = ctx->dry_max_token_repeat[i].second - ctx->dry_allowed_length;
+        if (max_exponent > 0 && repeat_exp > max_exponent) {
+            repeat_exp = max_exponent;
+        }
+        const float penalty = ctx->dry_multiplier * std::pow(ctx->dry_base, repeat_exp);
+
+        // update the candidates that have not been shuffled in the vocabulary (i.e. idx == id)
+        if (token >= 0 && cur_p->size > (size_t) token && cur_p->data[token].id == token) {
+            cur_p->data[token].logit -= penalty;
+        } else {
+            ctx->to_search.push_back({ token, penalty });
+        }
+    }
+
+    // search for the remaining candidates, sorted by token
+    if (!ctx->to_search.empty()) {
+        for (size_t i = 0; i < cur_p->size; ++i) {
+            const auto it = std::lower_bound(ctx->to_search.begin(), ctx->to_search.end(), cur_p->data[i].id,
+                    [](const llama_logit_bias & lb, llama_token id) { return lb.token < id; });
+            if (it != ctx->to_search.end() && it->token == cur_p->data[i].id) {
+                cur_p->data[i].logit -= it->bias;
             }
         }
     }
@@ -2086,8 +2208,12 @@ static void llama_sampler_dry_apply(struct llama_sampler * smpl, llama_token_dat
 static void llama_sampler_dry_reset(struct llama_sampler * smpl) {
     auto * ctx = (llama_sampler_dry *) smpl->ctx;
     ctx->last_tokens.clear();
-    ctx->dry_repeat_count.clear();
-    ctx->dry_max_token_repeat.clear();
+    ctx->last_ngrams.clear();
+    ctx->ngram_ends.clear();
+    ctx->repeats.clear();
+    ctx->n_accepted   = 0;
+    ctx->breaker_head = -1;
+    ctx->breaker_tail = 0;
 }
 
 static struct llama_sampler * llama_sampler_dry_clone(const struct llama_sampler * smpl) {
@@ -2102,9 +2228,16 @@ static struct llama_sampler * llama_sampler_dry_clone(const struct llama_sampler
     {
         auto * result_ctx = (llama_sampler_dry *) result->ctx;
         result_ctx->dry_processed_breakers = ctx->dry_processed_breakers;
-        result_ctx->dry_repeat_count = ctx->dry_repeat_count;
-        result_ctx->dry_max_token_repeat = ctx->dry_max_token_repeat;
-        result_ctx->last_tokens = ctx->last_tokens;
+        result_ctx->last_tokens            = ctx->last_tokens;
+        result_ctx->n_accepted             = ctx->n_accepted;
+        result_ctx->last_ngrams            = ctx->last_ngrams;
+        result_ctx->ngram_ends             = ctx->ngram_ends;
+        result_ctx->repeats                = ctx->repeats;
+        result_ctx->breakers_indexed       = ctx->breakers_indexed;
+        result_ctx->breakers_by_end        = ctx->breakers_by_end;
+        result_ctx->single_token_breakers  = ctx->single_token_breakers;
+        result_ctx->breaker_head           = ctx->breaker_head;
+        result_ctx->breaker_tail           = ctx->breaker_tail;
     }
 
     return result;
@@ -2163,9 +2296,20 @@ struct llama_sampler * llama_sampler_init_dry(const struct llama_vocab * vocab,
             /* .dry_allowed_length     = */ dry_allowed_length,
             /* .dry_penalty_last_n     = */ dry_penalty_last_n,
             /* .dry_processed_breakers = */ std::move(processed_breakers),
-            /* .dry_repeat_count       = */ dry_enabled ? std::vector<int>(effective_dry_penalty_last_n, 0) : std::vector<int>{},
-            /* .dry_max_token_repeat   = */ {},
             /* .last_tokens            = */ dry_enabled ? ring_buffer<llama_token>(effective_dry_penalty_last_n) : ring_buffer<llama_token>(0),
+            /* .n_accepted             = */ 0,
+            /* .ngram_order            = */ dry_allowed_length >= 2 ? 2 : 1,
+            /* .last_ngrams            = */ dry_enabled ? ring_buffer<uint64_t>(effective_dry_penalty_last_n) : ring_buffer<uint64_t>(0),
+            /* .ngram_ends             = */ {},
+            /* .repeats                = */ {},
+            /* .repeats_next           = */ {},
+            /* .breakers_indexed       = */ false,
+            /* .breakers_by_end        = */ {},
+            /* .single_token_breakers  = */ {},
+            /* .breaker_head           = */ -1,
+            /* .breaker_tail           = */ 0,
+            /* .dry_max_token_repeat   = */ {},
+            /* .to_search              = */ {},
         }
     );
 }
@@ -2,6 +2,7 @@
 
 #include "llama-impl.h"
 #include "llama-model-loader.h"
+#include "llama-grammar.h"
 
 #include "unicode.h"
 
@@ -13,6 +14,7 @@
 #include <cstring>
 #include <forward_list>
 #include <map>
+#include <mutex>
 #include <queue>
 #include <set>
 #include <unordered_map>
@@ -1268,6 +1270,10 @@ struct llama_vocab::impl {
 
     std::vector<llama_token> cache_special_tokens;
     std::vector<std::string> cache_token_to_piece; // llama_token_to_piece(special = true);
+
+    mutable std::once_flag                                    grammar_trie_once;
+    mutable std::unique_ptr<const llama_grammar_vocab_trie>   grammar_trie;
+    mutable llama_grammar_automaton_cache                     grammar_automata;
     struct pair_hash {
         size_t operator()(const std::pair<std::string, std::string> & p) const {
             return std::hash<std::string>{}(p.first) ^  //create some hash for pair
@@ -3031,6 +3037,17 @@ const std::string & llama_vocab::token_to_piece(llama_token token) const {
     return pimpl->token_to_piece(token);
 }
 
+const llama_grammar_vocab_trie & llama_vocab::grammar_trie() const {
+    std::call_once(pimpl->grammar_trie_once, [this]() {
+        pimpl->grammar_trie = llama_grammar_vocab_trie_init(*this);
+    });
+    return *pimpl->grammar_trie;
+}
+
+llama_grammar_automaton_cache & llama_vocab::grammar_automata() const {
+    return pimpl->grammar_automata;
+}
+
 int32_t llama_vocab::token_to_piece(llama_token token, char * buf, int32_t length, int32_t lstrip, bool special) const {
     return pimpl->token_to_piece(token, buf, length, lstrip, special);
 }
@@ -8,6 +8,8 @@
 
 struct LLM_KV;
 struct llama_model_loader;
+struct llama_grammar_vocab_trie;
+struct llama_grammar_automaton_cache;
 
 struct llama_vocab {
     struct token_data {
@@ -105,6 +107,12 @@ struct llama_vocab {
     // use cached data
     const std::string & token_to_piece(llama_token token) const;
 
+    // token pieces decoded into a code point trie for grammar sampling, built on first use
+    const llama_grammar_vocab_trie & grammar_trie() const;
+
+    // grammar automata compiled for this vocabulary
+    llama_grammar_automaton_cache & grammar_automata() const;
+
     int32_t detokenize(
             const llama_token * tokens,
                       int32_t   n_tokens,
@@ -36,15 +36,18 @@
 
 #define LLAMA_TOKEN_NULL -1
 
+// sequence ids must be in [0, LLAMA_MAX_SEQ)
+#define LLAMA_MAX_SEQ 64
+
 #define LLAMA_FILE_MAGIC_GGLA 0x67676c61u // 'ggla'
 #define LLAMA_FILE_MAGIC_GGSN 0x6767736eu // 'ggsn'
 #define LLAMA_FILE_MAGIC_GGSQ 0x67677371u // 'ggsq'
 
 #define LLAMA_SESSION_MAGIC   LLAMA_FILE_MAGIC_GGSN
-#define LLAMA_SESSION_VERSION 9
+#define LLAMA_SESSION_VERSION 10
 
 #define LLAMA_STATE_SEQ_MAGIC   LLAMA_FILE_MAGIC_GGSQ
-#define LLAMA_STATE_SEQ_VERSION 2
+#define LLAMA_STATE_SEQ_VERSION 3
 
 #ifdef __cplusplus
 extern "C" {
@@ -344,6 +347,11 @@ extern "C" {
         float    yarn_beta_slow;   // YaRN high correction dim
         uint32_t yarn_orig_ctx;    // YaRN original context size
         float    defrag_thold;     // defragment the KV cache if holes/size > thold, < 0 disabled (default)
+        uint32_t kv_block_size;    // if > 0, use a paged KV cache with blocks of this many cells (0 = contiguous unified cache)
+                                   // blocks are handed out on demand, but the K/V tensors of all n_ctx cells are still
+                                   // allocated up front: paging avoids fragmentation and shares prefixes, it does not save memory
+                                   // off by default: each layer gathers the attended cells with get_rows on every decode, which
+                                   // only pays off when many sequences share long prompt prefixes (e.g. the batch engine)
 
         lm_ggml_backend_sched_eval_callback cb_eval;
         void * cb_eval_user_data;
@@ -358,12 +366,15 @@ extern "C" {
         bool offload_kqv; // whether to offload the KQV ops (including the KV cache) to GPU
         bool flash_attn;  // whether to use flash attention [EXPERIMENTAL]
         bool no_perf;     // whether to measure performance timings
+        bool swa_full;    // whether the sliding-window layers cache the full context instead of their window
 
         // Abort callback
         // if it returns true, execution of llama_decode() will be aborted
         // currently works only with CPU execution
         lm_ggml_abort_callback abort_callback;
         void *              abort_callback_data;
+
+        int32_t logits_top_k; // if > 0, only the top k logits of each output are computed, see llama_get_logits_top_k_ith
     };
 
     // model quantization parameters
@@ -476,6 +487,10 @@ extern "C" {
     LLAMA_API uint32_t llama_n_ubatch   (const struct llama_context * ctx);
     LLAMA_API uint32_t llama_n_seq_max  (const struct llama_context * ctx);
 
+    // Size in bytes of the compute buffers reserved by the scheduler and of the KV cache buffers
+    LLAMA_API size_t llama_get_compute_buffer_size(const struct llama_context * ctx);
+    LLAMA_API size_t llama_get_kv_self_buffer_size(const struct llama_context * ctx);
+
     DEPRECATED(LLAMA_API int32_t llama_n_ctx_train(const struct llama_model * model), "use llama_model_n_ctx_train instead");
     DEPRECATED(LLAMA_API int32_t llama_n_embd     (const struct llama_model * model), "use llama_model_n_embd instead");
     DEPRECATED(LLAMA_API int32_t llama_n_layer    (const struct llama_model * model), "use llama_model_n_layer instead");
@@ -730,6 +745,17 @@ extern "C" {
             struct llama_context * ctx,
                      llama_seq_id   seq_id);
 
+    // Makes the longest cached prefix of tokens part of the specified sequence, which holds tokens [0, n_past)
+    // Only the paged KV cache (kv_block_size > 0) caches prefixes: full blocks of decoded tokens are kept and shared
+    // by the sequences that start with the same tokens, they are evicted in LRU order once no sequence uses them
+    // Returns the number of leading tokens now held by the sequence (>= n_past), decode the rest from that position
+    LLAMA_API int32_t llama_kv_self_seq_attach_prefix(
+            struct llama_context * ctx,
+                    llama_seq_id   seq_id,
+               const llama_token * tokens,
+                         int32_t   n_tokens,
+                         int32_t   n_past);
+
     // Defragment the KV cache
     // This will be applied:
     //   - lazily on next llama_decode()
@@ -984,6 +1010,16 @@ extern "C" {
     // returns NULL for invalid ids.
     LLAMA_API float * llama_get_logits_ith(struct llama_context * ctx, int32_t i);
 
+    // Compact logits for the ith token, for contexts created with logits_top_k > 0.
+    // Sets *logits and *ids to the logits_top_k largest logits and their token ids, in descending order.
+    // Returns the number of entries, 0 if the context outputs full logits (use llama_get_logits_ith), -1 for invalid ids.
+    // In this mode llama_get_logits and llama_get_logits_ith return NULL.
+    LLAMA_API int32_t llama_get_logits_top_k_ith(
+            struct llama_context * ctx,
+                         int32_t   i,
+                     const float ** logits,
+               const llama_token ** ids);
+
     // Get all output token embeddings.
     // when pooling_type == LLAMA_POOLING_TYPE_NONE or when using a generative model,
     // the embeddings for which llama_batch.logits[i] != 0 are stored contiguously
@@ -1311,6 +1347,22 @@ extern "C" {
                const llama_token * trigger_tokens,
                             size_t num_trigger_tokens);
 
+    /// @details Grammars are compiled lazily into automata (per-state token masks and transitions) that are
+    /// shared by every grammar sampler of the vocabulary. These save and load the compiled automata so a new
+    /// process does not have to recompute them. Loading fails if the file was saved for a different vocabulary.
+    LLAMA_API bool llama_grammar_cache_save(const struct llama_vocab * vocab, const char * path);
+    LLAMA_API bool llama_grammar_cache_load(const struct llama_vocab * vocab, const char * path);
+
+    /// @details Text that every continuation accepted by a grammar sampler starts with (e.g. JSON keys and
+    /// punctuation), up to max_chars code points. Does not write a null terminator to the buffer.
+    /// @return The number of bytes written, 0 if nothing is forced or smpl is not a grammar sampler, or the
+    /// negated required size if buf is too small.
+    LLAMA_API int32_t llama_sampler_grammar_forced_text(
+            const struct llama_sampler * smpl,
+                                  char * buf,
+                               int32_t   length,
+                               int32_t   max_chars);
+
 
     /// NOTE: Avoid using on the full vocabulary as searching for repeated tokens can become slow. For example, apply top-k or top-p sampling first.
     LLAMA_API struct llama_sampler * llama_sampler_init_penalties(
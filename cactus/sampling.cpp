@@ -2,10 +2,21 @@
 
 #include "common.h"
 
+#include <atomic>
 #include <cmath>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <thread>
 #include <unordered_map>
 #include <algorithm>
 
+#if defined(__AVX__) || defined(__SSE2__)
+#include <immintrin.h>
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+#include <arm_neon.h>
+#endif
+
 // the ring buffer works similarly to std::deque, but with a fixed capacity
 // TODO: deduplicate with llama-impl.h
 template<typename T>
@@ -99,6 +110,285 @@ struct ring_buffer {
     std::vector<T> data;
 };
 
+// returns the largest value of logits[0, n)
+static float logits_max(const float * logits, int n) {
+    float max_logit = -INFINITY;
+    int i = 0;
+#if defined(__AVX__)
+    __m256 vmax = _mm256_set1_ps(-INFINITY);
+    for (; i + 8 <= n; i += 8) {
+        vmax = _mm256_max_ps(vmax, _mm256_loadu_ps(logits + i));
+    }
+    float lanes[8];
+    _mm256_storeu_ps(lanes, vmax);
+    for (float v : lanes) {
+        max_logit = std::max(max_logit, v);
+    }
+#elif defined(__SSE2__)
+    __m128 vmax = _mm_set1_ps(-INFINITY);
+    for (; i + 4 <= n; i += 4) {
+        vmax = _mm_max_ps(vmax, _mm_loadu_ps(logits + i));
+    }
+    float lanes[4];
+    _mm_storeu_ps(lanes, vmax);
+    for (float v : lanes) {
+        max_logit = std::max(max_logit, v);
+    }
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+    float32x4_t vmax = vdupq_n_f32(-INFINITY);
+    for (; i + 4 <= n; i += 4) {
+        vmax = vmaxq_f32(vmax, vld1q_f32(logits + i));
+    }
+    max_logit = vmaxvq_f32(vmax);
+#endif
+    for (; i < n; ++i) {
+        max_logit = std::max(max_logit, logits[i]);
+    }
+    return max_logit;
+}
+
+// appends the ids in [i0, n) whose logit is >= thr to out, in blocks of 16 that are skipped with a
+// single vector compare when no lane passes
+// stops once out holds at least cap ids and returns the index to resume from
+static int logits_collect_ge(const float * logits, int i0, int n, float thr, std::vector<llama_token> & out, size_t cap) {
+    int i = i0;
+#if defined(__AVX__)
+    const __m256 vthr = _mm256_set1_ps(thr);
+    for (; i + 16 <= n && out.size() < cap; i += 16) {
+        const __m256 ge0 = _mm256_cmp_ps(_mm256_loadu_ps(logits + i + 0), vthr, _CMP_GE_OQ);
+        const __m256 ge1 = _mm256_cmp_ps(_mm256_loadu_ps(logits + i + 8), vthr, _CMP_GE_OQ);
+        if (_mm256_movemask_ps(_mm256_or_ps(ge0, ge1)) == 0) {
+            continue;
+        }
+        for (int l = 0; l < 16; ++l) {
+            if (logits[i + l] >= thr) {
+                out.push_back(i + l);
+            }
+        }
+    }
+#elif defined(__SSE2__)
+    const __m128 vthr = _mm_set1_ps(thr);
+    for (; i + 16 <= n && out.size() < cap; i += 16) {
+        const __m128 ge0 = _mm_cmpge_ps(_mm_loadu_ps(logits + i +  0), vthr);
+        const __m128 ge1 = _mm_cmpge_ps(_mm_loadu_ps(logits + i +  4), vthr);
+        const __m128 ge2 = _mm_cmpge_ps(_mm_loadu_ps(logits + i +  8), vthr);
+        const __m128 ge3 = _mm_cmpge_ps(_mm_loadu_ps(logits + i + 12), vthr);
+        if (_mm_movemask_ps(_mm_or_ps(_mm_or_ps(ge0, ge1), _mm_or_ps(ge2, ge3))) == 0) {
+            continue;
+        }
+        for (int l = 0; l < 16; ++l) {
+            if (logits[i + l] >= thr) {
+                out.push_back(i + l);
+            }
+        }
+    }
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+    const float32x4_t vthr = vdupq_n_f32(thr);
+    for (; i + 16 <= n && out.size() < cap; i += 16) {
+        const uint32x4_t ge0 = vcgeq_f32(vld1q_f32(logits + i +  0), vthr);
+        const uint32x4_t ge1 = vcgeq_f32(vld1q_f32(logits + i +  4), vthr);
+        const uint32x4_t ge2 = vcgeq_f32(vld1q_f32(logits + i +  8), vthr);
+        const uint32x4_t ge3 = vcgeq_f32(vld1q_f32(logits + i + 12), vthr);
+        if (vmaxvq_u32(vorrq_u32(vorrq_u32(ge0, ge1), vorrq_u32(ge2, ge3))) == 0) {
+            continue;
+        }
+        for (int l = 0; l < 16; ++l) {
+            if (logits[i + l] >= thr) {
+                out.push_back(i + l);
+            }
+        }
+    }
+#endif
+    for (; i < n && out.size() < cap; ++i) {
+        if (logits[i] >= thr) {
+            out.push_back(i);
+        }
+    }
+    return i;
+}
+
+// stores the ids of the n largest logits (in no particular order) in out
+// a threshold rises as candidates are found, so most of the vocabulary is rejected by vector compares
+static void logits_top_n(const float * logits, int n_vocab, int n, std::vector<llama_token> & out) {
+    const size_t cap = std::max<size_t>(4*(size_t) n, 256);
+
+    const auto by_logit = [logits](llama_token a, llama_token b) {
+        return logits[a] > logits[b];
+    };
+
+    out.clear();
+    out.reserve(cap + 16);
+
+    float thr = -INFINITY;
+    for (int i = 0; i < n_vocab; ) {
+        i = logits_collect_ge(logits, i, n_vocab, thr, out, cap);
+        if (out.size() >= cap) {
+            std::nth_element(out.begin(), out.begin() + (n - 1), out.end(), by_logit);
+            thr = logits[out[n - 1]];
+            out.resize(n);
+        }
+    }
+
+    if (out.size() > (size_t) n) {
+        std::nth_element(out.begin(), out.begin() + (n - 1), out.end(), by_logit);
+        out.resize(n);
+    }
+}
+
+// raw-logit preselection
+//
+// when the sampler chain truncates with top-k or min-p before doing anything that needs the full
+// distribution, and the samplers ahead of the truncation only adjust the logits of a known set of
+// tokens (logit bias, repetition penalties), only the tokens that can survive the truncation are
+// materialized: the top (k + |adjusted|) raw logits, or the raw logits above the min-p threshold,
+// plus the adjusted tokens themselves. the chain then produces the same result as on the full
+// vocabulary
+struct common_sampler_preselect {
+    int32_t top_k          = 0;    // > 0: the chain truncates with top-k
+    float   min_p          = 0.0f; // > 0: the chain truncates with min-p
+    size_t  min_keep       = 0;
+    int32_t penalty_last_n = 0;    // > 0: penalties adjust the last penalty_last_n accepted tokens
+
+    std::vector<llama_token> biased; // tokens with a logit bias
+
+    std::vector<llama_token> adjusted; // scratch
+    std::vector<llama_token> top;      // scratch
+
+    static common_sampler_preselect from_params(const common_params_sampling & params) {
+        common_sampler_preselect res;
+
+        if (params.mirostat != 0) {
+            return res;
+        }
+
+        if (params.top_n_sigma >= 0) {
+            // chain is top-k, temp, top-n-sigma
+            res.top_k = params.top_k;
+        } else {
+            for (const auto & cnstr : params.samplers) {
+                bool passthrough = false;
+                switch (cnstr) {
+                    case COMMON_SAMPLER_TYPE_PENALTIES:
+                        if (params.penalty_last_n > 0 &&
+                            (params.penalty_repeat != 1.0f || params.penalty_freq != 0.0f || params.penalty_present != 0.0f)) {
+                            res.penalty_last_n = params.penalty_last_n;
+                        }
+                        passthrough = true;
+                        break;
+                    case COMMON_SAMPLER_TYPE_DRY:
+                        // DRY can penalize any token of the context
+                        passthrough = params.dry_multiplier == 0.0f || params.dry_base < 1.0f || params.dry_penalty_last_n == 0;
+                        break;
+                    case COMMON_SAMPLER_TYPE_TOP_K:
+                        res.top_k  = params.top_k;
+                        passthrough = params.top_k <= 0;
+                        break;
+                    case COMMON_SAMPLER_TYPE_MIN_P:
+                        res.min_p    = params.min_p;
+                        res.min_keep = params.min_keep;
+                        passthrough  = params.min_p <= 0.0f;
+                        break;
+                    case COMMON_SAMPLER_TYPE_TOP_P:
+                        passthrough = params.top_p >= 1.0f;
+                        break;
+                    case COMMON_SAMPLER_TYPE_TYPICAL_P:
+                        passthrough = params.typ_p >= 1.0f;
+                        break;
+                    case COMMON_SAMPLER_TYPE_XTC:
+                        passthrough = params.xtc_probability <= 0.0f || params.xtc_threshold > 0.5f;
+                        break;
+                    default:
+                        break;
+                }
+                if (!passthrough) {
+                    break;
+                }
+            }
+        }
+
+        if (res.top_k <= 0) {
+            res.top_k = 0;
+        }
+        if (res.top_k > 0 || res.min_p <= 0.0f) {
+            res.min_p = 0.0f;
+        }
+        if (res.enabled()) {
+            for (const auto & lb : params.logit_bias) {
+                res.biased.push_back(lb.token);
+            }
+        }
+
+        return res;
+    }
+
+    bool enabled() const {
+        return top_k > 0 || min_p > 0.0f;
+    }
+
+    // collects the candidate ids into out (sorted by id)
+    // returns false if the full vocabulary has to be used
+    bool select(const float * logits, int n_vocab, const ring_buffer<llama_token> & prev, std::vector<llama_token> & out) {
+        adjusted.assign(biased.begin(), biased.end());
+        const size_t n_prev = std::min(prev.size(), (size_t) penalty_last_n);
+        for (size_t i = 0; i < n_prev; ++i) {
+            adjusted.push_back(prev.rat(i));
+        }
+        std::sort(adjusted.begin(), adjusted.end());
+        adjusted.erase(std::unique(adjusted.begin(), adjusted.end()), adjusted.end());
+        adjusted.erase(std::remove_if(adjusted.begin(), adjusted.end(), [n_vocab](llama_token id) {
+            return id < 0 || id >= n_vocab;
+        }), adjusted.end());
+
+        const int n_adjusted = (int) adjusted.size();
+
+        out.clear();
+
+        if (top_k > 0) {
+            // the top-k of the adjusted logits is within the top (k + |adjusted|) raw logits plus the adjusted tokens
+            const int n = top_k + n_adjusted;
+            if (n >= n_vocab / 2) {
+                return false;
+            }
+            logits_top_n(logits, n_vocab, n, out);
+        } else {
+            // only the largest logit of the tokens the chain does not adjust is known in advance; the
+            // min-p threshold on the adjusted logits can only be higher
+            const int n = n_adjusted + (int) std::max<size_t>(min_keep, 1);
+            if (n >= n_vocab / 2) {
+                return false;
+            }
+
+            float max_logit = -INFINITY;
+            if (n_adjusted == 0 && min_keep <= 1) {
+                max_logit = logits_max(logits, n_vocab);
+            } else {
+                // also keeps the top min_keep tokens in case min-p falls back to keeping min_keep
+                logits_top_n(logits, n_vocab, n, top);
+                for (llama_token id : top) {
+                    if (!std::binary_search(adjusted.begin(), adjusted.end(), id)) {
+                        max_logit = std::max(max_logit, logits[id]);
+                    }
+                }
+                out.insert(out.end(), top.begin(), top.end());
+            }
+
+            const float thr = max_logit + logf(min_p);
+            const size_t cap = (size_t) n_vocab / 2;
+            if (logits_collect_ge(logits, 0, n_vocab, thr, out, cap) < n_vocab) {
+                return false;
+            }
+        }
+
+        out.insert(out.end(), adjusted.begin(), adjusted.end());
+
+        // keep vocabulary order, like the full candidate array
+        std::sort(out.begin(), out.end());
+        out.erase(std::unique(out.begin(), out.end()), out.end());
+
+        return true;
+    }
+};
+
 struct common_sampler {
     common_params_sampling params;
 
@@ -111,17 +401,38 @@ struct common_sampler {
 
     llama_token_data_array cur_p;
 
-    void set_logits(struct llama_context * ctx, int idx) {
-        const auto * logits = llama_get_logits_ith(ctx, idx);
+    common_sampler_preselect preselect;
+
+    std::vector<llama_token> preselected;
+
+    // preselect: materialize only the candidates that can survive the chain's top-k/min-p
+    // ids == nullptr: logits of the full vocabulary, otherwise a compact list of candidates (see llama_get_logits_top_k_ith)
+    void set_logits(const float * logits, const llama_token * ids, int n_logits, bool allow_preselect = false) {
+        if (ids) {
+            cur.resize(n_logits);
+
+            for (int i = 0; i < n_logits; i++) {
+                cur[i] = llama_token_data{ids[i], logits[i], 0.0f};
+            }
+
+            cur_p = { cur.data(), cur.size(), -1, false };
+            return;
+        }
+
+        if (allow_preselect && preselect.enabled() && preselect.select(logits, n_logits, prev, preselected)) {
+            cur.resize(preselected.size());
 
-        const llama_model * model = llama_get_model(ctx);
-        const llama_vocab * vocab = llama_model_get_vocab(model);
+            for (size_t i = 0; i < preselected.size(); i++) {
+                cur[i] = llama_token_data{preselected[i], logits[preselected[i]], 0.0f};
+            }
 
-        const int n_vocab = llama_vocab_n_tokens(vocab);
+            cur_p = { cur.data(), cur.size(), -1, false };
+            return;
+        }
 
-        cur.resize(n_vocab);
+        cur.resize(n_logits);
 
-        for (llama_token token_id = 0; token_id < n_vocab; token_id++) {
+        for (llama_token token_id = 0; token_id < n_logits; token_id++) {
             cur[token_id] = llama_token_data{token_id, logits[token_id], 0.0f};
         }
 
@@ -213,13 +524,17 @@ struct common_sampler * common_sampler_init(const struct llama_model * model, co
         }
     }
 
+    auto preselect = common_sampler_preselect::from_params(params);
+
     auto * result = new common_sampler {
-        /* .params = */ params,
-        /* .grmr   = */ grmr,
-        /* .chain  = */ llama_sampler_chain_init(lparams),
-        /* .prev   = */ ring_buffer<llama_token>(std::max(32, params.n_prev)),
-        /* .cur    = */ {},
-        /* .cur_p  = */ {},
+        /* .params      = */ params,
+        /* .grmr        = */ grmr,
+        /* .chain       = */ llama_sampler_chain_init(lparams),
+        /* .prev        = */ ring_buffer<llama_token>(std::max({32, params.n_prev, preselect.penalty_last_n})),
+        /* .cur         = */ {},
+        /* .cur_p       = */ {},
+        /* .preselect   = */ preselect,
+        /* .preselected = */ {},
     };
 
     llama_sampler_chain_add(result->chain,
@@ -318,12 +633,14 @@ void common_sampler_reset(struct common_sampler * gsmpl) {
 
 struct common_sampler * common_sampler_clone(common_sampler * gsmpl) {
     return new common_sampler {
-        /* .params = */ gsmpl->params,
-        /* .grmr   = */ llama_sampler_clone(gsmpl->grmr),
-        /* .chain  = */ llama_sampler_clone(gsmpl->chain),
-        /* .prev   = */ gsmpl->prev,
-        /* .cur    = */ gsmpl->cur,
-        /* .cur_p  = */ gsmpl->cur_p,
+        /* .params      = */ gsmpl->params,
+        /* .grmr        = */ llama_sampler_clone(gsmpl->grmr),
+        /* .chain       = */ llama_sampler_clone(gsmpl->chain),
+        /* .prev        = */ gsmpl->prev,
+        /* .cur         = */ gsmpl->cur,
+        /* .cur_p       = */ gsmpl->cur_p,
+        /* .preselect   = */ gsmpl->preselect,
+        /* .preselected = */ {},
     };
 }
 
@@ -338,8 +655,13 @@ void common_perf_print(const struct llama_context * ctx, const struct common_sam
     }
 }
 
-llama_token common_sampler_sample(struct common_sampler * gsmpl, struct llama_context * ctx, int idx, bool grammar_first) {
-    gsmpl->set_logits(ctx, idx);
+// common_sampler_sample on logits that were already read from the context, so that it can run on any thread
+static llama_token common_sampler_sample_logits(struct common_sampler * gsmpl, const float * logits, const llama_token * ids, int n_vocab, bool grammar_first) {
+    // the grammar can reject all top-k candidates, and the remaining logits were never computed
+    LM_GGML_ASSERT((ids == nullptr || gsmpl->params.grammar.empty()) && "grammar sampling needs the full vocabulary, it cannot be used with logits_top_k");
+
+    // the grammar may reject every preselected candidate, so it has to see the full vocabulary
+    gsmpl->set_logits(logits, ids, n_vocab, !grammar_first || gsmpl->params.grammar.empty());
 
     auto & grmr  = gsmpl->grmr;
     auto & chain = gsmpl->chain;
@@ -374,7 +696,7 @@ llama_token common_sampler_sample(struct common_sampler * gsmpl, struct llama_co
 
     // resampling:
     // if the token is not valid, sample again, but first apply the grammar sampler and then the sampling chain
-    gsmpl->set_logits(ctx, idx);
+    gsmpl->set_logits(logits, ids, n_vocab);
 
     llama_sampler_apply(grmr,  &cur_p);
     llama_sampler_apply(chain, &cur_p);
@@ -384,6 +706,142 @@ llama_token common_sampler_sample(struct common_sampler * gsmpl, struct llama_co
     return cur_p.data[cur_p.selected].id;
 }
 
+// the logits of the idx-th output: the full vocabulary, or the top-k list of a context created with logits_top_k > 0
+static const float * common_sampler_get_logits(struct llama_context * ctx, int idx, const llama_token ** ids, int * n) {
+    const float * logits = nullptr;
+
+    const int32_t k = llama_get_logits_top_k_ith(ctx, idx, &logits, ids);
+    if (k > 0) {
+        *n = k;
+        return logits;
+    }
+
+    *ids = nullptr;
+    *n   = llama_vocab_n_tokens(llama_model_get_vocab(llama_get_model(ctx)));
+
+    return llama_get_logits_ith(ctx, idx);
+}
+
+llama_token common_sampler_sample(struct common_sampler * gsmpl, struct llama_context * ctx, int idx, bool grammar_first) {
+    const llama_token * ids = nullptr;
+    int n = 0;
+
+    const float * logits = common_sampler_get_logits(ctx, idx, &ids, &n);
+
+    return common_sampler_sample_logits(gsmpl, logits, ids, n, grammar_first);
+}
+
+struct common_sampler_pool {
+    std::vector<std::thread> workers;
+
+    std::mutex              mutex;
+    std::condition_variable cv_start;
+    std::condition_variable cv_done;
+
+    std::function<void()> job;
+    uint64_t              job_id    = 0;
+    int                   n_active  = 0; // workers taking part in the current job
+    int                   n_running = 0; // active workers that have not finished it yet
+    bool                  stop      = false;
+
+    void worker_loop(int i) {
+        uint64_t seen = 0;
+
+        std::unique_lock<std::mutex> lock(mutex);
+        while (true) {
+            cv_start.wait(lock, [&] { return stop || job_id != seen; });
+            if (stop) {
+                return;
+            }
+            seen = job_id;
+            if (i >= n_active) {
+                continue;
+            }
+
+            lock.unlock();
+            job();
+            lock.lock();
+
+            if (--n_running == 0) {
+                cv_done.notify_one();
+            }
+        }
+    }
+
+    // runs fn on this thread and on n_workers workers, and returns once all of them are done
+    void run(int n_workers, const std::function<void()> & fn) {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            job       = fn;
+            n_active  = n_workers;
+            n_running = n_workers;
+            job_id++;
+        }
+        cv_start.notify_all();
+
+        fn();
+
+        std::unique_lock<std::mutex> lock(mutex);
+        cv_done.wait(lock, [&] { return n_running == 0; });
+        job = nullptr;
+    }
+};
+
+struct common_sampler_pool * common_sampler_pool_init(int n_threads) {
+    if (n_threads <= 0) {
+        n_threads = (int) std::thread::hardware_concurrency();
+    }
+
+    auto * pool = new common_sampler_pool;
+    for (int i = 0; i < n_threads - 1; ++i) {
+        pool->workers.emplace_back([pool, i]() { pool->worker_loop(i); });
+    }
+
+    return pool;
+}
+
+void common_sampler_pool_free(struct common_sampler_pool * pool) {
+    if (pool == nullptr) {
+        return;
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(pool->mutex);
+        pool->stop = true;
+    }
+    pool->cv_start.notify_all();
+    for (auto & w : pool->workers) {
+        w.join();
+    }
+
+    delete pool;
+}
+
+void common_sampler_sample_batch(std::vector<common_sampler_seq> & seqs, struct llama_context * ctx, struct common_sampler_pool * pool, bool grammar_first) {
+    // reading the logits synchronizes the context, so it is done once and from this thread only
+    std::vector<const float *>       logits(seqs.size());
+    std::vector<const llama_token *> ids(seqs.size());
+    std::vector<int>                 n(seqs.size());
+    for (size_t i = 0; i < seqs.size(); ++i) {
+        logits[i] = common_sampler_get_logits(ctx, seqs[i].idx, &ids[i], &n[i]);
+    }
+
+    // sequences can differ a lot in cost (grammar, resampling), so the threads take them one at a time
+    std::atomic<size_t> next { 0 };
+    auto worker = [&]() {
+        for (size_t i = next++; i < seqs.size(); i = next++) {
+            seqs[i].token = common_sampler_sample_logits(seqs[i].gsmpl, logits[i], ids[i], n[i], grammar_first);
+        }
+    };
+
+    const int n_workers = pool ? std::min((int) pool->workers.size(), (int) seqs.size() - 1) : 0;
+    if (n_workers <= 0) {
+        worker();
+        return;
+    }
+    pool->run(n_workers, worker);
+}
+
 std::vector<llama_token> common_sampler_sample_and_accept_n(struct common_sampler * gsmpl, struct llama_context * ctx, const std::vector<int> & idxs, const llama_tokens & draft, bool grammar_first) {
     LM_GGML_ASSERT(idxs.size() == draft.size() + 1 && "idxs.size() must be draft.size() + 1");
 
@@ -448,6 +906,13 @@ std::string common_sampler_print(const struct common_sampler * gsmpl) {
     return result;
 }
 
+std::string common_sampler_grammar_forced_text(const struct common_sampler * gsmpl, int max_chars) {
+    std::string result(max_chars * 4, '\0');
+    const int32_t n = llama_sampler_grammar_forced_text(gsmpl->grmr, result.data(), (int32_t) result.size(), max_chars);
+    result.resize(std::max(n, 0));
+    return result;
+}
+
 std::string common_sampler_prev_str(common_sampler * gsmpl, llama_context * ctx_main, int n) {
     n = std::min(n, (int) gsmpl->prev.size());
 
@@ -60,6 +60,28 @@ void common_perf_print(const struct llama_context * ctx, const struct common_sam
 //
 llama_token common_sampler_sample(struct common_sampler * gsmpl, struct llama_context * ctx, int idx, bool grammar_first = false);
 
+// a sequence of a batched sampling call
+struct common_sampler_seq {
+    struct common_sampler * gsmpl;
+    int                     idx;                      // output of the batch to sample from
+    llama_token             token = LLAMA_TOKEN_NULL; // set by common_sampler_sample_batch
+};
+
+// persistent worker threads for common_sampler_sample_batch, so that a decode loop does not start
+// threads on every step (n_threads <= 0: one per hardware thread, the calling thread included).
+// a pool serves one common_sampler_sample_batch call at a time
+struct common_sampler_pool * common_sampler_pool_init(int n_threads);
+
+void common_sampler_pool_free(struct common_sampler_pool * pool);
+
+// samples several sequences from the outputs of the last batch, each like common_sampler_sample
+//
+// the logits are read once from this thread, then the sampler chains run on this thread and the
+// pool's workers, so that sampling does not serialize batched decoding (pool == nullptr: serially).
+// each sequence must have its own sampler
+//
+void common_sampler_sample_batch(std::vector<common_sampler_seq> & seqs, struct llama_context * ctx, struct common_sampler_pool * pool, bool grammar_first = false);
+
 // generalized version of common_sampler_sample
 //
 // will cross-reference the sampled tokens with a batch of draft tokens and accept those that match
@@ -97,6 +119,9 @@ std::string common_sampler_print(const struct common_sampler * gsmpl);
 // get a string representation of the last accepted tokens
 std::string common_sampler_prev_str(common_sampler * gsmpl, llama_context * ctx, int n);
 
+// text the grammar forces next (up to max_chars code points), empty without a grammar
+std::string common_sampler_grammar_forced_text(const struct common_sampler * gsmpl, int max_chars);
+
 char        common_sampler_type_to_chr(enum common_sampler_type cnstr);
 std::string common_sampler_type_to_str(enum common_sampler_type cnstr);
 
@@ -0,0 +1,7 @@
+mkdir -p build
+cd build
+cmake ..
+make
+
+ln -sf ../../../cactus/ggml-llama.metallib default.metallib
+./cactus_bench "$@"
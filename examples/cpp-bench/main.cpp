@@ -0,0 +1,143 @@
+// Benchmark sweep runner for Cactus.
+//
+// Usage: cactus_bench -m model.gguf [-p 512,2048] [-n 128] [-d 0,4096] [-t 4,8] [-pl 1,4]
+//                     [-ctk f16,q8_0] [-ctv f16,q8_0] [-r 3] [-o results.json]
+//
+// Every combination of the listed values is measured and the results are written as a
+// "cactus-bench" JSON document (to stdout unless -o is given), suitable for diffing
+// between releases.
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <thread>
+
+// Main header file for the Cactus library.
+#include "../../cactus/cactus.h"
+
+// --- Helper: split a comma separated list ---
+static std::vector<std::string> splitList(const std::string& value) {
+    std::vector<std::string> items;
+    std::stringstream ss(value);
+    std::string item;
+    while (std::getline(ss, item, ',')) {
+        if (!item.empty()) {
+            items.push_back(item);
+        }
+    }
+    return items;
+}
+
+static std::vector<int> parseIntList(const std::string& value) {
+    std::vector<int> values;
+    for (const auto& item : splitList(value)) {
+        values.push_back(std::stoi(item));
+    }
+    return values;
+}
+
+static std::vector<lm_ggml_type> parseTypeList(const std::string& value) {
+    std::vector<lm_ggml_type> types;
+    for (const auto& item : splitList(value)) {
+        types.push_back(cactus::kv_cache_type_from_str(item));
+    }
+    return types;
+}
+
+static void printUsage(const char* argv0) {
+    std::cerr << "usage: " << argv0 << " -m model.gguf [options]\n"
+              << "  -p   LIST  prompt lengths (default 512)\n"
+              << "  -n   LIST  generated tokens per sequence (default 128)\n"
+              << "  -d   LIST  context depth before the prompt (default 0)\n"
+              << "  -t   LIST  thread counts (default: hardware concurrency)\n"
+              << "  -pl  LIST  parallel sequences (default 1)\n"
+              << "  -ctk LIST  KV cache key types (default f16)\n"
+              << "  -ctv LIST  KV cache value types (default f16)\n"
+              << "  -ngl N     layers to offload to the GPU (default 99)\n"
+              << "  -r   N     repetitions per sweep point (default 3)\n"
+              << "  -o   FILE  write the JSON results to FILE\n";
+}
+
+int main(int argc, char **argv) {
+    common_params params;
+    cactus::cactus_bench_params bench_params;
+    std::string output_path;
+
+    unsigned int n_threads = std::thread::hardware_concurrency();
+    params.cpuparams.n_threads = n_threads > 0 ? n_threads : 4;
+    params.n_gpu_layers = 99;
+    params.use_mmap = true;
+    params.warmup = false;
+
+    try {
+        for (int i = 1; i < argc; ++i) {
+            const std::string arg = argv[i];
+            if (i + 1 >= argc) {
+                printUsage(argv[0]);
+                return 1;
+            }
+            const std::string value = argv[++i];
+            if (arg == "-m") {
+                params.model.path = value;
+            } else if (arg == "-p") {
+                bench_params.n_prompt = parseIntList(value);
+            } else if (arg == "-n") {
+                bench_params.n_gen = parseIntList(value);
+            } else if (arg == "-d") {
+                bench_params.n_depth = parseIntList(value);
+            } else if (arg == "-t") {
+                bench_params.n_threads = parseIntList(value);
+            } else if (arg == "-pl") {
+                bench_params.n_parallel = parseIntList(value);
+            } else if (arg == "-ctk") {
+                bench_params.type_k = parseTypeList(value);
+            } else if (arg == "-ctv") {
+                bench_params.type_v = parseTypeList(value);
+            } else if (arg == "-ngl") {
+                params.n_gpu_layers = std::stoi(value);
+            } else if (arg == "-r") {
+                bench_params.repetitions = std::stoi(value);
+            } else if (arg == "-o") {
+                output_path = value;
+            } else {
+                printUsage(argv[0]);
+                return 1;
+            }
+        }
+    } catch (const std::exception& e) {
+        std::cerr << "Invalid argument: " << e.what() << std::endl;
+        return 1;
+    }
+
+    if (params.model.path.empty()) {
+        printUsage(argv[0]);
+        return 1;
+    }
+
+    // The loaded context only needs to be big enough to load the model; each sweep
+    // point runs on a dedicated context sized by benchSuite.
+    params.n_ctx = 512;
+
+    cactus::cactus_context ctx;
+    std::cerr << "Loading model: " << params.model.path << std::endl;
+    if (!ctx.loadModel(params)) {
+        std::cerr << "Failed to load model." << std::endl;
+        return 1;
+    }
+
+    const std::string results = ctx.benchSuite(bench_params);
+
+    if (output_path.empty()) {
+        std::cout << results << std::endl;
+    } else {
+        std::ofstream out(output_path);
+        if (!out) {
+            std::cerr << "Failed to open " << output_path << std::endl;
+            return 1;
+        }
+        out << results << std::endl;
+        std::cerr << "Results written to " << output_path << std::endl;
+    }
+    return 0;
+}